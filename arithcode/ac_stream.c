@@ -95,15 +95,3 @@ u8 pop_u8(stream_t *self)
 	return v;
 }
 
-
-static const u8 max_u8 = (u8)(-1);
-
-void carry_u8(stream_t *self)
-{
-	size_t n = (self->ibyte - 1) / sizeof(u8);
-	while (((u8 *)(self->d))[n] == max_u8) {
-		((u8 *)(self->d))[n--] = 0;
-	};
-
-	((u8 *)(self->d))[n]++;
-}
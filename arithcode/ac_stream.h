@@ -13,10 +13,8 @@
  * - push/pop are not meant to work together.  That is, can't simultaneously
  *   encode and decode on the same stream; Can't interleave push/pop.
  *
- * - carry is somewhat specific to arithmetic coding, but seems like a stream
- *   op, so it's included here.  Alternatively, I could add an operation to
- *   rewind the stream a bit so that the carry op could be implemented
- *   elsewhere.
+ * - there's no carry op: the encoder holds back the bytes a carry could
+ *   reach, so nothing already pushed is ever rewritten.
  */
 
 typedef struct _stream_t {
@@ -47,6 +45,5 @@ void detach(stream_t *s, void **d, size_t *n);
 
 int push_u8(stream_t *s, uint8_t v);
 uint8_t pop_u8(stream_t *s);
-void carry_u8(stream_t* s);
 
 #endif /* _AC_STREAM_H_ */
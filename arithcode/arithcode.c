@@ -29,13 +29,10 @@
  * - empty stream?
  * - streams that generte big carries
  *
- * - might be nice to add an interface that will encode chunks.  That is,
- * you feed it symbols one at a time and every once in a while, when
- * bits get settled, it outputs some bytes.
- *
- * For streaming encoders, this would mean the intermediate buffer
- * wouldn't have to be quite as big, although worst case that
- * buffer is the size of the entire output message.
+ * - ac_push()/ac_pull() encode and decode in chunks: you feed it symbols
+ * and it tells you how many bytes it has written.  The encoder holds a
+ * byte back until no carry can reach it (see eshift_u8()), so nothing is
+ * ever rewritten.
  *
  * - A check-symbol could be encoded in a manner similar to the END-OF-MESSAGE
  * symbol.  For example, code the symbol every 2^x symbols and assign it a
@@ -120,6 +117,12 @@
  *
  * see cdf_build() for an example of how to build a CDF from a given input message.
  *
+ * Integer Models
+ * ac_model_build() and ac_model_from_counts() produce an ac_model_t, whose frequencies are integers summing to
+ * AC_MODEL_TOTAL.  ac_init_model() loads one without any floating point at all, so the encoder and decoder agree
+ * bit-for-bit no matter which compiler or FPU (if any) they run on.  The float CDF interface is kept for
+ * compatibility; it is converted once per ac_init().
+ *
  * Encoding Encoding Functions
  * Encoding functions all have the same form:
  *     encode_<TDst>_<TSrc>(void **out, size_t *nout, uint8_t *in, size_t nin, float *cdf, size_t nsym);
@@ -153,33 +156,17 @@
 
 #define SAFE_FREE(e) if (e) { free(e); (e) = NULL; }
 
-/*
- * Encoder/Decoder state
- * Used internally. Not externally visible.
- */
-typedef struct _state_t {
-	u64 b,			/* Beginning of the current interval. */
-	    l,			/* Length of the current interval. */
-	    v;			/* Current value. */
-
-	stream_t d;		/* The attached data stream. */
-	size_t nsym;		/* The number of symbols in the input alphabet. */
-	u64 D,			/* The number of symbols in the output alphabet. */
-	    shift,		/* A utility constant.  log2(D^P) - need 2P to fit in a register for multiplies. */
-	    mask,		/* Masks the live bits (can't remember exactly?) */
-	    lowl;		/* The minimum length of an encodable interval. */
-	u64 cdf[CDF_MAX_SYMB];	/* The cdf associated with the input alphabet.  Must be an array of N+1 symbols. */
-} state_t;
-
-/* A helper function that initializes the parts of the \ref state_t structure that do not depend on stream type. */
-static int init_common(state_t *state, u8 *buf, size_t nbuf, real *cdf, size_t nsym)
-{
-	const size_t cdf_len = nsym * sizeof(state->cdf[0]);
+/* the state is defined in the header so callers can own it; internally it's just state_t */
+typedef ac_state_t state_t;
+
+/* A helper function that scales the caller's CDF into the state.  Does not depend on stream type. */
+static int init_common(state_t *state, real *cdf, size_t nsym)
+{
 	state->l = (1ULL << state->shift) - 1;	/* e.g. 2^32-1 for u64 */
 	state->mask = state->l;			/* for modding a u64 to u32 with & */
 
 	nsym++;					/* add end symbol */
-	if (nsym < CDF_MAX_SYMB /*(state->cdf = malloc(cdf_len))*/) {
+	if (nsym < CDF_MAX_SYMB) {
 		size_t i;
 
 		real s = state->l - state->D;	/* scale to D^P range and adjust for end symbol */
@@ -189,22 +176,67 @@ static int init_common(state_t *state, u8 *buf, size_t nbuf, real *cdf, size_t n
 
 		state->cdf[i] = s;
 		state->nsym = nsym;
-
-		attach(&state->d, buf, nbuf);
 		return 0;
 	}
 
-	printf("%s: number of symbols %zd too large for maximum %zd\n", __func__, nsym, CDF_MAX_SYMB);
+	printf("%s: number of symbols %zd too large for maximum %d\n", __func__, nsym, CDF_MAX_SYMB);
 	return -1;
 }
 
-static int init_u8(state_t *state, u8 *buf, size_t nbuf, real *cdf, size_t nsym)
+static void set_u8_params(state_t *state)
 {
-	memset(state, 0, sizeof(*state));
 	state->D = 1ULL << 8;
 	state->shift = 32;		/* log2(D^P) - need 2P to fit in a register for multiplies */
 	state->lowl = 1ULL << 24;	/* 2^(shift - log2(D)) */
-	return init_common(state, buf, nbuf, cdf, nsym);
+	state->mask = (1ULL << state->shift) - 1;	/* for modding a u64 to u32 with & */
+	state->cbits = state->shift;	/* float CDFs are scaled to the full interval */
+}
+
+static void init_u8_params(state_t *state)
+{
+	memset(state, 0, sizeof(*state));
+	set_u8_params(state);
+}
+
+static int init_u8(state_t *state, real *cdf, size_t nsym)
+{
+	init_u8_params(state);
+	return init_common(state, cdf, nsym);
+}
+
+int ac_init(ac_state_t *state, real *cdf, size_t nsym)
+{
+	return init_u8(state, cdf, nsym);
+}
+
+int ac_init_model(ac_state_t *state, const ac_model_t *model)
+{
+	size_t i;
+
+	init_u8_params(state);
+	if (model->nsym + 1 >= CDF_MAX_SYMB) {
+		printf("%s: number of symbols %u too large for maximum %d\n", __func__, model->nsym + 1, CDF_MAX_SYMB);
+		return -1;
+	}
+
+	for (i = 0; i <= model->nsym; i++) {
+		state->cdf[i] = model->cum[i];
+	}
+
+	state->cbits = AC_MODEL_BITS;
+	state->nsym = model->nsym + 1;	/* add end symbol */
+	ac_reset(state);
+	return 0;
+}
+
+void ac_reset(ac_state_t *state)
+{
+	state->b = 0;
+	state->l = (1ULL << state->shift) - 1;
+	state->v = 0;
+	state->cache = AC_NO_CACHE;
+	state->pending = 0;
+	memset(&state->d, 0, sizeof(state->d));
 }
 
 static void free_internal(state_t *state)
@@ -272,6 +304,93 @@ real *cdf_build(real *cdf, size_t *M, u8 *s, size_t N)
 	return cdf;
 }
 
+int ac_model_from_counts(ac_model_t *model, const u32 *counts, size_t nsym)
+{
+	u32 freq[CDF_MAX_SYMB];
+	u64 total = 0;
+	u32 sum = 0;
+	size_t i, big = 0;
+
+	if (nsym + 1 >= CDF_MAX_SYMB) {
+		printf("%s: too many symbols (%zd > %d)\n", __func__, nsym + 1, CDF_MAX_SYMB);
+		return -1;
+	}
+
+	for (i = 0; i <= nsym; i++) {
+		total += counts[i];
+	}
+
+	if (total == 0) {
+		printf("%s: empty histogram\n", __func__);
+		return -1;
+	}
+
+	/* scale, keeping every symbol that occurred (and the end symbol) codable */
+	for (i = 0; i <= nsym; i++) {
+		freq[i] = (counts[i]) ? (u32)(((u64)counts[i] * AC_MODEL_TOTAL) / total) : 0;
+		if ((counts[i] || i == nsym) && freq[i] == 0) {
+			freq[i] = 1;
+		}
+
+		sum += freq[i];
+		big = (freq[i] > freq[big]) ? i : big;
+	}
+
+	/* rounding leaves the sum a little off; the most probable symbol absorbs the difference */
+	freq[big] += AC_MODEL_TOTAL - sum;
+
+	model->nsym = nsym;
+	model->cum[0] = 0;
+	for (i = 0; i < nsym; i++) {
+		model->cum[i + 1] = model->cum[i] + freq[i];
+	}
+
+	return 0;
+}
+
+int ac_model_build(ac_model_t *model, const u8 *s, size_t ns)
+{
+	u32 counts[257] = {0};
+	size_t i, nsym;
+
+	for (i = 0; i < ns; i++) {
+		counts[s[i]]++;
+	}
+
+	nsym = maximum((u8 *)s, ns) + 1;
+	counts[nsym] = 1;			/* one end symbol per message */
+	return ac_model_from_counts(model, counts, nsym);
+}
+
+void ac_lut_build(ac_lut_t *lut, const ac_model_t *model)
+{
+	const u32 shift = AC_MODEL_BITS - AC_LUT_BITS;
+	u32 k, s = 0;
+
+	/*
+	 * each slot gets the symbol whose interval contains the first frequency of the slot;
+	 * the extra one at the end gets the end symbol
+	 */
+	for (k = 0; k <= (1U << AC_LUT_BITS); k++) {
+		while (s < model->nsym && model->cum[s + 1] <= (k << shift)) {
+			s++;
+		}
+
+		lut->sym[k] = s;
+	}
+}
+
+int ac_use_lut(ac_state_t *state, const ac_lut_t *lut)
+{
+	if (lut && state->cbits != AC_MODEL_BITS) {
+		printf("%s: lookup tables only work with integer models\n", __func__);
+		return -1;
+	}
+
+	state->lut = lut;
+	return 0;
+}
+
 
 /* encoder */
 
@@ -279,6 +398,7 @@ real *cdf_build(real *cdf, size_t *M, u8 *s, size_t N)
 #define L         (state->l)
 #define C         (state->cdf)
 #define SHIFT     (state->shift)
+#define CBITS     (state->cbits)
 #define NSYM      (state->nsym)
 #define MASK      (state->mask)
 #define STREAM    (&(state->d))
@@ -288,39 +408,81 @@ real *cdf_build(real *cdf, size_t *M, u8 *s, size_t N)
 #define D         (1ULL<<bitsofD)
 #define LOWL      (state->lowl)
 
+/*
+ * B isn't masked after it is moved up the interval, so a carry out of it shows up
+ * in bit <SHIFT> until the next byte is shifted out.  Since B + L never grows, a
+ * carry can only happen once per byte.
+ */
 static int update_u8(u64 s, state_t *state)
 {
-	u64 a, x, y;
+	u64 x, y;
 
 	y = L;			/* End of interval */
 	if (s != (NSYM - 1)) {	/* is not last symbol */
-		y = (y * C[s + 1]) >> SHIFT;
+		y = (y * C[s + 1]) >> CBITS;
 	}
 
-	a = B;
-	x = (L * C[s]) >> SHIFT;
-	B = (B + x) & MASK;
+	x = (L * C[s]) >> CBITS;
+	B = B + x;
 	L = y - x;
 
-	if (L > 0) {
-		if (a > B) {
-			carry_u8(STREAM);
-		}
+	return (L > 0) ? 0 : -1;
+}
+
+/*
+ * Shifts the top byte out of B, with any carry.  Rather than going back over the
+ * output to add a carry, the last byte is held back in the cache, along with the
+ * run of 0xff bytes after it, which is all a carry could ever reach: any other
+ * byte settles them.  So every byte is written once, in order.  The very first
+ * byte can't be carried into (B + L starts below D^P), so it never needs a cache.
+ */
+static int eshift_u8(state_t *state)
+{
+	const u64 byte = B >> (SHIFT - bitsofD);	/* 9 bits, with the carry */
+	const u64 carry = byte >> bitsofD;
+	int ret = 0;
 
+	if (byte == 0xff) {
+		state->pending++;
 		return 0;
 	}
 
-	return -1;
+	if (state->cache != AC_NO_CACHE) {
+		ret = push_u8(STREAM, state->cache + carry);
+	}
+
+	for (; ret == 0 && state->pending; state->pending--) {
+		ret = push_u8(STREAM, (0xff + carry) & 0xff);
+	}
+
+	state->cache = byte & 0xff;
+	return ret;
+}
+
+/* writes out whatever eshift_u8() is still holding back */
+static int eflush_u8(state_t *state)
+{
+	int ret = 0;
+
+	if (state->cache != AC_NO_CACHE) {
+		ret = push_u8(STREAM, state->cache);
+		state->cache = AC_NO_CACHE;
+	}
+
+	for (; ret == 0 && state->pending; state->pending--) {
+		ret = push_u8(STREAM, 0xff);
+	}
+
+	return ret;
 }
 
 static int erenorm_u8(state_t *state)
 {
 	int ret;
-	const int s = SHIFT - bitsofD;
 
 	ret = 0;
 	while (ret == 0 && L < LOWL) {
-		ret = push_u8(STREAM, B >> s);
+		ret = eshift_u8(state);
 		L = (L << bitsofD) & MASK;
 		B = (B << bitsofD) & MASK;
 	};
@@ -330,20 +492,19 @@ static int erenorm_u8(state_t *state)
 
 static int eselect_u8(state_t *state)
 {
-	u64 a;
-
-	a = B;
+	int ret;
 
 	/* D^(P-1)/2: (2^8)^(4-1)/2 = 2^24/2 = 2^23 = 2^(32-8-1) */
-	B = (B + (1ULL << (SHIFT - bitsofD - 1))) & MASK;
+	B = B + (1ULL << (SHIFT - bitsofD - 1));
 
 	L = (1ULL << (SHIFT - 2 * bitsofD)) - 1;	/* requires P > 2 */
-	if (a > B) {
-		carry_u8(STREAM);
-	}
 
 	/* output last 2 symbols */
-	return erenorm_u8(state);
+	if ((ret = erenorm_u8(state)) == 0) {
+		ret = eflush_u8(state);
+	}
+
+	return ret;
 }
 
 static int estep_u8(state_t *state, u64 s)
@@ -359,22 +520,34 @@ static int estep_u8(state_t *state, u64 s)
 }
 
 /* returns 0 for successful encode, negative otherwise */
-int encode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym)
+int ac_encode_u8_u8(ac_state_t *s, void **out, size_t *nout, void *in, size_t nin)
 {
 	size_t i;
-	static state_t s;
 	int ret;
 
-	if ((ret = init_u8(&s, *out, *nout, cdf, nsym)) == 0) {
+	ac_reset(s);
+	if ((ret = attach(&s->d, *out, *nout)) == 0) {
 		for (i = 0; ret == 0 && i < nin; i++) {
-			ret = estep_u8(&s, ((u8 *)in)[i]);
+			ret = estep_u8(s, ((u8 *)in)[i]);
 		}
 
-		if ((ret = estep_u8(&s, s.nsym - 1)) == 0) {
-			ret = eselect_u8(&s);
+		if (ret == 0 && (ret = estep_u8(s, s->nsym - 1)) == 0) {
+			ret = eselect_u8(s);
 		}
-		detach(&s.d, out, nout);
-		free_internal(&s);
+		detach(&s->d, out, nout);
+		free_internal(s);
+	}
+
+	return ret;
+}
+
+int encode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym)
+{
+	state_t s;
+	int ret;
+
+	if ((ret = init_u8(&s, cdf, nsym)) == 0) {
+		ret = ac_encode_u8_u8(&s, out, nout, in, nin);
 	}
 
 	return ret;
@@ -392,7 +565,7 @@ static u64 dselect(state_t *state, u64 *v, int *isend)
 	y = L;
 	while ((n - s) > 1UL) {		/* bisection search */
 		u32 m = (s + n) >> 1;
-		u64 z = (L * C[m]) >> SHIFT;
+		u64 z = (L * C[m]) >> CBITS;
 
 		if (z > *v) {
 			n = m;
@@ -414,6 +587,76 @@ static u64 dselect(state_t *state, u64 *v, int *isend)
 	return s;
 }
 
+static u32 highbit(u32 v)
+{
+	return 31 - __builtin_clz(v);
+}
+
+/*
+ * The target frequency for a value <v> in a range <l> of at least 2^16, that is
+ * ((v + 1) * 2^AC_MODEL_BITS - 1) / l, the largest t with (l * t) >> AC_MODEL_BITS <= v.
+ * There's no division, which the target MCUs either don't have or only have for 32 bits:
+ * the top 17 bits of l, rounded up, give 2^47 / l from a straight line through 1/x and
+ * two Newton steps, never over and good to about one part in 2^15.  That leaves the
+ * estimate at most 3 short of t, and a multiply each settles those.
+ */
+static u64 dtarget(u64 v, u64 l)
+{
+	const u32 sh = highbit(l) - 16;
+	const u64 d = (l >> sh) + 1;
+	u64 r, t;
+
+	r = 3031741621u - ((2021161080u * d) >> 17);
+	r = (r * (((1ULL << 48) - d * r) >> 17)) >> 30;
+	r = (r * (((1ULL << 48) - d * r) >> 17)) >> 30;
+
+	t = (v * r) >> (31 + sh);
+	t += ((l * (t + 1)) >> AC_MODEL_BITS) <= v;
+	t += ((l * (t + 1)) >> AC_MODEL_BITS) <= v;
+	t += ((l * (t + 1)) >> AC_MODEL_BITS) <= v;
+
+	/* only a corrupt message can point past the top */
+	return (t < AC_MODEL_TOTAL) ? t : AC_MODEL_TOTAL - 1;
+}
+
+/*
+ * Table-driven version of dselect().
+ *
+ * A symbol c is selected when (L * C[c]) >> CBITS <= v, which is the same as
+ * C[c] <= t for the target t from dtarget().  The table gives the symbols at the
+ * start of t's slot and of the next one, and the search never leaves those two: they're
+ * usually the same symbol, and when they're neighbours one compare settles it.
+ */
+static u64 dselect_lut(state_t *state, u64 *v, int *isend)
+{
+	const u64 t = dtarget(*v, L);
+	const uint16_t *slot = &state->lut->sym[t >> (CBITS - AC_LUT_BITS)];
+	u64 s, n, m, x, y;
+
+	s = slot[0];
+	n = slot[1];
+	while (s < n) {
+		m = (s + n + 1) >> 1;
+		if (C[m] <= t) {
+			s = m;
+		} else {
+			n = m - 1;
+		}
+	}
+
+	x = (L * C[s]) >> CBITS;
+	y = L;
+	if (s != (NSYM - 1)) {
+		y = (L * C[s + 1]) >> CBITS;
+	} else {
+		*isend = 1;
+	}
+
+	*v -= x;
+	L = y - x;
+	return s;
+}
+
 static void drenorm_u8(state_t *state, u64 *v)
 {
 	while (L < LOWL) {
@@ -434,7 +677,7 @@ static void dprime_u8(state_t *state, u64* v)
 
 static u64 dstep_u8(state_t *state, u64 *v, int *isend)
 {
-	u64 s = dselect(state, v, isend);
+	u64 s = (state->lut) ? dselect_lut(state, v, isend) : dselect(state, v, isend);
 	if (L < LOWL) {
 		drenorm_u8(state, v);
 	}
@@ -442,28 +685,1474 @@ static u64 dstep_u8(state_t *state, u64 *v, int *isend)
 	return s;
 }
 
-int decode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym)
+int ac_decode_u8_u8(ac_state_t *s, void **out, size_t *nout, void *in, size_t nin)
 {
-	state_t s;
 	stream_t d = {0};
 	u64 v, x;
-	size_t i = 0;
 	int isend = 0;
 	int ret;
 
-	attach(&d, *out, *nout * sizeof(u8));
-	if ((ret = init_u8(&s, in, nin, cdf, nsym)) == 0) {
-		dprime_u8(&s, &v);
-		x = dstep_u8(&s, &v, &isend);
+	ac_reset(s);
+	if ((ret = attach(&d, *out, *nout * sizeof(u8))) == 0 && (ret = attach(&s->d, in, nin)) == 0) {
+		dprime_u8(s, &v);
+		x = dstep_u8(s, &v, &isend);
 		while (! isend) {
+			/* a corrupt message must not run off the end of the output buffer */
+			if (d.ibyte >= d.nbytes) {
+				ret = -1;
+				break;
+			}
+
 			push_u8(&d, x);
-			x = dstep_u8(&s, &v, &isend);
+			x = dstep_u8(s, &v, &isend);
 		}
 
-		free_internal(&s);
+		free_internal(s);
 		detach(&d, (void**)out, nout);
 		*nout /= sizeof(u8);
 	}
 
 	return ret;
 }
+
+int decode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym)
+{
+	state_t s;
+	int ret;
+
+	if ((ret = init_u8(&s, cdf, nsym)) == 0) {
+		ret = ac_decode_u8_u8(&s, out, nout, in, nin);
+	}
+
+	return ret;
+}
+
+
+/*
+ * Coding against a shared model
+ *
+ * These reference the caller's model instead of copying it into the state, so one
+ * read-only model (and its lookup table) can serve any number of coders.  Intervals
+ * are always given in units of AC_MODEL_TOTAL.
+ */
+
+/* the top of symbol <s>'s interval; the end symbol runs to the top of the model */
+static u64 model_hi(const ac_model_t *m, u64 s)
+{
+	return (s < m->nsym) ? m->cum[s + 1] : AC_MODEL_TOTAL;
+}
+
+/* the largest symbol whose interval starts at or below <t> */
+static u64 model_find(const ac_model_t *m, const ac_lut_t *lut, u64 t)
+{
+	const uint16_t *slot;
+	u64 s, n;
+
+	if (lut) {
+		/* between the symbols at the start of t's slot and the next (see dselect_lut()) */
+		slot = &lut->sym[t >> (AC_MODEL_BITS - AC_LUT_BITS)];
+		s = slot[0];
+		n = slot[1];
+		while (s < n) {
+			u64 mid = (s + n + 1) >> 1;
+			if (m->cum[mid] <= t) {
+				s = mid;
+			} else {
+				n = mid - 1;
+			}
+		}
+	} else {
+		s = 0;
+		n = m->nsym + 1;
+		while ((n - s) > 1) {
+			u64 mid = (s + n) >> 1;
+			if (m->cum[mid] <= t) {
+				s = mid;
+			} else {
+				n = mid;
+			}
+		}
+	}
+
+	return s;
+}
+
+/* narrow the interval to [B + x, B + y) */
+static int enarrow_u8(state_t *state, u64 x, u64 y)
+{
+	B = B + x;
+	L = y - x;
+	return (L < LOWL) ? erenorm_u8(state) : 0;
+}
+
+static void dnarrow_u8(state_t *state, u64 x, u64 y)
+{
+	state->v -= x;
+	L = y - x;
+
+	if (L < LOWL) {
+		drenorm_u8(state, &state->v);
+	}
+}
+
+/*
+ * rANS
+ *
+ * Between symbols the state (in state->v) stays in [RANS_L, RANS_L << 8), moving a
+ * byte at a time to and from the stream.  The encoder only queues intervals until
+ * the end of the message, then codes them last first; its output comes out
+ * backwards, so it's reversed to give the decoder the final state first and the
+ * rest of the bytes in the order it needs them.  The encoder starts from RANS_L,
+ * whose low bytes are zero, and the first bytes it writes often are too; they end
+ * up at the end of the message and are dropped, since the decoder reads zeros past
+ * the end anyway.
+ *
+ * RANS_L is as small as it can be with AC_MODEL_TOTAL: a larger one rounds less in
+ * x / freq, but the final state costs a byte more, which is worse on packets.
+ */
+#define RANS_L_BITS	(AC_MODEL_BITS)
+#define RANS_L		(1ULL << RANS_L_BITS)
+#define RANS_BYTES	((RANS_L_BITS + bitsofD + 7) / 8)	/* bytes needed for the final state */
+
+static int rans_put(state_t *state, u64 clo, u64 chi)
+{
+	ac_rans_queue_t *rq = state->rq;
+
+	if (rq == NULL) {
+		printf("%s: no rANS queue (see ac_use_rans_queue())\n", __func__);
+		return -1;
+	}
+
+	if (rq->n >= AC_RANS_MAX) {
+		printf("%s: message too long for the rANS queue (%d intervals)\n", __func__, AC_RANS_MAX);
+		return -1;
+	}
+
+	rq->q[rq->n++] = clo | ((chi - clo - 1) << AC_MODEL_BITS);
+	return 0;
+}
+
+static int rans_flush(state_t *state)
+{
+	const ac_rans_queue_t *rq = state->rq;
+	u8 *p;
+	u64 x = RANS_L, start, freq;
+	size_t i, n, z;
+	int ret = 0;
+
+	/* without a queue nothing can have been queued */
+	for (i = (rq) ? rq->n : 0; ret == 0 && i-- > 0;) {
+		start = rq->q[i] & (AC_MODEL_TOTAL - 1);
+		freq = (rq->q[i] >> AC_MODEL_BITS) + 1;
+		while (ret == 0 && x >= (freq << (RANS_L_BITS + bitsofD - AC_MODEL_BITS))) {
+			ret = push_u8(STREAM, x & 0xff);
+			x >>= bitsofD;
+		}
+
+		x = ((x / freq) << AC_MODEL_BITS) + (x % freq) + start;
+	}
+
+	for (i = 0; ret == 0 && i < RANS_BYTES; i++) {
+		ret = push_u8(STREAM, x & 0xff);
+		x >>= bitsofD;
+	}
+
+	if (ret != 0) {
+		return ret;
+	}
+
+	p = DATA;
+	n = STREAM->ibyte;
+	for (z = 0; z < n && p[z] == 0; z++) {
+	}
+
+	for (i = 0; i < n / 2; i++) {
+		u8 t = p[i];
+		p[i] = p[n - 1 - i];
+		p[n - 1 - i] = t;
+	}
+
+	STREAM->ibyte = n - z;
+	return 0;
+}
+
+static void rans_prime(state_t *state)
+{
+	state->v = 0;
+	for (int i = 0; i < RANS_BYTES; i++) {
+		state->v = (state->v << bitsofD) | pop_u8(STREAM);
+	}
+}
+
+static void rans_renorm(state_t *state)
+{
+	/* a valid message never takes the state to zero; a corrupt one mustn't hang here */
+	while (state->v && state->v < RANS_L) {
+		state->v = (state->v << bitsofD) | pop_u8(STREAM);
+	}
+}
+
+/* rANS needs a power of two total; every slice stays at least one wide as long as tot <= AC_MODEL_TOTAL */
+static u64 rans_scale(u64 c, u64 tot)
+{
+	return (c << AC_MODEL_BITS) / tot;
+}
+
+/* narrow the interval to [clo, chi) out of AC_MODEL_TOTAL */
+static int erange_u8(state_t *state, u64 clo, u64 chi)
+{
+	if (state->backend == AC_BACKEND_RANS) {
+		return rans_put(state, clo, chi);
+	}
+
+	return enarrow_u8(state, (L * clo) >> AC_MODEL_BITS, (L * chi) >> AC_MODEL_BITS);
+}
+
+/* the exact frequency the current value points at (see dtarget()) */
+static u64 dtarget_u8(state_t *state)
+{
+	if (state->backend == AC_BACKEND_RANS) {
+		return state->v & (AC_MODEL_TOTAL - 1);
+	}
+
+	return dtarget(state->v, L);
+}
+
+static void drange_u8(state_t *state, u64 clo, u64 chi)
+{
+	if (state->backend == AC_BACKEND_RANS) {
+		state->v = (chi - clo) * (state->v >> AC_MODEL_BITS) + (state->v & (AC_MODEL_TOTAL - 1)) - clo;
+		rans_renorm(state);
+		return;
+	}
+
+	dnarrow_u8(state, (L * clo) >> AC_MODEL_BITS, (L * chi) >> AC_MODEL_BITS);
+}
+
+/*
+ * The same for totals which aren't a power of two (adaptive models).  The interval is
+ * cut into <tot> slices of L / tot; whatever is left over at the top goes to the last
+ * symbol, so the decoder has to clamp its target.  rANS rescales the slices to
+ * AC_MODEL_TOTAL instead, and its target is the largest slice starting at or below
+ * the frequency the state points at.
+ */
+static int erange_div_u8(state_t *state, u64 clo, u64 chi, u64 tot)
+{
+	const u64 r = L / tot;
+
+	if (state->backend == AC_BACKEND_RANS) {
+		return rans_put(state, rans_scale(clo, tot), rans_scale(chi, tot));
+	}
+
+	return enarrow_u8(state, r * clo, (chi == tot) ? L : r * chi);
+}
+
+static u64 dtarget_div_u8(state_t *state, u64 tot)
+{
+	u64 t;
+
+	if (state->backend == AC_BACKEND_RANS) {
+		return (((state->v & (AC_MODEL_TOTAL - 1)) + 1) * tot - 1) >> AC_MODEL_BITS;
+	}
+
+	t = state->v / (L / tot);
+	return (t < tot) ? t : tot - 1;
+}
+
+static void drange_div_u8(state_t *state, u64 clo, u64 chi, u64 tot)
+{
+	const u64 r = L / tot;
+
+	if (state->backend == AC_BACKEND_RANS) {
+		drange_u8(state, rans_scale(clo, tot), rans_scale(chi, tot));
+		return;
+	}
+
+	dnarrow_u8(state, r * clo, (chi == tot) ? L : r * chi);
+}
+
+/* starts a message on <state>'s backend */
+static int ebegin_u8(state_t *state, void *out, size_t nout)
+{
+	set_u8_params(state);
+	ac_reset(state);
+	if (state->rq) {
+		state->rq->n = 0;
+	}
+
+	return attach(STREAM, out, nout);
+}
+
+/* codes whatever the backend still holds and finishes the message */
+static int efinish_u8(state_t *state)
+{
+	return (state->backend == AC_BACKEND_RANS) ? rans_flush(state) : eselect_u8(state);
+}
+
+static int dbegin_u8(state_t *state, const void *in, size_t nin)
+{
+	int ret;
+
+	set_u8_params(state);
+	ac_reset(state);
+	if ((ret = attach(STREAM, (void *)in, nin)) == 0) {
+		if (state->backend == AC_BACKEND_RANS) {
+			rans_prime(state);
+		} else {
+			dprime_u8(state, &state->v);
+		}
+	}
+
+	return ret;
+}
+
+int ac_set_backend(ac_state_t *state, u32 backend)
+{
+	if (backend != AC_BACKEND_ARITH && backend != AC_BACKEND_RANS) {
+		printf("%s: unknown backend %u\n", __func__, backend);
+		return -1;
+	}
+
+	state->backend = backend;
+	return 0;
+}
+
+void ac_use_rans_queue(ac_state_t *state, ac_rans_queue_t *queue)
+{
+	state->rq = queue;
+}
+
+/* bytes outside the model's alphabet (or with a zero frequency) are escaped and then sent flat */
+#define LITERAL_SHIFT	(AC_MODEL_BITS - bitsofD)
+
+static int has_escape(const ac_model_t *m)
+{
+	return m->nsym > AC_ESC && m->cum[AC_ESC + 1] > m->cum[AC_ESC];
+}
+
+/* codes byte <b> against <m>, escaping if it has no frequency of its own */
+static int emodel_u8(state_t *s, const ac_model_t *m, u64 b)
+{
+	int ret;
+
+	if (b < m->nsym && model_hi(m, b) > m->cum[b]) {
+		return erange_u8(s, m->cum[b], model_hi(m, b));
+	}
+
+	if (!has_escape(m)) {
+		return -1;
+	}
+
+	if ((ret = erange_u8(s, m->cum[AC_ESC], model_hi(m, AC_ESC))) == 0) {
+		ret = erange_u8(s, b << LITERAL_SHIFT, (b + 1) << LITERAL_SHIFT);
+	}
+
+	return ret;
+}
+
+/* the inverse of emodel_u8(); returns m->nsym for the end symbol */
+static u64 dmodel_u8(state_t *s, const ac_model_t *m, const ac_lut_t *lut)
+{
+	u64 sym;
+
+	sym = model_find(m, lut, dtarget_u8(s));
+	drange_u8(s, m->cum[sym], model_hi(m, sym));
+	if (sym == AC_ESC && sym != m->nsym) {
+		sym = dtarget_u8(s) >> LITERAL_SHIFT;
+		drange_u8(s, sym << LITERAL_SHIFT, (sym + 1) << LITERAL_SHIFT);
+	}
+
+	return sym;
+}
+
+/* codes <nin> bytes and the end symbol against <m>, on a started message */
+static int emessage_u8(state_t *s, const u8 *p, size_t nin, const ac_model_t *m)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; ret == 0 && i < nin; i++) {
+		ret = emodel_u8(s, m, p[i]);
+	}
+
+	if (ret == 0 && (ret = erange_u8(s, m->cum[m->nsym], AC_MODEL_TOTAL)) == 0) {
+		ret = efinish_u8(s);
+	}
+
+	return ret;
+}
+
+/* decodes a started message into <d> */
+static int dmessage_u8(state_t *s, stream_t *d, const ac_model_t *m, const ac_lut_t *lut)
+{
+	u64 sym;
+
+	while ((sym = dmodel_u8(s, m, lut)) != m->nsym) {
+		/* a corrupt message must not run off the end of the output buffer */
+		if (d->ibyte >= d->nbytes) {
+			return -1;
+		}
+
+		push_u8(d, sym);
+	}
+
+	return 0;
+}
+
+int ac_encode_model_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_model_t *m)
+{
+	int ret;
+
+	if ((ret = ebegin_u8(s, *out, *nout)) == 0) {
+		ret = emessage_u8(s, (const u8 *)in, nin, m);
+	}
+
+	detach(&s->d, out, nout);
+	return ret;
+}
+
+int ac_decode_model_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_model_t *m, const ac_lut_t *lut)
+{
+	stream_t d = {0};
+	int ret;
+
+	if ((ret = attach(&d, *out, *nout)) != 0 || (ret = dbegin_u8(s, in, nin)) != 0) {
+		return ret;
+	}
+
+	ret = dmessage_u8(s, &d, m, lut);
+	detach(&d, out, nout);
+	return ret;
+}
+
+
+/*
+ * Batches
+ *
+ * Every message in a batch is coded straight into its place in the caller's arena,
+ * one after the other, against the same model; nothing is allocated or copied.
+ */
+int ac_encode_batch_u8(ac_state_t *s, const ac_packet_t *pkts, size_t npkts, void *arena, size_t narena, size_t *offsets, const ac_model_t *m)
+{
+	size_t i;
+	int ret = 0;
+
+	offsets[0] = 0;
+	for (i = 0; ret == 0 && i < npkts; i++) {
+		if (offsets[i] >= narena) {
+			printf("%s: arena full after %zu of %zu messages\n", __func__, i, npkts);
+			return -1;
+		}
+
+		if ((ret = ebegin_u8(s, (u8 *)arena + offsets[i], narena - offsets[i])) == 0) {
+			ret = emessage_u8(s, (const u8 *)pkts[i].data, pkts[i].len, m);
+		}
+
+		offsets[i + 1] = offsets[i] + s->d.ibyte;
+		detach(&s->d, NULL, NULL);
+	}
+
+	return ret;
+}
+
+int ac_decode_batch_u8(ac_state_t *s, const void *in, const size_t *in_offsets, size_t npkts, void *arena, size_t narena, size_t *offsets, const ac_model_t *m, const ac_lut_t *lut)
+{
+	stream_t d;
+	size_t i;
+	int ret = 0;
+
+	offsets[0] = 0;
+	for (i = 0; ret == 0 && i < npkts; i++) {
+		memset(&d, 0, sizeof(d));
+		if ((ret = attach(&d, (u8 *)arena + offsets[i], narena - offsets[i])) != 0) {
+			break;
+		}
+
+		if ((ret = dbegin_u8(s, (const u8 *)in + in_offsets[i], in_offsets[i + 1] - in_offsets[i])) == 0) {
+			ret = dmessage_u8(s, &d, m, lut);
+		}
+
+		offsets[i + 1] = offsets[i] + d.ibyte;
+		detach(&s->d, NULL, NULL);
+	}
+
+	return ret;
+}
+
+
+
+/*
+ * Streaming
+ *
+ * A carry only reaches back through a run of 0xff bytes to the byte before it, so
+ * everything ahead of the last byte that isn't 0xff is final.  The decoder's value
+ * is built from the bytes it has taken from the stream; a symbol can pop up to
+ * PULL_AHEAD more (an escape and its literal, three bytes each), so until the last
+ * of the input is in, the decoder only starts a symbol with that many bytes to hand.
+ */
+#define PULL_AHEAD	(6)
+
+int ac_push_begin(ac_state_t *s, void *out, size_t nout)
+{
+	if (s->backend != AC_BACKEND_ARITH) {
+		printf("%s: only the arithmetic coder can stream\n", __func__);
+		return -1;
+	}
+
+	return ebegin_u8(s, out, nout);
+}
+
+int ac_push(ac_state_t *s, const ac_model_t *m, const void *in, size_t nin)
+{
+	const u8 *p = (const u8 *)in;
+
+	for (size_t i = 0; i < nin; i++) {
+		if (emodel_u8(s, m, p[i]) != 0) {
+			return -1;
+		}
+	}
+
+	return s->d.ibyte;
+}
+
+int ac_push_end(ac_state_t *s, const ac_model_t *m)
+{
+	size_t n;
+
+	if (erange_u8(s, m->cum[m->nsym], AC_MODEL_TOTAL) != 0 || eselect_u8(s) != 0) {
+		return -1;
+	}
+
+	detach(&s->d, NULL, &n);
+	return n;
+}
+
+int ac_pull_begin(ac_state_t *s)
+{
+	if (s->backend != AC_BACKEND_ARITH) {
+		printf("%s: only the arithmetic coder can stream\n", __func__);
+		return -1;
+	}
+
+	set_u8_params(s);
+	ac_reset(s);
+	return 0;
+}
+
+int ac_pull(ac_state_t *s, const ac_model_t *m, const ac_lut_t *lut, const void *in, size_t nin, int last, void *out, size_t nout, size_t *ndone)
+{
+	u8 *o = (u8 *)out;
+	u64 sym;
+
+	/* the stream just follows the caller's buffer as it fills */
+	s->d.d = (u8 *)in;
+	s->d.nbytes = nin;
+
+	if (s->d.ibyte == 0) {
+		if (nin < s->shift / bitsofD && !last) {
+			return 0;
+		}
+
+		dprime_u8(s, &s->v);
+	}
+
+	while (last || s->d.ibyte + PULL_AHEAD <= nin) {
+		if ((sym = dmodel_u8(s, m, lut)) == m->nsym) {
+			return 1;
+		}
+
+		if (*ndone >= nout) {
+			return -1;
+		}
+
+		o[(*ndone)++] = sym;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Context models
+ *
+ * Each context with a table has a short list of the symbols seen after it, sorted by
+ * symbol, each entry packing the start of the symbol's interval above its symbol number
+ * (see AC_CTX_ENTRY()).  The escape and end symbols are always present and, being the largest, are
+ * always the last two entries.  Anything the table doesn't have is escaped and coded
+ * against the order-0 model instead, as is everything in a context without a table.
+ */
+u32 ac_context_slot(const ac_context_t *cm, u32 prev1, u32 prev2)
+{
+	if (cm->order < 2) {
+		return prev1 & 0xff;
+	}
+
+	return ((((prev2 & 0xff) << 8) | (prev1 & 0xff)) * 2654435761U) >> (32 - cm->bits);
+}
+
+static const u32 *ctx_table(const ac_context_t *cm, u32 prev1, u32 prev2)
+{
+	const u32 off = cm->slot[ac_context_slot(cm, prev1, prev2)];
+	return (off == AC_CTX_NONE) ? NULL : cm->pool + off;
+}
+
+/* the top of entry <i>'s interval in table <t> */
+static u64 ctx_hi(const u32 *t, u32 i)
+{
+	return (i + 1 < t[0]) ? AC_CTX_CUM(t[i + 2]) : AC_MODEL_TOTAL;
+}
+
+/* codes <sym> (a byte or AC_CTX_END) in table <t>, falling back to the order-0 model */
+static int ectx_u8(state_t *s, const ac_context_t *cm, const u32 *t, u32 sym)
+{
+	const ac_model_t *m = cm->order0;
+	u32 lo, hi, mid;
+	int ret;
+
+	if (t) {
+		lo = 0;
+		hi = t[0];
+		while (lo < hi) {
+			mid = (lo + hi) >> 1;
+			if (AC_CTX_SYM(t[mid + 1]) < sym) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		if (AC_CTX_SYM(t[lo + 1]) == sym) {
+			return erange_u8(s, AC_CTX_CUM(t[lo + 1]), ctx_hi(t, lo));
+		}
+
+		if ((ret = erange_u8(s, AC_CTX_CUM(t[t[0] - 1]), AC_CTX_CUM(t[t[0]]))) != 0) {
+			return ret;
+		}
+	}
+
+	if (sym == AC_CTX_END) {
+		return erange_u8(s, m->cum[m->nsym], AC_MODEL_TOTAL);
+	}
+
+	return emodel_u8(s, m, sym);
+}
+
+static u32 dctx_u8(state_t *s, const ac_context_t *cm, const u32 *t)
+{
+	const ac_model_t *m = cm->order0;
+	u64 target, sym;
+	u32 lo, hi, mid;
+
+	if (t) {
+		target = dtarget_u8(s);
+		lo = 0;
+		hi = t[0];
+		while ((hi - lo) > 1) {
+			mid = (lo + hi) >> 1;
+			if (AC_CTX_CUM(t[mid + 1]) <= target) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+
+		drange_u8(s, AC_CTX_CUM(t[lo + 1]), ctx_hi(t, lo));
+		if ((sym = AC_CTX_SYM(t[lo + 1])) != AC_ESC) {
+			return sym;
+		}
+	}
+
+	sym = dmodel_u8(s, m, cm->lut0);
+	return (sym == m->nsym) ? AC_CTX_END : sym;
+}
+
+int ac_context_from_counts(ac_context_t *cm, u32 order, u32 bits, const u32 *counts, u32 min_total)
+{
+	const u32 *row;
+	u32 tmp[AC_CTX_NSYM];
+	ac_model_t model;
+	u32 nslot, npool, off, total, n, c, i;
+
+	if ((order == 1 && bits != 8) || order > 2 || bits < 1 || bits > 16) {
+		printf("%s: can't build an order-%u model with %u bits of context\n", __func__, order, bits);
+		return -1;
+	}
+
+	memset(cm, 0, sizeof(*cm));
+	cm->order = order;
+	cm->bits = bits;
+	nslot = 1U << bits;
+
+	/* size the pool: every seen byte, plus the escape and end symbols */
+	for (c = 0, npool = 0; c < nslot; c++) {
+		row = counts + (size_t)c * AC_CTX_NSYM;
+		for (i = 0, total = 0, n = 2; i < AC_CTX_NSYM; i++) {
+			total += row[i];
+			n += (i < AC_ESC && row[i]);
+		}
+
+		if (total && total >= min_total) {
+			npool += 1 + n;
+		}
+	}
+
+	cm->slot = malloc(nslot * sizeof(u32));
+	cm->pool = malloc((npool ? npool : 1) * sizeof(u32));
+	if (cm->slot == NULL || cm->pool == NULL) {
+		ac_context_free(cm);
+		return -1;
+	}
+
+	for (c = 0, off = 0; c < nslot; c++) {
+		row = counts + (size_t)c * AC_CTX_NSYM;
+		cm->slot[c] = AC_CTX_NONE;
+		for (i = 0, total = 0; i < AC_CTX_NSYM; i++) {
+			total += row[i];
+		}
+
+		if (total == 0 || total < min_total) {
+			continue;
+		}
+
+		/* every table must be able to escape */
+		memcpy(tmp, row, sizeof(tmp));
+		if (tmp[AC_ESC] == 0) {
+			tmp[AC_ESC] = 1;
+		}
+
+		if (ac_model_from_counts(&model, tmp, AC_CTX_NSYM - 1) != 0) {
+			ac_context_free(cm);
+			return -1;
+		}
+
+		cm->slot[c] = off;
+		for (i = 0, n = 0; i < AC_CTX_NSYM; i++) {
+			if (model_hi(&model, i) > model.cum[i]) {
+				cm->pool[off + 1 + n++] = AC_CTX_ENTRY(model.cum[i], i);
+			}
+		}
+
+		cm->pool[off] = n;
+		off += 1 + n;
+	}
+
+	cm->npool = off;
+	return 0;
+}
+
+void ac_context_free(ac_context_t *cm)
+{
+	free(cm->slot);
+	free(cm->pool);
+	cm->slot = NULL;
+	cm->pool = NULL;
+	cm->npool = 0;
+}
+
+int ac_encode_context_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_context_t *cm)
+{
+	const u8 *p = (const u8 *)in;
+	u32 prev1 = 0, prev2 = 0;
+	size_t i;
+	int ret;
+
+	if ((ret = ebegin_u8(s, *out, *nout)) != 0) {
+		return ret;
+	}
+
+	for (i = 0; ret == 0 && i < nin; i++) {
+		ret = ectx_u8(s, cm, ctx_table(cm, prev1, prev2), p[i]);
+		prev2 = prev1;
+		prev1 = p[i];
+	}
+
+	if (ret == 0 && (ret = ectx_u8(s, cm, ctx_table(cm, prev1, prev2), AC_CTX_END)) == 0) {
+		ret = efinish_u8(s);
+	}
+
+	detach(&s->d, out, nout);
+	return ret;
+}
+
+int ac_decode_context_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_context_t *cm)
+{
+	stream_t d = {0};
+	u32 prev1 = 0, prev2 = 0, sym;
+	int ret;
+
+	if ((ret = attach(&d, *out, *nout)) != 0 || (ret = dbegin_u8(s, in, nin)) != 0) {
+		return ret;
+	}
+
+	while ((sym = dctx_u8(s, cm, ctx_table(cm, prev1, prev2))) != AC_CTX_END) {
+		if (d.ibyte >= d.nbytes) {
+			ret = -1;
+			break;
+		}
+
+		push_u8(&d, sym);
+		prev2 = prev1;
+		prev1 = sym;
+	}
+
+	detach(&d, out, nout);
+	return ret;
+}
+
+
+/*
+ * Coding one symbol at a time
+ *
+ * For callers which pick the table for every symbol themselves.  Slots are taken
+ * modulo the number of slots in the model.
+ */
+int ac_encode_begin(ac_state_t *s, void *out, size_t nout)
+{
+	return ebegin_u8(s, out, nout);
+}
+
+int ac_encode_symbol(ac_state_t *s, const ac_context_t *cm, u32 slot, u32 sym)
+{
+	const u32 off = cm->slot[slot & ((1U << cm->bits) - 1)];
+	return ectx_u8(s, cm, (off == AC_CTX_NONE) ? NULL : cm->pool + off, sym);
+}
+
+int ac_encode_end(ac_state_t *s, void **out, size_t *nout)
+{
+	int ret = efinish_u8(s);
+
+	detach(&s->d, out, nout);
+	return ret;
+}
+
+int ac_decode_begin(ac_state_t *s, const void *in, size_t nin)
+{
+	return dbegin_u8(s, in, nin);
+}
+
+u32 ac_decode_symbol(ac_state_t *s, const ac_context_t *cm, u32 slot)
+{
+	const u32 off = cm->slot[slot & ((1U << cm->bits) - 1)];
+	return dctx_u8(s, cm, (off == AC_CTX_NONE) ? NULL : cm->pool + off);
+}
+
+void ac_decode_end(ac_state_t *s)
+{
+	detach(&s->d, NULL, NULL);
+}
+
+/*
+ * Adaptive models
+ *
+ * The frequencies live in a Fenwick (binary indexed) tree, so finding a symbol's
+ * interval, finding the symbol for a target and bumping a frequency are all O(log n).
+ * When the total would pass AC_ADAPT_LIMIT every frequency is halved, which also
+ * lets the model forget old statistics.
+ */
+#define ADAPT_END	(AC_ADAPT_NSYM - 1)
+
+static void adapt_rebuild(ac_adaptive_t *a)
+{
+	u32 i, j;
+
+	a->total = 0;
+	for (i = 1; i <= AC_ADAPT_TREE; i++) {
+		a->tree[i] = (i <= AC_ADAPT_NSYM) ? a->freq[i - 1] : 0;
+		a->total += a->tree[i];
+	}
+
+	for (i = 1; i <= AC_ADAPT_TREE; i++) {
+		j = i + (i & -i);
+		if (j <= AC_ADAPT_TREE) {
+			a->tree[j] += a->tree[i];
+		}
+	}
+}
+
+/* cumulative frequency of all symbols below <s> */
+static u32 adapt_cum(const ac_adaptive_t *a, u32 s)
+{
+	u32 sum = 0;
+
+	for (; s > 0; s -= s & -s) {
+		sum += a->tree[s];
+	}
+
+	return sum;
+}
+
+/* the symbol whose interval contains <t>; its interval starts at *clo */
+static u32 adapt_find(const ac_adaptive_t *a, u32 t, u32 *clo)
+{
+	u32 pos = 0, step;
+
+	*clo = t;
+	for (step = AC_ADAPT_TREE; step > 0; step >>= 1) {
+		if (a->tree[pos + step] <= t) {
+			pos += step;
+			t -= a->tree[pos];
+		}
+	}
+
+	*clo -= t;
+	return pos;
+}
+
+static void adapt_update(ac_adaptive_t *a, u32 s)
+{
+	u32 i;
+
+	if (a->total + a->inc > AC_ADAPT_LIMIT) {
+		for (i = 0; i < AC_ADAPT_NSYM; i++) {
+			a->freq[i] = (a->freq[i] + 1) >> 1;
+		}
+
+		adapt_rebuild(a);
+	}
+
+	a->freq[s] += a->inc;
+	a->total += a->inc;
+	for (i = s + 1; i <= AC_ADAPT_TREE; i += i & -i) {
+		a->tree[i] += a->inc;
+	}
+}
+
+int ac_adaptive_init(ac_adaptive_t *a, const ac_model_t *prior, u32 weight, u32 inc)
+{
+	u32 i;
+
+	if (weight < AC_ADAPT_NSYM || weight + inc > AC_ADAPT_LIMIT) {
+		printf("%s: prior weight %u out of range\n", __func__, weight);
+		return -1;
+	}
+
+	memset(a, 0, sizeof(*a));
+	a->inc = inc;
+	for (i = 0; i < AC_ADAPT_NSYM; i++) {
+		u32 f = weight / AC_ADAPT_NSYM;
+
+		/* byte i starts from symbol i of the prior, our end symbol from its end symbol */
+		if (prior) {
+			const u32 ps = (i == ADAPT_END) ? prior->nsym : i;
+			u64 pf = 0;
+
+			if (ps <= prior->nsym) {
+				pf = model_hi(prior, ps) - prior->cum[ps];
+			}
+
+			/* every symbol stays codable, so no escape is needed */
+			f = 1 + ((pf * (weight - AC_ADAPT_NSYM)) >> AC_MODEL_BITS);
+		}
+
+		a->freq[i] = f;
+	}
+
+	adapt_rebuild(a);
+	return 0;
+}
+
+int ac_encode_adaptive_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, ac_adaptive_t *a)
+{
+	const u8 *p = (const u8 *)in;
+	size_t i;
+	u32 clo;
+	int ret;
+
+	if ((ret = ebegin_u8(s, *out, *nout)) != 0) {
+		return ret;
+	}
+
+	for (i = 0; ret == 0 && i < nin; i++) {
+		clo = adapt_cum(a, p[i]);
+		ret = erange_div_u8(s, clo, clo + a->freq[p[i]], a->total);
+		adapt_update(a, p[i]);
+	}
+
+	if (ret == 0) {
+		clo = adapt_cum(a, ADAPT_END);
+		if ((ret = erange_div_u8(s, clo, clo + a->freq[ADAPT_END], a->total)) == 0) {
+			ret = efinish_u8(s);
+		}
+	}
+
+	detach(&s->d, out, nout);
+	return ret;
+}
+
+int ac_decode_adaptive_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, ac_adaptive_t *a)
+{
+	stream_t d = {0};
+	u32 sym, clo;
+	int ret;
+
+	if ((ret = attach(&d, *out, *nout)) != 0 || (ret = dbegin_u8(s, in, nin)) != 0) {
+		return ret;
+	}
+
+	for (;;) {
+		sym = adapt_find(a, dtarget_div_u8(s, a->total), &clo);
+		drange_div_u8(s, clo, clo + a->freq[sym], a->total);
+		if (sym == ADAPT_END) {
+			break;
+		}
+
+		if (d.ibyte >= d.nbytes) {
+			ret = -1;
+			break;
+		}
+
+		push_u8(&d, sym);
+		adapt_update(a, sym);
+	}
+
+	detach(&d, out, nout);
+	return ret;
+}
+
+
+/*
+ * tANS
+ *
+ * The model is rescaled to 2^AC_TANS_BITS and its symbols spread over that many
+ * states.  Decoding a symbol is one lookup in dec[], which gives the symbol and how
+ * to get the next state from a few bits of the stream; encoding reverses that with
+ * enc[].  Like rANS the encoder goes last symbol first.  Its bits go out LSB first
+ * and the decoder reads them back from the end of the message, where a marker bit
+ * tells it where the bits stop.  Escaped bytes follow the escape as 8 raw bits.
+ */
+#if AC_TANS_BITS < 9
+#error "AC_TANS_BITS must be at least 9, to leave room for every symbol"
+#endif
+
+#define TANS_SIZE	(1U << AC_TANS_BITS)
+
+int ac_tans_build(ac_tans_t *t, const ac_model_t *m)
+{
+	const u32 nsym = m->nsym + 1, shift = AC_MODEL_BITS - AC_TANS_BITS;
+	u32 q[CDF_MAX_SYMB], next[CDF_MAX_SYMB], cum[CDF_MAX_SYMB + 1];
+	uint16_t spread[TANS_SIZE];
+	u32 s, i, k, f, x, nb, pos, step, sum, big;
+
+	if (nsym >= CDF_MAX_SYMB) {
+		printf("%s: too many symbols (%u > %d)\n", __func__, nsym, CDF_MAX_SYMB);
+		return -1;
+	}
+
+	/* rescale, keeping every symbol with a frequency codable */
+	for (s = 0, sum = 0; s < nsym; s++) {
+		f = model_hi(m, s) - m->cum[s];
+		q[s] = (f + (1U << (shift - 1))) >> shift;
+		if (f && q[s] == 0) {
+			q[s] = 1;
+		}
+
+		sum += q[s];
+	}
+
+	/* then settle the rounding on the most probable symbols */
+	while (sum != TANS_SIZE) {
+		for (s = 0, big = 0; s < nsym; s++) {
+			big = (q[s] > q[big]) ? s : big;
+		}
+
+		if (sum < TANS_SIZE) {
+			q[big] += TANS_SIZE - sum;
+			sum = TANS_SIZE;
+		} else {
+			q[big]--;
+			sum--;
+		}
+	}
+
+	for (s = 0, pos = 0, step = (TANS_SIZE >> 1) + (TANS_SIZE >> 3) + 3; s < nsym; s++) {
+		for (k = 0; k < q[s]; k++) {
+			spread[pos] = s;
+			pos = (pos + step) & (TANS_SIZE - 1);
+		}
+	}
+
+	for (s = 0, cum[0] = 0; s < nsym; s++) {
+		cum[s + 1] = cum[s] + q[s];
+		next[s] = q[s];
+	}
+
+	/* the k-th state of symbol s leaves x = q[s] + k, which the encoder widens back to a full state */
+	for (i = 0; i < TANS_SIZE; i++) {
+		s = spread[i];
+		x = next[s]++;
+		nb = AC_TANS_BITS - highbit(x);
+		t->dec[i] = AC_TANS_ENTRY((x << nb) - TANS_SIZE, nb, s);
+		t->enc[cum[s] + x - q[s]] = TANS_SIZE + i;
+	}
+
+	/* (state + delta) >> 16 is the number of bits to take off a state before coding s; zero means s can't be coded */
+	for (s = 0; s < nsym; s++) {
+		t->find[s] = (int32_t)cum[s] - (int32_t)q[s];
+		if (q[s] == 0) {
+			t->delta[s] = 0;
+		} else if (q[s] == 1) {
+			t->delta[s] = (AC_TANS_BITS << 16) - TANS_SIZE;
+		} else {
+			nb = AC_TANS_BITS - highbit(q[s] - 1);
+			t->delta[s] = (nb << 16) - (q[s] << nb);
+		}
+	}
+
+	t->nsym = m->nsym;
+	return 0;
+}
+
+/* bits waiting to go out */
+struct tans_bits {
+	u64 acc;
+	u32 n;
+};
+
+static int tans_put(state_t *state, struct tans_bits *b, u32 v, u32 n)
+{
+	b->acc |= (u64)v << b->n;
+	b->n += n;
+	while (b->n >= 8) {
+		if (push_u8(STREAM, b->acc & 0xff) != 0) {
+			return -1;
+		}
+
+		b->acc >>= 8;
+		b->n -= 8;
+	}
+
+	return 0;
+}
+
+static int tans_step(state_t *state, const ac_tans_t *t, struct tans_bits *b, u32 *x, u32 sym)
+{
+	const u32 nb = (*x + t->delta[sym]) >> 16;
+	const int ret = tans_put(state, b, *x & ((1U << nb) - 1), nb);
+
+	*x = t->enc[(int32_t)(*x >> nb) + t->find[sym]];
+	return ret;
+}
+
+/* the <n> bits below bit <*pos> of <p>; a corrupt message which runs out just gets zeros */
+static u32 tans_get(const u8 *p, size_t *pos, u32 n)
+{
+	size_t i;
+	u32 v = 0;
+
+	if (n == 0 || *pos < n) {
+		*pos = (n) ? 0 : *pos;
+		return 0;
+	}
+
+	*pos -= n;
+	for (i = (*pos + n - 1) / 8 + 1; i-- > *pos / 8;) {
+		v = (v << 8) | p[i];
+	}
+
+	return (v >> (*pos & 7)) & ((1U << n) - 1);
+}
+
+int ac_encode_tans_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_tans_t *t)
+{
+	const u8 *p = (const u8 *)in;
+	const int esc = t->nsym > AC_ESC && t->delta[AC_ESC];
+	struct tans_bits b = {0};
+	u32 x = TANS_SIZE;
+	size_t i;
+	int ret;
+
+	set_u8_params(s);
+	ac_reset(s);
+	if ((ret = attach(&s->d, *out, *nout)) != 0) {
+		return ret;
+	}
+
+	ret = tans_step(s, t, &b, &x, t->nsym);
+	for (i = nin; ret == 0 && i-- > 0;) {
+		if (p[i] < t->nsym && t->delta[p[i]]) {
+			ret = tans_step(s, t, &b, &x, p[i]);
+		} else if (esc) {
+			if ((ret = tans_put(s, &b, p[i], 8)) == 0) {
+				ret = tans_step(s, t, &b, &x, AC_ESC);
+			}
+		} else {
+			ret = -1;
+		}
+	}
+
+	/* the final state, then the marker, padded out to a byte */
+	if (ret == 0 && (ret = tans_put(s, &b, x - TANS_SIZE, AC_TANS_BITS)) == 0) {
+		ret = tans_put(s, &b, 1, 8 - b.n);
+	}
+
+	detach(&s->d, out, nout);
+	return ret;
+}
+
+int ac_decode_tans_u8(ac_state_t *s, void **out, size_t *nout, const void *in, size_t nin, const ac_tans_t *t)
+{
+	const u8 *p = (const u8 *)in;
+	stream_t d = {0};
+	size_t pos;
+	u32 x, e, sym;
+	int ret;
+
+	if (nin == 0 || p[nin - 1] == 0) {
+		return -1;
+	}
+
+	if ((ret = attach(&d, *out, *nout)) != 0) {
+		return ret;
+	}
+
+	pos = 8 * (nin - 1) + highbit(p[nin - 1]);
+	x = tans_get(p, &pos, AC_TANS_BITS);
+	for (;;) {
+		e = t->dec[x];
+		x = AC_TANS_BASE(e) + tans_get(p, &pos, AC_TANS_NBITS(e));
+		if ((sym = AC_TANS_SYM(e)) == t->nsym) {
+			break;
+		}
+
+		if (sym == AC_ESC) {
+			sym = tans_get(p, &pos, 8);
+		}
+
+		if (d.ibyte >= d.nbytes) {
+			ret = -1;
+			break;
+		}
+
+		push_u8(&d, sym);
+	}
+
+	detach(&d, out, nout);
+	return ret;
+}
+
+
+/*
+ * Compact coder
+ *
+ * The shared model arithmetic coder again, cut down to what a small node needs: the
+ * parameters are the fixed u8 ones (see set_u8_params()), the buffers are the
+ * caller's and never grow, and the decoder searches the model directly, as a lookup
+ * table would be bigger than the model.  Carries are held back as in eshift_u8().
+ */
+#define COMPACT_SHIFT	(32)
+#define COMPACT_MASK	((1ULL << COMPACT_SHIFT) - 1)
+#define COMPACT_LOWL	(1ULL << (COMPACT_SHIFT - bitsofD))
+
+size_t ac_cmodel_size(u32 nsym)
+{
+	return sizeof(ac_cmodel_t) + (nsym + 1) * sizeof(uint16_t);
+}
+
+int ac_cmodel_from_model(ac_cmodel_t *cm, const ac_model_t *m)
+{
+	if (m->nsym >= CDF_MAX_SYMB || m->cum[m->nsym] >= AC_MODEL_TOTAL) {
+		printf("%s: not a valid model\n", __func__);
+		return -1;
+	}
+
+	cm->nsym = m->nsym;
+	for (u32 i = 0; i <= m->nsym; i++) {
+		cm->cum[i] = m->cum[i];
+	}
+
+	return 0;
+}
+
+static u32 cmodel_hi(const ac_cmodel_t *m, u32 s)
+{
+	return (s < m->nsym) ? m->cum[s + 1] : AC_MODEL_TOTAL;
+}
+
+static int cpush_u8(ac_coder_t *c, u32 v)
+{
+	if (c->i >= c->n) {
+		return -1;
+	}
+
+	c->d[c->i++] = v;
+	return 0;
+}
+
+static u32 cpop_u8(ac_coder_t *c)
+{
+	return (c->i < c->n) ? c->d[c->i++] : 0;
+}
+
+static int cshift_u8(ac_coder_t *c)
+{
+	const u32 byte = c->b >> (COMPACT_SHIFT - bitsofD);
+	const u32 carry = byte >> bitsofD;
+	int ret = 0;
+
+	if (byte == 0xff) {
+		c->pending++;
+		return 0;
+	}
+
+	if (c->cache != AC_NO_CACHE) {
+		ret = cpush_u8(c, c->cache + carry);
+	}
+
+	for (; ret == 0 && c->pending; c->pending--) {
+		ret = cpush_u8(c, (0xff + carry) & 0xff);
+	}
+
+	c->cache = byte & 0xff;
+	return ret;
+}
+
+static int crenorm_u8(ac_coder_t *c)
+{
+	int ret = 0;
+
+	while (ret == 0 && c->l < COMPACT_LOWL) {
+		ret = cshift_u8(c);
+		c->l <<= bitsofD;
+		c->b = (c->b << bitsofD) & COMPACT_MASK;
+	}
+
+	return ret;
+}
+
+static int cerange_u8(ac_coder_t *c, u64 clo, u64 chi)
+{
+	const u64 x = (c->l * clo) >> AC_MODEL_BITS, y = (c->l * chi) >> AC_MODEL_BITS;
+
+	c->b += x;
+	c->l = y - x;
+	return crenorm_u8(c);
+}
+
+static void cdrange_u8(ac_coder_t *c, u64 clo, u64 chi)
+{
+	const u64 x = (c->l * clo) >> AC_MODEL_BITS, y = (c->l * chi) >> AC_MODEL_BITS;
+
+	c->b -= x;
+	c->l = y - x;
+	while (c->l < COMPACT_LOWL) {
+		c->b = ((c->b << bitsofD) & COMPACT_MASK) + cpop_u8(c);
+		c->l <<= bitsofD;
+	}
+}
+
+static u32 cdtarget_u8(ac_coder_t *c)
+{
+	return dtarget(c->b, c->l);
+}
+
+/* the largest symbol whose interval starts at or below <t> */
+static u32 cmodel_find(const ac_cmodel_t *m, u32 t)
+{
+	u32 s = 0, n = m->nsym + 1;
+
+	while ((n - s) > 1) {
+		u32 mid = (s + n) >> 1;
+		if (m->cum[mid] <= t) {
+			s = mid;
+		} else {
+			n = mid;
+		}
+	}
+
+	return s;
+}
+
+/* as emodel_u8() */
+static int cemodel_u8(ac_coder_t *c, const ac_cmodel_t *m, u32 b)
+{
+	int ret;
+
+	if (b < m->nsym && cmodel_hi(m, b) > m->cum[b]) {
+		return cerange_u8(c, m->cum[b], cmodel_hi(m, b));
+	}
+
+	if (m->nsym <= AC_ESC || cmodel_hi(m, AC_ESC) == m->cum[AC_ESC]) {
+		return -1;
+	}
+
+	if ((ret = cerange_u8(c, m->cum[AC_ESC], cmodel_hi(m, AC_ESC))) == 0) {
+		ret = cerange_u8(c, (u64)b << LITERAL_SHIFT, (u64)(b + 1) << LITERAL_SHIFT);
+	}
+
+	return ret;
+}
+
+int ac_encode_compact_u8(ac_coder_t *c, const ac_cmodel_t *m, void *out, size_t nout, const void *in, size_t nin)
+{
+	const u8 *p = (const u8 *)in;
+	size_t i;
+	int ret = 0;
+
+	c->b = 0;
+	c->l = COMPACT_MASK;
+	c->pending = 0;
+	c->cache = AC_NO_CACHE;
+	c->d = (u8 *)out;
+	c->n = nout;
+	c->i = 0;
+
+	for (i = 0; ret == 0 && i < nin; i++) {
+		ret = cemodel_u8(c, m, p[i]);
+	}
+
+	if (ret == 0) {
+		ret = cerange_u8(c, m->cum[m->nsym], AC_MODEL_TOTAL);
+	}
+
+	/* as eselect_u8(): settle on the middle of the interval and write out the rest */
+	if (ret == 0) {
+		c->b += 1ULL << (COMPACT_SHIFT - bitsofD - 1);
+		c->l = (1ULL << (COMPACT_SHIFT - 2 * bitsofD)) - 1;
+		ret = crenorm_u8(c);
+	}
+
+	if (ret == 0 && c->cache != AC_NO_CACHE) {
+		ret = cpush_u8(c, c->cache);
+	}
+
+	for (; ret == 0 && c->pending; c->pending--) {
+		ret = cpush_u8(c, 0xff);
+	}
+
+	return (ret == 0) ? (int)c->i : -1;
+}
+
+int ac_decode_compact_u8(ac_coder_t *c, const ac_cmodel_t *m, void *out, size_t nout, const void *in, size_t nin)
+{
+	u8 *o = (u8 *)out;
+	size_t n = 0;
+	u32 sym;
+
+	c->d = (u8 *)in;
+	c->n = nin;
+	c->i = 0;
+	c->l = COMPACT_MASK;
+	c->b = 0;
+	for (int k = 0; k < COMPACT_SHIFT / bitsofD; k++) {
+		c->b = (c->b << bitsofD) + cpop_u8(c);
+	}
+
+	for (;;) {
+		sym = cmodel_find(m, cdtarget_u8(c));
+		cdrange_u8(c, m->cum[sym], cmodel_hi(m, sym));
+		if (sym == m->nsym) {
+			return (int)n;
+		}
+
+		if (sym == AC_ESC) {
+			sym = cdtarget_u8(c) >> LITERAL_SHIFT;
+			cdrange_u8(c, (u64)sym << LITERAL_SHIFT, (u64)(sym + 1) << LITERAL_SHIFT);
+		}
+
+		if (n >= nout) {
+			return -1;
+		}
+
+		o[n++] = sym;
+	}
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "ac_stream.h"
+
 /* since I'm using fixed-size CDFs, this sets the upper limit to the number of symbols */
 #define CDF_MAX_SYMB	(384)
 
@@ -12,6 +14,193 @@ typedef uint32_t	u32;
 typedef uint64_t	u64;
 typedef float		real;
 
+/*
+ * Integer models
+ * The frequencies of the symbols are scaled so they sum to AC_MODEL_TOTAL (a power of two),
+ * which lets the coder work from them directly without ever touching floating point.
+ */
+#define AC_MODEL_BITS	(16)
+#define AC_MODEL_TOTAL	(1UL << AC_MODEL_BITS)
+
+/*
+ * cum[i] is where symbol i starts and cum[nsym] is where the (implicit) end-of-message symbol
+ * starts, so the frequency of symbol i is cum[i+1] - cum[i] and the end symbol always gets
+ * AC_MODEL_TOTAL - cum[nsym].
+ */
+/*
+ * A model with more than 256 symbols reserves symbol 256 as an escape: a byte whose
+ * own frequency is zero is sent as the escape symbol followed by the byte coded flat.
+ */
+#define AC_ESC		(256)
+
+typedef struct _ac_model_t {
+	u32 nsym;			/* number of symbols in the input alphabet (not counting the end symbol) */
+	u32 cum[CDF_MAX_SYMB];		/* cumulative frequencies, nsym+1 entries are used */
+} ac_model_t;
+
+/*
+ * Decoder lookup table
+ * Maps the top AC_LUT_BITS of a cumulative frequency straight to a symbol, replacing the
+ * bisection search in the decoder.  A table entry is usually exact; when several symbols
+ * share one slot the next entry bounds them, so the decoder only searches between the
+ * two, and the extra entry at the end holds the end symbol.  Set AC_LUT_BITS to
+ * AC_MODEL_BITS to make every lookup exact, at the cost of a 128KB table.
+ */
+#ifndef AC_LUT_BITS
+#define AC_LUT_BITS	(12)
+#endif
+
+#if AC_LUT_BITS > AC_MODEL_BITS
+#error "AC_LUT_BITS can not be larger than AC_MODEL_BITS"
+#endif
+
+typedef struct _ac_lut_t {
+	uint16_t sym[(1 << AC_LUT_BITS) + 1];
+} ac_lut_t;
+
+/*
+ * Adaptive model
+ * Every byte value plus the end symbol, with frequencies that are updated as each
+ * symbol is coded.  Encoder and decoder must start from identical copies.
+ */
+#define AC_ADAPT_NSYM	(257)		/* 256 byte values and the end symbol */
+#define AC_ADAPT_TREE	(512)		/* Fenwick tree size, power of two >= AC_ADAPT_NSYM */
+#define AC_ADAPT_LIMIT	(0xffff)	/* halve all frequencies before the total passes this */
+#define AC_ADAPT_INC	(32)		/* default frequency increment per coded symbol */
+#define AC_ADAPT_WEIGHT	(4096)		/* default total of the prior */
+
+typedef struct _ac_adaptive_t {
+	u32 total;			/* sum of all frequencies */
+	u32 inc;			/* increment per coded symbol */
+	uint16_t freq[AC_ADAPT_NSYM];	/* symbol frequencies */
+	uint16_t tree[AC_ADAPT_TREE + 1];	/* Fenwick tree over freq[] (1-based) */
+} ac_adaptive_t;
+
+/*
+ * Context models
+ * Sparse tables selected by the previous byte (order 1) or a hash of the previous two
+ * (order 2), so the memory needed is bounded by the number of slots and the number of
+ * distinct symbols actually seen after each.  Contexts without a table, and symbols a
+ * table has never seen (through its escape), fall back to an order-0 model.
+ */
+#define AC_CTX_NSYM	(AC_ESC + 2)	/* 256 byte values, the escape and the end symbol */
+#define AC_CTX_END	(AC_ESC + 1)
+#define AC_CTX_NONE	(0xffffffffU)
+
+/* a table entry: the start of the symbol's interval and the symbol */
+#define AC_CTX_ENTRY(cum, sym)	(((cum) << 9) | (sym))
+#define AC_CTX_CUM(e)		((e) >> 9)
+#define AC_CTX_SYM(e)		((e) & 0x1ff)
+
+typedef struct _ac_context_t {
+	u32 order;			/* number of previous bytes the context is built from, 0 if the caller picks slots */
+	u32 bits;			/* log2 of the number of context slots */
+	u32 *slot;			/* per slot: offset of its table in pool[], or AC_CTX_NONE */
+	u32 *pool;			/* the tables: a count, then that many packed entries */
+	u32 npool;			/* number of words used in pool[] */
+	const ac_model_t *order0;	/* the fallback model; it should have an escape */
+	const ac_lut_t *lut0;		/* optional lookup table for order0 */
+} ac_context_t;
+
+/*
+ * tANS tables
+ * A table-driven ANS coder for an integer model, rescaled to 2^AC_TANS_BITS states.
+ * Coding a symbol is a table lookup and a few bits in or out, with no multiplies or
+ * divisions.  The tables are built once per model and shared read-only.
+ */
+#ifndef AC_TANS_BITS
+#define AC_TANS_BITS	(12)
+#endif
+
+#if AC_TANS_BITS > 14
+#error "AC_TANS_BITS can not be larger than 14"
+#endif
+
+/* a decoding table entry: the base of the next state, how many bits to add to it and the symbol */
+#define AC_TANS_ENTRY(base, nbits, sym)	(((u32)(base) << 16) | ((nbits) << 9) | (sym))
+#define AC_TANS_BASE(e)			((e) >> 16)
+#define AC_TANS_NBITS(e)		(((e) >> 9) & 0x1f)
+#define AC_TANS_SYM(e)			((e) & 0x1ff)
+
+typedef struct _ac_tans_t {
+	u32 nsym;				/* as the model's; symbol nsym is the end symbol */
+	u32 dec[1 << AC_TANS_BITS];		/* decoding table, by state */
+	uint16_t enc[1 << AC_TANS_BITS];	/* next state, by symbol (see find[]) and shifted state */
+	int32_t find[CDF_MAX_SYMB];		/* per symbol: where its run of enc[] starts, less its frequency */
+	u32 delta[CDF_MAX_SYMB];		/* per symbol: gives the number of bits to shift out of a state */
+} ac_tans_t;
+
+/*
+ * Backends
+ * The models above only describe symbols as intervals of AC_MODEL_TOTAL, so the same
+ * model can drive either the arithmetic coder or a range ANS (rANS) coder.  rANS
+ * decodes with one multiply per symbol and no division, but encodes last symbol
+ * first, so the encoder queues a message's intervals (up to AC_RANS_MAX of them) and
+ * codes them all at the end.  The queue is the caller's, lent to the state only by
+ * those who encode with rANS, so it costs nothing to anyone else.
+ */
+#define AC_BACKEND_ARITH	(0)
+#define AC_BACKEND_RANS		(1)
+#define AC_RANS_MAX		(1024)
+
+typedef struct _ac_rans_queue_t {
+	u32 n;				/* number of intervals queued */
+	u32 q[AC_RANS_MAX];		/* the intervals, start and frequency - 1 */
+} ac_rans_queue_t;
+
+#define AC_NO_CACHE		(0x100)	/* ac_state_t.cache before the first byte */
+
+/*
+ * Encoder/Decoder state
+ * The caller owns this; nothing in the coder keeps hidden state between calls, so
+ * any number of contexts can be used at once (one per thread, one per radio, ...).
+ */
+typedef struct _ac_state_t {
+	u64 b,			/* Beginning of the current interval. */
+	    l,			/* Length of the current interval. */
+	    v;			/* Current value. */
+
+	stream_t d;		/* The attached data stream. */
+	size_t nsym;		/* The number of symbols in the input alphabet. */
+	u64 D,			/* The number of symbols in the output alphabet. */
+	    shift,		/* A utility constant.  log2(D^P) - need 2P to fit in a register for multiplies. */
+	    mask,		/* Masks the live bits (can't remember exactly?) */
+	    lowl;		/* The minimum length of an encodable interval. */
+	u64 cbits;		/* The precision of the cdf below (log2 of its total). */
+	u64 cdf[CDF_MAX_SYMB];	/* The cdf associated with the input alphabet.  Must be an array of N+1 symbols. */
+	const ac_lut_t *lut;	/* Optional decoder lookup table for the model (integer models only). */
+	u32 backend;		/* AC_BACKEND_ARITH or AC_BACKEND_RANS (shared model APIs only). */
+	u32 cache;		/* Encoder: the last byte out, held back for a carry (AC_NO_CACHE if none). */
+	size_t pending;		/* Encoder: the number of 0xff bytes held back after <cache>. */
+	ac_rans_queue_t *rq;	/* rANS encoder: the caller's queue (see ac_use_rans_queue()). */
+} ac_state_t;
+
+/*
+ * Compact model and coder
+ * For nodes without RAM to spare: the same model as an ac_model_t, with 16-bit
+ * cumulative frequencies and only as many as the alphabet needs (see ac_cmodel_size()),
+ * and a coder state of a few tens of bytes which only ever points at it.  Arithmetic
+ * coding only; the output is the same as ac_encode_model_u8()'s.
+ */
+#if AC_MODEL_BITS > 16
+#error "the compact model needs AC_MODEL_BITS <= 16"
+#endif
+
+typedef struct _ac_cmodel_t {
+	uint16_t nsym;			/* number of symbols in the input alphabet (not counting the end symbol) */
+	uint16_t cum[];			/* cumulative frequencies, nsym+1 of them */
+} ac_cmodel_t;
+
+typedef struct _ac_coder_t {
+	u64 b;			/* Encoder: beginning of the interval, with a carry in bit 32.  Decoder: current value. */
+	u32 l;			/* Length of the current interval. */
+	u32 pending;		/* Encoder: the number of 0xff bytes held back after <cache>. */
+	uint16_t cache;		/* Encoder: the last byte out, held back for a carry (AC_NO_CACHE if none). */
+	u8 *d;			/* The caller's buffer, */
+	size_t n,		/* its size */
+	       i;		/* and how far into it the coder is. */
+} ac_coder_t;
+
 
 /*
  * encode
@@ -48,4 +237,203 @@ real *cdf_build(real *cdf, size_t *nsym, u8 *s, size_t ns);
 int encode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym);
 int decode_u8_u8(void **out, size_t *nout, void *in, size_t nin, real *cdf, size_t nsym);
 
+/*
+ * ac_model_from_counts
+ * --------------------
+ *  Scales the histogram <counts> to an integer model.  <counts> has <nsym>+1
+ *  entries; the last one counts end symbols (i.e. messages).  Every symbol with
+ *  a non-zero count, and the end symbol, is guaranteed a non-zero frequency;
+ *  symbols with a zero count can not be coded with the resulting model except
+ *  through the escape symbol (see below).
+ *
+ * ac_model_build
+ * --------------
+ *  The integer equivalent of cdf_build(): builds a model from the message itself.
+ */
+int ac_model_from_counts(ac_model_t *model, const u32 *counts, size_t nsym);
+int ac_model_build(ac_model_t *model, const u8 *s, size_t ns);
+
+/*
+ * ac_lut_build
+ * ------------
+ *  Builds the decoder lookup table for <model>.  Do this once per model; the
+ *  table is read-only afterwards and may be shared by any number of decoders.
+ */
+void ac_lut_build(ac_lut_t *lut, const ac_model_t *model);
+
+/*
+ * Context API
+ * -----------
+ *  ac_init()   loads the model (<cdf>, <nsym> as above) into <state> and resets it.
+ *              The scaled CDF is kept in the state, so any number of messages can be
+ *              coded with the same model without converting it again.
+ *  ac_init_model() does the same for an integer model; no floating point is involved.
+ *  ac_reset()  returns the coder to its starting interval but keeps the model.
+ *  ac_use_lut() makes the decoder resolve symbols through <lut> (built from the same
+ *              model) instead of a bisection search.  Pass NULL to go back.  Loading
+ *              a model clears it, so call this after ac_init_model().
+ *
+ *  ac_encode_u8_u8()/ac_decode_u8_u8() reset the state before they start, so a
+ *  context may be reused for encoding and decoding interchangeably.
+ *  encode_u8_u8()/decode_u8_u8() are wrappers which use a context on the stack.
+ */
+int ac_init(ac_state_t *state, real *cdf, size_t nsym);
+int ac_init_model(ac_state_t *state, const ac_model_t *model);
+void ac_reset(ac_state_t *state);
+int ac_use_lut(ac_state_t *state, const ac_lut_t *lut);
+
+int ac_encode_u8_u8(ac_state_t *state, void **out, size_t *nout, void *in, size_t nin);
+int ac_decode_u8_u8(ac_state_t *state, void **out, size_t *nout, void *in, size_t nin);
+
+/*
+ * Shared model API
+ * ----------------
+ *  Codes a message of bytes against <model> without copying it into <state>, so a
+ *  single read-only model can be shared by every coder in the system.  Bytes the
+ *  model gives no frequency go through the escape symbol if the model has one,
+ *  otherwise encoding fails.  <lut>, if not NULL, must be built from <model>.
+ *  <state> needs no initialization beyond existing.
+ */
+int ac_encode_model_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_model_t *model);
+int ac_decode_model_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_model_t *model, const ac_lut_t *lut);
+
+/*
+ * Batch API
+ * ---------
+ *  Codes <npkts> messages against one shared model (as above) in one call.  The
+ *  encoder writes message i to arena[offsets[i]..offsets[i+1]), so <offsets> has
+ *  <npkts>+1 entries.  The decoder takes its input in the same layout and writes
+ *  the decoded messages to its own arena and offsets.  The encoder needs a byte
+ *  to spare at the end of its arena.  If a message can't be coded or doesn't fit,
+ *  they return -1 and only the offsets of the messages before it are valid.
+ */
+typedef struct _ac_packet_t {
+	const void *data;
+	size_t len;
+} ac_packet_t;
+
+int ac_encode_batch_u8(ac_state_t *state, const ac_packet_t *pkts, size_t npkts, void *arena, size_t narena, size_t *offsets, const ac_model_t *model);
+int ac_decode_batch_u8(ac_state_t *state, const void *in, const size_t *in_offsets, size_t npkts, void *arena, size_t narena, size_t *offsets, const ac_model_t *model, const ac_lut_t *lut);
+
+/*
+ * Streaming API
+ * -------------
+ *  Codes a message against a shared model (as above) a piece at a time, for
+ *  sending or receiving it while it's still being coded.  The whole message still
+ *  lives in the caller's buffer, but the encoder only ever appends to it: a byte,
+ *  once written, is final.  Only the arithmetic backend can stream.
+ *
+ *  ac_push_begin() starts encoding into <out> (<nout> bytes).  ac_push() codes the
+ *  next <nin> bytes of the message and ac_push_end() its end.  Both return how many
+ *  bytes have been written to <out> (after ac_push_end(), the whole message), or -1
+ *  if the message can't be coded or doesn't fit.
+ *
+ *  ac_pull_begin() starts decoding.  ac_pull() is passed everything received so
+ *  far, <nin> bytes at <in> (the same buffer each time, as it fills), and <last>
+ *  once no more is coming.  It decodes all it can into <out> (<nout> bytes),
+ *  keeping *<ndone> as the number of bytes decoded so far (start it at 0), and
+ *  returns 1 once the end of the message has been decoded, 0 if it needs more
+ *  input, or -1 if the message doesn't fit.  It runs a few bytes behind the input
+ *  until <last>, as a symbol can't be decoded before all the bytes it spans arrive.
+ */
+int ac_push_begin(ac_state_t *state, void *out, size_t nout);
+int ac_push(ac_state_t *state, const ac_model_t *model, const void *in, size_t nin);
+int ac_push_end(ac_state_t *state, const ac_model_t *model);
+int ac_pull_begin(ac_state_t *state);
+int ac_pull(ac_state_t *state, const ac_model_t *model, const ac_lut_t *lut, const void *in, size_t nin, int last, void *out, size_t nout, size_t *ndone);
+
+/*
+ * Adaptive API
+ * ------------
+ *  ac_adaptive_init() sets up an adaptive model.  The starting frequencies are flat,
+ *  or taken from <prior> (if not NULL) and scaled to a total of about <weight>; the
+ *  smaller the weight, the faster the model follows the message.  Every symbol gets a
+ *  non-zero frequency.  <inc> is added to a symbol's frequency each time it is coded.
+ *
+ *  The encode/decode functions update <adaptive> as they go.  To code another message
+ *  from the same starting point, start from a fresh copy of the initialized model.
+ */
+int ac_adaptive_init(ac_adaptive_t *adaptive, const ac_model_t *prior, u32 weight, u32 inc);
+int ac_encode_adaptive_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, ac_adaptive_t *adaptive);
+int ac_decode_adaptive_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, ac_adaptive_t *adaptive);
+
+/*
+ * Context model API
+ * -----------------
+ *  ac_context_from_counts() builds a context model from <counts>, one row of
+ *  AC_CTX_NSYM counts per slot (bytes, then escapes, then end symbols).  Slots whose
+ *  row adds up to less than <min_total> get no table.  <order> is 1 (and <bits> 8),
+ *  2 (and <bits> at most 16) or 0 for a model only used through the symbol API.  The
+ *  tables are malloc()ed; ac_context_free() releases them.  The caller fills in
+ *  order0 (and lut0) before coding.
+ *
+ *  ac_context_slot() is the slot the coder uses after <prev1> (the last byte) and
+ *  <prev2> (the one before); both are 0 at the start of a message.
+ *
+ *  The encode/decode functions only read <context>, so it may be shared.
+ */
+int ac_context_from_counts(ac_context_t *context, u32 order, u32 bits, const u32 *counts, u32 min_total);
+void ac_context_free(ac_context_t *context);
+u32 ac_context_slot(const ac_context_t *context, u32 prev1, u32 prev2);
+int ac_encode_context_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_context_t *context);
+int ac_decode_context_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_context_t *context);
+
+/*
+ * Symbol API
+ * ----------
+ *  For coders which choose the table for each symbol themselves (e.g. by parsing the
+ *  message as they go).  Between ac_encode_begin() and ac_encode_end() each call to
+ *  ac_encode_symbol() codes <sym>, a byte or AC_CTX_END, with the table in <slot> of
+ *  <context>.  The decoder makes the same sequence of calls to ac_decode_symbol(),
+ *  which returns the symbol; it is up to the caller to know when to stop.  Buffers
+ *  are as for ac_encode_u8_u8().
+ */
+int ac_encode_begin(ac_state_t *state, void *out, size_t nout);
+int ac_encode_symbol(ac_state_t *state, const ac_context_t *context, u32 slot, u32 sym);
+int ac_encode_end(ac_state_t *state, void **out, size_t *nout);
+int ac_decode_begin(ac_state_t *state, const void *in, size_t nin);
+u32 ac_decode_symbol(ac_state_t *state, const ac_context_t *context, u32 slot);
+void ac_decode_end(ac_state_t *state);
+
+/*
+ * Backend API
+ * -----------
+ *  ac_set_backend() picks the coder behind the shared model, adaptive, context and
+ *  symbol APIs for <state>.  A message must be decoded with the backend it was
+ *  encoded with.  The float CDF API (ac_init() etc.) is always arithmetic coded.
+ *  Loading a model with ac_init()/ac_init_model() resets it to AC_BACKEND_ARITH.
+ *
+ *  ac_use_rans_queue() lends <state> the queue the rANS encoder needs; encoding
+ *  with AC_BACKEND_RANS fails without one, and nothing else uses it.  A queue
+ *  holds one message at a time, so it must not be lent to two states that encode
+ *  at once.  Pass NULL to take it back.  Loading a model clears it as well.
+ *
+ *  ac_tans_build() builds tANS tables from <model>; ac_encode_tans_u8() and
+ *  ac_decode_tans_u8() then code messages as ac_encode_model_u8() would, just
+ *  with the model rescaled to 2^AC_TANS_BITS.  The decoder doesn't use <state>.
+ */
+int ac_set_backend(ac_state_t *state, u32 backend);
+void ac_use_rans_queue(ac_state_t *state, ac_rans_queue_t *queue);
+
+int ac_tans_build(ac_tans_t *tans, const ac_model_t *model);
+int ac_encode_tans_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_tans_t *tans);
+int ac_decode_tans_u8(ac_state_t *state, void **out, size_t *nout, const void *in, size_t nin, const ac_tans_t *tans);
+
+/*
+ * Compact API
+ * -----------
+ *  ac_cmodel_from_model() copies <model> into <cmodel>, which must have room for
+ *  ac_cmodel_size(model->nsym) bytes.  A compact model can equally well be a const
+ *  table generated ahead of time and kept in flash.
+ *
+ *  ac_encode_compact_u8() codes <nin> bytes into <out> (<nout> bytes) and returns the
+ *  number of bytes written; ac_decode_compact_u8() returns the number of bytes it
+ *  decoded.  Both return -1 if the message can't be coded or doesn't fit.  Nothing is
+ *  allocated and <coder> needs no initialization.
+ */
+size_t ac_cmodel_size(u32 nsym);
+int ac_cmodel_from_model(ac_cmodel_t *cmodel, const ac_model_t *model);
+int ac_encode_compact_u8(ac_coder_t *coder, const ac_cmodel_t *cmodel, void *out, size_t nout, const void *in, size_t nin);
+int ac_decode_compact_u8(ac_coder_t *coder, const ac_cmodel_t *cmodel, void *out, size_t nout, const void *in, size_t nin);
+
 #endif /* _ARITHCODE_H_ */
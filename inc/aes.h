@@ -0,0 +1,70 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * AES-128 and AES-256 in CTR mode, as Meshtastic uses them for packet payloads
+ *
+ * The key is the channel PSK and the counter block is the nonce from mesh_nonce(),
+ * with its last 4 bytes counting blocks.  CTR mode is its own inverse, so
+ * aes_crypt() both encrypts and decrypts.
+ *
+ * Expanding a key takes longer than coding a packet, so a PSK that is used for many
+ * packets should be expanded once with aes_key_expand() and handed to each
+ * context with aes_use_key(); aes_set_key() expands into the context itself.
+ * Blocks are coded with VAES where the CPU has it, AES-NI where it has only that,
+ * and T-tables otherwise.
+ *
+ * mesh_crypt_batch() does the whole CTR setup for many packets at once, so their
+ * keystream blocks can be generated side by side.
+ */
+
+/* mesh_crypt_batch() generates up to this many keystream blocks at a time */
+#define AES_BATCH_BLOCKS	(64)
+
+/* an expanded key: the 11 or 15 round keys, 4 bytes to a word in little-endian order */
+typedef struct {
+	uint32_t rk[60];
+	uint8_t rounds;		/* 10 for AES-128, 14 for AES-256 */
+	uint8_t aesni;
+	uint8_t lanes;		/* blocks encrypted side by side: 16 with VAES, 8 with AES-NI, 1 otherwise */
+} aes_key_t;
+
+typedef struct {
+	const aes_key_t *key;
+	uint8_t ctr_start;
+	uint8_t idx;
+	uint8_t ctr[16];
+	uint8_t state[16];
+	aes_key_t schedule;	/* the key from aes_set_key() */
+} aes_ctx_t;
+
+int aes_key_expand(aes_key_t *key, const uint8_t *psk, size_t len);
+
+void aes_init(aes_ctx_t *ctx);
+void aes_set_ctrlen(aes_ctx_t *ctx, size_t len);
+void aes_set_iv(aes_ctx_t *ctx, const uint8_t *iv, size_t len);
+int aes_set_key(aes_ctx_t *ctx, const uint8_t *key, size_t len);
+void aes_use_key(aes_ctx_t *ctx, const aes_key_t *key);
+void aes_crypt(aes_ctx_t *ctx, uint8_t *output, const uint8_t *input, size_t len);
+
+/* which block cipher aes_key_expand() picks on this CPU: "vaes", "aes-ni" or "t-table" */
+const char *aes_impl(void);
+
+/* a packet for mesh_crypt_batch(): <len> bytes at <buf>, coded in place */
+typedef struct {
+	uint32_t from;
+	uint32_t id;
+	uint8_t *buf;
+	size_t len;
+} mesh_crypt_job_t;
+
+/* codes each packet in <jobs> in place, as aes_crypt() with its mesh_nonce() would */
+void mesh_crypt_batch(const aes_key_t *key, const mesh_crypt_job_t *jobs, size_t n);
+
+/* the 16 byte nonce for packet <packet_id> from node <from_nodeid> */
+void mesh_nonce(uint8_t *nonce, uint32_t from_nodeid, uint32_t packet_id);
+
+#endif /* _AES_H_ */
@@ -0,0 +1,112 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Binary packet capture
+ *
+ * The hex dumps are easy to make by hand but slow to parse, and they lose
+ * everything about a packet but its bytes.  A capture keeps each deduplicated,
+ * decrypted packet as a length-prefixed record along with its portnum, when it
+ * was received and which gateway uplinked it, and ends with an index so a reader
+ * that mmap()s it can go straight to one portnum or one stretch of time.
+ *
+ * All integers are little endian and nothing is aligned:
+ *
+ *   header    "MCTCAP\r\n", u32 version, u32 reserved (0)
+ *
+ *   records   u16 length of the rest of the record
+ *             u32 receive time (unix seconds, 0 if unknown)
+ *             u16 portnum
+ *             u8  gateway id length, then the gateway id
+ *             the 16 byte radio header and the meshtastic_data_t protobuf, as on a corpus line
+ *
+ *   index     u32 portnums, then for each {u32 portnum, u32 records, u64 offset of its record list}
+ *             the record lists: u64 record offsets, in file order
+ *             u32 time marks, then for each {u32 time, u32 reserved, u64 record offset}: one for
+ *             every CAPTURE_TIME_STRIDE'th record, time being the latest receive time up to it
+ *
+ *   trailer   u64 index offset, u64 records, "MCTIDX\r\n"
+ *
+ * The index is written when the capture is closed, and the records are flushed
+ * every CAPTURE_FLUSH_SECONDS until then.  A capture whose writer died has no
+ * trailer; it can still be read front to back up to the last whole record, and
+ * converting it again (meshtastic-compression-convert) indexes it.
+ */
+
+#define CAPTURE_MAGIC		"MCTCAP\r\n"
+#define CAPTURE_INDEX_MAGIC	"MCTIDX\r\n"
+#define CAPTURE_VERSION		(1)
+#define CAPTURE_HEADER_LEN	(16)
+#define CAPTURE_TRAILER_LEN	(24)
+#define CAPTURE_RECORD_MIN	(7)		/* the fixed part after the length */
+#define CAPTURE_TIME_STRIDE	(256)
+#define CAPTURE_PORTNUM_UNKNOWN	(0xffff)	/* records from a hex dump, before they are decoded */
+#define CAPTURE_FLUSH_SECONDS	(5)		/* the most a killed writer loses */
+
+/* one record; the pointers are views into the capture (or the writer's caller) */
+struct capture_record {
+	uint32_t rx_time;
+	uint16_t portnum;
+	const char *gateway;		/* not NUL terminated */
+	size_t gateway_len;
+	const uint8_t *packet;		/* radio header and data */
+	size_t len;
+};
+
+/* the writer's index of one portnum */
+struct capture_port {
+	uint16_t portnum;
+	uint64_t *offset;
+	size_t n, cap;
+};
+
+struct capture_time {
+	uint32_t time;
+	uint64_t offset;
+};
+
+struct capture_writer {
+	FILE *f;
+	pthread_mutex_t lock;		/* capture_write() may be called from several threads */
+	uint64_t off;			/* where the next record goes */
+	uint64_t records;
+	uint32_t latest;		/* latest receive time so far */
+	struct capture_port *ports;	/* sorted by portnum */
+	size_t nports;
+	struct capture_time *times;
+	size_t ntimes, maxtimes;
+	time_t flushed;			/* when the records were last flushed to the file */
+	bool failed;			/* a write failed; nothing more is written, and there will be no index */
+};
+
+/* creates (or truncates) <path> and writes the header; returns 0 on success */
+int capture_create(struct capture_writer *w, const char *path);
+
+/* appends a record; returns 0 on success; once a write has failed, every later one fails too */
+int capture_write(struct capture_writer *w, const struct capture_record *r);
+
+/* writes the index (unless a write failed) and closes the file; returns 0 if everything made it to disk */
+int capture_close(struct capture_writer *w);
+
+/* parses the record at <p>; returns its total length, or -1 if it is malformed or runs past <end> */
+int capture_record_parse(struct capture_record *r, const uint8_t *p, const uint8_t *end);
+
+/* little endian loads for reading the index in place */
+static inline uint32_t capture_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t capture_le64(const uint8_t *p)
+{
+	return capture_le32(p) | ((uint64_t)capture_le32(p + 4) << 32);
+}
+
+#endif /* _CAPTURE_H_ */
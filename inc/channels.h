@@ -0,0 +1,67 @@
+#ifndef _CHANNELS_H_
+#define _CHANNELS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+/*
+ * Channel key table
+ *
+ * Every channel the monitor can decrypt, with its PSK expanded as the firmware
+ * does it and its key schedule ready to use.  A packet only carries the channel
+ * hash (the XOR of the name bytes and the key bytes), so the table is indexed by
+ * hash: channel_decrypt() tries just the channels with the packet's hash, and
+ * keeps the first one whose output looks like a meshtastic_data_t protobuf.
+ *
+ * A key file has one channel per line, the name and then the PSK in base64 as
+ * the apps show it, with blank lines and # comments ignored:
+ *
+ *   # the default channel
+ *   LongFast   AQ==
+ *   Hiking     q1Ubs6H1S6xW0m3hF6Zqj3tQ4Yk2r9gV0kX1cLmO8dE=
+ *
+ * A one byte PSK is the firmware's shorthand for the default key (AQ== is 1; 2
+ * and up add to its last byte), and shorter keys are zero-padded to 16 or 32
+ * bytes.  Channels without encryption (PSK 0 or empty) need no entry.
+ */
+
+#define CHANNEL_NAME_MAX	(11)
+
+struct channel {
+	char name[CHANNEL_NAME_MAX + 1];
+	uint8_t psk[32];
+	size_t psk_len;
+	uint8_t hash;
+	aes_key_t key;
+};
+
+struct channel_table {
+	struct channel *chan;
+	size_t n;
+	/* the channels with hash h are chan[order[start[h]]] .. chan[order[start[h + 1] - 1]] */
+	uint16_t start[257];
+	uint16_t *order;
+};
+
+void channel_table_init(struct channel_table *t);
+void channel_table_free(struct channel_table *t);
+
+/* adds channel <name> with the base64 PSK <psk>; returns 0 on success, -1 if either is bad */
+int channel_add(struct channel_table *t, const char *name, const char *psk);
+
+/* adds every channel in key file <path>; returns 0 on success, -1 on any error */
+int channel_table_load(struct channel_table *t, const char *path);
+
+/*
+ * decrypts the <len> bytes at <buf> in place with the key of a channel with hash <hash>
+ * returns the channel, or NULL (with <buf> untouched) if none of them gives a plausible packet
+ */
+const struct channel *channel_decrypt(const struct channel_table *t, uint8_t hash, uint32_t from, uint32_t id, uint8_t *buf, size_t len);
+
+/* true if <buf> walks as a meshtastic_data_t: known fields with the right wire types, a portnum, nothing left over */
+bool mesh_data_plausible(const uint8_t *buf, size_t len);
+
+#endif /* _CHANNELS_H_ */
@@ -0,0 +1,81 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "arithcode.h"
+#include "models.h"
+
+/*
+ * Packet coders
+ *
+ * One encode/decode pair over every way the arithmetic coder can model a packet, so
+ * the compression test and the benchmark code packets the same way.  A codec holds
+ * the per-thread scratch state; the models it points at are shared and read-only.
+ */
+
+enum coder_mode {
+	CODER_PACKET,		/* order-0 model built from the packet itself (not sendable, an upper bound) */
+	CODER_STATIC,		/* pretrained per-portnum model (-M) */
+	CODER_ADAPTIVE,		/* adaptive order-0, starting from the pretrained model if there is one */
+	CODER_ORDER1,		/* pretrained order-1 context model */
+	CODER_ORDER2,		/* pretrained order-2 (hashed) context model */
+	CODER_WIRE,		/* pretrained protobuf wire-format model */
+	CODER_MAX
+};
+
+/* the entropy coder behind the model */
+enum coder_backend {
+	BACKEND_ARITH,		/* arithmetic coder */
+	BACKEND_RANS,		/* range ANS */
+	BACKEND_TANS,		/* table-driven ANS for the static coder, range ANS for the others */
+	BACKEND_MAX
+};
+
+extern const char *coder_names[CODER_MAX];
+extern const char *backend_names[BACKEND_MAX];
+
+struct codec {
+	enum coder_mode mode;
+	enum coder_backend backend;
+	const struct model_set *models;	/* pretrained models, or NULL */
+	ac_state_t state;
+	ac_rans_queue_t *rans;		/* the rANS encoder's queue, if the backend needs one */
+	ac_adaptive_t adaptive;		/* working copy of the adaptive model */
+	ac_adaptive_t flat;		/* adaptive starting point when there's no pretrained model */
+	ac_model_t packet;		/* the packet coder's model; the decoder uses the encoder's */
+	size_t nsym;			/* alphabet size of the model used for the last packet */
+	bool timed;			/* time building the packet coder's model */
+	uint64_t model_ticks;		/* how long that took for the last packet (see ticks.h), if timed */
+};
+
+/* the coder (backend) called <name>, or -1 */
+int coder_from_name(const char *name);
+int backend_from_name(const char *name);
+
+/* true if <mode> can't do anything useful without pretrained models */
+bool coder_needs_models(enum coder_mode mode);
+
+/*
+ * <models> may be NULL.  Portnums without a model of the kind <mode> needs fall back
+ * to the nearest thing there is: order-2, order-1 and wire to the static model, and
+ * the static coder to the packet coder.  Returns 0 on success; codec_free()
+ * releases what it allocates.
+ */
+int codec_init(struct codec *c, enum coder_mode mode, enum coder_backend backend, const struct model_set *models);
+void codec_free(struct codec *c);
+
+/* as ac_encode_u8_u8()/ac_decode_u8_u8(); a packet must be decoded with the portnum it was encoded with */
+int codec_encode(struct codec *c, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin);
+int codec_decode(struct codec *c, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin);
+
+/*
+ * The same for a batch of packets of one portnum, laid out as for ac_encode_batch_u8().
+ * The static coder codes the whole batch in one call, the others a packet at a time.
+ * The packet coder can't be batched, as the decoder only has the last packet's model.
+ */
+int codec_encode_batch(struct codec *c, unsigned portnum, const ac_packet_t *pkts, size_t npkts, void *arena, size_t narena, size_t *offsets);
+int codec_decode_batch(struct codec *c, unsigned portnum, const void *in, const size_t *in_offsets, size_t npkts, void *arena, size_t narena, size_t *offsets);
+
+#endif /* _CODEC_H_ */
@@ -0,0 +1,89 @@
+#ifndef _CORPUS_H_
+#define _CORPUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "capture.h"
+
+/*
+ * Packet corpus reader
+ *
+ * A corpus is the hex text dump described in the README: one packet per line,
+ * each byte written as two hex digits separated by whitespace.  Every line is
+ * the 16 byte LoRa header followed by the decrypted meshtastic_data_t protobuf.
+ *
+ * The file is mmap()ed read-only and can be split into line-aligned shards so
+ * several threads can walk it at once without any locking.
+ *
+ * A binary capture (capture.h) reads the same way: corpus_open() tells them
+ * apart by the magic, shards are split on record boundaries, and corpus_next()
+ * hands back the same header and data bytes a hex line would have.  Captures
+ * can also be narrowed to one portnum or a span of receive times using their
+ * index, without reading the records in between.
+ */
+
+#define MESH_HEADER_LEN	(16)
+
+/* the radio header, as it appears at the start of every corpus line (sender first, all little endian) */
+struct mesh_header {
+	uint32_t from, to, id;
+	uint8_t flags, channel, next_hop, relay_node;
+};
+
+struct corpus {
+	int fd;
+	const char *data;
+	size_t len;
+	bool capture;			/* a binary capture rather than a hex dump */
+	size_t first, last;		/* captures: where the records start and end */
+	const uint8_t *ports;		/* captures: the index's portnum table, NULL if there is no index */
+	const uint8_t *times;		/* captures: the index's time marks */
+	uint32_t nports, ntimes;
+	uint64_t records;		/* captures: records in the index */
+};
+
+struct corpus_cursor {
+	const char *p, *end;
+	size_t line;			/* lines (or records) read so far */
+	bool capture;
+	const char *base;		/* captures: the start of the file, which record offsets count from */
+	const uint8_t *list;		/* captures: record offsets to visit instead of walking p..end, or NULL */
+	size_t nlist;
+	uint32_t since, until;		/* captures: skip records not received in [since, until); until 0 is no limit */
+};
+
+int corpus_open(struct corpus *c, const char *path);
+void corpus_close(struct corpus *c);
+
+/* point <cur> at shard <shard> of <nshards>; shard boundaries always fall on line starts */
+void corpus_shard(const struct corpus *c, struct corpus_cursor *cur, int shard, int nshards);
+
+/*
+ * parse the next line at <cur> into <buf>
+ * returns the number of bytes parsed, 0 at the end of the shard, or -1 if the line was malformed
+ * (the cursor still advances past a bad line so the caller can keep going)
+ */
+int corpus_next(struct corpus_cursor *cur, uint8_t *buf, size_t nbuf);
+
+/*
+ * the next record at <cur>, with its portnum, receive time and gateway when the corpus is a capture
+ * a hex line is parsed into <buf> and comes back as CAPTURE_PORTNUM_UNKNOWN, received at 0 by no gateway;
+ * a capture record points into the mapping and <buf> is unused
+ * returns 1, 0 at the end of the shard, or -1 if the record was malformed
+ */
+int corpus_next_record(struct corpus_cursor *cur, struct capture_record *r, uint8_t *buf, size_t nbuf);
+
+/* point <cur> at shard <shard> of <nshards> of the records with <portnum>; returns -1 unless the corpus is an indexed capture */
+int corpus_port(const struct corpus *c, struct corpus_cursor *cur, unsigned portnum, int shard, int nshards);
+
+/* narrows <cur> to records received in [<since>, <until>) (<until> 0 for no limit); returns -1 unless the corpus is a capture */
+int corpus_time_range(const struct corpus *c, struct corpus_cursor *cur, uint32_t since, uint32_t until);
+
+void mesh_header_parse(struct mesh_header *h, const uint8_t *buf);
+
+/* the inverse of mesh_header_parse(): writes MESH_HEADER_LEN bytes to <buf> */
+void mesh_header_write(uint8_t *buf, const struct mesh_header *h);
+
+#endif /* _CORPUS_H_ */
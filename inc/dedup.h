@@ -0,0 +1,49 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Duplicate packet filter
+ *
+ * The same packet is uplinked by every gateway that hears it, so on a wide
+ * subscription it can turn up many times, minutes apart.  A packet is named by
+ * (from, id), and the filter remembers each one for <window> seconds after it
+ * first sees it.
+ *
+ * It is an open-addressing hash set with linear probing.  Entries older than the
+ * window are dead: a lookup that lands on one treats it as new, and an insert can
+ * reuse its slot.  When live and dead entries together pass 3/4 of the table, it
+ * is rebuilt without the dead ones, twice the size if the live ones alone fill
+ * half of it.  Inserts and lookups are O(1) amortized.
+ */
+
+struct dedup_entry {
+	uint32_t from, id;
+	uint32_t seen;		/* seconds since the filter's epoch, plus one; 0 is an empty slot */
+};
+
+struct dedup {
+	struct dedup_entry *slot;
+	uint32_t mask;		/* table size - 1, a power of two */
+	uint32_t used;		/* slots that aren't empty, dead or alive */
+	uint32_t window;
+	time_t epoch;
+	uint64_t hits;		/* duplicates found */
+	uint64_t misses;	/* packets not seen within the window */
+	uint64_t evictions;	/* dead entries dropped or overwritten */
+};
+
+/* <size> is the initial number of slots (rounded up to a power of two); returns 0 on success */
+int dedup_init(struct dedup *d, uint32_t window, uint32_t size);
+void dedup_free(struct dedup *d);
+
+/* true if (from, id) was first seen in the <window> seconds before <now>, otherwise records it as seen at <now> */
+bool dedup_check(struct dedup *d, uint32_t from, uint32_t id, time_t now);
+
+/* the fraction of slots in use, dead or alive */
+double dedup_load(const struct dedup *d);
+
+#endif /* _DEDUP_H_ */
@@ -0,0 +1,43 @@
+#ifndef _ENVELOPE_H_
+#define _ENVELOPE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ServiceEnvelope fast path
+ *
+ * Every MQTT message is a ServiceEnvelope wrapping one MeshPacket, and all the
+ * monitor wants from it is who sent the packet, its id and channel hash, the
+ * encrypted bytes, and the rest of the radio header for captures.  Decoding it
+ * with nanopb means zeroing a MeshPacket several hundred bytes long, mallocing
+ * it (the envelope holds it by pointer) and copying the payload, for every
+ * message.  mesh_envelope_parse() walks the wire format instead and hands back
+ * those fields, with the payload and the two id strings as views into the
+ * message itself.  It allocates nothing and copies nothing.
+ *
+ * Fields it doesn't know are skipped, so it keeps up with newer firmware the
+ * way nanopb would; a field it does know with the wrong wire type makes the
+ * message bad.
+ */
+
+struct mesh_envelope {
+	uint32_t from, to, id;
+	uint32_t channel;		/* the channel hash on encrypted packets */
+	uint32_t rx_time;		/* as the gateway reported it; 0 if absent */
+	uint32_t hop_limit, hop_start;
+	uint32_t next_hop, relay_node;	/* the last byte of the node numbers, as in the radio header */
+	bool want_ack, via_mqtt;
+	const uint8_t *encrypted;	/* NULL unless the packet is encrypted */
+	size_t encrypted_len;
+	const char *channel_id;		/* not NUL terminated; NULL if absent */
+	size_t channel_id_len;
+	const char *gateway_id;		/* not NUL terminated; NULL if absent */
+	size_t gateway_id_len;
+};
+
+/* parses the ServiceEnvelope in the <len> bytes at <buf>; returns 0, or -1 if it is malformed or has no packet */
+int mesh_envelope_parse(struct mesh_envelope *e, const uint8_t *buf, size_t len);
+
+#endif /* _ENVELOPE_H_ */
@@ -0,0 +1,72 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stats.h"
+
+/*
+ * Metrics export
+ *
+ * For running unattended: the numbers the stats dumps print, plus the ingest
+ * counters (queue, duplicates, packets that didn't decrypt or decode), served
+ * over HTTP in the Prometheus text format and published as JSON to an MQTT
+ * topic every so often.  Each exporter runs in its own thread and asks for a
+ * fresh snapshot when it needs one; building it only reads the workers' stats,
+ * so neither holds the workers up.
+ *
+ * The HTTP server is deliberately small: one connection at a time, and any GET
+ * gets the metrics.  It listens on localhost unless given an address.
+ */
+
+struct metrics_snapshot {
+	double uptime;				/* seconds since startup */
+	double rate;				/* packets/s since the previous snapshot; the publisher fills this in */
+	uint64_t messages;			/* MQTT messages queued */
+	uint64_t queue_dropped, queue_oversize, queue_waits, queue_depth;
+	uint64_t duplicates, unique;
+	uint64_t bad_envelopes;			/* messages without a ServiceEnvelope and packet in them */
+	uint64_t no_key;			/* packets no channel key decrypted */
+	uint64_t bad_payloads;			/* decrypted packets that didn't decode */
+	struct comp_stats stats;		/* every worker's stats, merged */
+};
+
+/* fills in <s> (its stats already initialised) with the numbers right now; returns 0 on success */
+typedef int (*metrics_snapshot_fn)(struct metrics_snapshot *s);
+
+void metrics_write_prometheus(FILE *f, const struct metrics_snapshot *s);
+void metrics_write_json(FILE *f, const struct metrics_snapshot *s);
+
+struct metrics_http {
+	int fd;
+	pthread_t thread;
+	metrics_snapshot_fn snapshot;
+	struct metrics_snapshot snap;
+};
+
+/* serves the metrics on <listen>, "[addr:]port"; returns 0 on success */
+int metrics_http_start(struct metrics_http *h, const char *listen, metrics_snapshot_fn snapshot);
+void metrics_http_stop(struct metrics_http *h);
+
+struct mosquitto;
+
+struct metrics_publisher {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	struct mosquitto *m;
+	const char *topic;
+	unsigned interval;			/* seconds between snapshots */
+	metrics_snapshot_fn snapshot;
+	struct metrics_snapshot snap;
+};
+
+/* publishes a JSON snapshot to <topic> every <interval> seconds; returns 0 on success */
+int metrics_publish_start(struct metrics_publisher *p, struct mosquitto *m, const char *topic, unsigned interval, metrics_snapshot_fn snapshot);
+void metrics_publish_stop(struct metrics_publisher *p);
+
+#endif /* _METRICS_H_ */
@@ -0,0 +1,88 @@
+#ifndef _MODELS_H_
+#define _MODELS_H_
+
+#include "arithcode.h"
+
+/*
+ * Pretrained per-portnum models
+ *
+ * A model file holds one integer model per portnum, plus an optional default model
+ * used for any portnum which doesn't have its own.  A model may also have order-1 and
+ * order-2 context models and a protobuf wire-format model (see wire.h), all of which
+ * fall back to it.  It's written by the training tool and loaded once at startup;
+ * after that the models are read-only and shared by every coder.
+ *
+ * File format (all multi-byte fields little endian):
+ *   char magic[4]     "MCTM"
+ *   u8   version      MODEL_FILE_VERSION
+ *   u8   bits         log2 of the model total, must match AC_MODEL_BITS
+ *   u16  count        number of records that follow
+ *
+ *   per record:
+ *   u8   kind         MODEL_KIND_ORDER0 or MODEL_KIND_CONTEXT (absent in version 1 files,
+ *                     which only have order-0 records)
+ *
+ *   order-0 record:
+ *   u16  portnum      or MODEL_DEFAULT
+ *   u16  nsym         alphabet size, not counting the end symbol
+ *   varint freq[nsym + 1]  symbol frequencies (LEB128), the last one is the end symbol.
+ *                          They must sum to AC_MODEL_TOTAL.
+ *
+ *   context record (follows the order-0 record for the same portnum):
+ *   u16  portnum      or MODEL_DEFAULT
+ *   u8   order        1 or 2, or 0 for the wire-format model
+ *   u8   bits         log2 of the number of context slots
+ *   varint ntables    number of slots with a table
+ *   per table:
+ *     u16  slot
+ *     u16  n          number of symbols in the table
+ *     n x { u16 sym, varint freq }  in increasing symbol order, summing to AC_MODEL_TOTAL
+ */
+
+#define MODEL_FILE_MAGIC	"MCTM"
+#define MODEL_FILE_VERSION	(2)
+#define MODEL_KIND_ORDER0	(0)
+#define MODEL_KIND_CONTEXT	(1)
+#define MODEL_MAX_ORDER		(2)
+#define MODEL_MAX_PORTNUM	(512)
+#define MODEL_DEFAULT		(0xffff)
+
+/* the full alphabet of a trained model: every byte value plus the escape symbol */
+#define MODEL_NSYM		(AC_ESC + 1)
+
+struct port_model {
+	ac_model_t model;
+	ac_lut_t lut;
+	ac_tans_t tans;			/* the model as tANS tables */
+	ac_adaptive_t prior;		/* the model as a starting point for the adaptive coder */
+	ac_context_t context[MODEL_MAX_ORDER];	/* order-1 and order-2 models, unused if slot is NULL */
+	ac_context_t wire;		/* protobuf wire-format model, likewise */
+};
+
+struct model_set {
+	struct port_model *port[MODEL_MAX_PORTNUM];
+	struct port_model *fallback;
+};
+
+void model_set_init(struct model_set *ms);
+void model_set_free(struct model_set *ms);
+
+/* build and add the model for <portnum> from a histogram (see ac_model_from_counts()) */
+int model_set_add(struct model_set *ms, unsigned portnum, const u32 *counts, size_t nsym);
+
+/*
+ * build and add an order-<order> context model (order 0: the wire-format model) for
+ * <portnum>, which must already have a model (see ac_context_from_counts())
+ */
+int model_set_add_context(struct model_set *ms, unsigned portnum, u32 order, u32 bits, const u32 *counts, u32 min_total);
+
+/* the order-<order> context model (or wire-format model) of <pm>, or NULL if it doesn't have one */
+const ac_context_t *port_model_context(const struct port_model *pm, unsigned order);
+
+/* returns the model for <portnum>, the default model if there isn't one, or NULL */
+const struct port_model *model_set_get(const struct model_set *ms, unsigned portnum);
+
+int model_set_load(struct model_set *ms, const char *path);
+int model_set_save(const struct model_set *ms, const char *path);
+
+#endif /* _MODELS_H_ */
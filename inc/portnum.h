@@ -0,0 +1,9 @@
+#ifndef _PORTNUM_H_
+#define _PORTNUM_H_
+
+#include "meshtastic/portnums.pb.h"
+
+/* printable name of a meshtastic portnum */
+const char *portnum_str(meshtastic_port_num_t portnum);
+
+#endif /* _PORTNUM_H_ */
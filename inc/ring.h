@@ -0,0 +1,71 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <semaphore.h>
+
+/*
+ * Bounded message ring
+ *
+ * Carries raw MQTT payloads from the network thread to the worker pool.  The
+ * slots are allocated up front and each holds a copy of one message, so a push
+ * is a memcpy and never a malloc.  Claiming a slot is lock-free: every slot has
+ * a sequence number saying whose turn it is, and producers and consumers each
+ * CAS their own position forward (D. Vyukov's bounded MPMC queue).  Semaphores
+ * are only there so idle workers can sleep, and so a producer can sleep under
+ * the block policy.
+ *
+ * When the ring is full a push either drops the oldest message to make room
+ * (RING_DROP_OLDEST, so the workers always see the latest traffic) or waits for
+ * a worker to free a slot (RING_BLOCK, which pushes back on the broker).
+ */
+
+#define RING_MSG_MAX	(512)	/* bigger messages are counted and dropped */
+
+enum ring_policy {
+	RING_DROP_OLDEST,
+	RING_BLOCK,
+};
+
+struct ring_slot {
+	atomic_size_t seq;
+	uint16_t len;
+	uint8_t data[RING_MSG_MAX];
+};
+
+struct ring {
+	struct ring_slot *slot;
+	size_t mask;				/* number of slots - 1, a power of two */
+	enum ring_policy policy;
+	_Alignas(64) atomic_size_t head;	/* next slot to push to */
+	_Alignas(64) atomic_size_t tail;	/* next slot to pop from */
+	_Alignas(64) sem_t items, space;
+	atomic_bool closed;
+
+	/* counters, updated as they happen */
+	atomic_uint_fast64_t pushed;		/* messages queued */
+	atomic_uint_fast64_t dropped;		/* queued messages dropped to make room */
+	atomic_uint_fast64_t oversize;		/* messages too big for a slot */
+	atomic_uint_fast64_t waits;		/* pushes that had to wait for a slot */
+};
+
+/* <nslots> is rounded up to a power of two; returns 0 on success */
+int ring_init(struct ring *r, size_t nslots, enum ring_policy policy);
+void ring_free(struct ring *r);
+
+/* queues a copy of <len> bytes at <buf>; returns 0, or -1 if it was too big or the ring is closed */
+int ring_push(struct ring *r, const void *buf, size_t len);
+
+/* waits for a message and copies it to <buf> (RING_MSG_MAX bytes); returns its length, or -1 once the ring is closed and empty */
+int ring_pop(struct ring *r, void *buf);
+
+/* wakes every waiting consumer; pops return what is left, then -1 */
+void ring_close(struct ring *r, int nconsumers);
+
+/* messages waiting right now */
+size_t ring_depth(struct ring *r);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,109 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compression statistics
+ *
+ * Exact counts and byte sums per portnum, plus histograms of the uncompressed
+ * length (one bucket per byte) and of the compression ratio (a quarter of a
+ * percent per bucket), so the median and tail can be read off as well as the
+ * mean.  Everything is a count or a sum, so two sets of stats merge by adding
+ * them up: each thread keeps its own shard and they are merged when somebody
+ * wants to look, and runs over different parts of a corpus (or on different
+ * machines) combine into the same numbers one run over all of it would give.
+ *
+ * A shard has a single writer.  Its counters are atomics updated with relaxed
+ * loads and stores, so a merge can read them while the writer runs without
+ * either taking a lock; the merged numbers might then be a packet behind in
+ * places.  A port's counters are allocated on its first packet (they are a few
+ * KB, and only a handful of the 512 portnums turn up).
+ *
+ * As before, packets that don't compress by more than 1% are counted but left
+ * out of the sizes and ratios.
+ *
+ * With timing on, each stage of the packet path adds how long it took (in
+ * ticks, see ticks.h) to a histogram with power of two buckets: bucket i holds
+ * times under 2^(i + STATS_LAT_SHIFT) ticks, and the last one everything slower.
+ */
+
+#define STATS_PORTS		(512)			/* portnums run to 511, as in models.h */
+#define STATS_LEN_MAX		(256)			/* longer payloads land in the last length bucket */
+#define STATS_RATIO_STEP	(4)			/* ratio buckets per percent */
+#define STATS_RATIO_BUCKETS	(100 * STATS_RATIO_STEP + 1)
+#define STATS_LAT_SHIFT		(6)			/* the first latency bucket is under 64 ticks */
+#define STATS_LAT_BUCKETS	(20)
+
+/* the stages of the packet path that can be timed */
+enum stats_stage {
+	STAGE_ENVELOPE,		/* parsing the ServiceEnvelope */
+	STAGE_DEDUP,		/* the duplicate filter */
+	STAGE_DECRYPT,		/* finding the channel and decrypting */
+	STAGE_DATA,		/* decoding the meshtastic_data_t */
+	STAGE_MODEL,		/* building the packet coder's model */
+	STAGE_ENCODE,		/* compressing, less building the model */
+	STAGE_DECODE,		/* decompressing and checking the result */
+	STAGE_PRINT,		/* printing packets and stats */
+	STAGE_CAPTURE,		/* writing packets to the capture file */
+	STAGE_MAX
+};
+
+extern const char *stage_names[STAGE_MAX];
+
+struct port_stats {
+	atomic_uint_fast64_t num;				/* packets of this type */
+	atomic_uint_fast64_t ncomp;				/* those that compressed, which the rest covers */
+	atomic_uint_fast64_t unc_bytes, comp_bytes;
+	atomic_uint_fast64_t ratio_sum;				/* per-packet ratios, in hundredths of a percent */
+	_Atomic uint32_t len[STATS_LEN_MAX + 1];		/* packets by uncompressed length */
+	atomic_uint_fast64_t len_comp[STATS_LEN_MAX + 1];	/* what those packets compressed to, in total */
+	_Atomic uint32_t ratio[STATS_RATIO_BUCKETS];		/* packets by ratio */
+};
+
+struct comp_stats {
+	atomic_uint_fast64_t packets;				/* every packet tested, whatever became of it */
+	atomic_uint_fast64_t stage_ticks[STAGE_MAX];		/* total time in each stage */
+	_Atomic uint32_t stage[STAGE_MAX][STATS_LAT_BUCKETS];	/* times through each stage, by how long they took */
+	_Atomic(struct port_stats *) port[STATS_PORTS];
+};
+
+void comp_stats_init(struct comp_stats *s);
+void comp_stats_free(struct comp_stats *s);
+
+/* zeroes every counter; only the writer may do this */
+void comp_stats_clear(struct comp_stats *s);
+
+/* counts a packet of <portnum> that round-tripped, <len> bytes compressed to <nout>; returns 0, or -1 if out of memory */
+int comp_stats_add(struct comp_stats *s, unsigned portnum, size_t len, size_t nout);
+
+/* counts a packet whatever became of it */
+void comp_stats_packet(struct comp_stats *s);
+
+/* records a pass through <stage> that took <ticks> */
+void comp_stats_stage(struct comp_stats *s, enum stats_stage stage, uint64_t ticks);
+
+/* passes through <stage> so far */
+uint64_t comp_stats_stage_count(const struct comp_stats *s, enum stats_stage stage);
+
+/* the upper bound in ticks of the latency bucket holding the <q> quantile (0 to 1) of <stage>, 0 for the last bucket */
+uint64_t comp_stats_stage_quantile(const struct comp_stats *s, enum stats_stage stage, double q);
+
+/* the upper bound in ticks of latency bucket <b> (the last one has none, and gives 0) */
+uint64_t comp_stats_latency_bound(int b);
+
+/* adds <src> (which may be being written) into <dst> (which must not); returns 0, or -1 if out of memory */
+int comp_stats_merge(struct comp_stats *dst, const struct comp_stats *src);
+
+/* the counters for <portnum>, or NULL if it has had no packets */
+const struct port_stats *comp_stats_port(const struct comp_stats *s, unsigned portnum);
+
+/* the <q> quantile (0 to 1) of the uncompressed length, and what packets that long compressed to on average */
+unsigned port_stats_len(const struct port_stats *p, double q, double *comp);
+
+/* the <q> quantile (0 to 1) of the compression ratio in percent, to the middle of its bucket */
+double port_stats_ratio(const struct port_stats *p, double q);
+
+#endif /* _STATS_H_ */
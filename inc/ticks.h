@@ -0,0 +1,49 @@
+#ifndef _TICKS_H_
+#define _TICKS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Tick counter
+ *
+ * The cheapest monotonic clock there is, for timing stages of the packet path:
+ * the TSC on x86 (constant rate on anything recent), the virtual counter on
+ * ARM64, and CLOCK_MONOTONIC in ns anywhere else.  ticks_per_ns() says how fast
+ * it runs, to turn ticks into time for display.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+static inline uint64_t ticks(void)
+{
+	return __rdtsc();
+}
+
+#elif defined(__aarch64__)
+
+static inline uint64_t ticks(void)
+{
+	uint64_t t;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (t));
+	return t;
+}
+
+#else
+
+static inline uint64_t ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
+
+/* ticks per ns, measured against CLOCK_MONOTONIC the first time it is called (which takes 20 ms) */
+double ticks_per_ns(void);
+
+#endif /* _TICKS_H_ */
@@ -0,0 +1,39 @@
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include "arithcode.h"
+
+/*
+ * Protobuf wire-format coder
+ *
+ * Walks a payload as protobuf wire format (tags, varints, fixed32/64 and length
+ * delimited fields) and codes every byte with a table chosen by where it is in the
+ * message rather than by the bytes before it:
+ *
+ *  - tags by the message and the previous field number, so a predictable field
+ *    order costs next to nothing; the first tag byte also carries the end of the
+ *    message
+ *  - varints by field number and byte position
+ *  - fixed32/64 by field number and byte lane, most significant lane first, with
+ *    the second lane also keyed on the first (coordinates and timestamps)
+ *  - strings (as named by the nanopb descriptors) with a shared order-2 text model
+ *  - bytes by field number and lane, since they're mostly packed ids
+ *  - submessages recursively; their lengths aren't coded at all, as the decoder
+ *    can work them out from the end of the submessage
+ *
+ * A payload which doesn't parse is coded as raw bytes (order-1), and plain text
+ * portnums go straight to the text model.  The tables are an ac_context_t with
+ * caller-chosen slots (order 0) whose escape falls back to the portnum's order-0
+ * model; they are built by the trainer from wire_count().
+ */
+
+#define WIRE_BITS		(12)	/* default log2 of the number of slots */
+#define WIRE_MAX_DEPTH		(8)	/* deepest submessage nesting that will be parsed */
+
+int wire_encode(ac_state_t *state, const ac_context_t *model, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin);
+int wire_decode(ac_state_t *state, const ac_context_t *model, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin);
+
+/* adds the symbols <in> is coded as to <counts> (1 << <bits> rows of AC_CTX_NSYM) */
+void wire_count(u32 *counts, u32 bits, unsigned portnum, const void *in, size_t nin);
+
+#endif /* _WIRE_H_ */
@@ -0,0 +1,465 @@
+/*
+ * AES-128/256 CTR (see aes.h)
+ *
+ * The round keys are expanded once per key, so a block is just the 10 or 14 rounds.
+ * The portable rounds use a T-table: Te0[x] is column (2s, s, s, 3s) for s the
+ * S-box of x, so one lookup does SubBytes and MixColumns for a byte, and the other
+ * three rows are the same word rotated.  That is 1 KB of table, and the state is
+ * four 32-bit columns rather than 16 bytes.
+ *
+ * mesh_crypt_batch() gathers the counter blocks of many packets and encrypts them
+ * together: AES-NI 8 blocks at a time, interleaved so each aesenc hides the latency
+ * of the others, or VAES 16 at a time, two to a ymm register.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_AESNI
+#ifdef bit_VAES
+#define HAVE_VAES
+#endif
+#endif
+
+#include "aes.h"
+
+#define ROTL(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define B(x, n)		(((x) >> (8 * (n))) & 0xff)
+
+static uint8_t const sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+static uint32_t const Te0[256] = {
+	0xa56363c6, 0x847c7cf8, 0x997777ee, 0x8d7b7bf6, 0x0df2f2ff, 0xbd6b6bd6, 0xb16f6fde, 0x54c5c591,
+	0x50303060, 0x03010102, 0xa96767ce, 0x7d2b2b56, 0x19fefee7, 0x62d7d7b5, 0xe6abab4d, 0x9a7676ec,
+	0x45caca8f, 0x9d82821f, 0x40c9c989, 0x877d7dfa, 0x15fafaef, 0xeb5959b2, 0xc947478e, 0x0bf0f0fb,
+	0xecadad41, 0x67d4d4b3, 0xfda2a25f, 0xeaafaf45, 0xbf9c9c23, 0xf7a4a453, 0x967272e4, 0x5bc0c09b,
+	0xc2b7b775, 0x1cfdfde1, 0xae93933d, 0x6a26264c, 0x5a36366c, 0x413f3f7e, 0x02f7f7f5, 0x4fcccc83,
+	0x5c343468, 0xf4a5a551, 0x34e5e5d1, 0x08f1f1f9, 0x937171e2, 0x73d8d8ab, 0x53313162, 0x3f15152a,
+	0x0c040408, 0x52c7c795, 0x65232346, 0x5ec3c39d, 0x28181830, 0xa1969637, 0x0f05050a, 0xb59a9a2f,
+	0x0907070e, 0x36121224, 0x9b80801b, 0x3de2e2df, 0x26ebebcd, 0x6927274e, 0xcdb2b27f, 0x9f7575ea,
+	0x1b090912, 0x9e83831d, 0x742c2c58, 0x2e1a1a34, 0x2d1b1b36, 0xb26e6edc, 0xee5a5ab4, 0xfba0a05b,
+	0xf65252a4, 0x4d3b3b76, 0x61d6d6b7, 0xceb3b37d, 0x7b292952, 0x3ee3e3dd, 0x712f2f5e, 0x97848413,
+	0xf55353a6, 0x68d1d1b9, 0x00000000, 0x2cededc1, 0x60202040, 0x1ffcfce3, 0xc8b1b179, 0xed5b5bb6,
+	0xbe6a6ad4, 0x46cbcb8d, 0xd9bebe67, 0x4b393972, 0xde4a4a94, 0xd44c4c98, 0xe85858b0, 0x4acfcf85,
+	0x6bd0d0bb, 0x2aefefc5, 0xe5aaaa4f, 0x16fbfbed, 0xc5434386, 0xd74d4d9a, 0x55333366, 0x94858511,
+	0xcf45458a, 0x10f9f9e9, 0x06020204, 0x817f7ffe, 0xf05050a0, 0x443c3c78, 0xba9f9f25, 0xe3a8a84b,
+	0xf35151a2, 0xfea3a35d, 0xc0404080, 0x8a8f8f05, 0xad92923f, 0xbc9d9d21, 0x48383870, 0x04f5f5f1,
+	0xdfbcbc63, 0xc1b6b677, 0x75dadaaf, 0x63212142, 0x30101020, 0x1affffe5, 0x0ef3f3fd, 0x6dd2d2bf,
+	0x4ccdcd81, 0x140c0c18, 0x35131326, 0x2fececc3, 0xe15f5fbe, 0xa2979735, 0xcc444488, 0x3917172e,
+	0x57c4c493, 0xf2a7a755, 0x827e7efc, 0x473d3d7a, 0xac6464c8, 0xe75d5dba, 0x2b191932, 0x957373e6,
+	0xa06060c0, 0x98818119, 0xd14f4f9e, 0x7fdcdca3, 0x66222244, 0x7e2a2a54, 0xab90903b, 0x8388880b,
+	0xca46468c, 0x29eeeec7, 0xd3b8b86b, 0x3c141428, 0x79dedea7, 0xe25e5ebc, 0x1d0b0b16, 0x76dbdbad,
+	0x3be0e0db, 0x56323264, 0x4e3a3a74, 0x1e0a0a14, 0xdb494992, 0x0a06060c, 0x6c242448, 0xe45c5cb8,
+	0x5dc2c29f, 0x6ed3d3bd, 0xefacac43, 0xa66262c4, 0xa8919139, 0xa4959531, 0x37e4e4d3, 0x8b7979f2,
+	0x32e7e7d5, 0x43c8c88b, 0x5937376e, 0xb76d6dda, 0x8c8d8d01, 0x64d5d5b1, 0xd24e4e9c, 0xe0a9a949,
+	0xb46c6cd8, 0xfa5656ac, 0x07f4f4f3, 0x25eaeacf, 0xaf6565ca, 0x8e7a7af4, 0xe9aeae47, 0x18080810,
+	0xd5baba6f, 0x887878f0, 0x6f25254a, 0x722e2e5c, 0x241c1c38, 0xf1a6a657, 0xc7b4b473, 0x51c6c697,
+	0x23e8e8cb, 0x7cdddda1, 0x9c7474e8, 0x211f1f3e, 0xdd4b4b96, 0xdcbdbd61, 0x868b8b0d, 0x858a8a0f,
+	0x907070e0, 0x423e3e7c, 0xc4b5b571, 0xaa6666cc, 0xd8484890, 0x05030306, 0x01f6f6f7, 0x120e0e1c,
+	0xa36161c2, 0x5f35356a, 0xf95757ae, 0xd0b9b969, 0x91868617, 0x58c1c199, 0x271d1d3a, 0xb99e9e27,
+	0x38e1e1d9, 0x13f8f8eb, 0xb398982b, 0x33111122, 0xbb6969d2, 0x70d9d9a9, 0x898e8e07, 0xa7949433,
+	0xb69b9b2d, 0x221e1e3c, 0x92878715, 0x20e9e9c9, 0x49cece87, 0xff5555aa, 0x78282850, 0x7adfdfa5,
+	0x8f8c8c03, 0xf8a1a159, 0x80898909, 0x170d0d1a, 0xdabfbf65, 0x31e6e6d7, 0xc6424284, 0xb86868d0,
+	0xc3414182, 0xb0999929, 0x772d2d5a, 0x110f0f1e, 0xcbb0b07b, 0xfc5454a8, 0xd6bbbb6d, 0x3a16162c
+};
+
+static uint32_t load32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32(uint8_t *p, uint32_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+static uint32_t subWord(uint32_t x)
+{
+	return sbox[B(x, 0)] | (sbox[B(x, 1)] << 8) | (sbox[B(x, 2)] << 16) | ((uint32_t)sbox[B(x, 3)] << 24);
+}
+
+/* one round of column <c> of <s>, starting from byte 0 of that column */
+#define ROUND(s, c) \
+	(Te0[B(s[(c) & 3], 0)] ^ ROTL(Te0[B(s[((c) + 1) & 3], 1)], 8) ^ \
+	 ROTL(Te0[B(s[((c) + 2) & 3], 2)], 16) ^ ROTL(Te0[B(s[((c) + 3) & 3], 3)], 24))
+
+/* the last round has no MixColumns */
+#define LAST(s, c) \
+	(sbox[B(s[(c) & 3], 0)] | (sbox[B(s[((c) + 1) & 3], 1)] << 8) | \
+	 (sbox[B(s[((c) + 2) & 3], 2)] << 16) | ((uint32_t)sbox[B(s[((c) + 3) & 3], 3)] << 24))
+
+static void encryptBlock(const aes_key_t *key, const uint8_t *input, uint8_t *output)
+{
+	const uint32_t *rk = key->rk;
+	uint32_t s[4], t[4];
+	int round, i;
+
+	for (i = 0; i < 4; i++) {
+		s[i] = load32(input + i * 4) ^ rk[i];
+	}
+
+	for (round = 1; round < key->rounds; round++) {
+		rk += 4;
+		t[0] = ROUND(s, 0) ^ rk[0];
+		t[1] = ROUND(s, 1) ^ rk[1];
+		t[2] = ROUND(s, 2) ^ rk[2];
+		t[3] = ROUND(s, 3) ^ rk[3];
+		memcpy(s, t, sizeof(s));
+	}
+
+	rk += 4;
+	for (i = 0; i < 4; i++) {
+		store32(output + i * 4, LAST(s, i) ^ rk[i]);
+	}
+}
+
+#ifdef HAVE_AESNI
+__attribute__((target("aes,sse2")))
+static void encryptBlockAesni(const aes_key_t *key, const uint8_t *input, uint8_t *output)
+{
+	const __m128i *rk = (const __m128i *)key->rk;
+	__m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)input), _mm_loadu_si128(rk));
+
+	for (int round = 1; round < key->rounds; round++) {
+		s = _mm_aesenc_si128(s, _mm_loadu_si128(rk + round));
+	}
+
+	_mm_storeu_si128((__m128i *)output, _mm_aesenclast_si128(s, _mm_loadu_si128(rk + key->rounds)));
+}
+
+/* the same for any number of blocks, 8 at a time */
+__attribute__((target("aes,sse2")))
+static void encryptBlocksAesni(const aes_key_t *key, const uint8_t *input, uint8_t *output, size_t n)
+{
+	const __m128i *rk = (const __m128i *)key->rk;
+	__m128i s[8], k;
+	size_t i, m;
+
+	for (; n > 0; n -= m, input += m * 16, output += m * 16) {
+		m = (n < 8) ? n : 8;
+
+		k = _mm_loadu_si128(rk);
+		for (i = 0; i < 8; i++) {
+			s[i] = (i < m) ? _mm_xor_si128(_mm_loadu_si128((const __m128i *)input + i), k) : k;
+		}
+
+		for (int round = 1; round < key->rounds; round++) {
+			k = _mm_loadu_si128(rk + round);
+			for (i = 0; i < 8; i++) {
+				s[i] = _mm_aesenc_si128(s[i], k);
+			}
+		}
+
+		k = _mm_loadu_si128(rk + key->rounds);
+		for (i = 0; i < m; i++) {
+			_mm_storeu_si128((__m128i *)output + i, _mm_aesenclast_si128(s[i], k));
+		}
+	}
+}
+
+static int have_aesni(void)
+{
+	unsigned int a, b, c, d;
+
+	return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES);
+}
+#else
+static int have_aesni(void)
+{
+	return 0;
+}
+#endif
+
+#ifdef HAVE_VAES
+/* 16 blocks at a time, in 8 ymm registers */
+__attribute__((target("vaes,avx2")))
+static void encryptBlocksVaes(const aes_key_t *key, const uint8_t *input, uint8_t *output, size_t n)
+{
+	const __m128i *rk = (const __m128i *)key->rk;
+	__m256i s[8], k;
+	size_t i, m;
+
+	for (; n > 0; n -= m, input += m * 16, output += m * 16) {
+		m = (n < 16) ? n : 16;
+
+		k = _mm256_broadcastsi128_si256(_mm_loadu_si128(rk));
+		for (i = 0; i < 8; i++) {
+			s[i] = (2 * i + 1 < m) ? _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)input + i), k) : k;
+		}
+
+		if (m & 1) {
+			s[m / 2] = _mm256_xor_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)input + m - 1)), k);
+		}
+
+		for (int round = 1; round < key->rounds; round++) {
+			k = _mm256_broadcastsi128_si256(_mm_loadu_si128(rk + round));
+			for (i = 0; i < 8; i++) {
+				s[i] = _mm256_aesenc_epi128(s[i], k);
+			}
+		}
+
+		k = _mm256_broadcastsi128_si256(_mm_loadu_si128(rk + key->rounds));
+		for (i = 0; i < m / 2; i++) {
+			_mm256_storeu_si256((__m256i *)output + i, _mm256_aesenclast_epi128(s[i], k));
+		}
+
+		if (m & 1) {
+			_mm_storeu_si128((__m128i *)output + m - 1, _mm256_castsi256_si128(_mm256_aesenclast_epi128(s[m / 2], k)));
+		}
+	}
+}
+
+/* VAES and AVX2, and an OS which saves the ymm registers */
+static int have_vaes(void)
+{
+	unsigned int a, b, c, d, lo, hi;
+
+	if (! __get_cpuid(1, &a, &b, &c, &d) || ! (c & bit_OSXSAVE)) {
+		return 0;
+	}
+
+	__asm__ ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	if ((lo & 6) != 6) {
+		return 0;
+	}
+
+	return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2) && (c & bit_VAES);
+}
+#else
+static int have_vaes(void)
+{
+	return 0;
+}
+#endif
+
+const char *aes_impl(void)
+{
+	return (have_vaes()) ? "vaes" : (have_aesni()) ? "aes-ni" : "t-table";
+}
+
+/* returns 0 if <psk> is an AES-128 or AES-256 key (16 or 32 bytes), -1 otherwise */
+int aes_key_expand(aes_key_t *key, const uint8_t *psk, size_t len)
+{
+	/*
+	 * Rcon(i), 2^i in the Rijndael finite field, for i = 1..10.
+	 * http://en.wikipedia.org/wiki/Rijndael_key_schedule
+	 */
+	static uint8_t const rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36 };
+	uint32_t *rk = key->rk;
+	const int nk = len / 4;
+
+	if (len != 16 && len != 32) {
+		return -1;
+	}
+
+	key->rounds = nk + 6;
+	for (int i = 0; i < nk; i++) {
+		rk[i] = load32(psk + i * 4);
+	}
+
+	for (int i = nk; i < 4 * (key->rounds + 1); i++) {
+		uint32_t temp = rk[i - 1];
+
+		if (i % nk == 0) {
+			temp = subWord(ROTL(temp, 24)) ^ rcon[i / nk - 1];
+		} else if (nk > 6 && i % nk == 4) {
+			temp = subWord(temp);
+		}
+
+		rk[i] = rk[i - nk] ^ temp;
+	}
+
+	key->aesni = have_aesni();
+	key->lanes = (have_vaes()) ? 16 : (key->aesni) ? 8 : 1;
+	return 0;
+}
+
+void aes_init(aes_ctx_t *ctx)
+{
+	ctx->key = &ctx->schedule;
+	ctx->idx = 16;
+	ctx->ctr_start = 0;
+}
+
+void aes_set_ctrlen(aes_ctx_t *ctx, size_t len)
+{
+	ctx->ctr_start = 16 - len;
+}
+
+void aes_set_iv(aes_ctx_t *ctx, const uint8_t *iv, size_t len)
+{
+	memcpy(ctx->ctr, iv, len);
+	ctx->idx = 16;
+}
+
+int aes_set_key(aes_ctx_t *ctx, const uint8_t *key, size_t len)
+{
+	ctx->key = &ctx->schedule;
+	return aes_key_expand(&ctx->schedule, key, len);
+}
+
+/* codes with <key>, which must outlive the context */
+void aes_use_key(aes_ctx_t *ctx, const aes_key_t *key)
+{
+	ctx->key = key;
+}
+
+void aes_crypt(aes_ctx_t *ctx, uint8_t *output, const uint8_t *input, size_t len)
+{
+	while (len > 0) {
+		uint8_t templen;
+
+		if (ctx->idx >= 16) {
+			/* Generate a new encrypted ctr block. */
+#ifdef HAVE_AESNI
+			if (ctx->key->aesni) {
+				encryptBlockAesni(ctx->key, ctx->ctr, ctx->state);
+			} else
+#endif
+			encryptBlock(ctx->key, ctx->ctr, ctx->state);
+			ctx->idx = 0;
+
+			/*
+			 * Increment the ctr, taking care not to reveal
+			 * any timing information about the starting value.
+			 * We iterate through the entire ctr region even
+			 * if we could stop earlier because a byte is non-zero.
+			 */
+			uint16_t temp = 1;
+			uint8_t i = 16;
+			while (i > ctx->ctr_start) {
+				--i;
+				temp += ctx->ctr[i];
+				ctx->ctr[i] = (uint8_t)temp;
+				temp >>= 8;
+			}
+		}
+
+		templen = 16 - ctx->idx;
+		if (templen > len) {
+			templen = len;
+		}
+
+		/* a plain indexed loop, so the compiler can XOR a whole block at once */
+		for (uint8_t i = 0; i < templen; i++) {
+			output[i] = input[i] ^ ctx->state[ctx->idx + i];
+		}
+
+		ctx->idx += templen;
+		output += templen;
+		input += templen;
+		len -= templen;
+	}
+}
+
+/* encrypts <n> blocks from <input> to <output> as wide as <key> allows */
+static void encryptBlocks(const aes_key_t *key, const uint8_t *input, uint8_t *output, size_t n)
+{
+#ifdef HAVE_VAES
+	if (key->lanes == 16) {
+		encryptBlocksVaes(key, input, output, n);
+		return;
+	}
+#endif
+#ifdef HAVE_AESNI
+	if (key->aesni) {
+		encryptBlocksAesni(key, input, output, n);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < n; i++) {
+		encryptBlock(key, input + i * 16, output + i * 16);
+	}
+}
+
+/* XORs a batch of keystream blocks into the packets they belong to */
+static void xorBlocks(uint8_t *const *dst, const uint8_t *len, const uint8_t *ks, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (len[i] == 16) {
+			for (int j = 0; j < 16; j++) {
+				dst[i][j] ^= ks[i * 16 + j];
+			}
+		} else {
+			for (uint8_t j = 0; j < len[i]; j++) {
+				dst[i][j] ^= ks[i * 16 + j];
+			}
+		}
+	}
+}
+
+void mesh_crypt_batch(const aes_key_t *key, const mesh_crypt_job_t *jobs, size_t n)
+{
+	uint8_t ctr[AES_BATCH_BLOCKS * 16], ks[AES_BATCH_BLOCKS * 16];
+	uint8_t *dst[AES_BATCH_BLOCKS], len[AES_BATCH_BLOCKS];
+	size_t nblk = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		uint8_t nonce[16];
+		uint32_t blk = 0;
+
+		mesh_nonce(nonce, jobs[i].from, jobs[i].id);
+		for (size_t off = 0; off < jobs[i].len; off += 16, blk++) {
+			/* the last 4 bytes of the nonce are zero, and count blocks big-endian */
+			memcpy(ctr + nblk * 16, nonce, 12);
+			ctr[nblk * 16 + 12] = blk >> 24;
+			ctr[nblk * 16 + 13] = blk >> 16;
+			ctr[nblk * 16 + 14] = blk >> 8;
+			ctr[nblk * 16 + 15] = blk;
+			dst[nblk] = jobs[i].buf + off;
+			len[nblk] = (jobs[i].len - off < 16) ? jobs[i].len - off : 16;
+
+			if (++nblk == AES_BATCH_BLOCKS) {
+				encryptBlocks(key, ctr, ks, nblk);
+				xorBlocks(dst, len, ks, nblk);
+				nblk = 0;
+			}
+		}
+	}
+
+	if (nblk) {
+		encryptBlocks(key, ctr, ks, nblk);
+		xorBlocks(dst, len, ks, nblk);
+	}
+}
+
+/*
+ * generate our 128 bit nonce for a new packet
+ *
+ * The nonce is constructed by concatenating (from MSB to LSB):
+ * a 64 bit packet number (stored in little endian order)
+ * a 32 bit sending node number (stored in little endian order)
+ * a 32 bit block counter (starts at zero)
+ *
+ * nonce pointer must be able to hold 16 bytes
+ */
+void mesh_nonce(uint8_t *nonce, uint32_t from_nodeid, uint32_t packet_id)
+{
+	memset(nonce, 0, 16);
+
+	/* use memcpy to avoid breaking strict-aliasing */
+	memcpy(nonce, &packet_id, sizeof(packet_id));
+	memcpy(nonce + sizeof(uint64_t), &from_nodeid, sizeof(from_nodeid));
+}
@@ -0,0 +1,1000 @@
+/*
+ * Coder benchmark
+ *
+ * Loads the payloads of a packet corpus (see corpus.h) into memory, then codes them
+ * with each of the requested coders on each of the requested backends and reports,
+ * per portnum and per payload size, how many bits per payload byte each one needs
+ * and how fast it encodes and decodes.  Every packet is decoded and checked against
+ * the original.
+ *
+ * It also times the stages of the original per-packet path on their own:
+ * cdf_build(), encode_u8_u8(), decode_u8_u8() and the AES-CTR decryption every
+ * packet goes through first.
+ *
+ * Each thread is pinned to a CPU and takes every <nthreads>th packet, in every group
+ * the packet is in.  Times are added up over the threads, so the rates are per core.  Cycles come from
+ * the TSC where there is one.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES
+#endif
+
+#include <pb_decode.h>
+#include "meshtastic/mesh.pb.h"
+
+#include "aes.h"
+#include "arithcode.h"
+#include "codec.h"
+#include "corpus.h"
+#include "models.h"
+#include "portnum.h"
+
+#define PAYLOAD_MAX	(sizeof(((meshtastic_data_t *)0)->payload.bytes))
+
+/* packets are also grouped by payload size, in these buckets */
+#define NBUCKETS	(5)
+static const char *bucket_names[NBUCKETS] = { "1-15 bytes", "16-31 bytes", "32-63 bytes", "64-127 bytes", "128+ bytes" };
+
+/* the stages of the per-packet path */
+enum stage { STAGE_CDF, STAGE_ENCODE, STAGE_DECODE, STAGE_AES, STAGE_AES_BATCH, STAGE_MAX };
+static const char *stage_names[STAGE_MAX] = { "cdf_build", "encode_u8_u8", "decode_u8_u8", "aes128_ctr", "aes128_ctr_batch" };
+
+/* stages are run over this many packets at a time, so the CDFs stay in cache between them */
+#define STAGE_CHUNK	(256)
+
+struct packet {
+	uint32_t from, id;
+	uint16_t portnum;
+	uint16_t len, clen;
+	uint8_t data[PAYLOAD_MAX];
+	uint8_t comp[CDF_MAX_SYMB];	/* compressed by the coder being measured */
+};
+
+/* one coder and backend */
+struct config {
+	enum coder_mode coder;
+	enum coder_backend backend;
+};
+
+/* a set of packets which is reported on as one row: a portnum or a size bucket */
+struct group {
+	char name[32];
+	bool portnum;			/* false for a size bucket */
+	size_t n, *idx;			/* indices into the packet array */
+};
+
+/* a time (from stamp()) or a length of time: seconds, and cycles if there's a counter */
+struct timing {
+	double s;
+	uint64_t cycles;
+};
+
+/* one configuration's results over one group */
+struct result {
+	uint64_t packets, bytes, cbytes;
+	struct timing enc, dec;
+	uint32_t failures;
+};
+
+/* the per-packet path's results over one group */
+struct stage_result {
+	uint64_t packets, bytes;
+	struct timing t[STAGE_MAX];
+	uint32_t failures;
+};
+
+/* one benchmark thread: its share of each group, and its results, [group][config] and [group] */
+struct worker {
+	pthread_t thread;
+	int id;
+	struct group *groups;
+	struct codec *c;
+	struct result *res;
+	struct stage_result *stages;
+};
+
+static struct model_set models;
+static bool use_models, batch;
+static struct packet *pkts;
+static struct group *groups;
+static struct config configs[CODER_MAX * BACKEND_MAX];
+static int ngroups, nconfigs, nthreads = 1, reps = 3, warmup = 1;
+
+/* any fixed key will do for timing */
+static const uint8_t bench_psk[16] = {
+	0xd4, 0xf1, 0xbb, 0x3a, 0x20, 0x29, 0x07, 0x59, 0xf0, 0xbc, 0xff, 0xab, 0xcf, 0x4e, 0x69, 0x01
+};
+static aes_key_t bench_key;
+
+static struct timing stamp(void)
+{
+	struct timespec ts;
+	struct timing s;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	s.s = ts.tv_sec + 1e-9 * ts.tv_nsec;
+#ifdef HAVE_CYCLES
+	s.cycles = __rdtsc();
+#else
+	s.cycles = 0;
+#endif
+	return s;
+}
+
+/* adds the time since <start> to <t> */
+static void elapsed(struct timing *t, struct timing start)
+{
+	struct timing end = stamp();
+
+	t->s += end.s - start.s;
+	t->cycles += end.cycles - start.cycles;
+}
+
+static void timing_add(struct timing *t, const struct timing *u)
+{
+	t->s += u->s;
+	t->cycles += u->cycles;
+}
+
+static int bucket_of(size_t len)
+{
+	int b = 0;
+
+	for (len >>= 4; len && b < NBUCKETS - 1; len >>= 1) {
+		b++;
+	}
+
+	return b;
+}
+
+static int by_portnum(const void *a, const void *b)
+{
+	return (int)((const struct packet *)a)->portnum - (int)((const struct packet *)b)->portnum;
+}
+
+/* decodes every packet in <path> into an array sorted by portnum */
+static struct packet *load_packets(const char *path, size_t *npkts)
+{
+	struct corpus c;
+	struct corpus_cursor cur;
+	struct mesh_header h;
+	struct packet *pkts = NULL, *p;
+	uint8_t buf[MESH_HEADER_LEN + 256];
+	size_t n = 0, cap = 0;
+	int len;
+
+	if (corpus_open(&c, path) != 0) {
+		return NULL;
+	}
+
+	corpus_shard(&c, &cur, 0, 1);
+	while ((len = corpus_next(&cur, buf, sizeof(buf))) != 0) {
+		meshtastic_data_t md = MESHTASTIC_DATA_INIT_DEFAULT;
+		pb_istream_t s;
+
+		if (len <= MESH_HEADER_LEN) {
+			continue;
+		}
+
+		s = pb_istream_from_buffer(buf + MESH_HEADER_LEN, len - MESH_HEADER_LEN);
+		if (! pb_decode(&s, MESHTASTIC_DATA_FIELDS, &md) || md.payload.size == 0) {
+			continue;
+		}
+
+		if (n == cap) {
+			cap = (cap) ? cap * 2 : 4096;
+			if ((p = realloc(pkts, cap * sizeof(*pkts))) == NULL) {
+				fprintf(stderr, "%s: out of memory\n", __func__);
+				free(pkts);
+				corpus_close(&c);
+				return NULL;
+			}
+
+			pkts = p;
+		}
+
+		mesh_header_parse(&h, buf);
+		p = &pkts[n++];
+		p->from = h.from;
+		p->id = h.id;
+		p->portnum = md.portnum;
+		p->len = md.payload.size;
+		memcpy(p->data, md.payload.bytes, md.payload.size);
+	}
+
+	corpus_close(&c);
+	qsort(pkts, n, sizeof(*pkts), by_portnum);
+	*npkts = n;
+	return pkts;
+}
+
+/* one group per portnum, then one per size bucket that has any packets */
+static int make_groups(size_t npkts)
+{
+	size_t a, b, n, nports = 1;
+	int k;
+
+	for (n = 1; n < npkts; n++) {
+		nports += (pkts[n].portnum != pkts[n - 1].portnum);
+	}
+
+	if ((groups = calloc(nports + NBUCKETS, sizeof(*groups))) == NULL) {
+		return -1;
+	}
+
+	for (a = 0; a < npkts; a = b) {
+		struct group *g = &groups[ngroups++];
+
+		for (b = a; b < npkts && pkts[b].portnum == pkts[a].portnum; b++) {
+		}
+
+		snprintf(g->name, sizeof(g->name), "%s", portnum_str(pkts[a].portnum));
+		g->portnum = true;
+		if ((g->idx = malloc((b - a) * sizeof(*g->idx))) == NULL) {
+			return -1;
+		}
+
+		for (n = a; n < b; n++) {
+			g->idx[g->n++] = n;
+		}
+	}
+
+	for (k = 0; k < NBUCKETS; k++) {
+		struct group *g = &groups[ngroups];
+
+		for (n = 0; n < npkts; n++) {
+			g->n += (bucket_of(pkts[n].len) == k);
+		}
+
+		if (g->n == 0) {
+			continue;
+		}
+
+		snprintf(g->name, sizeof(g->name), "%s", bucket_names[k]);
+		if ((g->idx = malloc(g->n * sizeof(*g->idx))) == NULL) {
+			return -1;
+		}
+
+		g->n = 0;
+		for (n = 0; n < npkts; n++) {
+			if (bucket_of(pkts[n].len) == k) {
+				g->idx[g->n++] = n;
+			}
+		}
+
+		ngroups++;
+	}
+
+	return 0;
+}
+
+/* this thread's share of every group */
+static int share_groups(struct worker *w)
+{
+	if ((w->groups = calloc(ngroups, sizeof(*w->groups))) == NULL) {
+		return -1;
+	}
+
+	for (int k = 0; k < ngroups; k++) {
+		struct group *g = &w->groups[k];
+
+		*g = groups[k];
+		g->n = 0;
+		if ((g->idx = malloc(groups[k].n * sizeof(*g->idx))) == NULL) {
+			return -1;
+		}
+
+		for (size_t i = 0; i < groups[k].n; i++) {
+			if (groups[k].idx[i] % nthreads == (size_t)w->id) {
+				g->idx[g->n++] = groups[k].idx[i];
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* codes <g> <reps> times each way with <c> */
+static void bench_group(struct worker *w, const struct group *g, struct result *r)
+{
+	struct codec *c = w->c;
+	uint8_t unc[CDF_MAX_SYMB], *uncp;
+	size_t nout, nunc;
+	struct timing t;
+
+	t = stamp();
+	for (int k = 0; k < reps; k++) {
+		for (size_t i = 0; i < g->n; i++) {
+			struct packet *p = &pkts[g->idx[i]];
+			uint8_t *outp = p->comp;
+
+			nout = sizeof(p->comp);
+			if (codec_encode(c, p->portnum, (void **)&outp, &nout, p->data, p->len) != 0) {
+				nout = 0;
+			}
+
+			p->clen = nout;
+		}
+	}
+
+	elapsed(&r->enc, t);
+
+	t = stamp();
+	for (int k = 0; k < reps; k++) {
+		for (size_t i = 0; i < g->n; i++) {
+			struct packet *p = &pkts[g->idx[i]];
+
+			uncp = unc;
+			nunc = sizeof(unc);
+			if (codec_decode(c, p->portnum, (void **)&uncp, &nunc, p->comp, p->clen) != 0) {
+				nunc = 0;
+			}
+
+			/* only check the last pass, the others are just for timing */
+			if (k == reps - 1 && (p->clen == 0 || nunc != p->len || memcmp(unc, p->data, nunc) != 0)) {
+				r->failures++;
+			}
+		}
+	}
+
+	elapsed(&r->dec, t);
+
+	for (size_t i = 0; i < g->n; i++) {
+		r->packets++;
+		r->bytes += pkts[g->idx[i]].len;
+		r->cbytes += pkts[g->idx[i]].clen;
+	}
+}
+
+/* the same through the batch API: each pass codes the group in one call each way */
+static int bench_batch(struct worker *w, const struct group *g, struct result *r)
+{
+	const size_t n = g->n;
+	const size_t ncomp = n * CDF_MAX_SYMB + 1, nunc = n * PAYLOAD_MAX;
+	ac_packet_t *in = malloc(n * sizeof(*in));
+	size_t *coff = malloc((n + 1) * sizeof(*coff)), *uoff = malloc((n + 1) * sizeof(*uoff));
+	uint8_t *comp = malloc(ncomp), *unc = malloc(nunc);
+	const struct packet *p;
+	int ret = -1, enc = 0, dec = 0;
+	struct timing t;
+
+	if (n == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	if (in == NULL || coff == NULL || uoff == NULL || comp == NULL || unc == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		goto out;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		p = &pkts[g->idx[i]];
+		in[i].data = p->data;
+		in[i].len = p->len;
+	}
+
+	p = &pkts[g->idx[0]];
+	t = stamp();
+	for (int k = 0; k < reps; k++) {
+		enc = codec_encode_batch(w->c, p->portnum, in, n, comp, ncomp, coff);
+	}
+
+	elapsed(&r->enc, t);
+
+	t = stamp();
+	for (int k = 0; k < reps && enc == 0; k++) {
+		dec = codec_decode_batch(w->c, p->portnum, comp, coff, n, unc, nunc, uoff);
+	}
+
+	elapsed(&r->dec, t);
+
+	for (size_t i = 0; i < n; i++) {
+		if (enc != 0 || dec != 0 || uoff[i + 1] - uoff[i] != in[i].len || memcmp(unc + uoff[i], in[i].data, in[i].len) != 0) {
+			r->failures++;
+		}
+
+		r->packets++;
+		r->bytes += in[i].len;
+	}
+
+	r->cbytes += (enc == 0) ? coff[n] : 0;
+	ret = 0;
+
+out:
+	free(in);
+	free(coff);
+	free(uoff);
+	free(comp);
+	free(unc);
+	return ret;
+}
+
+/* times each stage of the per-packet path over <g>, a chunk at a time */
+static int bench_stages(struct worker *w, const struct group *g, struct stage_result *r)
+{
+	struct packet *chunk[STAGE_CHUNK];
+	size_t nsym[STAGE_CHUNK];
+	real *cdf = malloc(STAGE_CHUNK * (CDF_MAX_SYMB + 1) * sizeof(*cdf));
+	uint8_t unc[CDF_MAX_SYMB], nonce[16], *crypt = malloc(2 * STAGE_CHUNK * PAYLOAD_MAX);
+	mesh_crypt_job_t jobs[STAGE_CHUNK];
+	aes_ctx_t ctx;
+	struct timing t;
+	size_t i, n, nout, nunc;
+	void *outp, *uncp;
+
+	if (cdf == NULL || crypt == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		free(cdf);
+		free(crypt);
+		return -1;
+	}
+
+	for (i = 0; i < g->n; ) {
+		for (n = 0; n < STAGE_CHUNK && i < g->n; i++) {
+			chunk[n++] = &pkts[g->idx[i]];
+		}
+
+		t = stamp();
+		for (int k = 0; k < reps; k++) {
+			for (size_t j = 0; j < n; j++) {
+				cdf_build(cdf + j * (CDF_MAX_SYMB + 1), &nsym[j], chunk[j]->data, chunk[j]->len);
+			}
+		}
+
+		elapsed(&r->t[STAGE_CDF], t);
+
+		t = stamp();
+		for (int k = 0; k < reps; k++) {
+			for (size_t j = 0; j < n; j++) {
+				outp = chunk[j]->comp;
+				nout = sizeof(chunk[j]->comp);
+				if (encode_u8_u8(&outp, &nout, chunk[j]->data, chunk[j]->len, cdf + j * (CDF_MAX_SYMB + 1), nsym[j]) != 0) {
+					nout = 0;
+				}
+
+				chunk[j]->clen = nout;
+			}
+		}
+
+		elapsed(&r->t[STAGE_ENCODE], t);
+
+		t = stamp();
+		for (int k = 0; k < reps; k++) {
+			for (size_t j = 0; j < n; j++) {
+				uncp = unc;
+				nunc = sizeof(unc);
+				if (decode_u8_u8(&uncp, &nunc, chunk[j]->comp, chunk[j]->clen, cdf + j * (CDF_MAX_SYMB + 1), nsym[j]) != 0) {
+					nunc = 0;
+				}
+
+				if (k == reps - 1 && (chunk[j]->clen == 0 || nunc != chunk[j]->len || memcmp(unc, chunk[j]->data, nunc) != 0)) {
+					r->failures++;
+				}
+			}
+		}
+
+		elapsed(&r->t[STAGE_DECODE], t);
+
+		/* as mesh_decrypt() does it: a fresh context and nonce for every packet, with the key expanded once */
+		t = stamp();
+		for (int k = 0; k < reps; k++) {
+			for (size_t j = 0; j < n; j++) {
+				aes_init(&ctx);
+				aes_set_ctrlen(&ctx, 4);
+				aes_use_key(&ctx, &bench_key);
+				mesh_nonce(nonce, chunk[j]->from, chunk[j]->id);
+				aes_set_iv(&ctx, nonce, sizeof(nonce));
+				aes_crypt(&ctx, crypt + j * PAYLOAD_MAX, chunk[j]->data, chunk[j]->len);
+			}
+		}
+
+		elapsed(&r->t[STAGE_AES], t);
+
+		/* and the whole chunk in one mesh_crypt_batch() call, in place, so each pass undoes the last */
+		for (size_t j = 0; j < n; j++) {
+			jobs[j].from = chunk[j]->from;
+			jobs[j].id = chunk[j]->id;
+			jobs[j].buf = crypt + (STAGE_CHUNK + j) * PAYLOAD_MAX;
+			jobs[j].len = chunk[j]->len;
+			memcpy(jobs[j].buf, chunk[j]->data, chunk[j]->len);
+		}
+
+		t = stamp();
+		for (int k = 0; k < reps; k++) {
+			mesh_crypt_batch(&bench_key, jobs, n);
+		}
+
+		elapsed(&r->t[STAGE_AES_BATCH], t);
+
+		for (size_t j = 0; j < n; j++) {
+			const uint8_t *want = (reps & 1) ? crypt + j * PAYLOAD_MAX : chunk[j]->data;
+
+			if (memcmp(jobs[j].buf, want, jobs[j].len) != 0) {
+				r->failures++;
+			}
+		}
+
+		for (size_t j = 0; j < n; j++) {
+			r->packets++;
+			r->bytes += chunk[j]->len;
+		}
+	}
+
+	free(cdf);
+	free(crypt);
+	return 0;
+}
+
+/* runs everything once over this thread's share of every group */
+static int bench_pass(struct worker *w)
+{
+	for (int k = 0; k < ngroups; k++) {
+		const struct group *g = &w->groups[k];
+
+		for (int i = 0; i < nconfigs; i++) {
+			struct result *r = &w->res[k * nconfigs + i];
+
+			int ret = 0;
+
+			if (codec_init(w->c, configs[i].coder, configs[i].backend, (use_models) ? &models : NULL) != 0) {
+				return -1;
+			}
+
+			if (! batch) {
+				bench_group(w, g, r);
+			} else if (g->portnum) {
+				ret = bench_batch(w, g, r);
+			}
+
+			codec_free(w->c);
+			if (ret != 0) {
+				return -1;
+			}
+		}
+
+		if (bench_stages(w, g, &w->stages[k]) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *bench_thread(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->id % ((ncpu > 0) ? ncpu : 1), &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		fprintf(stderr, "warning: could not pin thread %d\n", w->id);
+	}
+
+	/* warm the caches, the branch predictors and the CPU clock, then start again */
+	for (int k = 0; k < warmup; k++) {
+		if (bench_pass(w) != 0) {
+			return (void *)-1;
+		}
+	}
+
+	memset(w->res, 0, ngroups * nconfigs * sizeof(*w->res));
+	memset(w->stages, 0, ngroups * sizeof(*w->stages));
+	return (bench_pass(w) == 0) ? NULL : (void *)-1;
+}
+
+/* ns per packet, MB/s and cycles per byte (negative without a cycle counter) for one pass of <t> */
+static void rates(const struct timing *t, uint64_t packets, uint64_t bytes, double *ns, double *mbs, double *cpb)
+{
+	const double n = (double)packets * reps, b = (double)bytes * reps;
+
+	*ns = (n > 0) ? 1e9 * t->s / n : 0.0;
+	*mbs = (t->s > 0) ? b / 1e6 / t->s : 0.0;
+#ifdef HAVE_CYCLES
+	*cpb = (b > 0) ? t->cycles / b : 0.0;
+#else
+	*cpb = -1.0;
+#endif
+}
+
+static void print_cpb(double cpb)
+{
+	if (cpb < 0) {
+		printf("  %7s", "-");
+	} else {
+		printf("  %7.1f", cpb);
+	}
+}
+
+static void print_result(const char *name, const struct config *cf, const struct result *r, const struct result *base)
+{
+	double ens, embs, ecpb, dns, dmbs, dcpb;
+
+	rates(&r->enc, r->packets, r->bytes, &ens, &embs, &ecpb);
+	rates(&r->dec, r->packets, r->bytes, &dns, &dmbs, &dcpb);
+
+	printf("%20s  %9s  %7s  %8lu  %10lu  %9.3f", name, coder_names[cf->coder], backend_names[cf->backend], (unsigned long)r->packets, (unsigned long)r->bytes, (r->bytes) ? 8.0 * r->cbytes / r->bytes : 0.0);
+	if (base && base != r && base->cbytes) {
+		printf("  %+8.1f%%", 100.0 * ((double)r->cbytes - base->cbytes) / base->cbytes);
+	} else {
+		printf("  %9s", "");
+	}
+
+	printf("  %8.0f  %8.0f  %8.1f  %8.1f", ens, dns, embs, dmbs);
+	print_cpb(ecpb);
+	print_cpb(dcpb);
+	if (r->failures) {
+		printf("  (%u FAILED)", r->failures);
+	}
+
+	printf("\n");
+}
+
+static void print_stages(const char *name, const struct stage_result *r)
+{
+	double ns, mbs, cpb;
+
+	for (int s = 0; s < STAGE_MAX; s++) {
+		rates(&r->t[s], r->packets, r->bytes, &ns, &mbs, &cpb);
+		printf("%20s  %16s  %8lu  %10lu  %8.0f  %8.1f", name, stage_names[s], (unsigned long)r->packets, (unsigned long)r->bytes, ns, mbs);
+		print_cpb(cpb);
+		if (s == STAGE_DECODE && r->failures) {
+			printf("  (%u FAILED)", r->failures);
+		}
+
+		printf("\n");
+	}
+}
+
+static void json_timing(FILE *f, const char *name, const struct timing *t, uint64_t packets, uint64_t bytes)
+{
+	double ns, mbs, cpb;
+
+	rates(t, packets, bytes, &ns, &mbs, &cpb);
+	fprintf(f, "\"%s\": {\"ns_per_packet\": %.1f, \"mb_per_s\": %.3f, \"cycles_per_byte\": ", name, ns, mbs);
+	if (cpb < 0) {
+		fprintf(f, "null}");
+	} else {
+		fprintf(f, "%.2f}", cpb);
+	}
+}
+
+static void json_row(FILE *f, bool *first, const char *name, const char *kind, const struct config *cf, const struct result *r)
+{
+	fprintf(f, "%s\n    {\"group\": \"%s\", \"kind\": \"%s\", \"coder\": \"%s\", \"backend\": \"%s\", ", (*first) ? "" : ",", name, kind, coder_names[cf->coder], backend_names[cf->backend]);
+	fprintf(f, "\"packets\": %lu, \"bytes\": %lu, \"compressed_bytes\": %lu, \"bits_per_byte\": %.4f, ", (unsigned long)r->packets, (unsigned long)r->bytes, (unsigned long)r->cbytes, (r->bytes) ? 8.0 * r->cbytes / r->bytes : 0.0);
+	json_timing(f, "encode", &r->enc, r->packets, r->bytes);
+	fprintf(f, ", ");
+	json_timing(f, "decode", &r->dec, r->packets, r->bytes);
+	fprintf(f, ", \"failures\": %u}", r->failures);
+	*first = false;
+}
+
+static void json_stages(FILE *f, bool *first, const char *name, const char *kind, const struct stage_result *r)
+{
+	fprintf(f, "%s\n    {\"group\": \"%s\", \"kind\": \"%s\", \"packets\": %lu, \"bytes\": %lu, ", (*first) ? "" : ",", name, kind, (unsigned long)r->packets, (unsigned long)r->bytes);
+	for (int s = 0; s < STAGE_MAX; s++) {
+		json_timing(f, stage_names[s], &r->t[s], r->packets, r->bytes);
+		fprintf(f, ", ");
+	}
+
+	fprintf(f, "\"failures\": %u}", r->failures);
+	*first = false;
+}
+
+static int write_json(const char *path, size_t npkts, const struct result *res, const struct result *all, const struct stage_result *stages, const struct stage_result *stages_all)
+{
+	FILE *f = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+	bool first = true;
+	int i, k;
+
+	if (f == NULL) {
+		fprintf(stderr, "Error: could not write %s\n", path);
+		return -1;
+	}
+
+	fprintf(f, "{\n  \"packets\": %zu, \"repetitions\": %d, \"warmup\": %d, \"threads\": %d, \"batch\": %s, \"aes\": \"%s\", \"aes_lanes\": %d,\n", npkts, reps, warmup, nthreads,
+	        (batch) ? "true" : "false", aes_impl(), bench_key.lanes);
+	fprintf(f, "  \"coders\": [");
+	for (k = 0; k < ngroups; k++) {
+		for (i = 0; i < nconfigs && ! (batch && ! groups[k].portnum); i++) {
+			json_row(f, &first, groups[k].name, (groups[k].portnum) ? "portnum" : "size", &configs[i], &res[k * nconfigs + i]);
+		}
+	}
+
+	for (i = 0; i < nconfigs; i++) {
+		json_row(f, &first, "(all)", "all", &configs[i], &all[i]);
+	}
+
+	fprintf(f, "\n  ],\n  \"stages\": [");
+	first = true;
+	for (k = 0; k < ngroups; k++) {
+		json_stages(f, &first, groups[k].name, (groups[k].portnum) ? "portnum" : "size", &stages[k]);
+	}
+
+	json_stages(f, &first, "(all)", "all", stages_all);
+	fprintf(f, "\n  ]\n}\n");
+	if (f != stdout) {
+		fclose(f);
+	}
+
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-M model_file] [-c coder[,coder...]] [-e backend[,backend...]] [-n repetitions] [-w passes] [-j threads] [-B] [-J json_file] corpus_file\n", argv0);
+	fprintf(stderr, "  -M  load pretrained models from this file\n");
+	fprintf(stderr, "  -c  coders to compare: static, adaptive, order1, order2, wire\n");
+	fprintf(stderr, "      (default: all of them with -M, adaptive without)\n");
+	fprintf(stderr, "  -e  entropy coders to run each coder on: arith, rans, tans (default: arith)\n");
+	fprintf(stderr, "  -n  times to code every packet each way, for steadier timing (default: 3)\n");
+	fprintf(stderr, "  -w  untimed warm-up passes over everything first (default: 1)\n");
+	fprintf(stderr, "  -j  threads, each pinned to its own CPU (default: 1)\n");
+	fprintf(stderr, "  -B  code each portnum's packets as one batch (see codec_encode_batch()); no size buckets\n");
+	fprintf(stderr, "  -J  also write the results as JSON to this file (- for stdout)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *model_file = NULL, *json_file = NULL;
+	char *coder_list = NULL, *backend_list = NULL, *name, *save;
+	enum coder_mode coders[CODER_MAX];
+	enum coder_backend backends[BACKEND_MAX];
+	struct result *res, all[CODER_MAX * BACKEND_MAX];
+	struct stage_result *stages, stages_all;
+	struct worker *w;
+	size_t npkts;
+	int ncoders = 0, nbackends = 0, base = -1;
+	int opt, i, k, m, ret = 0;
+
+	while ((opt = getopt(argc, argv, "M:c:e:n:w:j:BJ:h")) != -1) {
+		switch (opt) {
+		case 'M': model_file = optarg; break;
+		case 'c': coder_list = optarg; break;
+		case 'e': backend_list = optarg; break;
+		case 'n': reps = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 'B': batch = true; break;
+		case 'J': json_file = optarg; break;
+		default:
+			usage(argv[0]);
+			return -1;
+		};
+	}
+
+	if (optind >= argc || reps < 1 || warmup < 0 || nthreads < 1) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (model_file) {
+		model_set_init(&models);
+		if (model_set_load(&models, model_file) != 0) {
+			fprintf(stderr, "Error: could not load models from %s\n", model_file);
+			return -1;
+		}
+
+		use_models = true;
+	}
+
+	if (coder_list) {
+		for (name = strtok_r(coder_list, ",", &save); name && ncoders < CODER_MAX; name = strtok_r(NULL, ",", &save)) {
+			/* the packet coder's decoder needs the encoder's model, so it can't be timed on its own */
+			if ((m = coder_from_name(name)) < 0 || m == CODER_PACKET) {
+				fprintf(stderr, "Error: can't benchmark coder %s\n", name);
+				return -1;
+			}
+
+			if (coder_needs_models(m) && ! use_models) {
+				fprintf(stderr, "Error: the %s coder needs a model file (-M)\n", name);
+				return -1;
+			}
+
+			coders[ncoders++] = m;
+		}
+
+	} else if (use_models) {
+		for (m = CODER_STATIC; m < CODER_MAX; m++) {
+			coders[ncoders++] = m;
+		}
+
+	} else {
+		coders[ncoders++] = CODER_ADAPTIVE;
+	}
+
+	if (backend_list) {
+		for (name = strtok_r(backend_list, ",", &save); name && nbackends < BACKEND_MAX; name = strtok_r(NULL, ",", &save)) {
+			if ((m = backend_from_name(name)) < 0) {
+				fprintf(stderr, "Error: unknown backend %s\n", name);
+				return -1;
+			}
+
+			backends[nbackends++] = m;
+		}
+
+	} else {
+		backends[nbackends++] = BACKEND_ARITH;
+	}
+
+	/* everything is compared against the order-0 model on the first backend */
+	for (i = 0; i < ncoders; i++) {
+		for (m = 0; m < nbackends; m++) {
+			if (coders[i] == CODER_STATIC && m == 0) {
+				base = nconfigs;
+			}
+
+			configs[nconfigs].coder = coders[i];
+			configs[nconfigs++].backend = backends[m];
+		}
+	}
+
+	if ((pkts = load_packets(argv[optind], &npkts)) == NULL || npkts == 0) {
+		fprintf(stderr, "Error: no usable packets in %s\n", argv[optind]);
+		return -1;
+	}
+
+	aes_key_expand(&bench_key, bench_psk, sizeof(bench_psk));
+	if (make_groups(npkts) != 0 || (w = calloc(nthreads, sizeof(*w))) == NULL) {
+		fprintf(stderr, "Error: Out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		w[i].id = i;
+		w[i].c = malloc(sizeof(*w[i].c));
+		w[i].res = calloc(ngroups * nconfigs, sizeof(*w[i].res));
+		w[i].stages = calloc(ngroups, sizeof(*w[i].stages));
+		if (w[i].c == NULL || w[i].res == NULL || w[i].stages == NULL || share_groups(&w[i]) != 0) {
+			fprintf(stderr, "Error: Out of memory\n");
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&w[i].thread, NULL, bench_thread, &w[i]) != 0) {
+			fprintf(stderr, "Error: could not start benchmark thread %d\n", i);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		void *rv;
+
+		pthread_join(w[i].thread, &rv);
+		ret |= (rv != NULL) ? -1 : 0;
+	}
+
+	if (ret != 0) {
+		return -1;
+	}
+
+	/* add up the threads, and the portnums for the totals */
+	res = w[0].res;
+	stages = w[0].stages;
+	for (i = 1; i < nthreads; i++) {
+		for (k = 0; k < ngroups * nconfigs; k++) {
+			res[k].packets += w[i].res[k].packets;
+			res[k].bytes += w[i].res[k].bytes;
+			res[k].cbytes += w[i].res[k].cbytes;
+			timing_add(&res[k].enc, &w[i].res[k].enc);
+			timing_add(&res[k].dec, &w[i].res[k].dec);
+			res[k].failures += w[i].res[k].failures;
+		}
+
+		for (k = 0; k < ngroups; k++) {
+			stages[k].packets += w[i].stages[k].packets;
+			stages[k].bytes += w[i].stages[k].bytes;
+			for (m = 0; m < STAGE_MAX; m++) {
+				timing_add(&stages[k].t[m], &w[i].stages[k].t[m]);
+			}
+
+			stages[k].failures += w[i].stages[k].failures;
+		}
+	}
+
+	memset(all, 0, sizeof(all));
+	memset(&stages_all, 0, sizeof(stages_all));
+	for (k = 0; k < ngroups && groups[k].portnum; k++) {
+		for (i = 0; i < nconfigs; i++) {
+			const struct result *r = &res[k * nconfigs + i];
+
+			all[i].packets += r->packets;
+			all[i].bytes += r->bytes;
+			all[i].cbytes += r->cbytes;
+			timing_add(&all[i].enc, &r->enc);
+			timing_add(&all[i].dec, &r->dec);
+			all[i].failures += r->failures;
+		}
+
+		stages_all.packets += stages[k].packets;
+		stages_all.bytes += stages[k].bytes;
+		for (m = 0; m < STAGE_MAX; m++) {
+			timing_add(&stages_all.t[m], &stages[k].t[m]);
+		}
+
+		stages_all.failures += stages[k].failures;
+	}
+
+	printf("%zu packets, %d repetition%s, %d warm-up pass%s, %d thread%s (rates are per core), AES with %s (%d lanes batched)\n\n", npkts, reps, (reps > 1) ? "s" : "",
+	       warmup, (warmup != 1) ? "es" : "", nthreads, (nthreads > 1) ? "s" : "", aes_impl(), bench_key.lanes);
+	printf("%20s  %9s  %7s  %8s  %10s  %9s  %9s  %8s  %8s  %8s  %8s  %7s  %7s\n", "group", "coder", "backend", "packets", "bytes", "bits/byte", "vs static",
+	       "enc ns/p", "dec ns/p", "enc MB/s", "dec MB/s", "enc c/B", "dec c/B");
+
+	for (k = 0; k < ngroups; k++) {
+		if (batch && ! groups[k].portnum) {
+			continue;
+		}
+
+		if (k > 0 && groups[k].portnum != groups[k - 1].portnum) {
+			printf("\n");
+		}
+
+		for (i = 0; i < nconfigs; i++) {
+			print_result(groups[k].name, &configs[i], &res[k * nconfigs + i], (base >= 0) ? &res[k * nconfigs + base] : NULL);
+		}
+	}
+
+	printf("\n");
+	for (i = 0; i < nconfigs; i++) {
+		print_result("(all)", &configs[i], &all[i], (base >= 0) ? &all[base] : NULL);
+	}
+
+	printf("\n%20s  %16s  %8s  %10s  %8s  %8s  %7s\n", "group", "stage", "packets", "bytes", "ns/p", "MB/s", "c/B");
+	for (k = 0; k < ngroups; k++) {
+		print_stages(groups[k].name, &stages[k]);
+	}
+
+	print_stages("(all)", &stages_all);
+
+	if (json_file && write_json(json_file, npkts, res, all, stages, &stages_all) != 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < nconfigs; i++) {
+		if (all[i].failures) {
+			ret = -1;
+		}
+	}
+
+	if (stages_all.failures) {
+		ret = -1;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < ngroups; k++) {
+			free(w[i].groups[k].idx);
+		}
+
+		free(w[i].groups);
+		free(w[i].c);
+		free(w[i].res);
+		free(w[i].stages);
+	}
+
+	for (k = 0; k < ngroups; k++) {
+		free(groups[k].idx);
+	}
+
+	free(groups);
+	free(w);
+	free(pkts);
+	if (use_models) {
+		model_set_free(&models);
+	}
+
+	return ret;
+}
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v);
+	put_le32(p + 4, v >> 32);
+}
+
+int capture_create(struct capture_writer *w, const char *path)
+{
+	uint8_t h[CAPTURE_HEADER_LEN] = { 0 };
+
+	memset(w, 0, sizeof(*w));
+	if ((w->f = fopen(path, "wb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	setvbuf(w->f, NULL, _IOFBF, 1 << 16);
+	memcpy(h, CAPTURE_MAGIC, 8);
+	put_le32(h + 8, CAPTURE_VERSION);
+	if (fwrite(h, sizeof(h), 1, w->f) != 1) {
+		perror(path);
+		fclose(w->f);
+		return -1;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	w->off = sizeof(h);
+	w->flushed = time(NULL);
+	return 0;
+}
+
+/* finds <portnum>'s index, adding it if it's new */
+static struct capture_port *find_port(struct capture_writer *w, uint16_t portnum)
+{
+	struct capture_port *p;
+	size_t i;
+
+	for (i = 0; i < w->nports && w->ports[i].portnum < portnum; i++) {
+	}
+
+	if (i < w->nports && w->ports[i].portnum == portnum) {
+		return &w->ports[i];
+	}
+
+	if ((p = realloc(w->ports, (w->nports + 1) * sizeof(*p))) == NULL) {
+		return NULL;
+	}
+
+	w->ports = p;
+	memmove(&p[i + 1], &p[i], (w->nports - i) * sizeof(*p));
+	memset(&p[i], 0, sizeof(*p));
+	p[i].portnum = portnum;
+	++w->nports;
+	return &p[i];
+}
+
+/* makes room to index one more record with <portnum>, so indexing it after it is written can't fail */
+static struct capture_port *index_reserve(struct capture_writer *w, uint16_t portnum)
+{
+	struct capture_port *p;
+
+	if ((p = find_port(w, portnum)) == NULL) {
+		return NULL;
+	}
+
+	if (p->n == p->cap) {
+		uint64_t *o = realloc(p->offset, ((p->cap) ? p->cap * 2 : 1024) * sizeof(*o));
+
+		if (o == NULL) {
+			return NULL;
+		}
+
+		p->offset = o;
+		p->cap = (p->cap) ? p->cap * 2 : 1024;
+	}
+
+	if (w->ntimes == w->maxtimes) {
+		struct capture_time *t = realloc(w->times, ((w->maxtimes) ? w->maxtimes * 2 : 256) * sizeof(*t));
+
+		if (t == NULL) {
+			return NULL;
+		}
+
+		w->times = t;
+		w->maxtimes = (w->maxtimes) ? w->maxtimes * 2 : 256;
+	}
+
+	return p;
+}
+
+int capture_write(struct capture_writer *w, const struct capture_record *r)
+{
+	uint8_t h[2 + CAPTURE_RECORD_MIN];
+	const size_t len = CAPTURE_RECORD_MIN + r->gateway_len + r->len;
+	struct capture_port *p;
+	time_t now;
+	int ret = 0;
+
+	if (len > UINT16_MAX || r->gateway_len > UINT8_MAX) {
+		fprintf(stderr, "%s: record too long\n", __func__);
+		return -1;
+	}
+
+	put_le16(h, len);
+	put_le32(h + 2, r->rx_time);
+	put_le16(h + 6, r->portnum);
+	h[8] = r->gateway_len;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->failed) {
+		ret = -1;
+
+	} else if ((p = index_reserve(w, r->portnum)) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		ret = -1;
+
+	} else if (fwrite(h, sizeof(h), 1, w->f) != 1 ||
+	    (r->gateway_len && fwrite(r->gateway, r->gateway_len, 1, w->f) != 1) ||
+	    fwrite(r->packet, r->len, 1, w->f) != 1) {
+		/* part of the record may be in the file, so everything after it would be misaligned */
+		perror(__func__);
+		w->failed = true;
+		ret = -1;
+
+	} else {
+		if (r->rx_time > w->latest) {
+			w->latest = r->rx_time;
+		}
+
+		p->offset[p->n++] = w->off;
+		if (w->records % CAPTURE_TIME_STRIDE == 0) {
+			w->times[w->ntimes].time = w->latest;
+			w->times[w->ntimes].offset = w->off;
+			++w->ntimes;
+		}
+
+		w->off += 2 + len;
+		++w->records;
+
+		/* so a writer that is killed only loses the last few seconds */
+		if ((now = time(NULL)) - w->flushed >= CAPTURE_FLUSH_SECONDS) {
+			w->flushed = now;
+			if (fflush(w->f) != 0) {
+				perror(__func__);
+				w->failed = true;
+				ret = -1;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/* the index and trailer described in capture.h */
+static int write_index(struct capture_writer *w)
+{
+	uint64_t lists = w->off + 4 + 16 * w->nports;
+	uint8_t b[16];
+
+	put_le32(b, w->nports);
+	if (fwrite(b, 4, 1, w->f) != 1) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < w->nports; i++) {
+		put_le32(b, w->ports[i].portnum);
+		put_le32(b + 4, w->ports[i].n);
+		put_le64(b + 8, lists);
+		if (fwrite(b, 16, 1, w->f) != 1) {
+			return -1;
+		}
+
+		lists += 8 * w->ports[i].n;
+	}
+
+	for (size_t i = 0; i < w->nports; i++) {
+		for (size_t j = 0; j < w->ports[i].n; j++) {
+			put_le64(b, w->ports[i].offset[j]);
+			if (fwrite(b, 8, 1, w->f) != 1) {
+				return -1;
+			}
+		}
+	}
+
+	put_le32(b, w->ntimes);
+	if (fwrite(b, 4, 1, w->f) != 1) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < w->ntimes; i++) {
+		put_le32(b, w->times[i].time);
+		put_le32(b + 4, 0);
+		put_le64(b + 8, w->times[i].offset);
+		if (fwrite(b, 16, 1, w->f) != 1) {
+			return -1;
+		}
+	}
+
+	put_le64(b, w->off);
+	put_le64(b + 8, w->records);
+	if (fwrite(b, 16, 1, w->f) != 1 || fwrite(CAPTURE_INDEX_MAGIC, 8, 1, w->f) != 1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int capture_close(struct capture_writer *w)
+{
+	int ret = 0;
+
+	if (w->f == NULL) {
+		return 0;
+	}
+
+	/* after a failed write the records may end part way through one, which only a reader without an index copes with */
+	pthread_mutex_lock(&w->lock);
+	if (w->failed || write_index(w) != 0) {
+		ret = -1;
+	}
+
+	if (fclose(w->f) != 0) {
+		ret = -1;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "%s: the capture could not be finished, so it may have no index\n", __func__);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	pthread_mutex_destroy(&w->lock);
+
+	for (size_t i = 0; i < w->nports; i++) {
+		free(w->ports[i].offset);
+	}
+
+	free(w->ports);
+	free(w->times);
+	memset(w, 0, sizeof(*w));
+	return ret;
+}
+
+int capture_record_parse(struct capture_record *r, const uint8_t *p, const uint8_t *end)
+{
+	size_t len;
+
+	if (end - p < 2 + CAPTURE_RECORD_MIN) {
+		return -1;
+	}
+
+	len = p[0] | (p[1] << 8);
+	if (len < CAPTURE_RECORD_MIN || len > (size_t)(end - p) - 2 || CAPTURE_RECORD_MIN + p[8] > len) {
+		return -1;
+	}
+
+	r->rx_time = capture_le32(p + 2);
+	r->portnum = p[6] | (p[7] << 8);
+	r->gateway_len = p[8];
+	r->gateway = (const char *)p + 9;
+	r->packet = p + 9 + r->gateway_len;
+	r->len = len - CAPTURE_RECORD_MIN - r->gateway_len;
+	return 2 + len;
+}
@@ -0,0 +1,284 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channels.h"
+
+/* the key a one byte PSK stands for, with its last byte bumped by the PSK index - 1 */
+static const uint8_t default_psk[16] = {
+	0xd4, 0xf1, 0xbb, 0x3a, 0x20, 0x29, 0x07, 0x59, 0xf0, 0xbc, 0xff, 0xab, 0xcf, 0x4e, 0x69, 0x01
+};
+
+/* the wire type each meshtastic_data_t field number must have, or -1 for none we know of */
+static const int8_t data_wire_type[] = {
+	-1,
+	0,	/* portnum */
+	2,	/* payload */
+	0,	/* want_response */
+	5,	/* dest */
+	5,	/* source */
+	5,	/* request_id */
+	5,	/* reply_id */
+	5,	/* emoji */
+	0,	/* bitfield */
+};
+
+
+void channel_table_init(struct channel_table *t)
+{
+	memset(t, 0, sizeof(*t));
+}
+
+void channel_table_free(struct channel_table *t)
+{
+	free(t->chan);
+	free(t->order);
+	memset(t, 0, sizeof(*t));
+}
+
+/* base64 (standard or URL-safe, padding optional) to bytes; returns the length or -1 */
+static int base64_decode(uint8_t *out, size_t nout, const char *in)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint32_t acc = 0;
+	int bits = 0;
+	size_t n = 0;
+
+	for (; *in && *in != '='; in++) {
+		const char c = (*in == '-') ? '+' : (*in == '_') ? '/' : *in;
+		const char *p = strchr(alphabet, c);
+
+		if (p == NULL) {
+			return -1;
+		}
+
+		acc = (acc << 6) | (p - alphabet);
+		if ((bits += 6) >= 8) {
+			if (n == nout) {
+				return -1;
+			}
+
+			bits -= 8;
+			out[n++] = acc >> bits;
+		}
+	}
+
+	return n;
+}
+
+/* sorts the channels by hash for channel_decrypt() */
+static int channel_index(struct channel_table *t)
+{
+	uint16_t *order = realloc(t->order, t->n * sizeof(*order));
+	uint16_t next[256];
+
+	if (order == NULL) {
+		return -1;
+	}
+
+	t->order = order;
+	memset(t->start, 0, sizeof(t->start));
+	for (size_t i = 0; i < t->n; i++) {
+		t->start[t->chan[i].hash + 1]++;
+	}
+
+	for (int h = 0; h < 256; h++) {
+		t->start[h + 1] += t->start[h];
+	}
+
+	memcpy(next, t->start, sizeof(next));
+	for (size_t i = 0; i < t->n; i++) {
+		t->order[next[t->chan[i].hash]++] = i;
+	}
+
+	return 0;
+}
+
+int channel_add(struct channel_table *t, const char *name, const char *psk)
+{
+	struct channel *ch, c = { 0 };
+	uint8_t raw[32];
+	int len;
+
+	if (strlen(name) > CHANNEL_NAME_MAX) {
+		fprintf(stderr, "channel name %s is longer than %d characters\n", name, CHANNEL_NAME_MAX);
+		return -1;
+	}
+
+	if ((len = base64_decode(raw, sizeof(raw), psk)) < 0) {
+		fprintf(stderr, "%s: bad PSK %s (want base64, at most 32 bytes)\n", name, psk);
+		return -1;
+	}
+
+	if (len == 0 || (len == 1 && raw[0] == 0)) {
+		fprintf(stderr, "%s: channel is unencrypted, it needs no key\n", name);
+		return -1;
+	}
+
+	/* expand the PSK the way the firmware does */
+	if (len == 1) {
+		memcpy(c.psk, default_psk, sizeof(default_psk));
+		c.psk[15] += raw[0] - 1;
+		c.psk_len = 16;
+	} else {
+		memcpy(c.psk, raw, len);
+		c.psk_len = (len <= 16) ? 16 : 32;
+	}
+
+	strcpy(c.name, name);
+	for (size_t i = 0; c.name[i]; i++) {
+		c.hash ^= c.name[i];
+	}
+
+	for (size_t i = 0; i < c.psk_len; i++) {
+		c.hash ^= c.psk[i];
+	}
+
+	aes_key_expand(&c.key, c.psk, c.psk_len);
+
+	if (t->n == UINT16_MAX || (ch = realloc(t->chan, (t->n + 1) * sizeof(*ch))) == NULL) {
+		fprintf(stderr, "%s: too many channels\n", __func__);
+		return -1;
+	}
+
+	t->chan = ch;
+	t->chan[t->n++] = c;
+	return channel_index(t);
+}
+
+int channel_table_load(struct channel_table *t, const char *path)
+{
+	char line[256], name[64], psk[128];
+	size_t lineno = 0;
+	FILE *f;
+	int ret = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (ret == 0 && fgets(line, sizeof(line), f)) {
+		char *p = line;
+
+		++lineno;
+		while (isspace((unsigned char)*p)) {
+			++p;
+		}
+
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+
+		if (sscanf(p, "%63s %127s", name, psk) != 2) {
+			fprintf(stderr, "%s:%zu: want a channel name and a PSK\n", path, lineno);
+			ret = -1;
+		} else {
+			ret = channel_add(t, name, psk);
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+static bool varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		const uint8_t b = *(*p)++;
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool mesh_data_plausible(const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	bool portnum = false;
+	uint64_t tag, v;
+
+	while (p < end) {
+		if (! varint(&p, end, &tag)) {
+			return false;
+		}
+
+		const uint64_t field = tag >> 3;
+		const int type = tag & 7;
+
+		/* later firmware may add fields, but not with wire types we don't know */
+		if (field == 0 || (field < sizeof(data_wire_type) && type != data_wire_type[field])) {
+			return false;
+		}
+
+		switch (type) {
+		case 0:
+			if (! varint(&p, end, &v)) {
+				return false;
+			}
+
+			break;
+
+		case 1:
+		case 5:
+			if ((size_t)(end - p) < ((type == 1) ? 8U : 4U)) {
+				return false;
+			}
+
+			p += (type == 1) ? 8 : 4;
+			break;
+
+		case 2:
+			if (! varint(&p, end, &v) || v > (uint64_t)(end - p)) {
+				return false;
+			}
+
+			p += v;
+			break;
+
+		default:
+			return false;
+		}
+
+		portnum |= (field == 1);
+	}
+
+	return portnum;
+}
+
+/* codes <buf> in place with <key>; a second call undoes the first */
+static void channel_crypt(const aes_key_t *key, uint32_t from, uint32_t id, uint8_t *buf, size_t len)
+{
+	aes_ctx_t ctx;
+	uint8_t nonce[16];
+
+	aes_init(&ctx);
+	aes_set_ctrlen(&ctx, 4);
+	aes_use_key(&ctx, key);
+	mesh_nonce(nonce, from, id);
+	aes_set_iv(&ctx, nonce, sizeof(nonce));
+	aes_crypt(&ctx, buf, buf, len);
+}
+
+const struct channel *channel_decrypt(const struct channel_table *t, uint8_t hash, uint32_t from, uint32_t id, uint8_t *buf, size_t len)
+{
+	for (size_t i = t->start[hash]; i < t->start[hash + 1]; i++) {
+		const struct channel *ch = &t->chan[t->order[i]];
+
+		channel_crypt(&ch->key, from, id, buf, len);
+		if (mesh_data_plausible(buf, len)) {
+			return ch;
+		}
+
+		channel_crypt(&ch->key, from, id, buf, len);
+	}
+
+	return NULL;
+}
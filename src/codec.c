@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "ticks.h"
+#include "wire.h"
+
+const char *coder_names[CODER_MAX] = { "packet", "static", "adaptive", "order1", "order2", "wire" };
+const char *backend_names[BACKEND_MAX] = { "arith", "rans", "tans" };
+
+static int name_index(const char *name, const char **names, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+int coder_from_name(const char *name)
+{
+	return name_index(name, coder_names, CODER_MAX);
+}
+
+int backend_from_name(const char *name)
+{
+	return name_index(name, backend_names, BACKEND_MAX);
+}
+
+bool coder_needs_models(enum coder_mode mode)
+{
+	return mode != CODER_PACKET && mode != CODER_ADAPTIVE;
+}
+
+int codec_init(struct codec *c, enum coder_mode mode, enum coder_backend backend, const struct model_set *models)
+{
+	memset(c, 0, sizeof(*c));
+	c->mode = mode;
+	c->backend = backend;
+	c->models = models;
+	ac_adaptive_init(&c->flat, NULL, AC_ADAPT_WEIGHT, AC_ADAPT_INC);
+	ac_set_backend(&c->state, (backend == BACKEND_ARITH) ? AC_BACKEND_ARITH : AC_BACKEND_RANS);
+
+	/* tANS only covers the static coder; the others fall back to rANS, which needs a queue to encode */
+	if (backend != BACKEND_ARITH) {
+		if ((c->rans = malloc(sizeof(*c->rans))) == NULL) {
+			printf("%s: out of memory\n", __func__);
+			return -1;
+		}
+
+		ac_use_rans_queue(&c->state, c->rans);
+	}
+
+	return 0;
+}
+
+void codec_free(struct codec *c)
+{
+	ac_use_rans_queue(&c->state, NULL);
+	free(c->rans);
+	c->rans = NULL;
+}
+
+/* the mode actually used for <portnum>, and its model (if any) */
+static enum coder_mode codec_resolve(const struct codec *c, unsigned portnum, const struct port_model **pm, const ac_context_t **cm)
+{
+	*pm = (c->models) ? model_set_get(c->models, portnum) : NULL;
+	*cm = NULL;
+
+	switch (c->mode) {
+	case CODER_ORDER1:
+	case CODER_ORDER2:
+	case CODER_WIRE:
+		if ((*cm = port_model_context(*pm, (c->mode == CODER_WIRE) ? 0 : c->mode - CODER_ORDER1 + 1)) != NULL) {
+			return c->mode;
+		}
+		/* fall through */
+	case CODER_STATIC:
+		return (*pm) ? CODER_STATIC : CODER_PACKET;
+
+	default:
+		return c->mode;
+	}
+}
+
+int codec_encode(struct codec *c, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin)
+{
+	const struct port_model *pm;
+	const ac_context_t *cm;
+	uint64_t t0;
+
+	c->model_ticks = 0;
+	switch (codec_resolve(c, portnum, &pm, &cm)) {
+	case CODER_STATIC:
+		/* shared model: nothing to build, and the receiver already has it */
+		c->nsym = pm->model.nsym;
+		if (c->backend == BACKEND_TANS) {
+			return ac_encode_tans_u8(&c->state, out, nout, in, nin, &pm->tans);
+		}
+
+		return ac_encode_model_u8(&c->state, out, nout, in, nin, &pm->model);
+
+	case CODER_ADAPTIVE:
+		/* both ends start from the same prior and adapt as they go */
+		c->nsym = AC_ADAPT_NSYM;
+		c->adaptive = (pm) ? pm->prior : c->flat;
+		return ac_encode_adaptive_u8(&c->state, out, nout, in, nin, &c->adaptive);
+
+	case CODER_ORDER1:
+	case CODER_ORDER2:
+		c->nsym = AC_CTX_NSYM;
+		return ac_encode_context_u8(&c->state, out, nout, in, nin, cm);
+
+	case CODER_WIRE:
+		c->nsym = AC_CTX_NSYM;
+		return wire_encode(&c->state, cm, portnum, out, nout, in, nin);
+
+	case CODER_PACKET:
+	default:
+		t0 = (c->timed) ? ticks() : 0;
+		if (ac_model_build(&c->packet, in, nin) != 0) {
+			printf("  ** building model failed\n");
+			return -1;
+		}
+
+		if (c->timed) {
+			c->model_ticks = ticks() - t0;
+		}
+
+		c->nsym = c->packet.nsym;
+		return ac_encode_model_u8(&c->state, out, nout, in, nin, &c->packet);
+	}
+}
+
+int codec_decode(struct codec *c, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin)
+{
+	const struct port_model *pm;
+	const ac_context_t *cm;
+
+	switch (codec_resolve(c, portnum, &pm, &cm)) {
+	case CODER_STATIC:
+		if (c->backend == BACKEND_TANS) {
+			return ac_decode_tans_u8(&c->state, out, nout, in, nin, &pm->tans);
+		}
+
+		return ac_decode_model_u8(&c->state, out, nout, in, nin, &pm->model, &pm->lut);
+
+	case CODER_ADAPTIVE:
+		c->adaptive = (pm) ? pm->prior : c->flat;
+		return ac_decode_adaptive_u8(&c->state, out, nout, in, nin, &c->adaptive);
+
+	case CODER_ORDER1:
+	case CODER_ORDER2:
+		return ac_decode_context_u8(&c->state, out, nout, in, nin, cm);
+
+	case CODER_WIRE:
+		return wire_decode(&c->state, cm, portnum, out, nout, in, nin);
+
+	case CODER_PACKET:
+	default:
+		return ac_decode_model_u8(&c->state, out, nout, in, nin, &c->packet, NULL);
+	}
+}
+
+int codec_encode_batch(struct codec *c, unsigned portnum, const ac_packet_t *pkts, size_t npkts, void *arena, size_t narena, size_t *offsets)
+{
+	const struct port_model *pm;
+	const ac_context_t *cm;
+	void *out;
+	size_t i, nout;
+
+	switch (codec_resolve(c, portnum, &pm, &cm)) {
+	case CODER_PACKET:
+		printf("  ** the packet coder can't code batches\n");
+		return -1;
+
+	case CODER_STATIC:
+		if (c->backend != BACKEND_TANS) {
+			c->nsym = pm->model.nsym;
+			return ac_encode_batch_u8(&c->state, pkts, npkts, arena, narena, offsets, &pm->model);
+		}
+		/* fall through */
+	default:
+		offsets[0] = 0;
+		for (i = 0; i < npkts; i++) {
+			if (offsets[i] >= narena) {
+				return -1;
+			}
+
+			out = (uint8_t *)arena + offsets[i];
+			nout = narena - offsets[i];
+			if (codec_encode(c, portnum, &out, &nout, pkts[i].data, pkts[i].len) != 0) {
+				return -1;
+			}
+
+			offsets[i + 1] = offsets[i] + nout;
+		}
+
+		return 0;
+	}
+}
+
+int codec_decode_batch(struct codec *c, unsigned portnum, const void *in, const size_t *in_offsets, size_t npkts, void *arena, size_t narena, size_t *offsets)
+{
+	const struct port_model *pm;
+	const ac_context_t *cm;
+	void *out;
+	size_t i, nout;
+
+	switch (codec_resolve(c, portnum, &pm, &cm)) {
+	case CODER_PACKET:
+		printf("  ** the packet coder can't code batches\n");
+		return -1;
+
+	case CODER_STATIC:
+		if (c->backend != BACKEND_TANS) {
+			return ac_decode_batch_u8(&c->state, in, in_offsets, npkts, arena, narena, offsets, &pm->model, &pm->lut);
+		}
+		/* fall through */
+	default:
+		offsets[0] = 0;
+		for (i = 0; i < npkts; i++) {
+			out = (uint8_t *)arena + offsets[i];
+			nout = narena - offsets[i];
+			if (codec_decode(c, portnum, &out, &nout, (const uint8_t *)in + in_offsets[i], in_offsets[i + 1] - in_offsets[i]) != 0) {
+				return -1;
+			}
+
+			offsets[i + 1] = offsets[i] + nout;
+		}
+
+		return 0;
+	}
+}
@@ -0,0 +1,135 @@
+/*
+ * Capture converter
+ *
+ * Writes the packets from one or more corpora (see corpus.h) to a binary capture
+ * (see capture.h).  Hex dumps have no receive times or gateways, so their records
+ * get 0 and none; their portnums are decoded from the packets.  A capture given as
+ * input is copied record for record, which is also how a capture left without an
+ * index by a writer that never closed it gets one.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <pb_decode.h>
+#include "meshtastic/mesh.pb.h"
+
+#include "capture.h"
+#include "corpus.h"
+
+static struct capture_writer out;
+
+/* the portnum of a hex dump packet, or CAPTURE_PORTNUM_UNKNOWN if it doesn't decode */
+static uint16_t packet_portnum(const uint8_t *pkt, size_t len)
+{
+	meshtastic_data_t md = MESHTASTIC_DATA_INIT_DEFAULT;
+	pb_istream_t s;
+
+	if (len <= MESH_HEADER_LEN) {
+		return CAPTURE_PORTNUM_UNKNOWN;
+	}
+
+	s = pb_istream_from_buffer(pkt + MESH_HEADER_LEN, len - MESH_HEADER_LEN);
+	if (! pb_decode(&s, MESHTASTIC_DATA_FIELDS, &md) || md.portnum >= CAPTURE_PORTNUM_UNKNOWN) {
+		return CAPTURE_PORTNUM_UNKNOWN;
+	}
+
+	return md.portnum;
+}
+
+static int convert_file(const char *path)
+{
+	struct corpus c;
+	struct corpus_cursor cur;
+	struct capture_record r;
+	uint8_t pkt[MESH_HEADER_LEN + 256];
+	uint32_t records = 0, bad = 0, unknown = 0;
+	int n;
+
+	if (corpus_open(&c, path) != 0) {
+		return -1;
+	}
+
+	corpus_shard(&c, &cur, 0, 1);
+	while ((n = corpus_next_record(&cur, &r, pkt, sizeof(pkt))) != 0) {
+		if (n < 0 || r.len == 0) {
+			++bad;
+			continue;
+		}
+
+		if (r.portnum == CAPTURE_PORTNUM_UNKNOWN && (r.portnum = packet_portnum(r.packet, r.len)) == CAPTURE_PORTNUM_UNKNOWN) {
+			++unknown;
+		}
+
+		if (capture_write(&out, &r) != 0) {
+			corpus_close(&c);
+			return -1;
+		}
+
+		++records;
+	}
+
+	printf("%s: %s, %u records, %u bad, %u undecodable\n", path, (c.capture) ? "capture" : "hex dump", records, bad, unknown);
+	corpus_close(&c);
+	return 0;
+}
+
+/* converting a capture onto itself would truncate it before it was read */
+static bool same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-o capture_file] corpus_file [corpus_file...]\n", argv0);
+	fprintf(stderr, "  -o  where to write the capture (default: packets.cap)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = "packets.cap";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o': path = optarg; break;
+		default:
+			usage(argv[0]);
+			return -1;
+		};
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (same_file(argv[i], path)) {
+			fprintf(stderr, "%s is both an input and the output\n", path);
+			return -1;
+		}
+	}
+
+	if (capture_create(&out, path) != 0) {
+		return -1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (convert_file(argv[i]) != 0) {
+			capture_close(&out);
+			unlink(path);
+			return -1;
+		}
+	}
+
+	printf("wrote %llu records, %zu portnums, to %s\n", (unsigned long long)out.records, out.nports, path);
+	return (capture_close(&out) == 0) ? 0 : -1;
+}
@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "corpus.h"
+
+#define XX	(0xff)
+
+/* hex digit -> nibble; anything that isn't a hex digit maps to XX */
+static const uint8_t hexval[256] = {
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+	[128 ... 255] = XX
+};
+
+
+/* finds the index from the trailer and checks it all lies within the file; returns -1 if there isn't a good one */
+static int read_index(struct corpus *c)
+{
+	const uint8_t *d = (const uint8_t *)c->data, *t;
+	uint64_t idx, off, end;
+
+	if (c->len < CAPTURE_HEADER_LEN + CAPTURE_TRAILER_LEN) {
+		return -1;
+	}
+
+	end = c->len - CAPTURE_TRAILER_LEN;
+	t = d + end;
+	idx = capture_le64(t);
+	if (memcmp(t + 16, CAPTURE_INDEX_MAGIC, 8) != 0 || idx < CAPTURE_HEADER_LEN || idx > end - 4) {
+		return -1;
+	}
+
+	c->nports = capture_le32(d + idx);
+	off = idx + 4;
+	if (c->nports > (end - off) / 16) {
+		return -1;
+	}
+
+	c->ports = d + off;
+	off += 16 * (uint64_t)c->nports;
+	for (uint32_t i = 0; i < c->nports; i++) {
+		const uint64_t n = capture_le32(c->ports + 16 * i + 4), list = capture_le64(c->ports + 16 * i + 8);
+
+		if (list < off || list > end || n > (end - list) / 8) {
+			return -1;
+		}
+	}
+
+	/* the time marks follow the last record list */
+	for (uint32_t i = 0; i < c->nports; i++) {
+		off += 8 * (uint64_t)capture_le32(c->ports + 16 * i + 4);
+	}
+
+	if (off > end - 4) {
+		return -1;
+	}
+
+	c->ntimes = capture_le32(d + off);
+	off += 4;
+	if (c->ntimes > (end - off) / 16) {
+		return -1;
+	}
+
+	/* shards and time ranges start at the marks, so each must be a record, in order, before the index */
+	c->times = d + off;
+	for (uint32_t i = 0; i < c->ntimes; i++) {
+		const uint64_t mark = capture_le64(c->times + 16 * i + 8);
+		struct capture_record r;
+
+		if (mark < CAPTURE_HEADER_LEN || mark >= idx || capture_record_parse(&r, d + mark, d + idx) < 0 ||
+		    (i > 0 && (mark <= capture_le64(c->times + 16 * (i - 1) + 8) || capture_le32(c->times + 16 * i) < capture_le32(c->times + 16 * (i - 1))))) {
+			return -1;
+		}
+	}
+
+	c->last = idx;
+	c->records = capture_le64(t + 8);
+	return 0;
+}
+
+static int open_capture(struct corpus *c, const char *path)
+{
+	const uint8_t *d = (const uint8_t *)c->data;
+	struct capture_record r;
+	size_t off;
+	int n;
+
+	if (capture_le32(d + 8) != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: capture version %u, expected %d\n", path, capture_le32(d + 8), CAPTURE_VERSION);
+		return -1;
+	}
+
+	c->capture = true;
+	c->first = CAPTURE_HEADER_LEN;
+	if (read_index(c) == 0) {
+		return 0;
+	}
+
+	/* no index (the writer never closed it) or a damaged one: the records run until the first one that doesn't parse */
+	c->ports = c->times = NULL;
+	c->nports = c->ntimes = 0;
+	c->records = 0;
+	for (off = c->first; (n = capture_record_parse(&r, d + off, d + c->len)) > 0; off += n) {
+		++c->records;
+	}
+
+	c->last = off;
+	fprintf(stderr, "%s: capture has no usable index, reading its %llu records in order\n", path, (unsigned long long)c->records);
+	return 0;
+}
+
+/* returns 0 if the corpus was mapped, -1 otherwise */
+int corpus_open(struct corpus *c, const char *path)
+{
+	struct stat st;
+
+	memset(c, 0, sizeof(*c));
+	if ((c->fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(c->fd, &st) == 0 && st.st_size > 0) {
+		c->len = st.st_size;
+		if ((c->data = mmap(NULL, c->len, PROT_READ, MAP_PRIVATE, c->fd, 0)) != MAP_FAILED) {
+			if (c->len < CAPTURE_HEADER_LEN || memcmp(c->data, CAPTURE_MAGIC, 8) != 0) {
+				madvise((void *)c->data, c->len, MADV_SEQUENTIAL);
+				return 0;
+			}
+
+			/* captures are read in whatever order their index says, so leave readahead alone */
+			if (open_capture(c, path) == 0) {
+				return 0;
+			}
+
+			munmap((void *)c->data, c->len);
+
+		} else {
+			perror("mmap");
+		}
+
+	} else {
+		fprintf(stderr, "%s: empty or unreadable corpus\n", path);
+	}
+
+	c->data = NULL;
+	close(c->fd);
+	c->fd = -1;
+	return -1;
+}
+
+void corpus_close(struct corpus *c)
+{
+	if (c->data) {
+		munmap((void *)c->data, c->len);
+	}
+
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+/* returns the first line start at or after <off> */
+static const char *line_start(const struct corpus *c, size_t off)
+{
+	const char *p, *end = c->data + c->len;
+
+	if (off == 0) {
+		return c->data;
+	}
+
+	if (off >= c->len) {
+		return end;
+	}
+
+	/* if the previous character ends a line, we're already at a line start */
+	p = c->data + off - 1;
+	if ((p = memchr(p, '\n', end - p)) == NULL) {
+		return end;
+	}
+
+	return p + 1;
+}
+
+/* the offset of the first capture record at or after <off> */
+static size_t record_start(const struct corpus *c, size_t off)
+{
+	const uint8_t *d = (const uint8_t *)c->data;
+	size_t pos = c->first, lo = 0, hi = c->ntimes;
+	struct capture_record r;
+	int n;
+
+	if (off <= c->first || off >= c->last) {
+		return (off <= c->first) ? c->first : c->last;
+	}
+
+	/* walk from the last time mark at or before <off> */
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+
+		if (capture_le64(c->times + 16 * mid + 8) <= off) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo > 0 && capture_le64(c->times + 16 * (lo - 1) + 8) >= c->first) {
+		pos = capture_le64(c->times + 16 * (lo - 1) + 8);
+	}
+
+	while (pos < off && (n = capture_record_parse(&r, d + pos, d + c->last)) > 0) {
+		pos += n;
+	}
+
+	return (pos < off) ? c->last : pos;
+}
+
+static void cursor_init(const struct corpus *c, struct corpus_cursor *cur)
+{
+	memset(cur, 0, sizeof(*cur));
+	cur->capture = c->capture;
+	cur->base = c->data;
+}
+
+void corpus_shard(const struct corpus *c, struct corpus_cursor *cur, int shard, int nshards)
+{
+	cursor_init(c, cur);
+	if (c->capture) {
+		const size_t span = c->last - c->first;
+
+		cur->p = c->data + record_start(c, c->first + span / nshards * shard);
+		cur->end = c->data + ((shard == nshards - 1) ? c->last : record_start(c, c->first + span / nshards * (shard + 1)));
+		return;
+	}
+
+	cur->p = line_start(c, c->len / nshards * shard);
+	cur->end = (shard == nshards - 1) ? c->data + c->len : line_start(c, c->len / nshards * (shard + 1));
+}
+
+int corpus_port(const struct corpus *c, struct corpus_cursor *cur, unsigned portnum, int shard, int nshards)
+{
+	cursor_init(c, cur);
+	if (! c->capture || c->ports == NULL) {
+		return -1;
+	}
+
+	cur->p = cur->end = c->data + c->last;
+	for (uint32_t i = 0; i < c->nports; i++) {
+		const uint8_t *e = c->ports + 16 * i;
+
+		if (capture_le32(e) == portnum) {
+			const uint64_t n = capture_le32(e + 4);
+			const uint64_t lo = n * shard / nshards, hi = n * (shard + 1) / nshards;
+
+			cur->list = (const uint8_t *)c->data + capture_le64(e + 8) + 8 * lo;
+			cur->nlist = hi - lo;
+			return 0;
+		}
+	}
+
+	/* no records with that portnum: an empty list */
+	cur->list = (const uint8_t *)c->data + c->last;
+	return 0;
+}
+
+int corpus_time_range(const struct corpus *c, struct corpus_cursor *cur, uint32_t since, uint32_t until)
+{
+	size_t lo = 0, hi = c->ntimes, start = c->first;
+
+	if (! c->capture) {
+		return -1;
+	}
+
+	cur->since = since;
+	cur->until = until;
+
+	/* the marks hold the latest time so far, so nothing before the last mark still earlier than <since> is in range */
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+
+		if (capture_le32(c->times + 16 * mid) < since) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo > 0) {
+		start = capture_le64(c->times + 16 * (lo - 1) + 8);
+	}
+
+	if (cur->list) {
+		/* the list is in file order */
+		lo = 0;
+		hi = cur->nlist;
+		while (lo < hi) {
+			const size_t mid = (lo + hi) / 2;
+
+			if (capture_le64(cur->list + 8 * mid) < start) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		cur->list += 8 * lo;
+		cur->nlist -= lo;
+
+	} else if (cur->p < c->data + start) {
+		cur->p = (c->data + start < cur->end) ? c->data + start : cur->end;
+	}
+
+	return 0;
+}
+
+static int next_line(struct corpus_cursor *cur, uint8_t *buf, size_t nbuf)
+{
+	const uint8_t *p = (const uint8_t *)cur->p, *end = (const uint8_t *)cur->end;
+	size_t n = 0;
+	int bad = 0;
+
+	/* skip blank lines */
+	while (p < end && (*p == '\n' || *p == '\r')) {
+		++p;
+	}
+
+	if (p >= end) {
+		cur->p = cur->end;
+		return 0;
+	}
+
+	++cur->line;
+	while (p < end && *p != '\n') {
+		uint8_t hi, lo;
+
+		if (*p == ' ' || *p == '\t' || *p == '\r') {
+			++p;
+			continue;
+		}
+
+		if ((end - p) < 2 || (hi = hexval[p[0]]) == XX || (lo = hexval[p[1]]) == XX || n >= nbuf) {
+			bad = 1;
+			break;
+		}
+
+		buf[n++] = (hi << 4) | lo;
+		p += 2;
+	}
+
+	/* on error, resync to the next line */
+	if (bad && (p = memchr(p, '\n', end - p)) == NULL) {
+		p = end;
+	}
+
+	cur->p = (const char *)p;
+	return (bad) ? -1 : (int)n;
+}
+
+int corpus_next_record(struct corpus_cursor *cur, struct capture_record *r, uint8_t *buf, size_t nbuf)
+{
+	const char *p;
+	int n;
+
+	if (! cur->capture) {
+		if ((n = next_line(cur, buf, nbuf)) <= 0) {
+			return n;
+		}
+
+		r->rx_time = 0;
+		r->portnum = CAPTURE_PORTNUM_UNKNOWN;
+		r->gateway = NULL;
+		r->gateway_len = 0;
+		r->packet = buf;
+		r->len = n;
+		return 1;
+	}
+
+	for (;;) {
+		if (cur->list) {
+			uint64_t off;
+
+			if (cur->nlist == 0) {
+				return 0;
+			}
+
+			off = capture_le64(cur->list);
+			cur->list += 8;
+			--cur->nlist;
+			++cur->line;
+
+			/* a bad offset only loses its own record */
+			p = cur->base + off;
+			if (off < CAPTURE_HEADER_LEN || p >= cur->end || capture_record_parse(r, (const uint8_t *)p, (const uint8_t *)cur->end) < 0) {
+				return -1;
+			}
+
+		} else {
+			if (cur->p >= cur->end) {
+				return 0;
+			}
+
+			/* but there's no finding the next record after a bad one */
+			++cur->line;
+			if ((n = capture_record_parse(r, (const uint8_t *)cur->p, (const uint8_t *)cur->end)) < 0) {
+				cur->p = cur->end;
+				return -1;
+			}
+
+			cur->p += n;
+		}
+
+		if (r->rx_time >= cur->since && (cur->until == 0 || r->rx_time < cur->until)) {
+			return 1;
+		}
+	}
+}
+
+int corpus_next(struct corpus_cursor *cur, uint8_t *buf, size_t nbuf)
+{
+	struct capture_record r;
+	int ret;
+
+	if (! cur->capture) {
+		return next_line(cur, buf, nbuf);
+	}
+
+	if ((ret = corpus_next_record(cur, &r, buf, nbuf)) <= 0) {
+		return ret;
+	}
+
+	if (r.len == 0 || r.len > nbuf) {
+		return -1;
+	}
+
+	memcpy(buf, r.packet, r.len);
+	return r.len;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void mesh_header_parse(struct mesh_header *h, const uint8_t *buf)
+{
+	h->from = get_le32(buf);
+	h->to = get_le32(buf + 4);
+	h->id = get_le32(buf + 8);
+	h->flags = buf[12];
+	h->channel = buf[13];
+	h->next_hop = buf[14];
+	h->relay_node = buf[15];
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void mesh_header_write(uint8_t *buf, const struct mesh_header *h)
+{
+	put_le32(buf, h->from);
+	put_le32(buf + 4, h->to);
+	put_le32(buf + 8, h->id);
+	buf[12] = h->flags;
+	buf[13] = h->channel;
+	buf[14] = h->next_hop;
+	buf[15] = h->relay_node;
+}
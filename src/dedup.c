@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dedup.h"
+
+/* a 64-bit finalizer (from MurmurHash3) over both halves of the key */
+static uint32_t dedup_hash(uint32_t from, uint32_t id)
+{
+	uint64_t h = ((uint64_t)from << 32) | id;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static bool dedup_alive(const struct dedup *d, const struct dedup_entry *e, uint32_t now)
+{
+	return e->seen && now - e->seen < d->window;
+}
+
+/* rebuilds the table with <size> slots, keeping only the live entries */
+static int dedup_rehash(struct dedup *d, uint32_t size, uint32_t now)
+{
+	struct dedup_entry *old = d->slot;
+	const uint32_t nold = (old) ? d->mask + 1 : 0;
+
+	if ((d->slot = calloc(size, sizeof(*d->slot))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		d->slot = old;
+		return -1;
+	}
+
+	d->mask = size - 1;
+	d->used = 0;
+	for (uint32_t i = 0; i < nold; i++) {
+		const struct dedup_entry *e = &old[i];
+		uint32_t j;
+
+		if (! e->seen) {
+			continue;
+		}
+
+		if (! dedup_alive(d, e, now)) {
+			d->evictions++;
+			continue;
+		}
+
+		for (j = dedup_hash(e->from, e->id) & d->mask; d->slot[j].seen; j = (j + 1) & d->mask) {
+		}
+
+		d->slot[j] = *e;
+		d->used++;
+	}
+
+	free(old);
+	return 0;
+}
+
+int dedup_init(struct dedup *d, uint32_t window, uint32_t size)
+{
+	uint32_t n = 16;
+
+	memset(d, 0, sizeof(*d));
+	while (n < size && n < (1U << 31)) {
+		n <<= 1;
+	}
+
+	d->window = (window) ? window : 1;
+	return dedup_rehash(d, n, 0);
+}
+
+void dedup_free(struct dedup *d)
+{
+	free(d->slot);
+	memset(d, 0, sizeof(*d));
+}
+
+bool dedup_check(struct dedup *d, uint32_t from, uint32_t id, time_t now)
+{
+	struct dedup_entry *e, *dead = NULL;
+	uint32_t t, i;
+
+	if (d->epoch == 0) {
+		d->epoch = now;
+	}
+
+	/* +1 so that no entry has a time of 0; a clock that steps back counts as the epoch */
+	t = (now > d->epoch) ? (uint32_t)(now - d->epoch) + 1 : 1;
+
+	for (i = dedup_hash(from, id) & d->mask; (e = &d->slot[i])->seen; i = (i + 1) & d->mask) {
+		if (dedup_alive(d, e, t)) {
+			if (e->from == from && e->id == id) {
+				d->hits++;
+				return true;
+			}
+		} else if (dead == NULL) {
+			dead = e;
+		}
+	}
+
+	d->misses++;
+	if (dead) {
+		/* reuse the first dead slot on the way; the chain beyond it stays intact */
+		d->evictions++;
+		e = dead;
+	} else {
+		d->used++;
+	}
+
+	e->from = from;
+	e->id = id;
+	e->seen = t;
+
+	if (d->used > d->mask - d->mask / 4) {
+		uint32_t live = 0;
+
+		for (i = 0; i <= d->mask; i++) {
+			live += dedup_alive(d, &d->slot[i], t);
+		}
+
+		/* if the table can't grow, it still gets rid of its dead entries */
+		dedup_rehash(d, (live > d->mask / 2 && d->mask < (1U << 30)) ? 2 * (d->mask + 1) : d->mask + 1, t);
+	}
+
+	return false;
+}
+
+double dedup_load(const struct dedup *d)
+{
+	return (double)d->used / (d->mask + 1);
+}
@@ -0,0 +1,234 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "envelope.h"
+
+/* protobuf wire types */
+enum {
+	WT_VARINT = 0,
+	WT_64BIT = 1,
+	WT_LEN = 2,
+	WT_32BIT = 5,
+};
+
+/* the fields we want, by message and field number */
+enum {
+	ENVELOPE_PACKET = 1,
+	ENVELOPE_CHANNEL_ID = 2,
+	ENVELOPE_GATEWAY_ID = 3,
+};
+
+enum {
+	PACKET_FROM = 1,
+	PACKET_TO = 2,
+	PACKET_CHANNEL = 3,
+	PACKET_DECODED = 4,
+	PACKET_ENCRYPTED = 5,
+	PACKET_ID = 6,
+	PACKET_RX_TIME = 7,
+	PACKET_HOP_LIMIT = 9,
+	PACKET_WANT_ACK = 10,
+	PACKET_VIA_MQTT = 14,
+	PACKET_HOP_START = 15,
+	PACKET_NEXT_HOP = 18,
+	PACKET_RELAY_NODE = 19,
+};
+
+/* one field: its number and type, and where its value is */
+struct field {
+	uint32_t num;
+	int type;
+	uint64_t value;			/* varints and fixed ints */
+	const uint8_t *data;		/* length-delimited fields */
+	size_t len;
+};
+
+static bool varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		const uint8_t b = *(*p)++;
+
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* reads the field at *<p> and steps past it; returns false if it runs past <end> */
+static bool next_field(const uint8_t **p, const uint8_t *end, struct field *f)
+{
+	uint64_t tag;
+
+	if (! varint(p, end, &tag) || (tag >> 3) == 0 || (tag >> 3) > UINT32_MAX) {
+		return false;
+	}
+
+	f->num = tag >> 3;
+	f->type = tag & 7;
+	switch (f->type) {
+	case WT_VARINT:
+		return varint(p, end, &f->value);
+
+	case WT_64BIT:
+	case WT_32BIT: {
+		const size_t n = (f->type == WT_64BIT) ? 8 : 4;
+
+		if ((size_t)(end - *p) < n) {
+			return false;
+		}
+
+		/* little endian on the wire */
+		f->value = 0;
+		for (size_t i = 0; i < n; i++) {
+			f->value |= (uint64_t)(*p)[i] << (8 * i);
+		}
+
+		*p += n;
+		return true;
+	}
+
+	case WT_LEN:
+		if (! varint(p, end, &f->value) || f->value > (uint64_t)(end - *p)) {
+			return false;
+		}
+
+		f->data = *p;
+		f->len = f->value;
+		*p += f->len;
+		return true;
+
+	default:
+		/* groups are long gone from the protocol */
+		return false;
+	}
+}
+
+static int parse_packet(struct mesh_envelope *e, const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	struct field f;
+
+	while (p < end) {
+		if (! next_field(&p, end, &f)) {
+			return -1;
+		}
+
+		switch (f.num) {
+		case PACKET_FROM:
+		case PACKET_TO:
+		case PACKET_ID:
+		case PACKET_RX_TIME:
+			if (f.type != WT_32BIT) {
+				return -1;
+			}
+
+			if (f.num == PACKET_FROM) {
+				e->from = f.value;
+			} else if (f.num == PACKET_TO) {
+				e->to = f.value;
+			} else if (f.num == PACKET_ID) {
+				e->id = f.value;
+			} else {
+				e->rx_time = f.value;
+			}
+
+			break;
+
+		case PACKET_CHANNEL:
+		case PACKET_HOP_LIMIT:
+		case PACKET_WANT_ACK:
+		case PACKET_VIA_MQTT:
+		case PACKET_HOP_START:
+		case PACKET_NEXT_HOP:
+		case PACKET_RELAY_NODE:
+			if (f.type != WT_VARINT) {
+				return -1;
+			}
+
+			switch (f.num) {
+			case PACKET_CHANNEL:	e->channel = f.value; break;
+			case PACKET_HOP_LIMIT:	e->hop_limit = f.value; break;
+			case PACKET_WANT_ACK:	e->want_ack = (f.value != 0); break;
+			case PACKET_VIA_MQTT:	e->via_mqtt = (f.value != 0); break;
+			case PACKET_HOP_START:	e->hop_start = f.value; break;
+			case PACKET_NEXT_HOP:	e->next_hop = f.value; break;
+			case PACKET_RELAY_NODE:	e->relay_node = f.value; break;
+			}
+
+			break;
+
+		/* decoded and encrypted are a oneof, so the last one wins */
+		case PACKET_DECODED:
+		case PACKET_ENCRYPTED:
+			if (f.type != WT_LEN) {
+				return -1;
+			}
+
+			e->encrypted = (f.num == PACKET_ENCRYPTED) ? f.data : NULL;
+			e->encrypted_len = (f.num == PACKET_ENCRYPTED) ? f.len : 0;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int mesh_envelope_parse(struct mesh_envelope *e, const uint8_t *buf, size_t len)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	bool packet = false;
+	struct field f;
+
+	e->from = e->to = e->id = e->channel = 0;
+	e->rx_time = e->hop_limit = e->hop_start = e->next_hop = e->relay_node = 0;
+	e->want_ack = e->via_mqtt = false;
+	e->encrypted = NULL;
+	e->encrypted_len = 0;
+	e->channel_id = e->gateway_id = NULL;
+	e->channel_id_len = e->gateway_id_len = 0;
+
+	while (p < end) {
+		if (! next_field(&p, end, &f)) {
+			return -1;
+		}
+
+		if (f.num > ENVELOPE_GATEWAY_ID) {
+			continue;
+		}
+
+		if (f.type != WT_LEN) {
+			return -1;
+		}
+
+		switch (f.num) {
+		case ENVELOPE_PACKET:
+			/* a repeated submessage merges into the first, as in any protobuf decoder */
+			if (parse_packet(e, f.data, f.len) != 0) {
+				return -1;
+			}
+
+			packet = true;
+			break;
+
+		case ENVELOPE_CHANNEL_ID:
+			e->channel_id = (const char *)f.data;
+			e->channel_id_len = f.len;
+			break;
+
+		case ENVELOPE_GATEWAY_ID:
+			e->gateway_id = (const char *)f.data;
+			e->gateway_id_len = f.len;
+			break;
+		}
+	}
+
+	return packet ? 0 : -1;
+}
@@ -3,58 +3,60 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <mosquitto.h>
 
 #include <pb_decode.h>
 #include "meshtastic/mqtt.pb.h"
 #include "meshtastic/mesh.pb.h"
 
+#include "aes.h"
 #include "arithcode.h"
+#include "capture.h"
+#include "channels.h"
+#include "codec.h"
+#include "corpus.h"
+#include "dedup.h"
+#include "envelope.h"
+#include "metrics.h"
+#include "models.h"
+#include "portnum.h"
+#include "ring.h"
+#include "stats.h"
+#include "ticks.h"
 
 static bool debug, dump, verbose;
 
-struct user_context {
-	const char *topic;
-};
+/* how packets are compressed (-c) */
+static enum coder_mode coder = CODER_PACKET;
+static enum coder_backend backend = BACKEND_ARITH;
 
-static const char *_portnum_str(meshtastic_port_num_t portnum)
-{
-	const char *s;
+/* pretrained models (-M) */
+static struct model_set models;
+static bool use_models;
 
-	switch (portnum) {
-	case MESHTASTIC_PORT_NUM_UNKNOWN_APP:		s = "UNKNOWN_APP"; break;
-	case MESHTASTIC_PORT_NUM_TEXT_MESSAGE_APP:	s = "TEXT_MESSAGE_APP"; break;
-	case MESHTASTIC_PORT_NUM_REMOTE_HARDWARE_APP:	s = "REMOTE_HARDWARE_APP"; break;
-	case MESHTASTIC_PORT_NUM_POSITION_APP:		s = "POSITION_APP"; break;
-	case MESHTASTIC_PORT_NUM_NODEINFO_APP:		s = "NODEINFO_APP"; break;
-	case MESHTASTIC_PORT_NUM_ROUTING_APP:		s = "ROUTING_APP"; break;
-	case MESHTASTIC_PORT_NUM_ADMIN_APP:		s = "ADMIN_APP"; break;
-	case MESHTASTIC_PORT_NUM_TEXT_MESSAGE_COMPRESSED_APP:	s = "TEXT_MESSAGE_COMPRESSED_APP"; break;
-	case MESHTASTIC_PORT_NUM_WAYPOINT_APP:		s = "WAYPOINT_APP"; break;
-	case MESHTASTIC_PORT_NUM_AUDIO_APP:		s = "AUDIO_APP"; break;
-	case MESHTASTIC_PORT_NUM_DETECTION_SENSOR_APP:	s = "DETECTION_SENSOR_APP"; break;
-	case MESHTASTIC_PORT_NUM_REPLY_APP:		s = "REPLY_APP"; break;
-	case MESHTASTIC_PORT_NUM_IP_TUNNEL_APP:		s = "IP_TUNNEL_APP"; break;
-	case MESHTASTIC_PORT_NUM_PAXCOUNTER_APP:	s = "PAXCOUNTER_APP"; break;
-	case MESHTASTIC_PORT_NUM_SERIAL_APP:		s = "SERIAL_APP"; break;
-	case MESHTASTIC_PORT_NUM_STORE_FORWARD_APP:	s = "STORE_FORWARD_APP"; break;
-	case MESHTASTIC_PORT_NUM_RANGE_TEST_APP:	s = "RANGE_TEST_APP"; break;
-	case MESHTASTIC_PORT_NUM_TELEMETRY_APP:		s = "TELEMETRY_APP"; break;
-	case MESHTASTIC_PORT_NUM_ZPS_APP:		s = "ZPS_APP"; break;
-	case MESHTASTIC_PORT_NUM_SIMULATOR_APP:		s = "SIMULATOR_APP"; break;
-	case MESHTASTIC_PORT_NUM_TRACEROUTE_APP:	s = "TRACEROUTE_APP"; break;
-	case MESHTASTIC_PORT_NUM_NEIGHBORINFO_APP:	s = "NEIGHBORINFO_APP"; break;
-	case MESHTASTIC_PORT_NUM_ATAK_PLUGIN:		s = "ATAK_PLUGIN"; break;
-	case MESHTASTIC_PORT_NUM_MAP_REPORT_APP:	s = "MAP_REPORT_APP"; break;
-	case MESHTASTIC_PORT_NUM_POWERSTRESS_APP:	s = "POWERSTRESS_APP"; break;
-	case MESHTASTIC_PORT_NUM_PRIVATE_APP:		s = "PRIVATE_APP"; break;
-	case MESHTASTIC_PORT_NUM_ATAK_FORWARDER:	s = "ATAK_FORWARDER"; break;
-	default: s = "(unknown)"; break;
-	};
+/* time the stages of the packet path (-L); when off, a stage costs a test of this flag */
+static bool timing;
 
-	return s;
+static inline uint64_t stage_start(void)
+{
+	return (timing) ? ticks() : 0;
+}
+
+/* adds the time since <t> (from stage_start()) to <stage> */
+static inline void stage_end(struct comp_stats *s, enum stats_stage stage, uint64_t t)
+{
+	if (timing) {
+		comp_stats_stage(s, stage, ticks() - t);
+	}
 }
 
+struct user_context {
+	const char *topic;
+};
 
 static char *time_str(uint32_t seconds)
 {
@@ -344,7 +346,7 @@ static int decode_portnum(void *buf, size_t len, meshtastic_port_num_t portnum)
 	case MESHTASTIC_PORT_NUM_ATAK_PLUGIN:
 	case MESHTASTIC_PORT_NUM_ATAK_FORWARDER:
 	default:
-		printf("  (don't know how to decode %d (%s) yet)\n", portnum, _portnum_str(portnum));
+		printf("  (don't know how to decode %d (%s) yet)\n", portnum, portnum_str(portnum));
 		break;
 	};
 
@@ -352,305 +354,178 @@ static int decode_portnum(void *buf, size_t len, meshtastic_port_num_t portnum)
 }
 
 
-/* 16 bytes of random PSK for our _public_ default channel that all devices power up on (AES128) */
-static const uint8_t default_psk[] = {
-	0xd4, 0xf1, 0xbb, 0x3a, 0x20, 0x29, 0x07, 0x59, 0xf0, 0xbc, 0xff, 0xab, 0xcf, 0x4e, 0x69, 0x01
-};
-
-
-typedef struct {
-	uint8_t ctr_start;
-	uint8_t idx;
-	uint8_t ctr[16];
-	uint8_t state[16];
-	uint8_t schedule[16];
-} aes128_ctx_t;
-
-#define OUT(col, row)   output[(col) * 4 + (row)]
-#define IN(col, row)    input[(col) * 4 + (row)]
-
-#define gmul2(x)    (t = ((uint16_t)(x)) << 1, ((uint8_t)t) ^ (uint8_t)(0x1B * ((uint8_t)(t >> 8))))
-
-#define KCORE(n) \
-	do { \
-		keyScheduleCore(temp, schedule + 12, (n)); \
-		schedule[0] ^= temp[0]; \
-		schedule[1] ^= temp[1]; \
-		schedule[2] ^= temp[2]; \
-		schedule[3] ^= temp[3]; \
-	} while (0)
-
-#define KXOR(a, b) \
-	do { \
-		schedule[(a) * 4] ^= schedule[(b) * 4]; \
-		schedule[(a) * 4 + 1] ^= schedule[(b) * 4 + 1]; \
-		schedule[(a) * 4 + 2] ^= schedule[(b) * 4 + 2]; \
-		schedule[(a) * 4 + 3] ^= schedule[(b) * 4 + 3]; \
-	} while (0)
-
-static uint8_t const sbox[256] = {
-	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
-	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
-	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
-	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
-	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
-	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
-	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
-	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
-	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
-	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
-	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
-	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
-	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
-	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
-	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
-	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
-};
+/* the channels we can decrypt (-k), or just the default (LongFast with the default key) */
+static struct channel_table channels;
 
+/* try to decrypt the given packet in place with the keys for its channel hash */
+static const struct channel *mesh_decrypt(struct comp_stats *stats, uint32_t src, uint32_t id, uint8_t hash, uint8_t *buf, size_t len)
+{
+	const uint64_t t = stage_start();
+	const struct channel *ch;
+	uint8_t nonce[16];
 
-static void subBytesAndShiftRows(uint8_t *output, const uint8_t *input)
-{
-	OUT(0, 0) = (*(sbox + IN(0, 0)));
-	OUT(0, 1) = (*(sbox + IN(1, 1)));
-	OUT(0, 2) = (*(sbox + IN(2, 2)));
-	OUT(0, 3) = (*(sbox + IN(3, 3)));
-	OUT(1, 0) = (*(sbox + IN(1, 0)));
-	OUT(1, 1) = (*(sbox + IN(2, 1)));
-	OUT(1, 2) = (*(sbox + IN(3, 2)));
-	OUT(1, 3) = (*(sbox + IN(0, 3)));
-	OUT(2, 0) = (*(sbox + IN(2, 0)));
-	OUT(2, 1) = (*(sbox + IN(3, 1)));
-	OUT(2, 2) = (*(sbox + IN(0, 2)));
-	OUT(2, 3) = (*(sbox + IN(1, 3)));
-	OUT(3, 0) = (*(sbox + IN(3, 0)));
-	OUT(3, 1) = (*(sbox + IN(0, 1)));
-	OUT(3, 2) = (*(sbox + IN(1, 2)));
-	OUT(3, 3) = (*(sbox + IN(2, 3)));
-}
-
-static void mixColumn(uint8_t *output, uint8_t *input)
-{
-	uint16_t t; /* Needed by the gmul2 macro */
-
-	uint8_t a = input[0];
-	uint8_t b = input[1];
-	uint8_t c = input[2];
-	uint8_t d = input[3];
-
-	uint8_t a2 = gmul2(a);
-	uint8_t b2 = gmul2(b);
-	uint8_t c2 = gmul2(c);
-	uint8_t d2 = gmul2(d);
-
-	output[0] = a2 ^ b2 ^ b ^ c ^ d;
-	output[1] = a ^ b2 ^ c2 ^ c ^ d;
-	output[2] = a ^ b ^ c2 ^ d2 ^ d;
-	output[3] = a2 ^ a ^ b ^ c ^ d2;
-}
-
-static void keyScheduleCore(uint8_t *output, const uint8_t *input, uint8_t iteration)
-{
-	/*
-	 * Rcon(i), 2^i in the Rijndael finite field, for i = 0..10.
-	 * http://en.wikipedia.org/wiki/Rijndael_key_schedule
-	 */
-	static uint8_t const rcon[11] = { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36 };
-
-	output[0] = (*(sbox + input[1])) ^ (*(rcon + iteration));
-	output[1] = (*(sbox + input[2]));
-	output[2] = (*(sbox + input[3]));
-	output[3] = (*(sbox + input[0]));
-}
-
-static void encryptBlock(aes128_ctx_t *ctx)
-{
-	uint8_t schedule[16];
-	uint8_t state1[16];
-	uint8_t state2[16];
-	uint8_t temp[4];
-	uint8_t i, round;
-
-	/* Start with the key in the schedule buffer */
-	memcpy(schedule, ctx->schedule, 16);
-
-	/* Copy the ctr into the state and XOR with the key schedule */
-	for (i = 0; i < 16; i++) {
-		state1[i] = ctx->ctr[i] ^ schedule[i];
-	}
-
-	/* Perform the first 9 rounds of the cipher. */
-	for (round = 1; round <= 9; round++) {
-		/* Expand the next 16 bytes of the key schedule */
-		KCORE(round);
-		KXOR(1, 0);
-		KXOR(2, 1);
-		KXOR(3, 2);
-
-		/* Encrypt using the key schedule */
-		subBytesAndShiftRows(state2, state1);
-		mixColumn(state1,      state2);
-		mixColumn(state1 + 4,  state2 + 4);
-		mixColumn(state1 + 8,  state2 + 8);
-		mixColumn(state1 + 12, state2 + 12);
-		for (i = 0; i < 16; ++i) {
-			state1[i] ^= schedule[i];
-		}
+	if (debug) {
+		mesh_nonce(nonce, src, id);
+		printf("nonce"); for (int i = 0; i < 16; i++) printf(" %02hhx", nonce[i]); printf("\n");
+		printf("enc  "); for (size_t i = 0; i < len; i++) printf(" %02hhx", buf[i]); printf("\n");
 	}
 
-	/* Expand the final 16 bytes of the key schedule */
-	KCORE(10);
-	KXOR(1, 0);
-	KXOR(2, 1);
-	KXOR(3, 2);
+	ch = channel_decrypt(&channels, hash, src, id, buf, len);
 
-	/* Perform the final round */
-	subBytesAndShiftRows(state2, state1);
-	for (i = 0; i < 16; i++) {
-		ctx->state[i] = state2[i] ^ schedule[i];
+	if (debug && ch) {
+		printf("key  "); for (size_t i = 0; i < ch->psk_len; i++) printf(" %02hhx", ch->psk[i]); printf(" (%s)\n", ch->name);
+		printf("dec  "); for (size_t i = 0; i < len; i++) printf(" %02hhx", buf[i]); printf("\n");
 	}
-}
 
-void aes128_init(aes128_ctx_t *ctx)
-{
-	ctx->idx = 16;
-	ctx->ctr_start = 0;
+	stage_end(stats, STAGE_DECRYPT, t);
+	return ch;
 }
 
-void aes128_set_ctrlen(aes128_ctx_t *ctx, size_t len)
+static uint64_t now_ns(void)
 {
-	ctx->ctr_start = 16 - len;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void aes128_set_iv(aes128_ctx_t *ctx, const uint8_t *iv, size_t len)
+/* everything test_compression() accumulates; each worker owns one and is the only writer of its stats */
+struct compression_run {
+	time_t t1;
+	uint32_t interval;			/* print a summary every <interval> packets (0 to disable) */
+	uint32_t since_print;			/* packets since the last summary */
+	bool quiet;				/* don't print a line for every packet */
+	struct codec codec;			/* coder context, reused for every packet */
+	struct dedup *dedup;			/* the duplicate filter in front of this run, if there is one */
+	struct comp_stats stats;
+
+	/* the counts the last summary printed, to tell what is new since */
+	uint64_t last_packets;
+	uint64_t last_num[STATS_PORTS];
+};
+
+static struct compression_run mqtt_run;
+
+/* MQTT stats are printed every this many packets */
+#define MQTT_STATS_INTERVAL	(1000)
+
+/* MQTT packets already seen through another gateway (-W sets the window) */
+static struct dedup dups;
+
+/* returns 0 on success */
+static int compression_run_init(struct compression_run *run, uint32_t interval, bool quiet)
 {
-	memcpy(ctx->ctr, iv, len);
-	ctx->idx = 16;
+	time(&run->t1);
+	run->interval = interval;
+	run->since_print = 0;
+	run->quiet = quiet;
+	run->dedup = NULL;
+	comp_stats_init(&run->stats);
+	run->last_packets = 0;
+	memset(run->last_num, 0, sizeof(run->last_num));
+	if (codec_init(&run->codec, coder, backend, (use_models) ? &models : NULL) != 0) {
+		return -1;
+	}
+
+	run->codec.timed = timing;
+	return 0;
 }
 
-void aes128_set_key(aes128_ctx_t *ctx, const uint8_t *key, size_t len)
+static void compression_run_free(struct compression_run *run)
 {
-	memcpy(ctx->schedule, key, 16);
+	codec_free(&run->codec);
+	comp_stats_free(&run->stats);
 }
 
-void aes128_crypt(aes128_ctx_t *ctx, uint8_t *output, const uint8_t *input, size_t len)
+/* how long each stage of the packet path took, for stages that have run */
+static void print_stage_stats(const struct comp_stats *s)
 {
-	while (len > 0) {
-		uint8_t templen;
+	const double tpn = ticks_per_ns();
 
-		if (ctx->idx >= 16) {
-			/* Generate a new encrypted ctr block. */
-			encryptBlock(ctx);
-			ctx->idx = 0;
+	for (int st = 0; st < STAGE_MAX; st++) {
+		const uint64_t n = comp_stats_stage_count(s, st);
+		char q[3][16];
 
-			/*
-			 * Increment the ctr, taking care not to reveal
-			 * any timing information about the starting value.
-			 * We iterate through the entire ctr region even
-			 * if we could stop earlier because a byte is non-zero.
-			 */
-			uint16_t temp = 1;
-			uint8_t i = 16;
-			while (i > ctx->ctr_start) {
-				--i;
-				temp += ctx->ctr[i];
-				ctx->ctr[i] = (uint8_t)temp;
-				temp >>= 8;
-			}
+		if (n == 0) {
+			continue;
 		}
 
-		templen = 16 - ctx->idx;
-		if (templen > len) {
-			templen = len;
-		}
+		/* quantiles are to the top of their bucket, a power of two ticks */
+		for (int i = 0; i < 3; i++) {
+			const uint64_t b = comp_stats_stage_quantile(s, st, (i == 0) ? 0.5 : (i == 1) ? 0.9 : 0.99);
 
-		len -= templen;
-		while (templen > 0) {
-			*output++ = *input++ ^ ctx->state[ctx->idx++];
-			--templen;
+			if (b) {
+				snprintf(q[i], sizeof(q[i]), "%.0f", b / tpn);
+			} else {
+				snprintf(q[i], sizeof(q[i]), "more");
+			}
 		}
-	}
-}
-
-
-/*
- * generate our 128 bit nonce for a new packet
- *
- * The nonce is constructed by concatenating (from MSB to LSB):
- * a 64 bit packet number (stored in little endian order)
- * a 32 bit sending node number (stored in little endian order)
- * a 32 bit block counter (starts at zero)
- *
- * nonce pointer must be able to hold 16 bytes
- */
-static void gen_nonce(uint8_t *nonce, uint32_t from_nodeid, uint32_t packet_id)
-{
-	memset(nonce, 0, 16);
 
-	/* use memcpy to avoid breaking strict-aliasing */
-	memcpy(nonce, &packet_id, sizeof(packet_id));
-	memcpy(nonce + sizeof(uint64_t), &from_nodeid, sizeof(from_nodeid));
+		printf("%14s stage: %llu times, mean %.0f ns, p50/p90/p99 under %s/%s/%s ns\n", stage_names[st], (unsigned long long)n,
+		       atomic_load(&s->stage_ticks[st]) / tpn / n, q[0], q[1], q[2]);
+	}
 }
 
-
-/* try to decrypt the given packet. if out is NULL, copy the decrypted payload back to the packet structure */
-static void mesh_decrypt(uint32_t src, uint32_t id, uint8_t *buf, size_t len)
+static void print_compression_stats(struct compression_run *run)
 {
-	aes128_ctx_t ctx;
-	uint8_t nonce[16];
-	static uint8_t crypt_buffer[256];
-	const uint8_t payload_len = len;
-	uint8_t crypt_len;
-
-	aes128_init(&ctx);
-	aes128_set_ctrlen(&ctx, 4);
-	aes128_set_key(&ctx, default_psk, sizeof(default_psk));
-
-	gen_nonce(nonce, src, id);
-	aes128_set_iv(&ctx, nonce, sizeof(nonce));
+	const uint64_t total = atomic_load(&run->stats.packets);
+	const uint64_t interval = total - run->last_packets;
+	time_t t2, dt;
+
+	time(&t2);
+	dt = difftime(t2, run->t1);
+	printf("\n\nCOMPRESSION STATS (%llu packets total, %llu in the last %s):\n", (unsigned long long)total, (unsigned long long)interval, time_str(dt));
+	for (int i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *p = comp_stats_port(&run->stats, i);
+		uint64_t num, ncomp, num_interval;
+		double cmin, cmax;
+		unsigned lmin, lmax;
+
+		if (p == NULL || (num = atomic_load(&p->num)) == 0) {
+			continue;
+		}
 
-	/* pad the crypt_buffer with zeroes up to the next multiple of 16 bytes */
-	crypt_len = (payload_len + 15) & -16;
-	memcpy(crypt_buffer, buf, payload_len);
-	memset(crypt_buffer + payload_len, 0, crypt_len - payload_len);
+		ncomp = atomic_load(&p->ncomp);
+		num_interval = num - run->last_num[i];
+		run->last_num[i] = num;
+
+		printf("%20s: %llu packets (%llu in this interval), %.1f%%/%.1f%% of all packets this interval/ever, %llu compressed\n", portnum_str(i),
+		       (unsigned long long)num, (unsigned long long)num_interval, interval ? 100.0 * num_interval / interval : 0.0, 100.0 * num / total,
+		       (unsigned long long)ncomp);
+
+		if (ncomp) {
+			const uint64_t unc = atomic_load(&p->unc_bytes), comp = atomic_load(&p->comp_bytes);
+			double c;
+
+			lmin = port_stats_len(p, 0.0, &cmin);
+			lmax = port_stats_len(p, 1.0, &cmax);
+			printf("%20s  length min %u -> %.1f, max %u -> %.1f, mean %.1f, p50/p90/p99 %u/%u/%u bytes\n", "", lmin, cmin, lmax, cmax,
+			       (double)unc / ncomp, port_stats_len(p, 0.5, &c), port_stats_len(p, 0.9, &c), port_stats_len(p, 0.99, &c));
+			printf("%20s  ratio mean %.2f%%, p50/p90/p99 %.2f%%/%.2f%%/%.2f%%, %llu -> %llu bytes (%.2f%%)\n", "",
+			       atomic_load(&p->ratio_sum) / (100.0 * ncomp), port_stats_ratio(p, 0.5), port_stats_ratio(p, 0.9), port_stats_ratio(p, 0.99),
+			       (unsigned long long)unc, (unsigned long long)comp, 100.0 - 100.0 * comp / unc);
+		}
+	}
 
-	if (debug) {
-		printf("nonce"); for (int i = 0; i < 16; i++) printf(" %02hhx", nonce[i]); printf("\n");
-		printf("key  "); for (int i = 0; i < 16; i++) printf(" %02hhx", default_psk[i]); printf("\n");
-		printf("enc  "); for (int i = 0; i < crypt_len; i++) printf(" %02hhx", crypt_buffer[i]); printf("\n");
+	if (timing) {
+		print_stage_stats(&run->stats);
 	}
 
-	aes128_crypt(&ctx, crypt_buffer, crypt_buffer, crypt_len);
+	if (run->dedup) {
+		const struct dedup *d = run->dedup;
 
-	if (debug) {
-		printf("dec  "); for (int i = 0; i < crypt_len; i++) printf(" %02hhx", crypt_buffer[i]); printf("\n");
+		printf("%20s: %llu dropped, %llu unique, %llu expired, %u slots (load %.2f)\n", "duplicates", (unsigned long long)d->hits,
+		       (unsigned long long)d->misses, (unsigned long long)d->evictions, d->mask + 1, dedup_load(d));
 	}
 
-	memcpy(buf, crypt_buffer, payload_len);
+	run->last_packets = total;
+	time(&run->t1);
+	printf("\n");
 }
 
-
-struct compression_stats {
-	uint8_t portnum;
-	int num, num_interval;			/* raw count of number of packets (in this interval) of this type */
-	int unc_len_min, comp_len_min;		/* minimum length (and what it compressed to) */
-	int unc_len_max, comp_len_max;		/* maximum length (and what it compressed to) */
-	float unc_len_avg, comp_ratio_avg;	/* average length and compression ratio */
-};
-
-static void test_compression(meshtastic_data_t *md)
+static void test_compression(struct compression_run *run, meshtastic_data_t *md)
 {
-	static bool first = true;
-	static time_t t1;
-	static uint32_t total_packets, total_this_run;
-	static struct compression_stats cstats[256];
-	struct compression_stats *cs;
-
-	/* "weight" for new data coming into the EMA filter */
-	const float cs_alpha = 0.1f;
-
-	int ret;
-	float cdf[CDF_MAX_SYMB];
-	size_t nsym;
+	int ret, dec_ret = -1;
 
 	/* original data source */
 	const void *buf = md->payload.bytes;
@@ -664,59 +539,39 @@ static void test_compression(meshtastic_data_t *md)
 	uint8_t unc[CDF_MAX_SYMB], *uncp = unc;
 	size_t nunc = sizeof(unc);
 
-	/* first time through, initialize the compression stats array */
-	if (first) {
-		for (int i = 0; i < sizeof(cstats)/sizeof(cstats[0]); i++) {
-			cs = &cstats[i];
-			cs->num = cs->num_interval = 0;
-			cs->unc_len_min = cs->comp_len_min = -1;
-			cs->unc_len_max = cs->comp_len_max = 0;
-			cs->unc_len_avg = cs->comp_ratio_avg = 0.0f;
-		}
+	uint64_t t = stage_start();
 
-		time(&t1);
-		total_packets = total_this_run = 0;
-		first = false;
-	}
+	if ((ret = codec_encode(&run->codec, md->portnum, (void **)&outp, &nout, buf, len)) == 0) {
+		/* the packet coder builds its model as part of encoding; that is a stage of its own */
+		if (run->codec.model_ticks) {
+			comp_stats_stage(&run->stats, STAGE_MODEL, run->codec.model_ticks);
+			t += run->codec.model_ticks;
+		}
 
-	nsym = 0;
-	if (cdf_build(cdf, &nsym, (uint8_t *)buf, len) == NULL) {
-		printf("  ** building CDF failed\n");
-		return;
+		stage_end(&run->stats, STAGE_ENCODE, t);
+		t = stage_start();
+		dec_ret = codec_decode(&run->codec, md->portnum, (void **)&uncp, &nunc, out, nout);
+		stage_end(&run->stats, STAGE_DECODE, t);
 	}
 
-	if ((ret = encode_u8_u8((void **)&outp, &nout, (void *)buf, len, cdf, nsym)) == 0) {
-		if ((ret = decode_u8_u8((void **)&uncp, &nunc, out, nout, cdf, nsym)) == 0) {
+	if (ret == 0) {
+		if (dec_ret == 0) {
 			if (nunc == len && memcmp(buf, uncp, len) == 0) {
-				cs = &cstats[md->portnum];
-				cs->portnum = md->portnum;
-				++cs->num;
-				++cs->num_interval;
-
-				/* don't count packets that didn't compress in the min/max/avg calculations */
-				float ratio = 100.0f - (100.0f * (float)nout / (float)len);
-				if (ratio > 1.0f) {
-					if (cs->num == 1) {
-						cs->unc_len_avg = (float)len;
-						cs->comp_ratio_avg = (float)ratio;
-					} else {
-						cs->unc_len_avg = (1.0f - cs_alpha) * cs->unc_len_avg + (cs_alpha * (float)len);
-						cs->comp_ratio_avg = (1.0f - cs_alpha) * cs->comp_ratio_avg + (cs_alpha * ratio);
-					}
-
-					/* update the min original/compressed sizes as a pair */
-					if (len < cs->unc_len_min || cs->num == 1) {
-						cs->unc_len_min = len;
-						cs->comp_len_min = nout;
-					}
-
-					/* update the max original/compressed sizes as a pair */
-					if (len > cs->unc_len_max || cs->num == 1) {
-						cs->unc_len_max = len;
-						cs->comp_len_max = nout;
-					}
-
-					printf("    %20s: %3.2f%% (%zd symbols: %zd -> %zd bytes) best: %d -> %d, worst: %d -> %d, avg %.1f bytes, avg ratio %3.2f%% over %d packets\n", _portnum_str(md->portnum), ratio, nsym, nunc, nout, cs->unc_len_min, cs->comp_len_min, cs->unc_len_max, cs->comp_len_max, cs->unc_len_avg, cs->comp_ratio_avg, cs->num);
+				comp_stats_add(&run->stats, md->portnum, len, nout);
+
+				/* don't print packets that didn't compress; the stats leave them out of the sizes and ratios too */
+				const float ratio = 100.0f - (100.0f * (float)nout / (float)len);
+				const struct port_stats *p = comp_stats_port(&run->stats, md->portnum);
+				if (ratio > 1.0f && p && ! run->quiet) {
+					t = stage_start();
+					const uint64_t ncomp = atomic_load(&p->ncomp);
+					double cmin, cmax;
+					const unsigned lmin = port_stats_len(p, 0.0, &cmin), lmax = port_stats_len(p, 1.0, &cmax);
+
+					printf("    %20s: %3.2f%% (%zd symbols: %zd -> %zd bytes) best: %u -> %.0f, worst: %u -> %.0f, avg %.1f bytes, avg ratio %3.2f%% over %llu packets\n",
+					       portnum_str(md->portnum), ratio, run->codec.nsym, nunc, nout, lmin, cmin, lmax, cmax,
+					       (double)atomic_load(&p->unc_bytes) / ncomp, atomic_load(&p->ratio_sum) / (100.0 * ncomp), (unsigned long long)ncomp);
+					stage_end(&run->stats, STAGE_PRINT, t);
 				}
 
 			} else {
@@ -737,108 +592,251 @@ static void test_compression(meshtastic_data_t *md)
 		printf("  ** compression failed\n");
 	}
 
-	++total_packets;
-	++total_this_run;
-	if (total_this_run >= 1000) {
-		time_t t2, dt;
-		time(&t2);
-		dt = difftime(t2, t1);
-		printf("\n\nCOMPRESSION STATS (%d packets total, %d in the last %s):\n", total_packets, total_this_run, time_str(dt));
-		for (int i = 0; i < sizeof(cstats)/sizeof(cstats[0]); i++) {
-			cs = &cstats[i];
+	comp_stats_packet(&run->stats);
+	if (run->interval && ++run->since_print >= run->interval) {
+		run->since_print = 0;
+		print_compression_stats(run);
+	}
+}
 
-			if (cs->num > 0) {
-				printf("%20s: min: %d -> %d, max: %d -> %d, avg unc. length %.1f bytes, avg comp. ratio %3.2f%% over %d packets (%d in this interval), %.1f%%/%.1f%% of all packets this interval/ever\n", _portnum_str(cs->portnum), cs->unc_len_min, cs->comp_len_min, cs->unc_len_max, cs->comp_len_max, cs->unc_len_avg, cs->comp_ratio_avg, cs->num, cs->num_interval, 100.0f * cs->num_interval / total_this_run, 100.0f * cs->num / total_packets);
-			}
 
-			cs->num_interval = 0;
-		}
+/* one MQTT worker: takes messages off the ring and keeps its own stats, which the stats dump merges without stopping it */
+struct mqtt_worker {
+	pthread_t thread;
+	struct compression_run run;
+	atomic_uint_fast64_t bad_envelopes;	/* messages that didn't parse */
+	atomic_uint_fast64_t no_key;		/* packets no channel key decrypted */
+	atomic_uint_fast64_t bad_payloads;	/* decrypted packets that didn't decode */
+};
 
-		total_this_run = 0;
-		time(&t1);
-		printf("\n");
+/* the ring between on_message() and the workers (-q, -b) */
+static struct ring mqtt_ring;
+static struct mqtt_worker *mqtt_workers;
+static int mqtt_nworkers;
+
+/* dups is shared by the workers */
+static pthread_mutex_t dups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* packets through test_compression() since startup, and the lock that keeps stats dumps one at a time */
+static atomic_uint mqtt_packets;
+static pthread_mutex_t mqtt_print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool is_duplicate(struct comp_stats *stats, uint32_t from, uint32_t id)
+{
+	const uint64_t t = stage_start();
+	bool dup;
+
+	pthread_mutex_lock(&dups_lock);
+	dup = dedup_check(&dups, from, id, time(NULL));
+	pthread_mutex_unlock(&dups_lock);
+	stage_end(stats, STAGE_DEDUP, t);
+	return dup;
+}
+
+/* merges every worker's stats into mqtt_run and prints them, starting a new interval */
+static void print_mqtt_stats(void)
+{
+	struct dedup d;
+
+	pthread_mutex_lock(&mqtt_print_lock);
+	comp_stats_clear(&mqtt_run.stats);
+	for (int i = 0; i < mqtt_nworkers; i++) {
+		comp_stats_merge(&mqtt_run.stats, &mqtt_workers[i].run.stats);
 	}
+
+	/* the workers need dups for every packet, so print from a copy of its counters rather than holding the lock */
+	pthread_mutex_lock(&dups_lock);
+	d = dups;
+	pthread_mutex_unlock(&dups_lock);
+	d.slot = NULL;
+	mqtt_run.dedup = &d;
+
+	print_compression_stats(&mqtt_run);
+	mqtt_run.dedup = NULL;
+
+	printf("%20s: %llu queued, %llu dropped to make room, %llu too big, %llu waits for room, %zu waiting now\n\n", "queue",
+	       (unsigned long long)mqtt_ring.pushed, (unsigned long long)mqtt_ring.dropped, (unsigned long long)mqtt_ring.oversize,
+	       (unsigned long long)mqtt_ring.waits, ring_depth(&mqtt_ring));
+	pthread_mutex_unlock(&mqtt_print_lock);
 }
 
+/* when the MQTT workers started, for the uptime in the metrics */
+static uint64_t mqtt_start_ns;
 
-/* maintains a short list of recently seen packet IDs. Returns true if this packet ID was seen already */
-static bool is_duplicate_packetid(uint32_t packet_id)
+/* the metrics exporters' view of the MQTT workers */
+static int mqtt_snapshot(struct metrics_snapshot *s)
 {
-	static uint32_t id_list[32], idx;
+	comp_stats_clear(&s->stats);
+	s->bad_envelopes = s->no_key = s->bad_payloads = 0;
+	for (int i = 0; i < mqtt_nworkers; i++) {
+		const struct mqtt_worker *w = &mqtt_workers[i];
 
-	/* don't count multiple messages about the same packet ID */
-	for (int i = 0; i < sizeof(id_list)/sizeof(id_list[0]); i++) {
-		if (id_list[i] == packet_id) {
-			return true;
+		if (comp_stats_merge(&s->stats, &w->run.stats) != 0) {
+			return -1;
 		}
+
+		s->bad_envelopes += atomic_load(&w->bad_envelopes);
+		s->no_key += atomic_load(&w->no_key);
+		s->bad_payloads += atomic_load(&w->bad_payloads);
 	}
 
-	id_list[idx++] = packet_id;
-	idx %= sizeof(id_list)/sizeof(id_list[0]);
-	return false;
+	s->uptime = (now_ns() - mqtt_start_ns) * 1e-9;
+	s->messages = atomic_load(&mqtt_ring.pushed);
+	s->queue_dropped = atomic_load(&mqtt_ring.dropped);
+	s->queue_oversize = atomic_load(&mqtt_ring.oversize);
+	s->queue_waits = atomic_load(&mqtt_ring.waits);
+	s->queue_depth = ring_depth(&mqtt_ring);
+
+	pthread_mutex_lock(&dups_lock);
+	s->duplicates = dups.hits;
+	s->unique = dups.misses;
+	pthread_mutex_unlock(&dups_lock);
+	return 0;
 }
 
+/* the capture file (-w) */
+static struct capture_writer capture;
+static bool capturing;
 
-/* MQTT received message callback */
-static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_message *msg)
+/* appends a decrypted packet to the capture, with the radio header it was sent with */
+static void capture_packet(struct comp_stats *stats, const struct mesh_envelope *e, meshtastic_port_num_t portnum, const uint8_t *data)
 {
-	if (verbose) {
-		printf("\nReceived message on %s len %d:\n", msg->topic, msg->payloadlen);
+	uint8_t pkt[MESH_HEADER_LEN + RING_MSG_MAX];
+	const struct mesh_header h = {
+		.from = e->from,
+		.to = e->to,
+		.id = e->id,
+		.flags = (e->hop_limit & 7) | (e->want_ack << 3) | (e->via_mqtt << 4) | ((e->hop_start & 7) << 5),
+		.channel = e->channel,
+		.next_hop = e->next_hop,
+		.relay_node = e->relay_node,
+	};
+	const struct capture_record r = {
+		.rx_time = (e->rx_time) ? e->rx_time : (uint32_t)time(NULL),
+		.portnum = portnum,
+		.gateway = e->gateway_id,
+		.gateway_len = (e->gateway_id_len < UINT8_MAX) ? e->gateway_id_len : UINT8_MAX,
+		.packet = pkt,
+		.len = MESH_HEADER_LEN + e->encrypted_len,
+	};
+	const uint64_t t = stage_start();
+
+	mesh_header_write(pkt, &h);
+	memcpy(pkt + MESH_HEADER_LEN, data, e->encrypted_len);
+	capture_write(&capture, &r);
+	stage_end(stats, STAGE_CAPTURE, t);
+}
+
+/* says why nanopb won't take a ServiceEnvelope the fast parser rejected */
+static void print_envelope_error(const uint8_t *payload, size_t len)
+{
+	meshtastic_service_envelope_t e = MESHTASTIC_SERVICE_ENVELOPE_INIT_DEFAULT;
+	pb_istream_t s = pb_istream_from_buffer(payload, len);
+
+	if (pb_decode(&s, MESHTASTIC_SERVICE_ENVELOPE_FIELDS, &e)) {
+		printf("Failed to decode ServiceEnvelope: no packet\n");
+	} else {
+		printf("Failed to decode ServiceEnvelope: %s\n", PB_GET_ERROR(&s));
 	}
 
-	if (msg->payloadlen) {
-		meshtastic_service_envelope_t e = MESHTASTIC_SERVICE_ENVELOPE_INIT_DEFAULT;
+	pb_release(MESHTASTIC_SERVICE_ENVELOPE_FIELDS, &e);
+}
 
-		pb_istream_t s = pb_istream_from_buffer(msg->payload, msg->payloadlen);
-		if (pb_decode(&s, MESHTASTIC_SERVICE_ENVELOPE_FIELDS, &e)) {
-			meshtastic_mesh_packet_t *p = e.packet;
+/*
+ * decodes, decrypts and tests one ServiceEnvelope off the ring
+ * <payload> is the worker's own copy of the message, so the packet is decrypted in place
+ */
+static void process_message(struct mqtt_worker *w, uint8_t *payload, size_t len)
+{
+	if (verbose) {
+		printf("\nReceived message len %zu:\n", len);
+	}
 
+	if (len) {
+		struct comp_stats *stats = &w->run.stats;
+		struct mesh_envelope e;
+		uint64_t t = stage_start();
+		const int ret = mesh_envelope_parse(&e, payload, len);
+
+		stage_end(stats, STAGE_ENVELOPE, t);
+		if (ret == 0) {
 			if (verbose) {
-				printf("Decoded ServiceEnvelope:\nChannel ID: %s\nGateway ID: %s\n", e.channel_id, e.gateway_id);
+				printf("Decoded ServiceEnvelope:\nChannel ID: %.*s\nGateway ID: %.*s\n",
+					(int)e.channel_id_len, e.channel_id ? e.channel_id : "",
+					(int)e.gateway_id_len, e.gateway_id ? e.gateway_id : "");
 			}
 
-			if (p->which_payload_variant == MESHTASTIC_MESH_PACKET_ENCRYPTED_TAG) {
+			if (e.encrypted) {
+				uint8_t *enc = payload + (e.encrypted - payload);
+
 				if (verbose || dump) {
-					printf("Packet:\n  From: !%08x\n  To: !%08x\n  ID: 0x%08x\n  Channel: %u\n", p->from, p->to, p->id, p->channel);
+					printf("Packet:\n  From: !%08x\n  To: !%08x\n  ID: 0x%08x\n  Channel: %u\n", e.from, e.to, e.id, e.channel);
 				}
 
-				/* only interested in default (LongFast) traffic and assume the default encryption key is used */
-				if (p->channel == 8 && p->encrypted.size > 0) {
-					if (is_duplicate_packetid(p->id) == false) {
-						mesh_decrypt(p->from, p->id, (uint8_t *)&p->encrypted.bytes, p->encrypted.size);
+				/* only interested in traffic on channels we have a key for */
+				if (e.encrypted_len > 0 && e.channel <= UINT8_MAX) {
+					const struct channel *ch;
+
+					if (is_duplicate(stats, e.from, e.id)) {
+						/* this message is a dupliate from another MQTT client which uplinked it */
+					} else if ((ch = mesh_decrypt(stats, e.from, e.id, e.channel, enc, e.encrypted_len)) == NULL) {
+						atomic_fetch_add(&w->no_key, 1);
+						if (verbose) {
+							printf("  (no key for channel hash %u)\n", e.channel);
+						}
+					} else {
+						if (verbose || dump) {
+							printf("  Channel: %s\n", ch->name);
+						}
 
 						meshtastic_data_t md = MESHTASTIC_DATA_INIT_DEFAULT;
-						pb_istream_t md_s = pb_istream_from_buffer((uint8_t *)&p->encrypted.bytes, p->encrypted.size);
-						if (pb_decode(&md_s, MESHTASTIC_DATA_FIELDS, &md)) {
+						pb_istream_t md_s = pb_istream_from_buffer(enc, e.encrypted_len);
+						t = stage_start();
+						const bool decoded = pb_decode(&md_s, MESHTASTIC_DATA_FIELDS, &md);
+						stage_end(stats, STAGE_DATA, t);
+
+						if (decoded) {
+							if (capturing) {
+								capture_packet(stats, &e, md.portnum, enc);
+							}
+
 							if (dump) {
+								t = stage_start();
 								printf("  Decoded meshdata packet:\n");
-								printf("    Portnum: %d (%s)\n", md.portnum, _portnum_str(md.portnum));
+								printf("    Portnum: %d (%s)\n", md.portnum, portnum_str(md.portnum));
 								printf("    Payload size: %d bytes\n", md.payload.size);
 								printf("    Decrypted Payload: ");
 								for (int i = 0; i < md.payload.size; i++) {
 									printf("%02hhx ", md.payload.bytes[i]);
 								}
 								printf("\n");
+								stage_end(stats, STAGE_PRINT, t);
 							}
 
 							if (md.payload.size > 0) {
 								if (dump) {
+									t = stage_start();
 									decode_portnum(md.payload.bytes, md.payload.size, md.portnum);
+									stage_end(stats, STAGE_PRINT, t);
 								}
 
-								test_compression(&md);
+								test_compression(&w->run, &md);
+
+								if ((atomic_fetch_add(&mqtt_packets, 1) + 1) % MQTT_STATS_INTERVAL == 0) {
+									t = stage_start();
+									print_mqtt_stats();
+									stage_end(stats, STAGE_PRINT, t);
+								}
 							}
 
 						} else {
+							atomic_fetch_add(&w->bad_payloads, 1);
 							printf("    (failed to decode decrypted protobuf)");
 						}
-
-					} else {
-						/* this message is a dupliate from another MQTT client which uplinked it */
 					}
 
 				} else {
-					/* not from the default channel or zero payload */
+					/* zero payload */
 				}
 
 			} else {
@@ -846,7 +844,12 @@ static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_me
 			}
 
 		} else {
-			printf("Failed to decode ServiceEnvelope: %s\n", PB_GET_ERROR(&s));
+			atomic_fetch_add(&w->bad_envelopes, 1);
+			if (verbose) {
+				print_envelope_error(payload, len);
+			} else {
+				printf("Failed to decode ServiceEnvelope\n");
+			}
 		}
 
 	} else {
@@ -854,6 +857,72 @@ static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_me
 	}
 }
 
+static void *mqtt_thread(void *arg)
+{
+	struct mqtt_worker *w = (struct mqtt_worker *)arg;
+	uint8_t buf[RING_MSG_MAX];
+	int len;
+
+	while ((len = ring_pop(&mqtt_ring, buf)) >= 0) {
+		process_message(w, buf, len);
+	}
+
+	return NULL;
+}
+
+/* MQTT received message callback: runs on the network thread, so it only queues the message */
+static void on_message(struct mosquitto *m, void *obj, const struct mosquitto_message *msg)
+{
+	if (msg->payloadlen > 0) {
+		ring_push(&mqtt_ring, msg->payload, msg->payloadlen);
+	}
+}
+
+static void stop_mqtt_workers(void)
+{
+	ring_close(&mqtt_ring, mqtt_nworkers);
+	for (int i = 0; i < mqtt_nworkers; i++) {
+		pthread_join(mqtt_workers[i].thread, NULL);
+		compression_run_free(&mqtt_workers[i].run);
+	}
+
+	free(mqtt_workers);
+}
+
+/* starts <n> MQTT workers; returns 0 on success */
+static int start_mqtt_workers(int n)
+{
+	if ((mqtt_workers = calloc(n, sizeof(*mqtt_workers))) == NULL) {
+		fprintf(stderr, "Error: Out of memory\n");
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (compression_run_init(&mqtt_workers[i].run, 0, false) != 0) {
+			while (i-- > 0) {
+				compression_run_free(&mqtt_workers[i].run);
+			}
+
+			free(mqtt_workers);
+			return -1;
+		}
+	}
+
+	mqtt_nworkers = n;
+	mqtt_start_ns = now_ns();
+	for (int i = 0; i < n; i++) {
+		if (pthread_create(&mqtt_workers[i].thread, NULL, mqtt_thread, &mqtt_workers[i]) != 0) {
+			fprintf(stderr, "Error: could not start MQTT worker %d\n", i);
+			mqtt_nworkers = i;
+			stop_mqtt_workers();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
 
 /* MQTT connect callback */
 static void on_connect(struct mosquitto *m, void *ctx, int rc)
@@ -875,44 +944,405 @@ static void on_connect(struct mosquitto *m, void *ctx, int rc)
 }
 
 
+/* one replay thread: walks its shard of the corpus and keeps its own stats */
+struct replay_worker {
+	pthread_t thread;
+	struct corpus_cursor cur;
+	struct compression_run run;
+	uint32_t bad_lines, decode_failures;
+};
+
+static void *replay_thread(void *arg)
+{
+	struct replay_worker *w = (struct replay_worker *)arg;
+	uint8_t pkt[MESH_HEADER_LEN + 256];
+	int n;
+
+	while ((n = corpus_next(&w->cur, pkt, sizeof(pkt))) != 0) {
+		if (n <= MESH_HEADER_LEN) {
+			++w->bad_lines;
+			continue;
+		}
+
+		meshtastic_data_t md = MESHTASTIC_DATA_INIT_DEFAULT;
+		pb_istream_t s = pb_istream_from_buffer(pkt + MESH_HEADER_LEN, n - MESH_HEADER_LEN);
+		const uint64_t t = stage_start();
+		const bool decoded = pb_decode(&s, MESHTASTIC_DATA_FIELDS, &md);
+
+		stage_end(&w->run.stats, STAGE_DATA, t);
+		if (decoded) {
+			if (md.payload.size > 0) {
+				test_compression(&w->run, &md);
+			}
+
+		} else {
+			++w->decode_failures;
+		}
+	}
+
+	return NULL;
+}
+
+
+/* what part of a capture to replay (-p, -s); the whole of it by default */
+struct replay_filter {
+	int portnum;			/* -1 for all */
+	uint32_t since, until;		/* until 0 for no limit */
+};
+
+/* run every packet in the corpus file (or the part of a capture <f> picks) through test_compression() using <nthreads> workers */
+static int replay_corpus(const char *path, const struct replay_filter *f, int nthreads)
+{
+	struct corpus c;
+	struct replay_worker *w;
+	struct compression_run total;
+	struct timespec ts1, ts2;
+	uint32_t bad_lines = 0, decode_failures = 0;
+	double dt;
+	int i;
+
+	if (corpus_open(&c, path) != 0) {
+		return -1;
+	}
+
+	if ((f->portnum >= 0 || f->since || f->until) && ! (c.capture && c.ports)) {
+		fprintf(stderr, "Error: %s is not an indexed capture, it can only be replayed whole\n", path);
+		corpus_close(&c);
+		return -1;
+	}
+
+	if ((w = calloc(nthreads, sizeof(*w))) == NULL || compression_run_init(&total, 0, true) != 0) {
+		fprintf(stderr, "Error: Out of memory\n");
+		free(w);
+		corpus_close(&c);
+		return -1;
+	}
+
+	printf("Replaying %s (%zd bytes) with %d thread%s\n", path, c.len, nthreads, (nthreads > 1) ? "s" : "");
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+	for (i = 0; i < nthreads; i++) {
+		if (compression_run_init(&w[i].run, 0, ! verbose) != 0) {
+			break;
+		}
+
+		if (f->portnum >= 0) {
+			corpus_port(&c, &w[i].cur, f->portnum, i, nthreads);
+		} else {
+			corpus_shard(&c, &w[i].cur, i, nthreads);
+		}
+
+		if (f->since || f->until) {
+			corpus_time_range(&c, &w[i].cur, f->since, f->until);
+		}
+
+		if (pthread_create(&w[i].thread, NULL, replay_thread, &w[i]) != 0) {
+			fprintf(stderr, "Error: could not start replay thread %d\n", i);
+			compression_run_free(&w[i].run);
+			break;
+		}
+	}
+
+	nthreads = i;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		comp_stats_merge(&total.stats, &w[i].run.stats);
+		compression_run_free(&w[i].run);
+		bad_lines += w[i].bad_lines;
+		decode_failures += w[i].decode_failures;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts2);
+	dt = (ts2.tv_sec - ts1.tv_sec) + 1e-9 * (ts2.tv_nsec - ts1.tv_nsec);
+
+	print_compression_stats(&total);
+	printf("%llu packets in %.3f seconds (%.0f packets/s), %u bad lines, %u undecodable packets\n", (unsigned long long)total.stats.packets, dt, total.stats.packets / dt, bad_lines, decode_failures);
+
+	compression_run_free(&total);
+	free(w);
+	corpus_close(&c);
+	return 0;
+}
+
+
+/*
+ * SIGINT and SIGTERM disconnect the client, so mosquitto_loop_forever() returns and
+ * main() cleans up.  mosquitto_disconnect() takes the library's locks, so it can't be
+ * called from a signal handler: the signals are blocked in every thread instead, and
+ * one thread of their own waits for them.
+ */
+static pthread_mutex_t mqtt_client_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mosquitto *mqtt_client;		/* the client to disconnect, once it has connected */
+static atomic_bool stopping;
+
+static void *signal_thread(void *arg)
+{
+	const sigset_t *set = (const sigset_t *)arg;
+	int sig;
+
+	while (sigwait(set, &sig) == 0) {
+		if (stopping) {
+			/* a second signal: shutting down is stuck, so go the usual way */
+			signal(sig, SIG_DFL);
+			pthread_sigmask(SIG_UNBLOCK, set, NULL);
+			raise(sig);
+		}
+
+		stopping = true;
+		pthread_mutex_lock(&mqtt_client_lock);
+		if (mqtt_client) {
+			mosquitto_disconnect(mqtt_client);
+		}
+
+		pthread_mutex_unlock(&mqtt_client_lock);
+	}
+
+	return NULL;
+}
+
+/* blocks SIGINT and SIGTERM here and in every thread started after, and starts the thread that takes them; returns 0 on success */
+static int catch_signals(void)
+{
+	static sigset_t set;
+	pthread_t t;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (pthread_create(&t, NULL, signal_thread, &set) != 0) {
+		fprintf(stderr, "Error: could not start the signal thread\n");
+		pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		return -1;
+	}
+
+	pthread_detach(t);
+	return 0;
+}
+
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-v] [-d] [-D] [-k key_file] [-W seconds] [-j threads] [-q slots] [-b] [-P [addr:]port] [-t stats_topic] [-T seconds] [-w capture_file] [-L] [-M model_file] [-c coder] [-e backend] <broker_host> <port> <topic> <username> <password> [ca_file]\n", argv0);
+	fprintf(stderr, "       %s [-v] [-L] [-M model_file] [-c coder] [-e backend] -r <corpus_file> [-p portnum] [-s from[-to]] [-j threads]\n", argv0);
+	fprintf(stderr, "  -v  verbose\n");
+	fprintf(stderr, "  -d  dump decoded packets\n");
+	fprintf(stderr, "  -D  debug (dump crypto state)\n");
+	fprintf(stderr, "  -k  decrypt the channels in this file (name and base64 PSK per line; default: LongFast AQ==)\n");
+	fprintf(stderr, "  -W  drop packets already seen within this many seconds (default: 600)\n");
+	fprintf(stderr, "  -r  replay a hex packet dump or a capture instead of connecting to MQTT\n");
+	fprintf(stderr, "  -p  replay only this portnum from a capture\n");
+	fprintf(stderr, "  -s  replay only packets from a capture received in this span of unix times (to is exclusive)\n");
+	fprintf(stderr, "  -j  number of replay threads or MQTT workers (default: number of CPUs)\n");
+	fprintf(stderr, "  -q  MQTT messages that can wait for a worker (default: 4096)\n");
+	fprintf(stderr, "  -b  when the queue is full, make the MQTT client wait instead of dropping the oldest message\n");
+	fprintf(stderr, "  -P  serve Prometheus metrics over HTTP on this port (on localhost unless an address is given)\n");
+	fprintf(stderr, "  -t  publish a JSON stats snapshot to this MQTT topic\n");
+	fprintf(stderr, "  -T  seconds between stats snapshots (default: 10)\n");
+	fprintf(stderr, "  -w  write each new packet that decrypts to this capture file, indexed when stopped with SIGINT or SIGTERM\n");
+	fprintf(stderr, "  -L  time each stage of the packet path, and show how long they take with the stats\n");
+	fprintf(stderr, "  -M  load pretrained models from this file (implies -c static unless -c is given)\n");
+	fprintf(stderr, "  -c  coder: packet (model built from each packet, default), static (pretrained models),\n");
+	fprintf(stderr, "      adaptive (adaptive order-0, starting from the pretrained model if there is one),\n");
+	fprintf(stderr, "      order1 or order2 (pretrained context models) or wire (pretrained protobuf wire-format models)\n");
+	fprintf(stderr, "  -e  entropy coder behind the model: arith (arithmetic coder, default), rans (range ANS)\n");
+	fprintf(stderr, "      or tans (table-driven ANS for the static coder, range ANS for the others)\n");
+}
+
+
 int main(int argc, char *argv[])
 {
+	const char *corpus_file = NULL;
+	const char *model_file = NULL;
+	const char *coder_name = NULL;
+	const char *backend_name = NULL;
+	const char *key_file = NULL;
+	uint32_t dup_window = 600;
+	size_t queue_slots = 4096;
+	enum ring_policy policy = RING_DROP_OLDEST;
+	const char *metrics_listen = NULL;
+	const char *stats_topic = NULL;
+	unsigned stats_interval = 10;
+	const char *capture_file = NULL;
+	struct replay_filter filter = { .portnum = -1 };
+	int nthreads = 0;
+	int opt;
+
 	verbose = debug = dump = false;
 
-	if (argc < 6) {
-		fprintf(stderr, "Usage: %s <broker_host> <port> <topic> <username> <password> [ca_file]\n", argv[0]);
+	while ((opt = getopt(argc, argv, "vdDr:p:s:j:M:c:e:k:W:q:bP:t:T:w:Lh")) != -1) {
+		switch (opt) {
+		case 'v': verbose = true; break;
+		case 'd': dump = true; break;
+		case 'D': debug = true; break;
+		case 'r': corpus_file = optarg; break;
+		case 'p': filter.portnum = atoi(optarg); break;
+		case 's':
+			if (sscanf(optarg, "%u-%u", &filter.since, &filter.until) < 1) {
+				usage(argv[0]);
+				return -1;
+			}
+
+			break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 'M': model_file = optarg; break;
+		case 'c': coder_name = optarg; break;
+		case 'e': backend_name = optarg; break;
+		case 'k': key_file = optarg; break;
+		case 'W': dup_window = atoi(optarg); break;
+		case 'q': queue_slots = atoi(optarg); break;
+		case 'b': policy = RING_BLOCK; break;
+		case 'P': metrics_listen = optarg; break;
+		case 't': stats_topic = optarg; break;
+		case 'T': stats_interval = atoi(optarg); break;
+		case 'w': capture_file = optarg; break;
+		case 'L': timing = true; break;
+		default:
+			usage(argv[0]);
+			return -1;
+		};
+	}
+
+	channel_table_init(&channels);
+	if (key_file) {
+		if (channel_table_load(&channels, key_file) != 0) {
+			fprintf(stderr, "Error: could not load channel keys from %s\n", key_file);
+			return -1;
+		}
+	} else if (channel_add(&channels, "LongFast", "AQ==") != 0) {
+		return -1;
+	}
+
+	if (debug) {
+		printf("AES: %s\n", aes_impl());
+		for (size_t i = 0; i < channels.n; i++) {
+			printf("channel %-11s hash %3u, AES-%zu\n", channels.chan[i].name, channels.chan[i].hash, channels.chan[i].psk_len * 8);
+		}
+	}
+
+	if (model_file) {
+		model_set_init(&models);
+		if (model_set_load(&models, model_file) != 0) {
+			fprintf(stderr, "Error: could not load models from %s\n", model_file);
+			return -1;
+		}
+
+		use_models = true;
+		coder = CODER_STATIC;
+	}
+
+	if (coder_name) {
+		int i;
+
+		if ((i = coder_from_name(coder_name)) < 0) {
+			fprintf(stderr, "Error: unknown coder %s\n", coder_name);
+			return -1;
+		}
+
+		coder = i;
+		if (coder_needs_models(coder) && ! use_models) {
+			fprintf(stderr, "Error: the %s coder needs a model file (-M)\n", coder_name);
+			return -1;
+		}
+	}
+
+	if (backend_name) {
+		int i;
+
+		if ((i = backend_from_name(backend_name)) < 0) {
+			fprintf(stderr, "Error: unknown backend %s\n", backend_name);
+			return -1;
+		}
+
+		backend = i;
+	}
+
+	if (timing) {
+		/* calibrate the tick counter now rather than in the middle of the first stats dump */
+		printf("Timing stages, %.3f ticks/ns\n", ticks_per_ns());
+	}
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (nthreads > 0) ? nthreads : 1;
+	}
+
+	if (corpus_file) {
+		return replay_corpus(corpus_file, &filter, nthreads);
+	}
+
+	if (argc - optind < 5) {
+		usage(argv[0]);
 		return -1;
 	}
 
-	const char *host = argv[1];
-	int port = atoi(argv[2]);
-	const char *topic = argv[3];
-	const char *username = argv[4];
-	const char *password = argv[5];
-	const char *cafile = argc > 6 ? argv[6] : NULL;
+	const char *host = argv[optind];
+	int port = atoi(argv[optind + 1]);
+	const char *topic = argv[optind + 2];
+	const char *username = argv[optind + 3];
+	const char *password = argv[optind + 4];
+	const char *cafile = argc - optind > 5 ? argv[optind + 5] : NULL;
 	char client_id[32];
 	time_t t;
+	struct metrics_http http;
+	struct metrics_publisher publisher;
+	struct mosquitto *m;
+	int ret = -1;
 
 	struct user_context context = {
 		.topic = topic
 	};
 
+	/* before any other thread starts, so that none of them ever sees the signals */
+	if (catch_signals() != 0) {
+		return -1;
+	}
+
+	if (capture_file) {
+		if (capture_create(&capture, capture_file) != 0) {
+			return -1;
+		}
+
+		capturing = true;
+		printf("Capturing packets to %s\n", capture_file);
+	}
+
+	if (compression_run_init(&mqtt_run, 0, true) != 0) {
+		goto out_capture;
+	}
+
+	if (dedup_init(&dups, dup_window, 4096) != 0 || ring_init(&mqtt_ring, queue_slots, policy) != 0) {
+		goto out_run;
+	}
+
+	if (start_mqtt_workers(nthreads) != 0) {
+		goto out_ring;
+	}
+
+	printf("%d worker%s, %zu slot queue, %s when full\n", nthreads, (nthreads > 1) ? "s" : "", mqtt_ring.mask + 1,
+	       (policy == RING_BLOCK) ? "blocking" : "dropping the oldest");
+
+	if (metrics_listen) {
+		if (metrics_http_start(&http, metrics_listen, mqtt_snapshot) != 0) {
+			goto out_workers;
+		}
+
+		printf("Serving metrics on %s\n", metrics_listen);
+	}
+
 	mosquitto_lib_init();
 
 	time(&t);
 	srand((int)t);
 	snprintf(client_id, sizeof(client_id), "compression_test-%u", rand());
-	struct mosquitto *m = mosquitto_new(client_id, true, &context);
-	if (!m) {
+	if ((m = mosquitto_new(client_id, true, &context)) == NULL) {
 		fprintf(stderr, "Error: Out of memory\n");
-		return -1;
+		goto out_lib;
 	}
 
 	if (mosquitto_username_pw_set(m, username, password) != MOSQ_ERR_SUCCESS) {
 		fprintf(stderr, "Error setting credentials\n");
-		mosquitto_destroy(m);
-		mosquitto_lib_cleanup();
-		return -1;
+		goto out_client;
 	}
 
 	// Set TLS options if CA file is provided
@@ -920,9 +1350,8 @@ int main(int argc, char *argv[])
 		int rc = mosquitto_tls_set(m, cafile, NULL, NULL, NULL, NULL);
 		if (rc != MOSQ_ERR_SUCCESS) {
 			fprintf(stderr, "Error: TLS setup failed: %s\n", mosquitto_strerror(rc));
-			mosquitto_destroy(m);
-			mosquitto_lib_cleanup();
-			return 1;
+			ret = 1;
+			goto out_client;
 		}
 
 		// Force TLSv1.2
@@ -935,16 +1364,56 @@ int main(int argc, char *argv[])
 	int rc = mosquitto_connect(m, host, port, 60);
 	if (rc != MOSQ_ERR_SUCCESS) {
 		fprintf(stderr, "Error: Could not connect to broker: %s\n", mosquitto_strerror(rc));
-		mosquitto_destroy(m);
-		mosquitto_lib_cleanup();
-		return -1;
+		goto out_client;
 	}
 
+	/* from here on, Ctrl-C or a kill disconnects, and the loop below returns */
+	pthread_mutex_lock(&mqtt_client_lock);
+	mqtt_client = m;
+	pthread_mutex_unlock(&mqtt_client_lock);
+
 	printf("Connecting to %s:%d\n", host, port);
-	mosquitto_loop_forever(m, -1, 1);
+	if (stats_topic && metrics_publish_start(&publisher, m, stats_topic, stats_interval, mqtt_snapshot) == 0) {
+		printf("Publishing stats to %s every %u seconds\n", stats_topic, publisher.interval);
+	} else {
+		stats_topic = NULL;
+	}
+
+	/* a signal before the client was connected had nothing to disconnect */
+	if (! stopping) {
+		mosquitto_loop_forever(m, -1, 1);
+	}
+
+	if (stopping) {
+		printf("Stopping\n");
+	}
 
+	if (stats_topic) {
+		metrics_publish_stop(&publisher);
+	}
+
+	ret = 0;
+
+out_client:
+	pthread_mutex_lock(&mqtt_client_lock);
+	mqtt_client = NULL;
+	pthread_mutex_unlock(&mqtt_client_lock);
 	mosquitto_destroy(m);
+out_lib:
 	mosquitto_lib_cleanup();
-	return 0;
-}
+	if (metrics_listen) {
+		metrics_http_stop(&http);
+	}
+out_workers:
+	stop_mqtt_workers();
+out_ring:
+	ring_free(&mqtt_ring);
+out_run:
+	compression_run_free(&mqtt_run);
+out_capture:
+	if (capturing) {
+		capture_close(&capture);
+	}
 
+	return ret;
+}
@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <mosquitto.h>
+
+#include "metrics.h"
+#include "portnum.h"
+#include "ticks.h"
+
+static const double quantiles[] = { 0.5, 0.9, 0.99 };
+#define NQUANTILES	(sizeof(quantiles) / sizeof(quantiles[0]))
+
+/* one counter or gauge with its HELP and TYPE lines */
+static void prom_value(FILE *f, const char *name, const char *type, const char *help, double v)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, v);
+}
+
+/* the time each stage of the packet path takes, if anything timed them */
+static void prom_stages(FILE *f, const struct comp_stats *s)
+{
+	const char *name = "mct_stage_seconds";
+	bool first = true;
+
+	for (int st = 0; st < STAGE_MAX; st++) {
+		uint64_t n = 0;
+
+		if (comp_stats_stage_count(s, st) == 0) {
+			continue;
+		}
+
+		if (first) {
+			fprintf(f, "# HELP %s Time spent in each stage of the packet path.\n# TYPE %s histogram\n", name, name);
+			first = false;
+		}
+
+		for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+			n += atomic_load_explicit(&s->stage[st][b], memory_order_relaxed);
+			if (b < STATS_LAT_BUCKETS - 1) {
+				fprintf(f, "%s_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n", name, stage_names[st],
+					comp_stats_latency_bound(b) / ticks_per_ns() * 1e-9, (unsigned long long)n);
+			} else {
+				fprintf(f, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", name, stage_names[st], (unsigned long long)n);
+			}
+		}
+
+		fprintf(f, "%s_sum{stage=\"%s\"} %.9f\n", name, stage_names[st], atomic_load(&s->stage_ticks[st]) / ticks_per_ns() * 1e-9);
+		fprintf(f, "%s_count{stage=\"%s\"} %llu\n", name, stage_names[st], (unsigned long long)n);
+	}
+}
+
+static void prom_labels(char *buf, size_t len, unsigned portnum)
+{
+	snprintf(buf, len, "portnum=\"%u\",app=\"%s\"", portnum, portnum_str(portnum));
+}
+
+/* a counter per portnum */
+static void prom_port_counter(FILE *f, const struct comp_stats *s, const char *name, const char *help, size_t offset)
+{
+	char labels[64];
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+	for (unsigned i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *p = comp_stats_port(s, i);
+
+		if (p) {
+			prom_labels(labels, sizeof(labels), i);
+			fprintf(f, "%s{%s} %llu\n", name, labels, (unsigned long long)atomic_load((const atomic_uint_fast64_t *)((const char *)p + offset)));
+		}
+	}
+}
+
+void metrics_write_prometheus(FILE *f, const struct metrics_snapshot *s)
+{
+	const struct comp_stats *cs = &s->stats;
+	char labels[64];
+	double c;
+
+	prom_value(f, "mct_uptime_seconds", "gauge", "Seconds since the monitor started.", s->uptime);
+	prom_value(f, "mct_messages_total", "counter", "MQTT messages queued for the workers.", s->messages);
+	prom_value(f, "mct_queue_dropped_total", "counter", "Queued messages dropped to make room.", s->queue_dropped);
+	prom_value(f, "mct_queue_oversize_total", "counter", "Messages too big to queue.", s->queue_oversize);
+	prom_value(f, "mct_queue_waits_total", "counter", "Times the MQTT client waited for room in the queue.", s->queue_waits);
+	prom_value(f, "mct_queue_depth", "gauge", "Messages waiting for a worker.", s->queue_depth);
+	prom_value(f, "mct_duplicates_total", "counter", "Packets dropped as already seen through another gateway.", s->duplicates);
+	prom_value(f, "mct_unique_packets_total", "counter", "Packets not seen before within the duplicate window.", s->unique);
+	prom_value(f, "mct_bad_envelopes_total", "counter", "Messages that were not a ServiceEnvelope with a packet.", s->bad_envelopes);
+	prom_value(f, "mct_undecrypted_packets_total", "counter", "Packets no channel key decrypted.", s->no_key);
+	prom_value(f, "mct_bad_payloads_total", "counter", "Decrypted packets that did not decode.", s->bad_payloads);
+	prom_value(f, "mct_packets_total", "counter", "Packets run through the coder.", atomic_load(&cs->packets));
+
+	prom_stages(f, cs);
+
+	prom_port_counter(f, cs, "mct_port_packets_total", "Packets that round-tripped, by portnum.", offsetof(struct port_stats, num));
+	prom_port_counter(f, cs, "mct_port_compressed_packets_total", "Packets that compressed by more than 1%, by portnum.", offsetof(struct port_stats, ncomp));
+	prom_port_counter(f, cs, "mct_port_uncompressed_bytes_total", "Bytes in, of packets that compressed.", offsetof(struct port_stats, unc_bytes));
+	prom_port_counter(f, cs, "mct_port_compressed_bytes_total", "Bytes out, of packets that compressed.", offsetof(struct port_stats, comp_bytes));
+
+	fprintf(f, "# HELP mct_compression_ratio_percent Compression ratio of packets that compressed, by portnum.\n# TYPE mct_compression_ratio_percent summary\n");
+	for (unsigned i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *p = comp_stats_port(cs, i);
+
+		if (p && atomic_load(&p->ncomp)) {
+			prom_labels(labels, sizeof(labels), i);
+			for (size_t q = 0; q < NQUANTILES; q++) {
+				fprintf(f, "mct_compression_ratio_percent{%s,quantile=\"%g\"} %.2f\n", labels, quantiles[q], port_stats_ratio(p, quantiles[q]));
+			}
+
+			fprintf(f, "mct_compression_ratio_percent_sum{%s} %.2f\n", labels, atomic_load(&p->ratio_sum) / 100.0);
+			fprintf(f, "mct_compression_ratio_percent_count{%s} %llu\n", labels, (unsigned long long)atomic_load(&p->ncomp));
+		}
+	}
+
+	fprintf(f, "# HELP mct_payload_bytes Uncompressed length of packets that compressed, by portnum.\n# TYPE mct_payload_bytes summary\n");
+	for (unsigned i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *p = comp_stats_port(cs, i);
+
+		if (p && atomic_load(&p->ncomp)) {
+			prom_labels(labels, sizeof(labels), i);
+			for (size_t q = 0; q < NQUANTILES; q++) {
+				fprintf(f, "mct_payload_bytes{%s,quantile=\"%g\"} %u\n", labels, quantiles[q], port_stats_len(p, quantiles[q], &c));
+			}
+
+			fprintf(f, "mct_payload_bytes_sum{%s} %llu\n", labels, (unsigned long long)atomic_load(&p->unc_bytes));
+			fprintf(f, "mct_payload_bytes_count{%s} %llu\n", labels, (unsigned long long)atomic_load(&p->ncomp));
+		}
+	}
+}
+
+static void json_stages(FILE *f, const struct comp_stats *s)
+{
+	const double tpn = ticks_per_ns();
+	bool first = true;
+
+	fprintf(f, "\"stages\":{");
+	for (int st = 0; st < STAGE_MAX; st++) {
+		const uint64_t n = comp_stats_stage_count(s, st);
+
+		if (n == 0) {
+			continue;
+		}
+
+		fprintf(f, "%s\"%s\":{\"count\":%llu,\"mean_ns\":%.0f", first ? "" : ",", stage_names[st], (unsigned long long)n,
+			atomic_load(&s->stage_ticks[st]) / tpn / n);
+		for (size_t q = 0; q < NQUANTILES; q++) {
+			/* the bucket's upper bound, or -1 past the last one */
+			const uint64_t b = comp_stats_stage_quantile(s, st, quantiles[q]);
+
+			fprintf(f, ",\"p%g_ns\":%.0f", 100 * quantiles[q], b ? b / tpn : -1.0);
+		}
+
+		fprintf(f, "}");
+		first = false;
+	}
+
+	fprintf(f, "}");
+}
+
+void metrics_write_json(FILE *f, const struct metrics_snapshot *s)
+{
+	const struct comp_stats *cs = &s->stats;
+	bool first = true;
+	double c;
+
+	fprintf(f, "{\"uptime\":%.1f,\"rate\":%.2f,\"packets\":%llu,\"messages\":%llu,", s->uptime, s->rate,
+		(unsigned long long)atomic_load(&cs->packets), (unsigned long long)s->messages);
+	fprintf(f, "\"queue\":{\"dropped\":%llu,\"oversize\":%llu,\"waits\":%llu,\"depth\":%llu},",
+		(unsigned long long)s->queue_dropped, (unsigned long long)s->queue_oversize, (unsigned long long)s->queue_waits,
+		(unsigned long long)s->queue_depth);
+	fprintf(f, "\"duplicates\":%llu,\"unique\":%llu,\"bad_envelopes\":%llu,\"no_key\":%llu,\"bad_payloads\":%llu,",
+		(unsigned long long)s->duplicates, (unsigned long long)s->unique, (unsigned long long)s->bad_envelopes,
+		(unsigned long long)s->no_key, (unsigned long long)s->bad_payloads);
+
+	json_stages(f, cs);
+	fprintf(f, ",\"ports\":[");
+
+	for (unsigned i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *p = comp_stats_port(cs, i);
+		uint64_t ncomp;
+
+		if (p == NULL || atomic_load(&p->num) == 0) {
+			continue;
+		}
+
+		ncomp = atomic_load(&p->ncomp);
+		fprintf(f, "%s{\"portnum\":%u,\"app\":\"%s\",\"packets\":%llu,\"compressed\":%llu", first ? "" : ",", i, portnum_str(i),
+			(unsigned long long)atomic_load(&p->num), (unsigned long long)ncomp);
+		first = false;
+
+		if (ncomp) {
+			fprintf(f, ",\"bytes_in\":%llu,\"bytes_out\":%llu,\"ratio\":{\"mean\":%.2f", (unsigned long long)atomic_load(&p->unc_bytes),
+				(unsigned long long)atomic_load(&p->comp_bytes), atomic_load(&p->ratio_sum) / (100.0 * ncomp));
+			for (size_t q = 0; q < NQUANTILES; q++) {
+				fprintf(f, ",\"p%g\":%.2f", 100 * quantiles[q], port_stats_ratio(p, quantiles[q]));
+			}
+
+			fprintf(f, "},\"length\":{\"mean\":%.1f", (double)atomic_load(&p->unc_bytes) / ncomp);
+			for (size_t q = 0; q < NQUANTILES; q++) {
+				fprintf(f, ",\"p%g\":%u", 100 * quantiles[q], port_stats_len(p, quantiles[q], &c));
+			}
+
+			fprintf(f, "}");
+		}
+
+		fprintf(f, "}");
+	}
+
+	fprintf(f, "]}");
+}
+
+/* writes <snap> to a new buffer at *<buf> with <write>; returns 0 on success */
+static int render(const struct metrics_snapshot *snap, void (*write)(FILE *, const struct metrics_snapshot *), char **buf, size_t *len)
+{
+	FILE *f;
+
+	*buf = NULL;
+	if ((f = open_memstream(buf, len)) == NULL) {
+		return -1;
+	}
+
+	write(f, snap);
+	if (fclose(f) != 0) {
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		const ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			return -1;
+		}
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void serve(struct metrics_http *h, int fd)
+{
+	const struct timeval tv = { .tv_sec = 2 };
+	char req[1024], head[160];
+	size_t n = 0;
+	ssize_t r;
+	char *body;
+	size_t len;
+
+	/* a client that stalls only holds the server up for a couple of seconds */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/* the request line and headers; the body, if any, is ignored */
+	while (n < sizeof(req) - 1 && (r = recv(fd, req + n, sizeof(req) - 1 - n, 0)) > 0) {
+		n += r;
+		req[n] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+			break;
+		}
+	}
+
+	req[n] = '\0';
+	if (strncmp(req, "GET ", 4) != 0) {
+		static const char bad[] = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+		send_all(fd, bad, sizeof(bad) - 1);
+		return;
+	}
+
+	if (h->snapshot(&h->snap) != 0 || render(&h->snap, metrics_write_prometheus, &body, &len) != 0) {
+		static const char err[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+		send_all(fd, err, sizeof(err) - 1);
+		return;
+	}
+
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	if (send_all(fd, head, strlen(head)) == 0) {
+		send_all(fd, body, len);
+	}
+
+	free(body);
+}
+
+static void *http_thread(void *arg)
+{
+	struct metrics_http *h = (struct metrics_http *)arg;
+	int fd;
+
+	for (;;) {
+		if ((fd = accept(h->fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+
+			/* metrics_http_stop() shut the socket down */
+			break;
+		}
+
+		serve(h, fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int metrics_http_start(struct metrics_http *h, const char *listen_on, metrics_snapshot_fn snapshot)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE }, *ai, *a;
+	char host[256] = "127.0.0.1";
+	const char *port = listen_on, *colon = strrchr(listen_on, ':');
+	int rc, one = 1;
+
+	if (colon) {
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - listen_on), listen_on);
+		port = colon + 1;
+	}
+
+	if ((rc = getaddrinfo(host, port, &hints, &ai)) != 0) {
+		fprintf(stderr, "metrics: %s: %s\n", listen_on, gai_strerror(rc));
+		return -1;
+	}
+
+	h->fd = -1;
+	for (a = ai; a && h->fd < 0; a = a->ai_next) {
+		if ((h->fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0) {
+			continue;
+		}
+
+		setsockopt(h->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(h->fd, a->ai_addr, a->ai_addrlen) != 0 || listen(h->fd, 8) != 0) {
+			close(h->fd);
+			h->fd = -1;
+		}
+	}
+
+	freeaddrinfo(ai);
+	if (h->fd < 0) {
+		fprintf(stderr, "metrics: can't listen on %s: %s\n", listen_on, strerror(errno));
+		return -1;
+	}
+
+	h->snapshot = snapshot;
+	comp_stats_init(&h->snap.stats);
+	if (pthread_create(&h->thread, NULL, http_thread, h) != 0) {
+		fprintf(stderr, "metrics: could not start the HTTP thread\n");
+		close(h->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_http_stop(struct metrics_http *h)
+{
+	shutdown(h->fd, SHUT_RDWR);
+	pthread_join(h->thread, NULL);
+	close(h->fd);
+	comp_stats_free(&h->snap.stats);
+}
+
+static void *publish_thread(void *arg)
+{
+	struct metrics_publisher *p = (struct metrics_publisher *)arg;
+	uint64_t packets, last_packets = 0;
+	double last_uptime = 0.0;
+	struct timespec deadline;
+	size_t len;
+	char *buf;
+	int rc;
+
+	pthread_mutex_lock(&p->lock);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while (! p->stop) {
+		deadline.tv_sec += p->interval;
+		while (! p->stop && pthread_cond_timedwait(&p->cond, &p->lock, &deadline) != ETIMEDOUT) {
+		}
+
+		if (p->stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&p->lock);
+
+		if (p->snapshot(&p->snap) == 0) {
+			packets = atomic_load(&p->snap.stats.packets);
+			p->snap.rate = (p->snap.uptime > last_uptime) ? (packets - last_packets) / (p->snap.uptime - last_uptime) : 0.0;
+			last_packets = packets;
+			last_uptime = p->snap.uptime;
+
+			if (render(&p->snap, metrics_write_json, &buf, &len) == 0) {
+				if ((rc = mosquitto_publish(p->m, NULL, p->topic, len, buf, 0, false)) != MOSQ_ERR_SUCCESS) {
+					fprintf(stderr, "metrics: publish to %s failed: %s\n", p->topic, mosquitto_strerror(rc));
+				}
+
+				free(buf);
+			}
+		}
+
+		pthread_mutex_lock(&p->lock);
+	}
+
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+int metrics_publish_start(struct metrics_publisher *p, struct mosquitto *m, const char *topic, unsigned interval, metrics_snapshot_fn snapshot)
+{
+	p->m = m;
+	p->topic = topic;
+	p->interval = (interval > 0) ? interval : 1;
+	p->snapshot = snapshot;
+	p->stop = false;
+	p->snap.rate = 0.0;
+	comp_stats_init(&p->snap.stats);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	if (pthread_create(&p->thread, NULL, publish_thread, p) != 0) {
+		fprintf(stderr, "metrics: could not start the publisher thread\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_publish_stop(struct metrics_publisher *p)
+{
+	pthread_mutex_lock(&p->lock);
+	p->stop = true;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	pthread_join(p->thread, NULL);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	comp_stats_free(&p->snap.stats);
+}
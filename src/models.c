@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "models.h"
+
+void model_set_init(struct model_set *ms)
+{
+	memset(ms, 0, sizeof(*ms));
+}
+
+static void port_model_free(struct port_model *pm)
+{
+	if (pm == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < MODEL_MAX_ORDER; i++) {
+		ac_context_free(&pm->context[i]);
+	}
+
+	ac_context_free(&pm->wire);
+	free(pm);
+}
+
+void model_set_free(struct model_set *ms)
+{
+	for (int i = 0; i < MODEL_MAX_PORTNUM; i++) {
+		port_model_free(ms->port[i]);
+	}
+
+	port_model_free(ms->fallback);
+	memset(ms, 0, sizeof(*ms));
+}
+
+static struct port_model **model_slot(struct model_set *ms, unsigned portnum)
+{
+	if (portnum == MODEL_DEFAULT) {
+		return &ms->fallback;
+	}
+
+	return (portnum < MODEL_MAX_PORTNUM) ? &ms->port[portnum] : NULL;
+}
+
+/* takes ownership of <pm> */
+static int model_set_put(struct model_set *ms, unsigned portnum, struct port_model *pm)
+{
+	struct port_model **slot;
+
+	if ((slot = model_slot(ms, portnum)) == NULL) {
+		fprintf(stderr, "%s: portnum %u out of range\n", __func__, portnum);
+		port_model_free(pm);
+		return -1;
+	}
+
+	ac_lut_build(&pm->lut, &pm->model);
+	ac_adaptive_init(&pm->prior, &pm->model, AC_ADAPT_WEIGHT, AC_ADAPT_INC);
+	if (ac_tans_build(&pm->tans, &pm->model) != 0) {
+		port_model_free(pm);
+		return -1;
+	}
+
+	port_model_free(*slot);
+	*slot = pm;
+	return 0;
+}
+
+int model_set_add(struct model_set *ms, unsigned portnum, const u32 *counts, size_t nsym)
+{
+	struct port_model *pm;
+
+	if ((pm = calloc(1, sizeof(*pm))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		return -1;
+	}
+
+	if (ac_model_from_counts(&pm->model, counts, nsym) != 0) {
+		free(pm);
+		return -1;
+	}
+
+	return model_set_put(ms, portnum, pm);
+}
+
+/* where the order-<order> context model of <pm> lives */
+static ac_context_t *port_model_slot(struct port_model *pm, unsigned order)
+{
+	if (order > MODEL_MAX_ORDER) {
+		return NULL;
+	}
+
+	return (order) ? &pm->context[order - 1] : &pm->wire;
+}
+
+/* takes ownership of the tables in <cm> */
+static int model_set_put_context(struct model_set *ms, unsigned portnum, ac_context_t *cm)
+{
+	struct port_model **slot;
+	ac_context_t *dst;
+
+	slot = model_slot(ms, portnum);
+	if (slot == NULL || *slot == NULL || (dst = port_model_slot(*slot, cm->order)) == NULL) {
+		fprintf(stderr, "%s: no model for an order-%u context for portnum %u\n", __func__, cm->order, portnum);
+		ac_context_free(cm);
+		return -1;
+	}
+
+	ac_context_free(dst);
+	*dst = *cm;
+	dst->order0 = &(*slot)->model;
+	dst->lut0 = &(*slot)->lut;
+	return 0;
+}
+
+int model_set_add_context(struct model_set *ms, unsigned portnum, u32 order, u32 bits, const u32 *counts, u32 min_total)
+{
+	ac_context_t cm;
+
+	if (ac_context_from_counts(&cm, order, bits, counts, min_total) != 0) {
+		return -1;
+	}
+
+	return model_set_put_context(ms, portnum, &cm);
+}
+
+const ac_context_t *port_model_context(const struct port_model *pm, unsigned order)
+{
+	const ac_context_t *cm;
+
+	if (pm == NULL || (cm = port_model_slot((struct port_model *)pm, order)) == NULL || cm->slot == NULL) {
+		return NULL;
+	}
+
+	return cm;
+}
+
+const struct port_model *model_set_get(const struct model_set *ms, unsigned portnum)
+{
+	if (portnum < MODEL_MAX_PORTNUM && ms->port[portnum]) {
+		return ms->port[portnum];
+	}
+
+	return ms->fallback;
+}
+
+
+static void put_u16(FILE *f, unsigned v)
+{
+	fputc(v & 0xff, f);
+	fputc((v >> 8) & 0xff, f);
+}
+
+static void put_varint(FILE *f, u32 v)
+{
+	while (v >= 0x80) {
+		fputc((v & 0x7f) | 0x80, f);
+		v >>= 7;
+	}
+
+	fputc(v, f);
+}
+
+static int save_model(FILE *f, unsigned portnum, const ac_model_t *m)
+{
+	fputc(MODEL_KIND_ORDER0, f);
+	put_u16(f, portnum);
+	put_u16(f, m->nsym);
+	for (u32 i = 0; i < m->nsym; i++) {
+		put_varint(f, m->cum[i + 1] - m->cum[i]);
+	}
+
+	put_varint(f, AC_MODEL_TOTAL - m->cum[m->nsym]);
+	return ferror(f) ? -1 : 0;
+}
+
+static int save_context(FILE *f, unsigned portnum, const ac_context_t *cm)
+{
+	const u32 nslot = 1U << cm->bits;
+	const u32 *t;
+	u32 ntables = 0, c, i, hi;
+
+	for (c = 0; c < nslot; c++) {
+		ntables += (cm->slot[c] != AC_CTX_NONE);
+	}
+
+	fputc(MODEL_KIND_CONTEXT, f);
+	put_u16(f, portnum);
+	fputc(cm->order, f);
+	fputc(cm->bits, f);
+	put_varint(f, ntables);
+
+	for (c = 0; c < nslot; c++) {
+		if (cm->slot[c] == AC_CTX_NONE) {
+			continue;
+		}
+
+		t = cm->pool + cm->slot[c];
+		put_u16(f, c);
+		put_u16(f, t[0]);
+		for (i = 1; i <= t[0]; i++) {
+			hi = (i < t[0]) ? AC_CTX_CUM(t[i + 1]) : AC_MODEL_TOTAL;
+			put_u16(f, AC_CTX_SYM(t[i]));
+			put_varint(f, hi - AC_CTX_CUM(t[i]));
+		}
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* a model and its context models */
+static unsigned count_records(const struct port_model *pm)
+{
+	unsigned count = 0;
+
+	if (pm) {
+		count++;
+		for (int i = 0; i <= MODEL_MAX_ORDER; i++) {
+			count += (port_model_context(pm, i) != NULL);
+		}
+	}
+
+	return count;
+}
+
+static int save_port_model(FILE *f, unsigned portnum, const struct port_model *pm)
+{
+	const ac_context_t *cm;
+	int ret;
+
+	ret = save_model(f, portnum, &pm->model);
+	for (int i = 0; ret == 0 && i <= MODEL_MAX_ORDER; i++) {
+		if ((cm = port_model_context(pm, i)) != NULL) {
+			ret = save_context(f, portnum, cm);
+		}
+	}
+
+	return ret;
+}
+
+int model_set_save(const struct model_set *ms, const char *path)
+{
+	unsigned count = 0;
+	int ret = 0;
+	FILE *f;
+
+	if ((f = fopen(path, "wb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	for (int i = 0; i < MODEL_MAX_PORTNUM; i++) {
+		count += count_records(ms->port[i]);
+	}
+
+	count += count_records(ms->fallback);
+
+	fwrite(MODEL_FILE_MAGIC, 1, 4, f);
+	fputc(MODEL_FILE_VERSION, f);
+	fputc(AC_MODEL_BITS, f);
+	put_u16(f, count);
+
+	for (int i = 0; ret == 0 && i < MODEL_MAX_PORTNUM; i++) {
+		if (ms->port[i]) {
+			ret = save_port_model(f, i, ms->port[i]);
+		}
+	}
+
+	if (ret == 0 && ms->fallback) {
+		ret = save_port_model(f, MODEL_DEFAULT, ms->fallback);
+	}
+
+	if (fclose(f) != 0 || ret != 0) {
+		fprintf(stderr, "%s: error writing %s\n", __func__, path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* a bounds-checked reader over the loaded file */
+struct reader {
+	const uint8_t *p, *end;
+	int err;
+};
+
+static unsigned get_u8(struct reader *r)
+{
+	if (r->p >= r->end) {
+		r->err = 1;
+		return 0;
+	}
+
+	return *r->p++;
+}
+
+static unsigned get_u16(struct reader *r)
+{
+	unsigned v;
+
+	if (r->end - r->p < 2) {
+		r->err = 1;
+		return 0;
+	}
+
+	v = r->p[0] | (r->p[1] << 8);
+	r->p += 2;
+	return v;
+}
+
+static u32 get_varint(struct reader *r)
+{
+	u32 v = 0;
+
+	for (int shift = 0; shift < 32; shift += 7) {
+		if (r->p >= r->end) {
+			break;
+		}
+
+		v |= (u32)(*r->p & 0x7f) << shift;
+		if ((*r->p++ & 0x80) == 0) {
+			return v;
+		}
+	}
+
+	r->err = 1;
+	return 0;
+}
+
+static int load_model(struct model_set *ms, struct reader *r)
+{
+	struct port_model *pm;
+	unsigned portnum, nsym;
+	u32 sum = 0;
+
+	portnum = get_u16(r);
+	nsym = get_u16(r);
+	if (r->err || nsym + 1 >= CDF_MAX_SYMB) {
+		fprintf(stderr, "%s: bad model header\n", __func__);
+		return -1;
+	}
+
+	if ((pm = calloc(1, sizeof(*pm))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		return -1;
+	}
+
+	pm->model.nsym = nsym;
+	for (unsigned i = 0; i <= nsym; i++) {
+		pm->model.cum[i] = sum;
+		sum += get_varint(r);
+	}
+
+	/* the end symbol must be codable and everything must add up exactly */
+	if (r->err || sum != AC_MODEL_TOTAL || pm->model.cum[nsym] >= AC_MODEL_TOTAL) {
+		fprintf(stderr, "%s: model for portnum %u is corrupt\n", __func__, portnum);
+		free(pm);
+		return -1;
+	}
+
+	return model_set_put(ms, portnum, pm);
+}
+
+/* the tables are rebuilt from their frequencies, which come back out unchanged */
+static int load_context(struct model_set *ms, struct reader *r)
+{
+	unsigned portnum, order, bits, ntables, slot, n, sym, prev;
+	ac_context_t cm;
+	u32 *counts, *row, sum;
+	int ret = -1;
+
+	portnum = get_u16(r);
+	order = get_u8(r);
+	bits = get_u8(r);
+	ntables = get_varint(r);
+	if (r->err || order > MODEL_MAX_ORDER || bits < 1 || bits > 16) {
+		fprintf(stderr, "%s: bad context model header\n", __func__);
+		return -1;
+	}
+
+	if ((counts = calloc((size_t)AC_CTX_NSYM << bits, sizeof(u32))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		return -1;
+	}
+
+	for (unsigned t = 0; t < ntables && !r->err; t++) {
+		slot = get_u16(r);
+		n = get_u16(r);
+		if (slot >= (1U << bits) || n > AC_CTX_NSYM) {
+			r->err = 1;
+			break;
+		}
+
+		row = counts + (size_t)slot * AC_CTX_NSYM;
+		for (unsigned i = sum = prev = 0; i < n; i++) {
+			sym = get_u16(r);
+			if (r->err || sym >= AC_CTX_NSYM || (i && sym <= prev)) {
+				r->err = 1;
+				break;
+			}
+
+			row[sym] = get_varint(r);
+			sum += row[sym];
+			prev = sym;
+		}
+
+		if (sum != AC_MODEL_TOTAL) {
+			r->err = 1;
+		}
+	}
+
+	if (r->err) {
+		fprintf(stderr, "%s: order-%u model for portnum %u is corrupt\n", __func__, order, portnum);
+
+	} else if (ac_context_from_counts(&cm, order, bits, counts, 1) == 0) {
+		ret = model_set_put_context(ms, portnum, &cm);
+	}
+
+	free(counts);
+	return ret;
+}
+
+int model_set_load(struct model_set *ms, const char *path)
+{
+	struct reader r;
+	uint8_t *buf;
+	unsigned count, kind;
+	long len;
+	FILE *f;
+	int ret = -1;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+
+	if (len < 8 || (buf = malloc(len)) == NULL || fread(buf, 1, len, f) != len) {
+		fprintf(stderr, "%s: could not read %s\n", __func__, path);
+		fclose(f);
+		return -1;
+	}
+
+	fclose(f);
+
+	r.p = buf;
+	r.end = buf + len;
+	r.err = 0;
+
+	/* version 1 files have no kind bytes and only order-0 models */
+	if (memcmp(buf, MODEL_FILE_MAGIC, 4) != 0 || buf[4] < 1 || buf[4] > MODEL_FILE_VERSION || buf[5] != AC_MODEL_BITS) {
+		fprintf(stderr, "%s: %s is not a version %d, %d bit model file\n", __func__, path, MODEL_FILE_VERSION, AC_MODEL_BITS);
+
+	} else {
+		r.p += 6;
+		count = get_u16(&r);
+		ret = 0;
+		for (unsigned i = 0; ret == 0 && i < count; i++) {
+			kind = (buf[4] > 1) ? get_u8(&r) : MODEL_KIND_ORDER0;
+			if (kind == MODEL_KIND_ORDER0) {
+				ret = load_model(ms, &r);
+			} else if (kind == MODEL_KIND_CONTEXT) {
+				ret = load_context(ms, &r);
+			} else {
+				fprintf(stderr, "%s: unknown record kind %u\n", __func__, kind);
+				ret = -1;
+			}
+		}
+	}
+
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,39 @@
+#include "portnum.h"
+
+const char *portnum_str(meshtastic_port_num_t portnum)
+{
+	const char *s;
+
+	switch (portnum) {
+	case MESHTASTIC_PORT_NUM_UNKNOWN_APP:		s = "UNKNOWN_APP"; break;
+	case MESHTASTIC_PORT_NUM_TEXT_MESSAGE_APP:	s = "TEXT_MESSAGE_APP"; break;
+	case MESHTASTIC_PORT_NUM_REMOTE_HARDWARE_APP:	s = "REMOTE_HARDWARE_APP"; break;
+	case MESHTASTIC_PORT_NUM_POSITION_APP:		s = "POSITION_APP"; break;
+	case MESHTASTIC_PORT_NUM_NODEINFO_APP:		s = "NODEINFO_APP"; break;
+	case MESHTASTIC_PORT_NUM_ROUTING_APP:		s = "ROUTING_APP"; break;
+	case MESHTASTIC_PORT_NUM_ADMIN_APP:		s = "ADMIN_APP"; break;
+	case MESHTASTIC_PORT_NUM_TEXT_MESSAGE_COMPRESSED_APP:	s = "TEXT_MESSAGE_COMPRESSED_APP"; break;
+	case MESHTASTIC_PORT_NUM_WAYPOINT_APP:		s = "WAYPOINT_APP"; break;
+	case MESHTASTIC_PORT_NUM_AUDIO_APP:		s = "AUDIO_APP"; break;
+	case MESHTASTIC_PORT_NUM_DETECTION_SENSOR_APP:	s = "DETECTION_SENSOR_APP"; break;
+	case MESHTASTIC_PORT_NUM_REPLY_APP:		s = "REPLY_APP"; break;
+	case MESHTASTIC_PORT_NUM_IP_TUNNEL_APP:		s = "IP_TUNNEL_APP"; break;
+	case MESHTASTIC_PORT_NUM_PAXCOUNTER_APP:	s = "PAXCOUNTER_APP"; break;
+	case MESHTASTIC_PORT_NUM_SERIAL_APP:		s = "SERIAL_APP"; break;
+	case MESHTASTIC_PORT_NUM_STORE_FORWARD_APP:	s = "STORE_FORWARD_APP"; break;
+	case MESHTASTIC_PORT_NUM_RANGE_TEST_APP:	s = "RANGE_TEST_APP"; break;
+	case MESHTASTIC_PORT_NUM_TELEMETRY_APP:		s = "TELEMETRY_APP"; break;
+	case MESHTASTIC_PORT_NUM_ZPS_APP:		s = "ZPS_APP"; break;
+	case MESHTASTIC_PORT_NUM_SIMULATOR_APP:		s = "SIMULATOR_APP"; break;
+	case MESHTASTIC_PORT_NUM_TRACEROUTE_APP:	s = "TRACEROUTE_APP"; break;
+	case MESHTASTIC_PORT_NUM_NEIGHBORINFO_APP:	s = "NEIGHBORINFO_APP"; break;
+	case MESHTASTIC_PORT_NUM_ATAK_PLUGIN:		s = "ATAK_PLUGIN"; break;
+	case MESHTASTIC_PORT_NUM_MAP_REPORT_APP:	s = "MAP_REPORT_APP"; break;
+	case MESHTASTIC_PORT_NUM_POWERSTRESS_APP:	s = "POWERSTRESS_APP"; break;
+	case MESHTASTIC_PORT_NUM_PRIVATE_APP:		s = "PRIVATE_APP"; break;
+	case MESHTASTIC_PORT_NUM_ATAK_FORWARDER:	s = "ATAK_FORWARDER"; break;
+	default: s = "(unknown)"; break;
+	};
+
+	return s;
+}
@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int ring_init(struct ring *r, size_t nslots, enum ring_policy policy)
+{
+	size_t n = 2;
+
+	memset(r, 0, sizeof(*r));
+	while (n < nslots) {
+		n <<= 1;
+	}
+
+	if ((r->slot = calloc(n, sizeof(*r->slot))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		return -1;
+	}
+
+	/* slot i is free for the push at position i */
+	for (size_t i = 0; i < n; i++) {
+		atomic_init(&r->slot[i].seq, i);
+	}
+
+	r->mask = n - 1;
+	r->policy = policy;
+	sem_init(&r->items, 0, 0);
+	sem_init(&r->space, 0, (n < SEM_VALUE_MAX) ? n : SEM_VALUE_MAX);
+	return 0;
+}
+
+void ring_free(struct ring *r)
+{
+	sem_destroy(&r->items);
+	sem_destroy(&r->space);
+	free(r->slot);
+	memset(r, 0, sizeof(*r));
+}
+
+/* claims the slot at the head and fills it; returns -1 if the ring is full */
+static int enqueue(struct ring *r, const void *buf, size_t len)
+{
+	size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	struct ring_slot *s;
+
+	for (;;) {
+		s = &r->slot[pos & r->mask];
+		const intptr_t diff = (intptr_t)atomic_load_explicit(&s->seq, memory_order_acquire) - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+		}
+	}
+
+	memcpy(s->data, buf, len);
+	s->len = len;
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+/* claims the slot at the tail and copies it to <buf> (if not NULL); returns its length, or -1 if the ring is empty */
+static int dequeue(struct ring *r, void *buf)
+{
+	size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	struct ring_slot *s;
+	int len;
+
+	for (;;) {
+		s = &r->slot[pos & r->mask];
+		const intptr_t diff = (intptr_t)atomic_load_explicit(&s->seq, memory_order_acquire) - (intptr_t)(pos + 1);
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		}
+	}
+
+	len = s->len;
+	if (buf) {
+		memcpy(buf, s->data, len);
+	}
+
+	/* free for the push one lap later */
+	atomic_store_explicit(&s->seq, pos + r->mask + 1, memory_order_release);
+	return len;
+}
+
+static void sem_wait_intr(sem_t *sem)
+{
+	while (sem_wait(sem) != 0 && errno == EINTR) {
+	}
+}
+
+int ring_push(struct ring *r, const void *buf, size_t len)
+{
+	if (len > RING_MSG_MAX) {
+		atomic_fetch_add(&r->oversize, 1);
+		return -1;
+	}
+
+	if (r->policy == RING_BLOCK && sem_trywait(&r->space) != 0) {
+		atomic_fetch_add(&r->waits, 1);
+		sem_wait_intr(&r->space);
+	}
+
+	if (atomic_load(&r->closed)) {
+		return -1;
+	}
+
+	/*
+	 * Under RING_BLOCK a slot is free by now, though the one at the head may still
+	 * be being copied out.  Otherwise make room by taking the oldest message like a
+	 * consumer would; if the consumers hold every item token they are about to free
+	 * slots anyway.
+	 */
+	while (enqueue(r, buf, len) != 0) {
+		if (r->policy == RING_DROP_OLDEST && sem_trywait(&r->items) == 0) {
+			if (dequeue(r, NULL) >= 0) {
+				atomic_fetch_add(&r->dropped, 1);
+			} else {
+				sem_post(&r->items);
+			}
+		} else {
+			sched_yield();
+		}
+	}
+
+	atomic_fetch_add(&r->pushed, 1);
+	sem_post(&r->items);
+	return 0;
+}
+
+int ring_pop(struct ring *r, void *buf)
+{
+	int len;
+
+	sem_wait_intr(&r->items);
+	while ((len = dequeue(r, buf)) < 0) {
+		if (atomic_load(&r->closed)) {
+			return -1;
+		}
+
+		sched_yield();
+	}
+
+	if (r->policy == RING_BLOCK) {
+		sem_post(&r->space);
+	}
+
+	return len;
+}
+
+void ring_close(struct ring *r, int nconsumers)
+{
+	atomic_store(&r->closed, true);
+	for (int i = 0; i < nconsumers; i++) {
+		sem_post(&r->items);
+	}
+
+	sem_post(&r->space);
+}
+
+size_t ring_depth(struct ring *r)
+{
+	return atomic_load(&r->head) - atomic_load(&r->tail);
+}
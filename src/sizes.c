@@ -0,0 +1,27 @@
+/*
+ * Coder footprint
+ *
+ * Prints how much RAM each of the coder's structures takes, for budgeting a radio
+ * task on a small node.  The build makes it but doesn't run it; make sizes does,
+ * and a cross-built copy run on the node gives the node's own sizes.
+ */
+#include <stdio.h>
+
+#include "arithcode.h"
+
+#define SHOW(type, note)	printf("  %-22s %6zu  %s\n", #type, sizeof(type), note)
+
+int main(void)
+{
+	printf("coder footprint (bytes):\n");
+	SHOW(ac_state_t, "full coder state (float CDF)");
+	SHOW(ac_rans_queue_t, "rANS encoder queue, only when encoding with rANS");
+	SHOW(ac_coder_t, "compact coder state");
+	SHOW(ac_model_t, "shared model");
+	printf("  %-22s %6zu  %s\n", "ac_cmodel_t", ac_cmodel_size(AC_ESC + 1), "compact model (bytes and escape)");
+	SHOW(ac_lut_t, "decoder lookup table");
+	SHOW(ac_tans_t, "tANS tables");
+	SHOW(ac_adaptive_t, "adaptive model");
+	SHOW(ac_context_t, "context model, before its tables");
+	return 0;
+}
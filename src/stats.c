@@ -0,0 +1,261 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/* a shard has one writer, so it can add with a plain load and store instead of a locked add */
+static void add64(atomic_uint_fast64_t *c, uint64_t v)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static void add32(_Atomic uint32_t *c, uint32_t v)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static uint64_t get(const atomic_uint_fast64_t *c)
+{
+	return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+void comp_stats_init(struct comp_stats *s)
+{
+	atomic_init(&s->packets, 0);
+	for (int st = 0; st < STAGE_MAX; st++) {
+		atomic_init(&s->stage_ticks[st], 0);
+		for (int i = 0; i < STATS_LAT_BUCKETS; i++) {
+			atomic_init(&s->stage[st][i], 0);
+		}
+	}
+
+	for (int i = 0; i < STATS_PORTS; i++) {
+		atomic_init(&s->port[i], NULL);
+	}
+}
+
+void comp_stats_free(struct comp_stats *s)
+{
+	for (int i = 0; i < STATS_PORTS; i++) {
+		free(atomic_load(&s->port[i]));
+	}
+
+	comp_stats_init(s);
+}
+
+void comp_stats_clear(struct comp_stats *s)
+{
+	struct port_stats *p;
+
+	atomic_store(&s->packets, 0);
+	for (int st = 0; st < STAGE_MAX; st++) {
+		atomic_store(&s->stage_ticks[st], 0);
+		for (int i = 0; i < STATS_LAT_BUCKETS; i++) {
+			atomic_store(&s->stage[st][i], 0);
+		}
+	}
+
+	for (int i = 0; i < STATS_PORTS; i++) {
+		if ((p = atomic_load(&s->port[i])) != NULL) {
+			memset(p, 0, sizeof(*p));
+		}
+	}
+}
+
+/* the counters for <portnum>, allocated if this is its first packet */
+static struct port_stats *port(struct comp_stats *s, unsigned portnum)
+{
+	struct port_stats *p = atomic_load_explicit(&s->port[portnum], memory_order_acquire);
+
+	if (p == NULL) {
+		if ((p = calloc(1, sizeof(*p))) == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			return NULL;
+		}
+
+		/* readers that see the pointer see the zeroed counters */
+		atomic_store_explicit(&s->port[portnum], p, memory_order_release);
+	}
+
+	return p;
+}
+
+void comp_stats_packet(struct comp_stats *s)
+{
+	add64(&s->packets, 1);
+}
+
+const char *stage_names[STAGE_MAX] = {
+	[STAGE_ENVELOPE] = "envelope",
+	[STAGE_DEDUP] = "dedup",
+	[STAGE_DECRYPT] = "decrypt",
+	[STAGE_DATA] = "data",
+	[STAGE_MODEL] = "model",
+	[STAGE_ENCODE] = "encode",
+	[STAGE_DECODE] = "decode",
+	[STAGE_PRINT] = "print",
+	[STAGE_CAPTURE] = "capture",
+};
+
+/* the latency bucket for <t> ticks */
+static int latency_bucket(uint64_t t)
+{
+	int b = 0;
+
+	for (t >>= STATS_LAT_SHIFT; t && b < STATS_LAT_BUCKETS - 1; t >>= 1) {
+		++b;
+	}
+
+	return b;
+}
+
+void comp_stats_stage(struct comp_stats *s, enum stats_stage stage, uint64_t t)
+{
+	add64(&s->stage_ticks[stage], t);
+	add32(&s->stage[stage][latency_bucket(t)], 1);
+}
+
+uint64_t comp_stats_stage_count(const struct comp_stats *s, enum stats_stage stage)
+{
+	uint64_t n = 0;
+
+	for (int b = 0; b < STATS_LAT_BUCKETS; b++) {
+		n += atomic_load_explicit(&s->stage[stage][b], memory_order_relaxed);
+	}
+
+	return n;
+}
+
+uint64_t comp_stats_latency_bound(int b)
+{
+	return (b < STATS_LAT_BUCKETS - 1) ? (uint64_t)1 << (b + STATS_LAT_SHIFT) : 0;
+}
+
+int comp_stats_add(struct comp_stats *s, unsigned portnum, size_t len, size_t nout)
+{
+	struct port_stats *p;
+
+	if (portnum >= STATS_PORTS || len == 0) {
+		return 0;
+	}
+
+	if ((p = port(s, portnum)) == NULL) {
+		return -1;
+	}
+
+	add64(&p->num, 1);
+
+	const double ratio = 100.0 - (100.0 * (double)nout / (double)len);
+	if (ratio > 1.0) {
+		const size_t l = (len < STATS_LEN_MAX) ? len : STATS_LEN_MAX;
+
+		add64(&p->ncomp, 1);
+		add64(&p->unc_bytes, len);
+		add64(&p->comp_bytes, nout);
+		add64(&p->ratio_sum, llround(100.0 * ratio));
+		add32(&p->len[l], 1);
+		add64(&p->len_comp[l], nout);
+		add32(&p->ratio[(int)(ratio * STATS_RATIO_STEP)], 1);
+	}
+
+	return 0;
+}
+
+int comp_stats_merge(struct comp_stats *dst, const struct comp_stats *src)
+{
+	add64(&dst->packets, get(&src->packets));
+	for (int st = 0; st < STAGE_MAX; st++) {
+		add64(&dst->stage_ticks[st], get(&src->stage_ticks[st]));
+		for (int i = 0; i < STATS_LAT_BUCKETS; i++) {
+			add32(&dst->stage[st][i], atomic_load_explicit(&src->stage[st][i], memory_order_relaxed));
+		}
+	}
+
+	for (unsigned i = 0; i < STATS_PORTS; i++) {
+		const struct port_stats *s = atomic_load_explicit(&src->port[i], memory_order_acquire);
+		struct port_stats *d;
+
+		if (s == NULL) {
+			continue;
+		}
+
+		if ((d = port(dst, i)) == NULL) {
+			return -1;
+		}
+
+		add64(&d->num, get(&s->num));
+		add64(&d->ncomp, get(&s->ncomp));
+		add64(&d->unc_bytes, get(&s->unc_bytes));
+		add64(&d->comp_bytes, get(&s->comp_bytes));
+		add64(&d->ratio_sum, get(&s->ratio_sum));
+		for (int l = 0; l <= STATS_LEN_MAX; l++) {
+			add32(&d->len[l], atomic_load_explicit(&s->len[l], memory_order_relaxed));
+			add64(&d->len_comp[l], get(&s->len_comp[l]));
+		}
+
+		for (int r = 0; r < STATS_RATIO_BUCKETS; r++) {
+			add32(&d->ratio[r], atomic_load_explicit(&s->ratio[r], memory_order_relaxed));
+		}
+	}
+
+	return 0;
+}
+
+const struct port_stats *comp_stats_port(const struct comp_stats *s, unsigned portnum)
+{
+	return (portnum < STATS_PORTS) ? atomic_load_explicit(&s->port[portnum], memory_order_acquire) : NULL;
+}
+
+/* the bucket holding the <q> quantile of the <n> buckets in <h>, or -1 if they are all empty */
+static int quantile(const _Atomic uint32_t *h, int n, double q)
+{
+	uint64_t total = 0, rank, seen = 0;
+
+	for (int i = 0; i < n; i++) {
+		total += atomic_load_explicit(&h[i], memory_order_relaxed);
+	}
+
+	if (total == 0) {
+		return -1;
+	}
+
+	rank = ceil(q * total);
+	rank = (rank < 1) ? 1 : (rank > total) ? total : rank;
+	for (int i = 0; i < n; i++) {
+		if ((seen += atomic_load_explicit(&h[i], memory_order_relaxed)) >= rank) {
+			return i;
+		}
+	}
+
+	return n - 1;
+}
+
+unsigned port_stats_len(const struct port_stats *p, double q, double *comp)
+{
+	const int l = quantile(p->len, STATS_LEN_MAX + 1, q);
+	uint32_t n;
+
+	if (l < 0 || (n = atomic_load_explicit(&p->len[l], memory_order_relaxed)) == 0) {
+		*comp = 0.0;
+		return 0;
+	}
+
+	*comp = (double)get(&p->len_comp[l]) / n;
+	return l;
+}
+
+uint64_t comp_stats_stage_quantile(const struct comp_stats *s, enum stats_stage stage, double q)
+{
+	const int b = quantile(s->stage[stage], STATS_LAT_BUCKETS, q);
+
+	return (b < 0) ? 0 : comp_stats_latency_bound(b);
+}
+
+double port_stats_ratio(const struct port_stats *p, double q)
+{
+	const int r = quantile(p->ratio, STATS_RATIO_BUCKETS, q);
+
+	return (r < 0) ? 0.0 : (r + 0.5) / STATS_RATIO_STEP;
+}
@@ -0,0 +1,35 @@
+#include <pthread.h>
+#include <time.h>
+
+#include "ticks.h"
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static double rate = 1.0;
+
+static uint64_t ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void calibrate(void)
+{
+	const uint64_t n0 = ns(), t0 = ticks();
+	uint64_t n1;
+
+	while ((n1 = ns()) - n0 < 20000000) {
+	}
+
+	rate = (double)(ticks() - t0) / (n1 - n0);
+	if (rate <= 0.0) {
+		rate = 1.0;
+	}
+}
+
+double ticks_per_ns(void)
+{
+	pthread_once(&once, calibrate);
+	return rate;
+}
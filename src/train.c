@@ -0,0 +1,521 @@
+/*
+ * Model trainer
+ *
+ * Reads one or more packet corpora (see corpus.h), builds an order-0 model of the
+ * payload bytes for every portnum with enough traffic plus a default model over all
+ * traffic, and writes them to a model file (see models.h) for the compression test
+ * to load with -M.  Each model also gets order-1 and order-2 context models and a
+ * protobuf wire-format model unless told otherwise.
+ *
+ * The corpora are mapped once and every thread counts its shard of each into its
+ * own histograms, so nothing is shared while counting.  The threads' counts are
+ * summed at the end, and the default model's are the sum of every portnum's, so
+ * the models come out the same however many threads there were.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <pb_decode.h>
+#include "meshtastic/mesh.pb.h"
+
+#include "arithcode.h"
+#include "corpus.h"
+#include "models.h"
+#include "portnum.h"
+#include "wire.h"
+
+/* a context table needs at least this many symbols behind it, or the order-0 model does better */
+#define CTX_MIN_TOTAL	(16)
+
+/*
+ * counts[] has one slot per model symbol plus the end symbol; ctx[] has a row of
+ * AC_CTX_NSYM counts per context slot for each order, and wire[] the same for the
+ * wire-format model, allocated on first use
+ */
+struct port_hist {
+	u32 counts[MODEL_NSYM + 1];
+	u32 *ctx[MODEL_MAX_ORDER];
+	u32 *wire;
+	uint32_t packets;
+	uint64_t bytes;
+};
+
+static struct port_hist hist[MODEL_MAX_PORTNUM], all;
+
+/* the shape of the context models being trained (only order and bits are used) */
+static ac_context_t shape[MODEL_MAX_ORDER] = {
+	{ .order = 1, .bits = 8 },
+	{ .order = 2, .bits = 12 },
+};
+static unsigned max_order = MODEL_MAX_ORDER;
+static unsigned wire_bits = WIRE_BITS;
+
+
+static int hist_add(struct port_hist *h, unsigned portnum, const uint8_t *buf, size_t len)
+{
+	u32 prev1, prev2, sym;
+
+	for (size_t i = 0; i < len; i++) {
+		h->counts[buf[i]]++;
+	}
+
+	h->counts[MODEL_NSYM]++;
+	h->packets++;
+	h->bytes += len;
+
+	for (unsigned k = 0; k < max_order; k++) {
+		if (h->ctx[k] == NULL && (h->ctx[k] = calloc((size_t)AC_CTX_NSYM << shape[k].bits, sizeof(u32))) == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			return -1;
+		}
+
+		prev1 = prev2 = 0;
+		for (size_t i = 0; i <= len; i++) {
+			sym = (i < len) ? buf[i] : AC_CTX_END;
+			h->ctx[k][(size_t)ac_context_slot(&shape[k], prev1, prev2) * AC_CTX_NSYM + sym]++;
+			prev2 = prev1;
+			prev1 = sym;
+		}
+	}
+
+	if (wire_bits) {
+		if (h->wire == NULL && (h->wire = calloc((size_t)AC_CTX_NSYM << wire_bits, sizeof(u32))) == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			return -1;
+		}
+
+		wire_count(h->wire, wire_bits, portnum, buf, len);
+	}
+
+	return 0;
+}
+
+/* adds the counts in <src> to <dst>; with <move>, tables <dst> doesn't have yet are taken from <src> rather than copied */
+static int hist_merge(struct port_hist *dst, struct port_hist *src, bool move)
+{
+	for (int i = 0; i <= MODEL_NSYM; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+
+	dst->packets += src->packets;
+	dst->bytes += src->bytes;
+
+	for (unsigned k = 0; k <= max_order; k++) {
+		u32 **d = (k < max_order) ? &dst->ctx[k] : &dst->wire;
+		u32 **t = (k < max_order) ? &src->ctx[k] : &src->wire;
+		const size_t n = (size_t)AC_CTX_NSYM << ((k < max_order) ? shape[k].bits : wire_bits);
+
+		if (*t == NULL) {
+			continue;
+		}
+
+		if (*d == NULL && move) {
+			*d = *t;
+			*t = NULL;
+			continue;
+		}
+
+		if (*d == NULL && (*d = calloc(n, sizeof(u32))) == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			return -1;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			(*d)[i] += (*t)[i];
+		}
+	}
+
+	return 0;
+}
+
+static void hist_free(struct port_hist *h)
+{
+	for (unsigned k = 0; k < MODEL_MAX_ORDER; k++) {
+		free(h->ctx[k]);
+	}
+
+	free(h->wire);
+	memset(h, 0, sizeof(*h));
+}
+
+/* the corpora being trained on, mapped once and shared by every thread */
+static struct corpus *corpora;
+static int ncorpora;
+
+/* one training thread: takes its shard of every corpus and counts into its own histograms */
+struct train_worker {
+	pthread_t thread;
+	int shard, nshards;
+	struct port_hist *hist;		/* MODEL_MAX_PORTNUM of them */
+	size_t *lines;			/* per corpus */
+	uint32_t *bad;
+	int ret;
+};
+
+static void *train_thread(void *arg)
+{
+	struct train_worker *w = (struct train_worker *)arg;
+	uint8_t pkt[MESH_HEADER_LEN + 256];
+	struct corpus_cursor cur;
+	struct capture_record r;
+	int n;
+
+	for (int f = 0; f < ncorpora; f++) {
+		corpus_shard(&corpora[f], &cur, w->shard, w->nshards);
+
+		/* capture records are decoded straight from the mapping */
+		while ((n = corpus_next_record(&cur, &r, pkt, sizeof(pkt))) != 0) {
+			meshtastic_data_t md = MESHTASTIC_DATA_INIT_DEFAULT;
+			pb_istream_t s;
+
+			if (n < 0 || r.len <= MESH_HEADER_LEN || (r.portnum != CAPTURE_PORTNUM_UNKNOWN && r.portnum >= MODEL_MAX_PORTNUM)) {
+				w->bad[f] += (n < 0 || r.len <= MESH_HEADER_LEN);
+				continue;
+			}
+
+			s = pb_istream_from_buffer(r.packet + MESH_HEADER_LEN, r.len - MESH_HEADER_LEN);
+			if (! pb_decode(&s, MESHTASTIC_DATA_FIELDS, &md)) {
+				++w->bad[f];
+				continue;
+			}
+
+			if (md.payload.size > 0 && md.portnum < MODEL_MAX_PORTNUM &&
+			    hist_add(&w->hist[md.portnum], md.portnum, md.payload.bytes, md.payload.size) != 0) {
+				w->ret = -1;
+				return NULL;
+			}
+		}
+
+		w->lines[f] = cur.line;
+	}
+
+	return NULL;
+}
+
+/* counts every corpus with <nthreads> threads into hist[], and all[] from those */
+static int train_corpora(char **paths, int npaths, int nthreads)
+{
+	struct train_worker *w;
+	struct timespec ts1, ts2;
+	int i, ret = 0;
+
+	if ((corpora = calloc(npaths, sizeof(*corpora))) == NULL || (w = calloc(nthreads, sizeof(*w))) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", __func__);
+		free(corpora);
+		return -1;
+	}
+
+	for (ncorpora = 0; ncorpora < npaths; ncorpora++) {
+		if (corpus_open(&corpora[ncorpora], paths[ncorpora]) != 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	for (i = 0; i < nthreads; i++) {
+		w[i].shard = i;
+		w[i].nshards = nthreads;
+		w[i].hist = calloc(MODEL_MAX_PORTNUM, sizeof(*w[i].hist));
+		w[i].lines = calloc(ncorpora, sizeof(*w[i].lines));
+		w[i].bad = calloc(ncorpora, sizeof(*w[i].bad));
+		if (w[i].hist == NULL || w[i].lines == NULL || w[i].bad == NULL) {
+			fprintf(stderr, "%s: out of memory\n", __func__);
+			ret = -1;
+			break;
+		}
+
+		if (pthread_create(&w[i].thread, NULL, train_thread, &w[i]) != 0) {
+			fprintf(stderr, "%s: could not start thread %d\n", __func__, i);
+			ret = -1;
+			break;
+		}
+	}
+
+	nthreads = i;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].thread, NULL);
+		ret |= w[i].ret;
+	}
+
+	for (i = 0; i < nthreads && ret == 0; i++) {
+		for (int p = 0; p < MODEL_MAX_PORTNUM && ret == 0; p++) {
+			ret = hist_merge(&hist[p], &w[i].hist[p], true);
+		}
+	}
+
+	/* the default model is trained on all of it */
+	for (int p = 0; p < MODEL_MAX_PORTNUM && ret == 0; p++) {
+		ret = hist_merge(&all, &hist[p], false);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts2);
+	if (ret == 0) {
+		const double dt = (ts2.tv_sec - ts1.tv_sec) + 1e-9 * (ts2.tv_nsec - ts1.tv_nsec);
+
+		for (int f = 0; f < ncorpora; f++) {
+			size_t lines = 0;
+			uint32_t bad = 0;
+
+			for (i = 0; i < nthreads; i++) {
+				lines += w[i].lines[f];
+				bad += w[i].bad[f];
+			}
+
+			printf("%s: %zd %s, %u skipped\n", paths[f], lines, (corpora[f].capture) ? "records" : "lines", bad);
+		}
+
+		printf("%u packets counted in %.3f seconds (%.0f packets/s) with %d thread%s\n", all.packets, dt, all.packets / dt,
+		       nthreads, (nthreads > 1) ? "s" : "");
+	}
+
+out:
+	for (i = 0; i < nthreads; i++) {
+		if (w[i].hist) {
+			for (int p = 0; p < MODEL_MAX_PORTNUM; p++) {
+				hist_free(&w[i].hist[p]);
+			}
+		}
+
+		free(w[i].hist);
+		free(w[i].lines);
+		free(w[i].bad);
+	}
+
+	for (i = 0; i < ncorpora; i++) {
+		corpus_close(&corpora[i]);
+	}
+
+	free(w);
+	free(corpora);
+	return ret;
+}
+
+/*
+ * Give the escape symbol the Good-Turing estimate of the probability of a byte
+ * we haven't seen: the number of byte values seen exactly once.
+ */
+static void set_escape(struct port_hist *h)
+{
+	u32 n1 = 0;
+
+	for (int i = 0; i < 256; i++) {
+		n1 += (h->counts[i] == 1);
+	}
+
+	h->counts[AC_ESC] = n1 + 1;
+}
+
+/* the same for every context, so each table can escape to the order-0 model */
+static void set_context_escapes(u32 *ctx, u32 bits)
+{
+	for (size_t c = 0; c < (1U << bits); c++) {
+		u32 *row = ctx + c * AC_CTX_NSYM;
+		u32 n1 = 0;
+
+		for (int i = 0; i < 256; i++) {
+			n1 += (row[i] == 1);
+		}
+
+		row[AC_ESC] = n1 + 1;
+	}
+}
+
+/* the cost in bits of symbol <i> (m->nsym is the end symbol) under the quantized model */
+static double symbol_bits(const ac_model_t *m, u32 i)
+{
+	const u32 hi = (i < m->nsym) ? m->cum[i + 1] : AC_MODEL_TOTAL;
+	return log2((double)AC_MODEL_TOTAL / (hi - m->cum[i]));
+}
+
+/* bits per payload byte the training set costs under the quantized model, end symbols included */
+static double cross_entropy(const ac_model_t *m, const struct port_hist *h)
+{
+	double bits = 0.0;
+
+	for (u32 i = 0; i <= m->nsym; i++) {
+		if (h->counts[i]) {
+			bits += h->counts[i] * symbol_bits(m, i);
+		}
+	}
+
+	return bits / h->bytes;
+}
+
+/* the same for a context model, counting escapes to its order-0 model */
+static double context_entropy(const ac_context_t *cm, const u32 *ctx, const struct port_hist *h)
+{
+	const ac_model_t *m = cm->order0;
+	u32 freq[AC_CTX_NSYM];
+	double bits = 0.0, cost;
+
+	for (size_t c = 0; c < (1U << cm->bits); c++) {
+		const u32 *row = ctx + c * AC_CTX_NSYM;
+		const u32 *t = (cm->slot[c] != AC_CTX_NONE) ? cm->pool + cm->slot[c] : NULL;
+
+		memset(freq, 0, sizeof(freq));
+		for (u32 i = 1; t && i <= t[0]; i++) {
+			const u32 hi = (i < t[0]) ? AC_CTX_CUM(t[i + 1]) : AC_MODEL_TOTAL;
+			freq[AC_CTX_SYM(t[i])] = hi - AC_CTX_CUM(t[i]);
+		}
+
+		for (u32 i = 0; i < AC_CTX_NSYM; i++) {
+			if (i == AC_ESC || row[i] == 0) {
+				continue;
+			}
+
+			if (freq[i]) {
+				cost = log2((double)AC_MODEL_TOTAL / freq[i]);
+			} else {
+				cost = symbol_bits(m, (i == AC_CTX_END) ? m->nsym : i);
+				if (t) {
+					cost += log2((double)AC_MODEL_TOTAL / freq[AC_ESC]);
+				}
+			}
+
+			bits += row[i] * cost;
+		}
+	}
+
+	return bits / h->bytes;
+}
+
+/* builds one context model from <ctx> and prints its cross entropy */
+static int train_context(struct model_set *ms, unsigned portnum, struct port_hist *h, unsigned order, u32 bits, u32 *ctx, size_t *mem)
+{
+	const ac_context_t *cm;
+
+	set_context_escapes(ctx, bits);
+	if (model_set_add_context(ms, portnum, order, bits, ctx, CTX_MIN_TOTAL) != 0) {
+		return -1;
+	}
+
+	cm = port_model_context(model_set_get(ms, portnum), order);
+	*mem += ((1U << cm->bits) + cm->npool) * sizeof(u32);
+	printf("  %.3f", context_entropy(cm, ctx, h));
+	return 0;
+}
+
+/* adds the context and wire-format models for <portnum> */
+static int train_contexts(struct model_set *ms, unsigned portnum, struct port_hist *h, size_t *mem)
+{
+	for (unsigned k = 0; k < max_order; k++) {
+		if (train_context(ms, portnum, h, k + 1, shape[k].bits, h->ctx[k], mem) != 0) {
+			return -1;
+		}
+	}
+
+	if (wire_bits && train_context(ms, portnum, h, 0, wire_bits, h->wire, mem) != 0) {
+		return -1;
+	}
+
+	printf("\n");
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-o model_file] [-m min_packets] [-x order] [-b bits] [-w bits] [-j threads] corpus_file [corpus_file...]\n", argv0);
+	fprintf(stderr, "  -o  where to write the models (default: models.bin)\n");
+	fprintf(stderr, "  -m  portnums with fewer packets than this use the default model (default: 100)\n");
+	fprintf(stderr, "  -x  highest order of context model to build, 0 for none (default: %d)\n", MODEL_MAX_ORDER);
+	fprintf(stderr, "  -b  log2 of the number of order-2 context slots, 8..16 (default: 12)\n");
+	fprintf(stderr, "  -w  log2 of the number of wire-format model slots, 8..16, 0 for none (default: %d)\n", WIRE_BITS);
+	fprintf(stderr, "  -j  number of counting threads, each with its own tables (default: number of CPUs)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out = "models.bin";
+	struct model_set ms;
+	size_t mem = 0;
+	uint32_t min_packets = 100;
+	int nthreads = 0;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "o:m:x:b:w:j:h")) != -1) {
+		switch (opt) {
+		case 'o': out = optarg; break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 'm': min_packets = atoi(optarg); break;
+		case 'x': max_order = atoi(optarg); break;
+		case 'b': shape[1].bits = atoi(optarg); break;
+		case 'w': wire_bits = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return -1;
+		};
+	}
+
+	if (optind >= argc || max_order > MODEL_MAX_ORDER || shape[1].bits < 8 || shape[1].bits > 16 ||
+	    (wire_bits && (wire_bits < 8 || wire_bits > 16))) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (nthreads > 0) ? nthreads : 1;
+	}
+
+	if (train_corpora(&argv[optind], argc - optind, nthreads) != 0) {
+		return -1;
+	}
+
+	if (all.packets == 0) {
+		fprintf(stderr, "no usable packets\n");
+		return -1;
+	}
+
+	model_set_init(&ms);
+	printf("\n%20s  %9s  %11s  %s\n", "portnum", "packets", "bytes", "bits/byte (order 0, 1, 2, wire)");
+	for (int i = 0; i < MODEL_MAX_PORTNUM; i++) {
+		struct port_hist *h = &hist[i];
+
+		if (h->packets < min_packets || h->bytes == 0) {
+			continue;
+		}
+
+		set_escape(h);
+		if (model_set_add(&ms, i, h->counts, MODEL_NSYM) != 0) {
+			goto fail;
+		}
+
+		printf("%20s  %9u  %11lu  %.3f", portnum_str(i), h->packets, (unsigned long)h->bytes, cross_entropy(&ms.port[i]->model, h));
+		if (train_contexts(&ms, i, h, &mem) != 0) {
+			goto fail;
+		}
+	}
+
+	set_escape(&all);
+	if (model_set_add(&ms, MODEL_DEFAULT, all.counts, MODEL_NSYM) != 0) {
+		goto fail;
+	}
+
+	printf("%20s  %9u  %11lu  %.3f", "(default)", all.packets, (unsigned long)all.bytes, cross_entropy(&ms.fallback->model, &all));
+	if (train_contexts(&ms, MODEL_DEFAULT, &all, &mem) != 0) {
+		goto fail;
+	}
+
+	if (max_order || wire_bits) {
+		printf("\ncontext tables: %zu KB\n", mem / 1024);
+	}
+
+	if ((ret = model_set_save(&ms, out)) == 0) {
+		printf("\nwrote %s\n", out);
+	}
+
+	model_set_free(&ms);
+	return ret;
+
+fail:
+	model_set_free(&ms);
+	return -1;
+}
@@ -0,0 +1,460 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pb.h>
+#include <pb_common.h>
+#include "meshtastic/mesh.pb.h"
+#include "meshtastic/telemetry.pb.h"
+#include "meshtastic/portnums.pb.h"
+
+#include "wire.h"
+
+/* token classes; the first part of every slot key */
+enum wire_class {
+	WIRE_MODE = 1,
+	WIRE_TAG,
+	WIRE_VARINT,
+	WIRE_FIXED32,
+	WIRE_FIXED64,
+	WIRE_LENGTH,
+	WIRE_TEXT,
+	WIRE_BYTES,
+	WIRE_RAW,
+};
+
+/* how the payload is coded, sent as the first symbol */
+enum wire_mode {
+	WIRE_MESSAGE,		/* parsed as protobuf */
+	WIRE_PLAIN,		/* didn't parse: raw bytes */
+	WIRE_STRING,		/* a plain text portnum */
+};
+
+/* what a length delimited field holds */
+enum wire_kind {
+	KIND_BYTES,
+	KIND_TEXT,
+	KIND_MESSAGE,
+};
+
+/* wire_run() until the end of the message rather than for a given length */
+#define WIRE_TO_END	((size_t)-1)
+
+/*
+ * One pass over a payload.  The walk is the same whether encoding, decoding, counting
+ * or just checking that a payload parses; only sym() differs.  It's given the slot and
+ * the symbol at the current position (meaningless when decoding) and returns the
+ * symbol that is actually there, or -1.
+ */
+struct wire_walk {
+	int (*sym)(struct wire_walk *w, u32 slot, u32 hint);
+	const uint8_t *in;		/* the payload, NULL when decoding */
+	uint8_t *out;			/* where the payload is rebuilt when decoding, otherwise NULL */
+	size_t pos;			/* current position in the payload */
+	u32 bits;			/* log2 of the number of slots */
+
+	ac_state_t *state;
+	const ac_context_t *model;
+	u32 *counts;
+};
+
+/* the root message of each portnum we have a descriptor for; NULL for plain text */
+static const struct wire_schema {
+	unsigned portnum;
+	const pb_msgdesc_t *desc;
+} schemas[] = {
+	{ MESHTASTIC_PORT_NUM_TEXT_MESSAGE_APP,	NULL },
+	{ MESHTASTIC_PORT_NUM_POSITION_APP,	MESHTASTIC_POSITION_FIELDS },
+	{ MESHTASTIC_PORT_NUM_NODEINFO_APP,	MESHTASTIC_USER_FIELDS },
+	{ MESHTASTIC_PORT_NUM_TELEMETRY_APP,	MESHTASTIC_TELEMETRY_FIELDS },
+	{ MESHTASTIC_PORT_NUM_TRACEROUTE_APP,	MESHTASTIC_ROUTE_DISCOVERY_FIELDS },
+};
+
+static const struct wire_schema *wire_schema(unsigned portnum)
+{
+	for (int i = 0; i < sizeof(schemas)/sizeof(schemas[0]); i++) {
+		if (schemas[i].portnum == portnum) {
+			return &schemas[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* what field <field> of <desc> holds, according to its descriptor */
+static enum wire_kind wire_kind(const pb_msgdesc_t *desc, u32 field, const pb_msgdesc_t **sub)
+{
+	pb_field_iter_t it;
+
+	if (desc == NULL || ! pb_field_iter_begin(&it, desc, NULL) || ! pb_field_iter_find(&it, field)) {
+		return KIND_BYTES;
+	}
+
+	if (PB_LTYPE_IS_SUBMSG(it.type) && it.submsg_desc) {
+		*sub = it.submsg_desc;
+		return KIND_MESSAGE;
+	}
+
+	return (PB_LTYPE(it.type) == PB_LTYPE_STRING) ? KIND_TEXT : KIND_BYTES;
+}
+
+/*
+ * Slots are a hash of the token class and up to three more values.  Message ids are
+ * the portnum for the root message and derived from the parent's id and the field
+ * number for submessages, so they're the same on every machine.
+ */
+static u32 wire_slot(const struct wire_walk *w, u32 cls, u32 a, u32 b, u32 c)
+{
+	u32 h = cls * 0x9e3779b1U;
+
+	h = (h ^ a) * 0x85ebca6bU;
+	h ^= h >> 13;
+	h = (h ^ b) * 0xc2b2ae35U;
+	h ^= h >> 16;
+	h = (h ^ c) * 0x9e3779b1U;
+	return h >> (32 - w->bits);
+}
+
+static u32 wire_subid(u32 msg, u32 field)
+{
+	return (msg * 0x01000193U) ^ field;
+}
+
+/* codes the byte at w->pos, or the end of the message if it ends there and <end_ok> */
+static int wire_next(struct wire_walk *w, u32 slot, size_t limit, bool end_ok)
+{
+	u32 hint = AC_CTX_END;
+	int sym;
+
+	if (w->pos < limit) {
+		hint = (w->in) ? w->in[w->pos] : 0;
+	} else if (! end_ok) {
+		return -1;
+	}
+
+	if ((sym = w->sym(w, slot, hint)) < 0 || sym == AC_CTX_END) {
+		return (end_ok) ? sym : -1;
+	}
+
+	/* a corrupt message must not run off the end of the output buffer */
+	if (w->pos >= limit) {
+		return -1;
+	}
+
+	if (w->out) {
+		w->out[w->pos] = sym;
+	}
+
+	w->pos++;
+	return sym;
+}
+
+static int wire_varint(struct wire_walk *w, u32 cls, u32 msg, u32 field, size_t limit, u64 *v)
+{
+	int sym;
+
+	*v = 0;
+	for (u32 i = 0; i < 10; i++) {
+		if ((sym = wire_next(w, wire_slot(w, cls, msg, field, (i < 3) ? i : 3), limit, false)) < 0) {
+			return -1;
+		}
+
+		*v |= (u64)(sym & 0x7f) << (7 * i);
+		if ((sym & 0x80) == 0) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* an <n> byte fixed-size field, most significant lane first */
+static int wire_fixed(struct wire_walk *w, u32 cls, u32 msg, u32 field, size_t n, size_t limit)
+{
+	u32 key, top = 0;
+	int sym;
+
+	if (w->pos + n > limit) {
+		return -1;
+	}
+
+	for (size_t i = n; i-- > 0; ) {
+		key = (i << 9) | ((i == n - 2) ? 0x100 | top : 0);
+		if ((sym = w->sym(w, wire_slot(w, cls, msg, field, key), (w->in) ? w->in[w->pos + i] : 0)) < 0 || sym == AC_CTX_END) {
+			return -1;
+		}
+
+		if (w->out) {
+			w->out[w->pos + i] = sym;
+		}
+
+		top = (i == n - 1) ? sym : top;
+	}
+
+	w->pos += n;
+	return 0;
+}
+
+/* <len> bytes (or up to the end symbol) of text, bytes or raw payload */
+static int wire_run(struct wire_walk *w, u32 cls, u32 msg, u32 field, size_t len, size_t limit)
+{
+	const bool to_end = (len == WIRE_TO_END);
+	u32 prev1 = 0, prev2 = 0, slot;
+	int sym;
+
+	for (size_t i = 0; to_end || i < len; i++) {
+		switch (cls) {
+		case WIRE_TEXT:	slot = wire_slot(w, cls, prev1, prev2, 0); break;
+		case WIRE_RAW:	slot = wire_slot(w, cls, prev1, 0, 0); break;
+		default:	slot = wire_slot(w, cls, msg, field, i & 3); break;
+		}
+
+		if ((sym = wire_next(w, slot, limit, to_end)) < 0) {
+			return -1;
+		}
+
+		if (sym == AC_CTX_END) {
+			break;
+		}
+
+		prev2 = prev1;
+		prev1 = sym;
+	}
+
+	return 0;
+}
+
+static int wire_message(struct wire_walk *w, const pb_msgdesc_t *desc, u32 msg, size_t limit, int depth);
+
+/*
+ * The encoder checks the length is one the decoder will reproduce and codes the
+ * submessage within it.  The decoder leaves room for a one byte length, decodes the
+ * submessage, then writes the length and, if it took more than a byte, moves the
+ * submessage up behind it.  The submessage is never decoded past where it ends up,
+ * so an output buffer as long as the payload is always enough.
+ */
+static int wire_submessage(struct wire_walk *w, const pb_msgdesc_t *desc, u32 msg, size_t limit, int depth)
+{
+	const size_t start = w->pos;
+	uint8_t hdr[5];
+	size_t n, end;
+	u64 len;
+
+	if (w->in) {
+		for (n = 0, len = 0; n < 5 && start + n < limit; n++) {
+			len |= (u64)(w->in[start + n] & 0x7f) << (7 * n);
+			if ((w->in[start + n] & 0x80) == 0) {
+				break;
+			}
+		}
+
+		/* not terminated, not minimal (a trailing zero byte) or too long */
+		if (n == 5 || start + n == limit || (n > 0 && w->in[start + n] == 0) || len > limit - (start + n + 1)) {
+			return -1;
+		}
+
+		w->pos = start + n + 1;
+		end = w->pos + len;
+		return (wire_message(w, desc, msg, end, depth) == 0 && w->pos == end) ? 0 : -1;
+	}
+
+	if (start >= limit) {
+		return -1;
+	}
+
+	w->pos = start + 1;
+	if (wire_message(w, desc, msg, limit, depth) != 0) {
+		return -1;
+	}
+
+	len = w->pos - (start + 1);
+	for (n = 0; len >= 0x80; n++, len >>= 7) {
+		hdr[n] = (len & 0x7f) | 0x80;
+	}
+
+	hdr[n++] = len;
+	len = w->pos - (start + 1);
+	if (len > limit - (start + n)) {
+		return -1;
+	}
+
+	memmove(w->out + start + n, w->out + start + 1, len);
+	memcpy(w->out + start, hdr, n);
+	w->pos = start + n + len;
+	return 0;
+}
+
+static int wire_message(struct wire_walk *w, const pb_msgdesc_t *desc, u32 msg, size_t limit, int depth)
+{
+	const pb_msgdesc_t *sub = NULL;
+	u32 prev = 0, field;
+	u64 tag, len;
+	int sym, ret;
+
+	if (depth > WIRE_MAX_DEPTH) {
+		return -1;
+	}
+
+	for (;;) {
+		/* the first byte of the tag is also where the message ends */
+		if ((sym = wire_next(w, wire_slot(w, WIRE_TAG, msg, prev, 0), limit, true)) < 0) {
+			return -1;
+		}
+
+		if (sym == AC_CTX_END) {
+			return 0;
+		}
+
+		tag = sym & 0x7f;
+		for (u32 i = 1; sym & 0x80; i++) {
+			if (i == 5 || (sym = wire_next(w, wire_slot(w, WIRE_TAG, msg, prev, i), limit, false)) < 0) {
+				return -1;
+			}
+
+			tag |= (u64)(sym & 0x7f) << (7 * i);
+		}
+
+		if ((field = tag >> 3) == 0 || (tag >> 3) > 0x1fffffff) {
+			return -1;
+		}
+
+		switch (tag & 7) {
+		case PB_WT_VARINT:
+			ret = wire_varint(w, WIRE_VARINT, msg, field, limit, &len);
+			break;
+
+		case PB_WT_32BIT:
+			ret = wire_fixed(w, WIRE_FIXED32, msg, field, 4, limit);
+			break;
+
+		case PB_WT_64BIT:
+			ret = wire_fixed(w, WIRE_FIXED64, msg, field, 8, limit);
+			break;
+
+		case PB_WT_STRING:
+			switch (wire_kind(desc, field, &sub)) {
+			case KIND_MESSAGE:
+				ret = wire_submessage(w, sub, wire_subid(msg, field), limit, depth + 1);
+				break;
+
+			case KIND_TEXT:
+				if ((ret = wire_varint(w, WIRE_LENGTH, msg, field, limit, &len)) == 0) {
+					ret = (len <= limit - w->pos) ? wire_run(w, WIRE_TEXT, msg, field, len, limit) : -1;
+				}
+				break;
+
+			case KIND_BYTES:
+			default:
+				if ((ret = wire_varint(w, WIRE_LENGTH, msg, field, limit, &len)) == 0) {
+					ret = (len <= limit - w->pos) ? wire_run(w, WIRE_BYTES, msg, field, len, limit) : -1;
+				}
+				break;
+			}
+			break;
+
+		default:
+			ret = -1;
+			break;
+		}
+
+		if (ret != 0) {
+			return -1;
+		}
+
+		prev = field;
+	}
+}
+
+
+static int check_sym(struct wire_walk *w, u32 slot, u32 hint)
+{
+	return hint;
+}
+
+static int count_sym(struct wire_walk *w, u32 slot, u32 hint)
+{
+	w->counts[(size_t)slot * AC_CTX_NSYM + hint]++;
+	return hint;
+}
+
+static int encode_sym(struct wire_walk *w, u32 slot, u32 hint)
+{
+	return (ac_encode_symbol(w->state, w->model, slot, hint) == 0) ? (int)hint : -1;
+}
+
+static int decode_sym(struct wire_walk *w, u32 slot, u32 hint)
+{
+	return ac_decode_symbol(w->state, w->model, slot);
+}
+
+/* codes (or decodes into a buffer of <limit> bytes) a whole payload */
+static int wire_payload(struct wire_walk *w, unsigned portnum, size_t limit)
+{
+	const struct wire_schema *sc = wire_schema(portnum);
+	const pb_msgdesc_t *desc = (sc) ? sc->desc : NULL;
+	u32 mode = 0;
+	int sym;
+
+	if (w->in) {
+		struct wire_walk chk = { .sym = check_sym, .in = w->in, .bits = w->bits };
+
+		if (sc && sc->desc == NULL) {
+			mode = WIRE_STRING;
+		} else {
+			mode = (wire_message(&chk, desc, portnum, limit, 0) == 0) ? WIRE_MESSAGE : WIRE_PLAIN;
+		}
+	}
+
+	switch ((sym = w->sym(w, wire_slot(w, WIRE_MODE, portnum, 0, 0), mode))) {
+	case WIRE_MESSAGE:
+		return wire_message(w, desc, portnum, limit, 0);
+
+	case WIRE_STRING:
+		return wire_run(w, WIRE_TEXT, 0, 0, WIRE_TO_END, limit);
+
+	case WIRE_PLAIN:
+		return wire_run(w, WIRE_RAW, 0, 0, WIRE_TO_END, limit);
+
+	default:
+		return -1;
+	}
+}
+
+int wire_encode(ac_state_t *s, const ac_context_t *m, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin)
+{
+	struct wire_walk w = { .sym = encode_sym, .in = in, .bits = m->bits, .state = s, .model = m };
+	int ret;
+
+	if ((ret = ac_encode_begin(s, *out, *nout)) != 0) {
+		return ret;
+	}
+
+	ret = wire_payload(&w, portnum, nin);
+	if (ac_encode_end(s, out, nout) != 0) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int wire_decode(ac_state_t *s, const ac_context_t *m, unsigned portnum, void **out, size_t *nout, const void *in, size_t nin)
+{
+	struct wire_walk w = { .sym = decode_sym, .out = *out, .bits = m->bits, .state = s, .model = m };
+	int ret;
+
+	if (*out == NULL || (ret = ac_decode_begin(s, in, nin)) != 0) {
+		return -1;
+	}
+
+	ret = wire_payload(&w, portnum, *nout);
+	ac_decode_end(s);
+	*nout = w.pos;
+	return ret;
+}
+
+void wire_count(u32 *counts, u32 bits, unsigned portnum, const void *in, size_t nin)
+{
+	struct wire_walk w = { .sym = count_sym, .in = in, .bits = bits, .counts = counts };
+
+	wire_payload(&w, portnum, nin);
+}
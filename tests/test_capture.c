@@ -0,0 +1,277 @@
+/*
+ * Capture round trip test
+ *
+ * Writes a capture of made-up records, some received late so the receive times
+ * aren't sorted, and reads it back through the corpus reader: whole, in shards,
+ * by portnum and by span of receive times, checking every record against what
+ * was written and every count against a walk over the records themselves.  The
+ * same reads are then repeated on the capture with a bad time mark and with its
+ * trailer cut off, where the reader must give up on the index and still find
+ * every record.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "corpus.h"
+
+#define RECORDS		(5000)
+#define NO_PORT		(-1)
+
+struct expected {
+	uint32_t rx_time;
+	uint16_t portnum;
+	size_t gateway_len;
+	size_t len;
+};
+
+static struct expected want[RECORDS];
+static int failures;
+
+static uint32_t next_random(void)
+{
+	static uint32_t seed = 1;
+
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+/* record <i>'s bytes all derive from <i>, which starts the packet */
+static void fill_packet(uint8_t *pkt, size_t len, uint32_t i)
+{
+	memset(pkt, i * 7, len);
+	memcpy(pkt, &i, sizeof(i));
+}
+
+static int write_capture(const char *path)
+{
+	struct capture_writer w;
+	const char gateway[] = "!0123456789ab";
+	uint8_t pkt[MESH_HEADER_LEN + 64];
+	uint32_t t = 1700000000;
+
+	if (capture_create(&w, path) != 0) {
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < RECORDS; i++) {
+		t += next_random() % 5;
+		want[i].rx_time = (next_random() % 10 == 0) ? t - next_random() % 600 : t;
+		want[i].portnum = (next_random() % 4) * 3 + 1;
+		want[i].gateway_len = i % sizeof(gateway);
+		want[i].len = MESH_HEADER_LEN + i % 48;
+		fill_packet(pkt, want[i].len, i);
+
+		const struct capture_record r = {
+			.rx_time = want[i].rx_time,
+			.portnum = want[i].portnum,
+			.gateway = gateway,
+			.gateway_len = want[i].gateway_len,
+			.packet = pkt,
+			.len = want[i].len,
+		};
+
+		if (capture_write(&w, &r) != 0) {
+			capture_close(&w);
+			return -1;
+		}
+	}
+
+	return capture_close(&w);
+}
+
+static bool wanted(uint32_t i, int portnum, uint32_t since, uint32_t until)
+{
+	return (portnum == NO_PORT || want[i].portnum == portnum) && want[i].rx_time >= since && (until == 0 || want[i].rx_time < until);
+}
+
+/* reads the records with <portnum> received in [since, until) in <nshards> shards, checking each one; returns how many there were */
+static long read_capture(const struct corpus *c, int portnum, uint32_t since, uint32_t until, int nshards)
+{
+	struct corpus_cursor cur;
+	struct capture_record r;
+	uint8_t pkt[MESH_HEADER_LEN + 64];
+	uint32_t i;
+	long n = 0;
+	int ret;
+
+	for (int shard = 0; shard < nshards; shard++) {
+		if (portnum == NO_PORT) {
+			corpus_shard(c, &cur, shard, nshards);
+		} else if (corpus_port(c, &cur, portnum, shard, nshards) != 0) {
+			return -1;
+		}
+
+		if ((since || until) && corpus_time_range(c, &cur, since, until) != 0) {
+			return -1;
+		}
+
+		while ((ret = corpus_next_record(&cur, &r, NULL, 0)) != 0) {
+			if (ret < 0 || r.len < sizeof(i)) {
+				fprintf(stderr, "a malformed record after %ld good ones\n", n);
+				++failures;
+				continue;
+			}
+
+			memcpy(&i, r.packet, sizeof(i));
+			if (i < RECORDS) {
+				fill_packet(pkt, want[i].len, i);
+			}
+
+			if (i >= RECORDS || ! wanted(i, portnum, since, until) || r.rx_time != want[i].rx_time || r.portnum != want[i].portnum ||
+			    r.gateway_len != want[i].gateway_len || memcmp(r.gateway, "!0123456789ab", r.gateway_len) != 0 ||
+			    r.len != want[i].len || memcmp(r.packet, pkt, r.len) != 0) {
+				fprintf(stderr, "record %u doesn't match what was written, or shouldn't be here\n", i);
+				++failures;
+			}
+
+			++n;
+		}
+	}
+
+	return n;
+}
+
+static long count_wanted(int portnum, uint32_t since, uint32_t until)
+{
+	long n = 0;
+
+	for (uint32_t i = 0; i < RECORDS; i++) {
+		n += wanted(i, portnum, since, until);
+	}
+
+	return n;
+}
+
+/* the reads a replay does, with and without the index */
+static void check_reads(const char *path, bool indexed)
+{
+	static const uint32_t spans[][2] = {
+		{ 0, 0 }, { 1700000000, 0 }, { 1700001000, 1700002000 }, { 1700004000, 1700004001 },
+		{ 1700003000, 0 }, { 0, 1700000500 }, { 1800000000, 0 },
+	};
+	struct corpus c;
+	long got, expected;
+
+	if (corpus_open(&c, path) != 0) {
+		++failures;
+		return;
+	}
+
+	if ((c.ports != NULL) != indexed || c.records != RECORDS) {
+		fprintf(stderr, "%s: %s index, %llu records\n", path, (c.ports) ? "an" : "no", (unsigned long long)c.records);
+		++failures;
+	}
+
+	for (size_t s = 0; s < sizeof(spans) / sizeof(spans[0]); s++) {
+		for (int portnum = NO_PORT; portnum <= 12; portnum += (portnum == NO_PORT) ? 2 : 1) {
+			if (portnum != NO_PORT && ! indexed) {
+				break;
+			}
+
+			for (int nshards = 1; nshards <= 4; nshards++) {
+				got = read_capture(&c, portnum, spans[s][0], spans[s][1], nshards);
+				expected = count_wanted(portnum, spans[s][0], spans[s][1]);
+				if (got != expected) {
+					fprintf(stderr, "%s: portnum %d, [%u, %u), %d shards: %ld records, expected %ld\n",
+						path, portnum, spans[s][0], spans[s][1], nshards, got, expected);
+					++failures;
+				}
+			}
+		}
+	}
+
+	corpus_close(&c);
+}
+
+/* points the first time mark before the records, as a damaged index might */
+static int break_time_mark(const char *path)
+{
+	uint8_t b[24], off[8] = { 3 };
+	uint64_t idx, records;
+	uint32_t nports;
+	FILE *f;
+	int ret = -1;
+
+	if ((f = fopen(path, "r+b")) == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fseek(f, -CAPTURE_TRAILER_LEN, SEEK_END) == 0 && fread(b, CAPTURE_TRAILER_LEN, 1, f) == 1) {
+		idx = capture_le64(b);
+		records = capture_le64(b + 8);
+		if (fseek(f, idx, SEEK_SET) == 0 && fread(b, 4, 1, f) == 1) {
+			nports = capture_le32(b);
+			if (fseek(f, idx + 4 + 16 * nports + 8 * records + 4 + 8, SEEK_SET) == 0 && fwrite(off, sizeof(off), 1, f) == 1) {
+				ret = 0;
+			}
+		}
+	}
+
+	if (fclose(f) != 0) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* where the trailer starts */
+static long trailer_offset(const char *path)
+{
+	FILE *f;
+	long len = -1;
+
+	if ((f = fopen(path, "rb")) != NULL) {
+		if (fseek(f, 0, SEEK_END) == 0) {
+			len = ftell(f);
+		}
+
+		fclose(f);
+	}
+
+	return len - CAPTURE_TRAILER_LEN;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/test_capture.XXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+
+	close(fd);
+	if (write_capture(path) != 0) {
+		unlink(path);
+		return 1;
+	}
+
+	check_reads(path, true);
+	printf("indexed: %d failures\n", failures);
+
+	if (break_time_mark(path) != 0) {
+		++failures;
+	}
+
+	check_reads(path, false);
+	printf("bad time mark: %d failures\n", failures);
+
+	/* as if the writer had been killed part way through the index */
+	if (write_capture(path) != 0 || truncate(path, trailer_offset(path) - 100) != 0) {
+		unlink(path);
+		return 1;
+	}
+
+	check_reads(path, false);
+	printf("no trailer: %d failures\n", failures);
+
+	unlink(path);
+	return (failures == 0) ? 0 : 1;
+}
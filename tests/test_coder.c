@@ -0,0 +1,673 @@
+/*
+ * Coder round trip test
+ *
+ * Codes random, skewed and mostly-0xff messages, and ones chosen to keep long
+ * runs of 0xff bytes pending and force carries into them, through every way in
+ * to the coder: the float CDF API, the shared model API with and without a lookup
+ * table, the batch, adaptive and context APIs on both the arithmetic and rANS
+ * backends, tANS, the streaming encoder and decoder fed a byte at a time, and the
+ * compact coder.  Every message must come back as it went in.
+ *
+ * The arithmetic coder's output is checked against checksums taken from the
+ * coder as it was before it held carries back (it went back over its output to
+ * add them then), and the streaming and compact encoders, which must write the
+ * same bytes, against it byte for byte.  Finally a model file is saved and loaded
+ * back, and the models in it must come back exactly, and decode what the
+ * originals encoded.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arithcode.h"
+#include "models.h"
+
+#define MESSAGES	(3000)
+#define TRAINING	(500)
+#define MAX_LEN		(300)
+#define OUT_MAX		(4 * MAX_LEN + 64)
+#define BATCH		(16)
+#define PORTNUM		(3)
+
+/* checksums of the test messages as coded before carries were held back */
+#define FLOAT_SUM	(0x0521c3a8u)
+#define SKEWED_SUM	(0x7ef6503bu)
+#define FLAT_SUM	(0xb01d59c7u)
+
+enum kind { RANDOM, SKEWED, RUNS, STRADDLE, KINDS };
+
+static const char *kind_names[KINDS] = { "random", "skewed", "0xff runs", "straddling" };
+
+static uint8_t msg[MESSAGES][MAX_LEN];
+static size_t msg_len[MESSAGES];
+static int failures;
+
+static uint32_t next_random(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+/* message <i>, the same every run and independent of any other use of random numbers */
+static size_t make_message(uint8_t *buf, uint32_t i)
+{
+	uint32_t seed = (i + 1) * 2654435761u, r;
+	size_t len;
+
+	seed = (seed ^ (seed >> 15)) * 2246822519u;
+	seed ^= seed >> 13;
+
+	len = next_random(&seed) % MAX_LEN;
+	for (size_t k = 0; k < len; k++) {
+		switch (i % KINDS) {
+		case RANDOM:
+			buf[k] = next_random(&seed);
+			break;
+
+		case SKEWED:
+			r = next_random(&seed);
+			buf[k] = r % (1 + next_random(&seed) % 24);
+			break;
+
+		case RUNS:
+			buf[k] = (next_random(&seed) % 16 == 0) ? next_random(&seed) : 0xff;
+			break;
+
+		/* filled in for each model by make_straddling() */
+		default:
+			buf[k] = 0xff;
+			break;
+		}
+	}
+
+	return len;
+}
+
+static uint32_t checksum(uint32_t h, const uint8_t *p, size_t n)
+{
+	h = (h ^ (n & 0xff)) * 16777619u;
+	h = (h ^ (n >> 8)) * 16777619u;
+	for (size_t k = 0; k < n; k++) {
+		h = (h ^ p[k]) * 16777619u;
+	}
+
+	return h;
+}
+
+/* a model trained on skewed and mostly-0xff messages, so random ones need the escape */
+static int skewed_counts(u32 *counts)
+{
+	uint8_t buf[MAX_LEN];
+	size_t len;
+	u32 n1 = 0;
+
+	memset(counts, 0, (MODEL_NSYM + 1) * sizeof(*counts));
+	for (uint32_t i = MESSAGES; i < MESSAGES + TRAINING; i++) {
+		if (i % KINDS != SKEWED && i % KINDS != RUNS) {
+			continue;
+		}
+
+		len = make_message(buf, i);
+		for (size_t k = 0; k < len; k++) {
+			counts[buf[k]]++;
+		}
+
+		counts[MODEL_NSYM]++;
+	}
+
+	for (int k = 0; k < 256; k++) {
+		n1 += (counts[k] == 1);
+	}
+
+	counts[AC_ESC] = n1 + 1;
+	return 0;
+}
+
+/* every byte equally likely, with no escape */
+static void flat_counts(u32 *counts)
+{
+	for (int k = 0; k < 256; k++) {
+		counts[k] = 1;
+	}
+
+	counts[256] = 1;
+}
+
+/*
+ * The straddling messages are what <m> decodes from a point just under 1/4, 1/2
+ * or 3/4, cut short at the length make_message() gave them.  Every symbol's
+ * interval then holds the point, so the encoder can't settle the top byte and
+ * keeps 0xff bytes pending for as long as the message runs, until the end
+ * symbol carries into them or doesn't.
+ */
+static void make_straddling(const ac_model_t *m)
+{
+	static const uint8_t points[3] = { 0x3f, 0x7f, 0xbf };
+	ac_state_t s = { 0 };
+	uint8_t in[MAX_LEN + 64];
+	void *outp;
+
+	memset(in, 0xff, sizeof(in));
+	for (uint32_t i = STRADDLE; i < MESSAGES; i += KINDS) {
+		in[0] = points[(i / KINDS) % 3];
+		outp = msg[i];
+		msg_len[i] = make_message(msg[i], i);
+
+		/* this runs out of room, but what it decoded stays */
+		ac_decode_model_u8(&s, &outp, &msg_len[i], in, sizeof(in), m, NULL);
+	}
+}
+
+static void expect_message(uint32_t i, const uint8_t *out, size_t nout, int ret, const char *what)
+{
+	if (ret < 0 || nout != msg_len[i] || memcmp(out, msg[i], nout) != 0) {
+		fprintf(stderr, "%s: %s message %u (%zu bytes) came back wrong\n", what, kind_names[i % KINDS], i, msg_len[i]);
+		++failures;
+	}
+}
+
+/* the float CDF API, with a CDF built from each message */
+static uint32_t check_float(void)
+{
+	real cdf[CDF_MAX_SYMB + 1];
+	uint8_t enc[OUT_MAX], dec[MAX_LEN];
+	void *outp;
+	size_t nsym, nenc, nout;
+	uint32_t sum = 0;
+	int ret;
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		if (msg_len[i] == 0) {
+			continue;
+		}
+
+		cdf_build(cdf, &nsym, msg[i], msg_len[i]);
+		outp = enc;
+		nenc = sizeof(enc);
+		if (encode_u8_u8(&outp, &nenc, msg[i], msg_len[i], cdf, nsym) != 0) {
+			fprintf(stderr, "float: message %u didn't encode\n", i);
+			++failures;
+			continue;
+		}
+
+		sum = checksum(sum, enc, nenc);
+		outp = dec;
+		nout = sizeof(dec);
+		ret = decode_u8_u8(&outp, &nout, enc, nenc, cdf, nsym);
+		expect_message(i, dec, nout, ret, "float");
+	}
+
+	return sum;
+}
+
+/* the shared model API, arithmetic coded; returns the checksum of the output */
+static uint32_t check_model(const ac_model_t *m, const ac_lut_t *lut, uint8_t (*enc)[OUT_MAX], size_t *nenc)
+{
+	ac_state_t s = { 0 };
+	uint8_t dec[MAX_LEN];
+	void *outp;
+	size_t nout;
+	uint32_t sum = 0;
+	int ret;
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		outp = enc[i];
+		nenc[i] = OUT_MAX;
+		if (ac_encode_model_u8(&s, &outp, &nenc[i], msg[i], msg_len[i], m) != 0) {
+			fprintf(stderr, "model: message %u didn't encode\n", i);
+			++failures;
+			nenc[i] = 0;
+			continue;
+		}
+
+		sum = checksum(sum, enc[i], nenc[i]);
+		for (int k = 0; k < 2; k++) {
+			outp = dec;
+			nout = sizeof(dec);
+			ret = ac_decode_model_u8(&s, &outp, &nout, enc[i], nenc[i], m, (k) ? lut : NULL);
+			expect_message(i, dec, nout, ret, (k) ? "model with table" : "model");
+		}
+	}
+
+	return sum;
+}
+
+/* the streaming encoder must write what check_model() did, and never change a byte it has written */
+static void check_push(const ac_model_t *m, uint8_t (*enc)[OUT_MAX], const size_t *nenc)
+{
+	ac_state_t s = { 0 };
+	uint8_t out[OUT_MAX], seen[OUT_MAX];
+	size_t most_pending = 0;
+	int n, written;
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		if (ac_push_begin(&s, out, sizeof(out)) != 0) {
+			++failures;
+			return;
+		}
+
+		written = 0;
+		for (size_t k = 0; k <= msg_len[i]; k++) {
+			n = (k < msg_len[i]) ? ac_push(&s, m, &msg[i][k], 1) : ac_push_end(&s, m);
+			if (n < written || memcmp(out, seen, written) != 0) {
+				fprintf(stderr, "push: message %u: %d bytes written, then %d, or one was changed\n", i, written, n);
+				++failures;
+				break;
+			}
+
+			memcpy(seen + written, out + written, n - written);
+			written = n;
+			if (s.pending > most_pending) {
+				most_pending = s.pending;
+			}
+		}
+
+		if ((size_t)written != nenc[i] || memcmp(out, enc[i], written) != 0) {
+			fprintf(stderr, "push: message %u: %d bytes, not the %zu ac_encode_model_u8() wrote\n", i, written, nenc[i]);
+			++failures;
+		}
+	}
+
+	if (most_pending < 64) {
+		fprintf(stderr, "push: at most %zu 0xff bytes were ever pending\n", most_pending);
+		++failures;
+	}
+
+	printf("push: up to %zu 0xff bytes pending\n", most_pending);
+}
+
+/* the streaming decoder, given one more byte each call */
+static void check_pull(const ac_model_t *m, const ac_lut_t *lut, uint8_t (*enc)[OUT_MAX], const size_t *nenc)
+{
+	ac_state_t s = { 0 };
+	uint8_t dec[MAX_LEN];
+	size_t ndone, prev, early = 0;
+	int ret = 0;
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		if (ac_pull_begin(&s) != 0) {
+			++failures;
+			return;
+		}
+
+		ndone = 0;
+		for (size_t k = 1; k <= nenc[i]; k++) {
+			prev = ndone;
+			ret = ac_pull(&s, m, lut, enc[i], k, k == nenc[i], dec, sizeof(dec), &ndone);
+			if (ret < 0 || ndone < prev || ndone > msg_len[i] || memcmp(dec, msg[i], ndone) != 0) {
+				break;
+			}
+
+			if (k < nenc[i]) {
+				early += ndone - prev;
+			}
+
+			if (ret == 1) {
+				break;
+			}
+		}
+
+		expect_message(i, dec, ndone, (ret == 1) ? 0 : -1, "pull");
+	}
+
+	if (early == 0) {
+		fprintf(stderr, "pull: nothing was decoded before the last byte arrived\n");
+		++failures;
+	}
+
+	printf("pull: %zu bytes decoded before the end of their message arrived\n", early);
+}
+
+/* the compact coder must write what check_model() did */
+static void check_compact(const ac_model_t *m, uint8_t (*enc)[OUT_MAX], const size_t *nenc)
+{
+	ac_cmodel_t *cm;
+	ac_coder_t c;
+	uint8_t out[OUT_MAX], dec[MAX_LEN];
+	int n;
+
+	if ((cm = malloc(ac_cmodel_size(m->nsym))) == NULL || ac_cmodel_from_model(cm, m) != 0) {
+		free(cm);
+		++failures;
+		return;
+	}
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		n = ac_encode_compact_u8(&c, cm, out, sizeof(out), msg[i], msg_len[i]);
+		if (n < 0 || (size_t)n != nenc[i] || memcmp(out, enc[i], n) != 0) {
+			fprintf(stderr, "compact: message %u: %d bytes, not the %zu ac_encode_model_u8() wrote\n", i, n, nenc[i]);
+			++failures;
+			continue;
+		}
+
+		n = ac_decode_compact_u8(&c, cm, dec, sizeof(dec), out, n);
+		expect_message(i, dec, (n < 0) ? 0 : n, n, "compact");
+	}
+
+	free(cm);
+}
+
+/* the shared model, batch, adaptive and tANS coders on one backend */
+static void check_backend(u32 backend, const ac_model_t *m, const ac_lut_t *lut)
+{
+	static uint8_t arena[BATCH * OUT_MAX + 1], unpacked[BATCH * MAX_LEN];
+	static ac_rans_queue_t queue;
+	const char *name = (backend == AC_BACKEND_RANS) ? "rans" : "arith";
+	ac_packet_t pkts[BATCH];
+	size_t offsets[BATCH + 1], unpacked_offsets[BATCH + 1];
+	ac_state_t enc_state = { 0 }, dec_state = { 0 };
+	ac_adaptive_t prior, adaptive;
+	ac_tans_t tans;
+	uint8_t enc[OUT_MAX], dec[MAX_LEN];
+	void *outp;
+	size_t nenc, nout;
+	char what[32];
+	int ret;
+
+	if (ac_set_backend(&enc_state, backend) != 0 || ac_set_backend(&dec_state, backend) != 0 ||
+	    ac_adaptive_init(&prior, m, AC_ADAPT_WEIGHT, AC_ADAPT_INC) != 0 || ac_tans_build(&tans, m) != 0) {
+		++failures;
+		return;
+	}
+
+	ac_use_rans_queue(&enc_state, &queue);
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		for (int k = 0; k < 2; k++) {
+			outp = enc;
+			nenc = sizeof(enc);
+			ret = ac_encode_model_u8(&enc_state, &outp, &nenc, msg[i], msg_len[i], m);
+			outp = dec;
+			nout = sizeof(dec);
+			if (ret == 0) {
+				ret = ac_decode_model_u8(&dec_state, &outp, &nout, enc, nenc, m, (k) ? lut : NULL);
+			}
+
+			snprintf(what, sizeof(what), "%s%s", name, (k) ? " with table" : "");
+			expect_message(i, dec, nout, ret, what);
+		}
+
+		adaptive = prior;
+		outp = enc;
+		nenc = sizeof(enc);
+		ret = ac_encode_adaptive_u8(&enc_state, &outp, &nenc, msg[i], msg_len[i], &adaptive);
+		adaptive = prior;
+		outp = dec;
+		nout = sizeof(dec);
+		if (ret == 0) {
+			ret = ac_decode_adaptive_u8(&dec_state, &outp, &nout, enc, nenc, &adaptive);
+		}
+
+		snprintf(what, sizeof(what), "%s adaptive", name);
+		expect_message(i, dec, nout, ret, what);
+
+		/* tANS has a backend of its own, so only once */
+		if (backend == AC_BACKEND_ARITH) {
+			outp = enc;
+			nenc = sizeof(enc);
+			ret = ac_encode_tans_u8(&enc_state, &outp, &nenc, msg[i], msg_len[i], &tans);
+			outp = dec;
+			nout = sizeof(dec);
+			if (ret == 0) {
+				ret = ac_decode_tans_u8(&dec_state, &outp, &nout, enc, nenc, &tans);
+			}
+
+			expect_message(i, dec, nout, ret, "tans");
+		}
+	}
+
+	for (uint32_t i = 0; i + BATCH <= MESSAGES; i += BATCH) {
+		for (int k = 0; k < BATCH; k++) {
+			pkts[k].data = msg[i + k];
+			pkts[k].len = msg_len[i + k];
+		}
+
+		ret = ac_encode_batch_u8(&enc_state, pkts, BATCH, arena, sizeof(arena), offsets, m);
+		if (ret == 0) {
+			ret = ac_decode_batch_u8(&dec_state, arena, offsets, BATCH, unpacked, sizeof(unpacked), unpacked_offsets, m, lut);
+		}
+
+		snprintf(what, sizeof(what), "%s batch", name);
+		for (int k = 0; k < BATCH; k++) {
+			if (ret != 0) {
+				expect_message(i + k, NULL, 0, -1, what);
+				continue;
+			}
+
+			expect_message(i + k, unpacked + unpacked_offsets[k], unpacked_offsets[k + 1] - unpacked_offsets[k], 0, what);
+		}
+	}
+
+	printf("%s: %d messages through the shared model, adaptive and batch coders%s\n", name, MESSAGES,
+	       (backend == AC_BACKEND_ARITH) ? ", and tANS" : "");
+}
+
+/* order-1 and order-2 context counts, with escapes as the training tool sets them */
+static u32 *context_counts(const ac_context_t *shape)
+{
+	const size_t slots = (size_t)1 << shape->bits;
+	uint8_t buf[MAX_LEN];
+	u32 *ctx, *row, prev1, prev2, sym, n1;
+	size_t len;
+
+	if ((ctx = calloc(slots * AC_CTX_NSYM, sizeof(*ctx))) == NULL) {
+		return NULL;
+	}
+
+	for (uint32_t i = MESSAGES; i < MESSAGES + TRAINING; i++) {
+		len = make_message(buf, i);
+		prev1 = prev2 = 0;
+		for (size_t k = 0; k <= len; k++) {
+			sym = (k < len) ? buf[k] : AC_CTX_END;
+			ctx[(size_t)ac_context_slot(shape, prev1, prev2) * AC_CTX_NSYM + sym]++;
+			prev2 = prev1;
+			prev1 = sym;
+		}
+	}
+
+	for (size_t c = 0; c < slots; c++) {
+		row = ctx + c * AC_CTX_NSYM;
+		n1 = 0;
+		for (int k = 0; k < 256; k++) {
+			n1 += (row[k] == 1);
+		}
+
+		row[AC_ESC] = n1 + 1;
+	}
+
+	return ctx;
+}
+
+static bool same_context(const ac_context_t *a, const ac_context_t *b)
+{
+	if (a->slot == NULL || b->slot == NULL) {
+		return a->slot == b->slot;
+	}
+
+	return a->order == b->order && a->bits == b->bits && a->npool == b->npool &&
+	       memcmp(a->slot, b->slot, ((size_t)1 << a->bits) * sizeof(*a->slot)) == 0 &&
+	       memcmp(a->pool, b->pool, a->npool * sizeof(*a->pool)) == 0;
+}
+
+static bool same_port_model(const struct port_model *a, const struct port_model *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+
+	if (a->model.nsym != b->model.nsym || memcmp(a->model.cum, b->model.cum, (a->model.nsym + 1) * sizeof(a->model.cum[0])) != 0 ||
+	    ! same_context(&a->wire, &b->wire)) {
+		return false;
+	}
+
+	for (int k = 0; k < MODEL_MAX_ORDER; k++) {
+		if (! same_context(&a->context[k], &b->context[k])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* what one set's context models encode, the other's must decode */
+static void check_context(const ac_context_t *saved, const ac_context_t *loaded, u32 backend)
+{
+	static ac_rans_queue_t queue;
+	ac_state_t enc_state = { 0 }, dec_state = { 0 };
+	uint8_t enc[OUT_MAX], dec[MAX_LEN];
+	void *outp;
+	size_t nenc, nout;
+	char what[32];
+	int ret;
+
+	ac_set_backend(&enc_state, backend);
+	ac_set_backend(&dec_state, backend);
+	ac_use_rans_queue(&enc_state, &queue);
+	snprintf(what, sizeof(what), "order-%u %s", saved->order, (backend == AC_BACKEND_RANS) ? "rans" : "arith");
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		outp = enc;
+		nenc = sizeof(enc);
+		ret = ac_encode_context_u8(&enc_state, &outp, &nenc, msg[i], msg_len[i], saved);
+		outp = dec;
+		nout = sizeof(dec);
+		if (ret == 0) {
+			ret = ac_decode_context_u8(&dec_state, &outp, &nout, enc, nenc, loaded);
+		}
+
+		expect_message(i, dec, nout, ret, what);
+	}
+}
+
+/* a model set saved and loaded back */
+static void check_model_file(void)
+{
+	static const ac_context_t shapes[MODEL_MAX_ORDER] = { { .order = 1, .bits = 8 }, { .order = 2, .bits = 12 } };
+	char path[] = "/tmp/test_coder.XXXXXX";
+	struct model_set saved, loaded;
+	const struct port_model *a, *b;
+	u32 counts[MODEL_NSYM + 1], *ctx;
+	const int before = failures;
+	int fd;
+
+	model_set_init(&saved);
+	model_set_init(&loaded);
+	skewed_counts(counts);
+	if (model_set_add(&saved, PORTNUM, counts, MODEL_NSYM) != 0) {
+		++failures;
+		return;
+	}
+
+	for (int k = 0; k < MODEL_MAX_ORDER; k++) {
+		if ((ctx = context_counts(&shapes[k])) == NULL ||
+		    model_set_add_context(&saved, PORTNUM, shapes[k].order, shapes[k].bits, ctx, 16) != 0) {
+			free(ctx);
+			++failures;
+			model_set_free(&saved);
+			return;
+		}
+
+		free(ctx);
+	}
+
+	flat_counts(counts);
+	if (model_set_add(&saved, MODEL_DEFAULT, counts, 256) != 0) {
+		++failures;
+		model_set_free(&saved);
+		return;
+	}
+
+	if ((fd = mkstemp(path)) < 0) {
+		perror("mkstemp");
+		++failures;
+		model_set_free(&saved);
+		return;
+	}
+
+	close(fd);
+	if (model_set_save(&saved, path) != 0 || model_set_load(&loaded, path) != 0) {
+		fprintf(stderr, "model file: couldn't save and load %s\n", path);
+		++failures;
+	}
+
+	unlink(path);
+	for (unsigned portnum = 0; portnum < MODEL_MAX_PORTNUM; portnum++) {
+		if (! same_port_model(saved.port[portnum], loaded.port[portnum])) {
+			fprintf(stderr, "model file: portnum %u came back different\n", portnum);
+			++failures;
+		}
+	}
+
+	if (! same_port_model(saved.fallback, loaded.fallback)) {
+		fprintf(stderr, "model file: the default model came back different\n");
+		++failures;
+	}
+
+	a = model_set_get(&saved, PORTNUM);
+	b = model_set_get(&loaded, PORTNUM);
+	if (a && b && b->context[0].slot && b->context[1].slot) {
+		for (int k = 0; k < MODEL_MAX_ORDER; k++) {
+			check_context(&a->context[k], &b->context[k], AC_BACKEND_ARITH);
+			check_context(&a->context[k], &b->context[k], AC_BACKEND_RANS);
+		}
+	} else {
+		fprintf(stderr, "model file: portnum %u or its context models went missing\n", PORTNUM);
+		++failures;
+	}
+
+	printf("model file: %s\n", (failures > before) ? "failed" : "saved and loaded back");
+	model_set_free(&saved);
+	model_set_free(&loaded);
+}
+
+int main(void)
+{
+	static uint8_t enc[MESSAGES][OUT_MAX];
+	static size_t nenc[MESSAGES];
+	static ac_model_t models[2];
+	static ac_lut_t luts[2];
+	static const char *model_names[2] = { "skewed", "flat" };
+	const uint32_t want[2] = { SKEWED_SUM, FLAT_SUM };
+	u32 counts[MODEL_NSYM + 1];
+	uint32_t sum;
+
+	for (uint32_t i = 0; i < MESSAGES; i++) {
+		msg_len[i] = make_message(msg[i], i);
+	}
+
+	skewed_counts(counts);
+	if (ac_model_from_counts(&models[0], counts, MODEL_NSYM) != 0) {
+		return 1;
+	}
+
+	flat_counts(counts);
+	if (ac_model_from_counts(&models[1], counts, 256) != 0) {
+		return 1;
+	}
+
+	make_straddling(&models[0]);
+	if ((sum = check_float()) != FLOAT_SUM) {
+		fprintf(stderr, "float: output checksum %08x, expected %08x\n", sum, FLOAT_SUM);
+		++failures;
+	}
+
+	for (int k = 0; k < 2; k++) {
+		make_straddling(&models[k]);
+		ac_lut_build(&luts[k], &models[k]);
+		if ((sum = check_model(&models[k], &luts[k], enc, nenc)) != want[k]) {
+			fprintf(stderr, "%s model: output checksum %08x, expected %08x\n", model_names[k], sum, want[k]);
+			++failures;
+		}
+
+		check_push(&models[k], enc, nenc);
+		check_pull(&models[k], &luts[k], enc, nenc);
+		check_compact(&models[k], enc, nenc);
+		check_backend(AC_BACKEND_ARITH, &models[k], &luts[k]);
+		check_backend(AC_BACKEND_RANS, &models[k], &luts[k]);
+		printf("%s model: %d failures\n", model_names[k], failures);
+	}
+
+	check_model_file();
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+/*
+ * Duplicate filter test
+ *
+ * Checks that a packet is a duplicate for exactly <window> seconds after it is
+ * first seen and new again after that, against a brute force record of first
+ * sightings over a long run with a small key space, so that entries expire,
+ * their slots are reused and the table is rebuilt many times over, never
+ * staying more than 3/4 full.  Then checks that the table grows to hold many
+ * live entries, and that it doesn't grow to make room for ones that have
+ * expired.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dedup.h"
+
+#define WINDOW		(600)
+#define NODES		(64)
+#define IDS		(64)
+#define CHECKS		(2000000)
+#define UNIQUE		(200000)
+
+static int failures;
+
+static uint32_t next_random(void)
+{
+	static uint32_t seed = 5;
+
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void expect(struct dedup *d, uint32_t from, uint32_t id, time_t now, bool dup, const char *what)
+{
+	if (dedup_check(d, from, id, now) != dup) {
+		fprintf(stderr, "%s: (%u, %u) at %ld should %sbe a duplicate\n", what, from, id, (long)now, (dup) ? "" : "not ");
+		++failures;
+	}
+}
+
+/* the edges of the window, for one packet */
+static void check_window(time_t t)
+{
+	struct dedup d;
+
+	if (dedup_init(&d, WINDOW, 16) != 0) {
+		++failures;
+		return;
+	}
+
+	expect(&d, 1, 2, t, false, "first sighting");
+	expect(&d, 1, 2, t + WINDOW - 1, true, "end of the window");
+	expect(&d, 2, 1, t + WINDOW - 1, false, "another packet");
+	expect(&d, 1, 2, t + WINDOW, false, "expired");
+	expect(&d, 1, 2, t + 2 * WINDOW - 1, true, "end of the second window");
+	expect(&d, 1, 2, t + 2 * WINDOW, false, "expired again");
+	dedup_free(&d);
+}
+
+/* random traffic against brute force */
+static void check_reference(time_t t)
+{
+	static time_t first[NODES][IDS];
+	struct dedup d;
+	uint32_t from, id;
+	bool dup;
+	long wrong = 0, full = 0;
+
+	if (dedup_init(&d, WINDOW, 4) != 0) {
+		++failures;
+		return;
+	}
+
+	for (from = 0; from < NODES; from++) {
+		for (id = 0; id < IDS; id++) {
+			first[from][id] = -1;
+		}
+	}
+
+	for (long n = 0; n < CHECKS; n++) {
+		t += (next_random() % 3 == 0);
+		from = next_random() % NODES;
+		id = next_random() % IDS;
+
+		dup = first[from][id] >= 0 && t - first[from][id] < WINDOW;
+		if (! dup) {
+			first[from][id] = t;
+		}
+
+		/* spread the node numbers out, as real ones are */
+		wrong += dedup_check(&d, from * 2654435761u, id, t) != dup;
+
+		/* past 3/4 the table should have been rebuilt */
+		full += d.used > d.mask - d.mask / 4;
+	}
+
+	if (wrong || full || d.evictions == 0 || d.mask + 1 > 4 * NODES * IDS) {
+		fprintf(stderr, "reference: %ld wrong, %ld over 3/4 full, %llu evictions, %u slots\n", wrong, full,
+			(unsigned long long)d.evictions, d.mask + 1);
+		++failures;
+	}
+
+	printf("reference: %llu duplicates, %llu new, %llu evictions, %u slots, load %.2f\n", (unsigned long long)d.hits,
+	       (unsigned long long)d.misses, (unsigned long long)d.evictions, d.mask + 1, dedup_load(&d));
+	dedup_free(&d);
+}
+
+/* many live packets, then as many again once they have expired */
+static void check_growth(time_t t)
+{
+	struct dedup d;
+	uint32_t slots;
+
+	if (dedup_init(&d, WINDOW, 1024) != 0) {
+		++failures;
+		return;
+	}
+
+	for (uint32_t i = 0; i < UNIQUE; i++) {
+		expect(&d, i, i * 7, t, false, "growing");
+	}
+
+	for (uint32_t i = 0; i < UNIQUE; i++) {
+		expect(&d, i, i * 7, t + WINDOW - 1, true, "after growing");
+	}
+
+	slots = d.mask + 1;
+	for (uint32_t i = 0; i < UNIQUE; i++) {
+		expect(&d, i + UNIQUE, i, t + WINDOW, false, "replacing");
+	}
+
+	if (d.mask + 1 != slots || d.evictions == 0) {
+		fprintf(stderr, "replacing: %u slots, was %u, %llu evictions\n", d.mask + 1, slots, (unsigned long long)d.evictions);
+		++failures;
+	}
+
+	for (uint32_t i = 0; i < UNIQUE; i++) {
+		expect(&d, i + UNIQUE, i, t + WINDOW, true, "after replacing");
+	}
+
+	printf("growth: %u slots for %d packets, load %.2f\n", d.mask + 1, UNIQUE, dedup_load(&d));
+	dedup_free(&d);
+}
+
+int main(void)
+{
+	const time_t t = 1700000000;
+
+	check_window(t);
+	check_reference(t);
+	check_growth(t);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Ring stress test
+ *
+ * One producer pushes numbered messages of varying length through a small
+ * ring while several consumers pop them, under both full-ring policies.  Every
+ * message that comes out must be whole and come out once, and every one pushed
+ * must either come out or be counted as dropped; under RING_BLOCK none may be
+ * dropped at all.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define MESSAGES	(200000)
+#define SLOTS		(64)
+#define MAX_CONSUMERS	(4)
+
+static struct ring r;
+static atomic_uchar seen[MESSAGES];
+static atomic_ulong popped;
+static atomic_int failed;
+
+static size_t message_len(uint32_t v)
+{
+	return 4 + v % 100;
+}
+
+static void *consumer(void *arg)
+{
+	uint8_t buf[RING_MSG_MAX];
+	uint32_t v;
+	int len;
+
+	while ((len = ring_pop(&r, buf)) >= 0) {
+		memcpy(&v, buf, 4);
+		if (v >= MESSAGES || (size_t)len != message_len(v)) {
+			fprintf(stderr, "message %u: wrong length %d\n", v, len);
+			failed = 1;
+			continue;
+		}
+
+		for (int i = 4; i < len; i++) {
+			if (buf[i] != (uint8_t)(v + i)) {
+				fprintf(stderr, "message %u: corrupt at byte %d\n", v, i);
+				failed = 1;
+				break;
+			}
+		}
+
+		if (atomic_fetch_add(&seen[v], 1) != 0) {
+			fprintf(stderr, "message %u: popped twice\n", v);
+			failed = 1;
+		}
+
+		++popped;
+	}
+
+	return NULL;
+}
+
+static int run(enum ring_policy policy, int nconsumers)
+{
+	const char *name = (policy == RING_BLOCK) ? "block" : "drop oldest";
+	pthread_t t[MAX_CONSUMERS];
+	uint8_t buf[RING_MSG_MAX + 1];
+
+	memset(seen, 0, sizeof(seen));
+	popped = 0;
+	failed = 0;
+	if (ring_init(&r, SLOTS, policy) != 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < nconsumers; i++) {
+		pthread_create(&t[i], NULL, consumer, NULL);
+	}
+
+	for (uint32_t v = 0; v < MESSAGES; v++) {
+		memcpy(buf, &v, 4);
+		for (size_t i = 4; i < message_len(v); i++) {
+			buf[i] = v + i;
+		}
+
+		if (ring_push(&r, buf, message_len(v)) != 0) {
+			fprintf(stderr, "message %u: push failed\n", v);
+			failed = 1;
+		}
+	}
+
+	if (ring_push(&r, buf, sizeof(buf)) == 0) {
+		fprintf(stderr, "an oversize message was queued\n");
+		failed = 1;
+	}
+
+	ring_close(&r, nconsumers);
+	for (int i = 0; i < nconsumers; i++) {
+		pthread_join(t[i], NULL);
+	}
+
+	if (r.pushed != MESSAGES || r.oversize != 1 || r.pushed != popped + r.dropped) {
+		fprintf(stderr, "%s, %d consumers: %lu pushed, %lu popped, %lu dropped, %lu oversize\n", name, nconsumers,
+			(unsigned long)r.pushed, (unsigned long)popped, (unsigned long)r.dropped, (unsigned long)r.oversize);
+		failed = 1;
+	}
+
+	if (policy == RING_BLOCK && r.dropped != 0) {
+		fprintf(stderr, "%s, %d consumers: %lu messages dropped\n", name, nconsumers, (unsigned long)r.dropped);
+		failed = 1;
+	}
+
+	printf("%s, %d consumer%s: %lu popped, %lu dropped, %lu waits\n", name, nconsumers, (nconsumers > 1) ? "s" : "",
+	       (unsigned long)popped, (unsigned long)r.dropped, (unsigned long)r.waits);
+	ring_free(&r);
+	return (failed) ? -1 : 0;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	for (int n = 1; n <= MAX_CONSUMERS; n *= 2) {
+		ret |= run(RING_DROP_OLDEST, n);
+		ret |= run(RING_BLOCK, n);
+	}
+
+	return (ret == 0) ? 0 : 1;
+}